@@ -2355,6 +2355,12 @@ rspamd_controller_stat_fin_task (void *ud)
 		ucl_object_insert_key (top, cbdata->stat, "statfiles", 0, false);
 	}
 
+	ar = rspamd_stat_tokens_cache_statistics ();
+
+	if (ar) {
+		ucl_object_insert_key (top, ar, "tokens_cache", 0, false);
+	}
+
 	fuzzy_elts = rspamd_mempool_get_variable (cbdata->task->task_pool, "fuzzy_stat");
 
 	if (fuzzy_elts) {
@@ -42,6 +42,20 @@
 #define DEFAULT_MASTER_TIMEOUT 10.0
 #define DEFAULT_UPDATES_MAXFAIL 3
 #define COOKIE_SIZE 128
+/* Maximum size of a fuzzy datagram */
+#define FUZZY_DGRAM_MAX 512
+/* Number of sessions allocated when a worker starts */
+#define FUZZY_SESSIONS_PREALLOC 256
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define FUZZY_BATCHED_IO 1
+/* Maximum number of datagrams read or written by a single syscall */
+#define FUZZY_BATCH_SIZE 64
+/* Maximum number of crypto jobs queued to a single crypto thread */
+#define FUZZY_CRYPTO_RING_SIZE 16
+/* Minimum number of commands in a crypto job */
+#define FUZZY_CRYPTO_MIN_JOB 8
+#endif
 
 static const gchar *local_db_name = "local";
 
@@ -139,6 +153,7 @@ struct rspamd_fuzzy_storage_ctx {
 	const ucl_object_t *masters_map;
 	GHashTable *master_flags;
 	guint keypair_cache_size;
+	guint crypto_threads;
 	struct event_base *ev_base;
 	gint peer_fd;
 	struct event peer_ev;
@@ -165,6 +180,12 @@ struct rspamd_fuzzy_storage_ctx {
 	struct rspamd_worker *worker;
 	struct rspamd_http_connection_router *collection_rt;
 	guchar cookie[COOKIE_SIZE];
+	/* Preallocated sessions */
+	struct fuzzy_session *sessions;
+	struct fuzzy_session **free_sessions;
+	guint nfree_sessions;
+	struct fuzzy_batch *batch;
+	struct fuzzy_crypto_pool *crypto;
 };
 
 enum fuzzy_cmd_type {
@@ -196,9 +217,83 @@ struct fuzzy_session {
 	struct event io;
 	ref_entry_t ref;
 	struct fuzzy_key_stat *key_stat;
+	gboolean preallocated;
+	gboolean encrypt_pending;
 	guchar nm[rspamd_cryptobox_MAX_NMBYTES];
 };
 
+#ifdef FUZZY_BATCHED_IO
+/*
+ * Datagrams received by a single recvmmsg call and replies that are sent
+ * by a single sendmmsg call after all datagrams are processed
+ */
+struct fuzzy_batch {
+	struct mmsghdr in_msgs[FUZZY_BATCH_SIZE];
+	struct iovec in_iov[FUZZY_BATCH_SIZE];
+	struct sockaddr_storage in_addrs[FUZZY_BATCH_SIZE];
+	guint8 in_bufs[FUZZY_BATCH_SIZE][FUZZY_DGRAM_MAX];
+	struct mmsghdr out_msgs[FUZZY_BATCH_SIZE];
+	struct iovec out_iov[FUZZY_BATCH_SIZE];
+	struct fuzzy_session *out_sessions[FUZZY_BATCH_SIZE];
+	guint nout;
+	gint fd;
+	gboolean active;
+};
+
+enum fuzzy_crypto_op {
+	FUZZY_CRYPTO_DECRYPT,
+	FUZZY_CRYPTO_ENCRYPT
+};
+
+/*
+ * Commands of a single batch to be decrypted or replies to be encrypted by a
+ * crypto thread. Sessions are owned by the job until it returns to the event
+ * loop, and nothing else touches them meanwhile
+ */
+struct fuzzy_crypto_job {
+	enum fuzzy_crypto_op op;
+	gint fd;
+	guint n;
+	struct fuzzy_session *sessions[FUZZY_BATCH_SIZE];
+	struct fuzzy_key *keys[FUZZY_BATCH_SIZE];
+	const gchar *errors[FUZZY_BATCH_SIZE];
+	struct mmsghdr msgs[FUZZY_BATCH_SIZE];
+	struct iovec iov[FUZZY_BATCH_SIZE];
+};
+
+/* Lockless ring with a single producer and a single consumer */
+struct fuzzy_crypto_ring {
+	struct fuzzy_crypto_job *jobs[FUZZY_CRYPTO_RING_SIZE];
+	gint head;
+	gint tail;
+};
+
+struct fuzzy_crypto_thread {
+	struct fuzzy_crypto_pool *pool;
+	GThread *thr;
+	/* Jobs from the event loop */
+	struct fuzzy_crypto_ring in;
+	/* Finished jobs to the event loop */
+	struct fuzzy_crypto_ring out;
+	/* Pipe to wake up the thread, closed to stop it */
+	gint wakeup[2];
+	/* Jobs being processed by the thread, used by the event loop only */
+	guint inflight;
+	/* Keypairs cache of the thread, NULL if caching is disabled */
+	struct rspamd_keypair_cache *keypair_cache;
+};
+
+struct fuzzy_crypto_pool {
+	struct rspamd_fuzzy_storage_ctx *ctx;
+	struct fuzzy_crypto_thread *threads;
+	guint nthreads;
+	guint cur;
+	/* Pipe to wake up the event loop when jobs are finished */
+	gint notify[2];
+	struct event notify_ev;
+};
+#endif
+
 struct fuzzy_peer_request {
 	struct event io_ev;
 	struct fuzzy_peer_cmd cmd;
@@ -592,24 +687,52 @@ rspamd_fuzzy_reply_io (gint fd, gshort what, gpointer d)
 	REF_RELEASE (session);
 }
 
+static gconstpointer
+rspamd_fuzzy_reply_data (struct fuzzy_session *session, gsize *len)
+{
+	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
+				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
+		/* Encrypted reply */
+		*len = sizeof (session->reply);
+
+		return &session->reply;
+	}
+
+	*len = sizeof (session->reply.rep);
+
+	return &session->reply.rep;
+}
+
+#ifdef FUZZY_BATCHED_IO
+static inline gboolean
+rspamd_fuzzy_batch_accepts (struct fuzzy_session *session)
+{
+	struct fuzzy_batch *batch = session->ctx->batch;
+
+	return batch != NULL && batch->active && batch->fd == session->fd &&
+			batch->nout < FUZZY_BATCH_SIZE;
+}
+#endif
+
 static void
 rspamd_fuzzy_write_reply (struct fuzzy_session *session)
 {
 	gssize r;
 	gsize len;
 	gconstpointer data;
+#ifdef FUZZY_BATCHED_IO
+	struct fuzzy_batch *batch = session->ctx->batch;
 
-	if (session->cmd_type == CMD_ENCRYPTED_NORMAL ||
-				session->cmd_type == CMD_ENCRYPTED_SHINGLE) {
-		/* Encrypted reply */
-		data = &session->reply;
-		len = sizeof (session->reply);
-	}
-	else {
-		data = &session->reply.rep;
-		len = sizeof (session->reply.rep);
+	if (rspamd_fuzzy_batch_accepts (session)) {
+		/* Reply is sent when the whole batch is processed */
+		REF_RETAIN (session);
+		batch->out_sessions[batch->nout ++] = session;
+
+		return;
 	}
+#endif
 
+	data = rspamd_fuzzy_reply_data (session, &len);
 	r = rspamd_inet_address_sendto (session->fd, data, len, 0,
 			session->addr);
 
@@ -729,12 +852,23 @@ rspamd_fuzzy_make_reply (struct rspamd_fuzzy_cmd *cmd,
 			/* We need also to encrypt reply */
 			ottery_rand_bytes (session->reply.hdr.nonce,
 					sizeof (session->reply.hdr.nonce));
-			rspamd_cryptobox_encrypt_nm_inplace ((guchar *)&session->reply.rep,
-					sizeof (session->reply.rep),
-					session->reply.hdr.nonce,
-					session->nm,
-					session->reply.hdr.mac,
-					RSPAMD_CRYPTOBOX_MODE_25519);
+#ifdef FUZZY_BATCHED_IO
+			if (session->ctx->crypto != NULL &&
+					rspamd_fuzzy_batch_accepts (session)) {
+				/* Encrypted by a crypto thread before the batch is sent */
+				session->encrypt_pending = TRUE;
+			}
+			else
+#endif
+			{
+				rspamd_cryptobox_encrypt_nm_inplace (
+						(guchar *)&session->reply.rep,
+						sizeof (session->reply.rep),
+						session->reply.hdr.nonce,
+						session->nm,
+						session->reply.hdr.mac,
+						RSPAMD_CRYPTOBOX_MODE_25519);
+			}
 		}
 	}
 
@@ -949,35 +1083,46 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 	return ret;
 }
 
-static gboolean
-rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+static struct rspamd_fuzzy_encrypted_req_hdr *
+rspamd_fuzzy_encrypted_payload (struct fuzzy_session *s, guchar **payload,
+		gsize *payload_len)
+{
+	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
+		*payload = (guchar *)&s->cmd.enc_normal.cmd;
+		*payload_len = sizeof (s->cmd.enc_normal.cmd);
+
+		return &s->cmd.enc_normal.hdr;
+	}
+
+	*payload = (guchar *) &s->cmd.enc_shingle.cmd;
+	*payload_len = sizeof (s->cmd.enc_shingle.cmd);
+
+	return &s->cmd.enc_shingle.hdr;
+}
+
+/*
+ * Checks header of the encrypted command and returns the local key to decrypt
+ * it with
+ */
+static struct fuzzy_key *
+rspamd_fuzzy_encrypted_key (struct fuzzy_session *s)
 {
 	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
 	guchar *payload;
 	gsize payload_len;
-	struct rspamd_cryptobox_pubkey *rk;
 	struct fuzzy_key *key;
 
 	if (s->ctx->default_key == NULL) {
 		msg_warn ("received encrypted request when encryption is not enabled");
-		return FALSE;
+		return NULL;
 	}
 
-	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
-		hdr = &s->cmd.enc_normal.hdr;
-		payload = (guchar *)&s->cmd.enc_normal.cmd;
-		payload_len = sizeof (s->cmd.enc_normal.cmd);
-	}
-	else {
-		hdr = &s->cmd.enc_shingle.hdr;
-		payload = (guchar *) &s->cmd.enc_shingle.cmd;
-		payload_len = sizeof (s->cmd.enc_shingle.cmd);
-	}
+	hdr = rspamd_fuzzy_encrypted_payload (s, &payload, &payload_len);
 
 	/* Compare magic */
 	if (memcmp (hdr->magic, fuzzy_encrypted_magic, sizeof (hdr->magic)) != 0) {
 		msg_debug ("invalid magic for the encrypted packet");
-		return FALSE;
+		return NULL;
 	}
 
 	/* Try to find the desired key */
@@ -990,29 +1135,98 @@ rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
 
 	s->key_stat = key->stat;
 
+	return key;
+}
+
+/*
+ * Decrypts command in place. This function does not log anything, as it is
+ * also called from crypto threads, and returns an error message instead.
+ * Keypairs cache must be used by the calling thread only
+ */
+static const gchar *
+rspamd_fuzzy_decrypt_payload (struct fuzzy_session *s, struct fuzzy_key *key,
+		struct rspamd_keypair_cache *cache)
+{
+	struct rspamd_fuzzy_encrypted_req_hdr *hdr;
+	guchar *payload;
+	gsize payload_len;
+	struct rspamd_cryptobox_pubkey *rk;
+	const gchar *ret = NULL;
+
+	hdr = rspamd_fuzzy_encrypted_payload (s, &payload, &payload_len);
+
 	/* Now process keypair */
 	rk = rspamd_pubkey_from_bin (hdr->pubkey, sizeof (hdr->pubkey),
 			RSPAMD_KEYPAIR_KEX, RSPAMD_CRYPTOBOX_MODE_25519);
 
 	if (rk == NULL) {
-		msg_err ("bad key");
-		return FALSE;
+		return "bad key";
 	}
 
-	rspamd_keypair_cache_process (s->ctx->keypair_cache, key->key, rk);
+	if (cache) {
+		rspamd_keypair_cache_process (cache, key->key, rk);
+	}
+	else {
+		rspamd_pubkey_calculate_nm (rk, key->key);
+	}
 
 	/* Now decrypt request */
 	if (!rspamd_cryptobox_decrypt_nm_inplace (payload, payload_len, hdr->nonce,
 			rspamd_pubkey_get_nm (rk),
 			hdr->mac, RSPAMD_CRYPTOBOX_MODE_25519)) {
-		msg_err ("decryption failed");
-		rspamd_pubkey_unref (rk);
+		ret = "decryption failed";
+	}
+	else {
+		memcpy (s->nm, rspamd_pubkey_get_nm (rk), sizeof (s->nm));
+	}
+
+	rspamd_pubkey_unref (rk);
+
+	return ret;
+}
+
+static gboolean
+rspamd_fuzzy_decrypt_command (struct fuzzy_session *s)
+{
+	struct fuzzy_key *key;
+	const gchar *err;
+
+	key = rspamd_fuzzy_encrypted_key (s);
 
+	if (key == NULL) {
 		return FALSE;
 	}
 
-	memcpy (s->nm, rspamd_pubkey_get_nm (rk), sizeof (s->nm));
-	rspamd_pubkey_unref (rk);
+	err = rspamd_fuzzy_decrypt_payload (s, key, s->ctx->keypair_cache);
+
+	if (err != NULL) {
+		msg_err ("%s", err);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_encrypted_cmd_valid (struct fuzzy_session *s)
+{
+	enum rspamd_fuzzy_epoch epoch;
+
+	if (s->cmd_type == CMD_ENCRYPTED_NORMAL) {
+		epoch = rspamd_fuzzy_command_valid (&s->cmd.enc_normal.cmd,
+				sizeof (s->cmd.enc_normal.cmd));
+	}
+	else {
+		epoch = rspamd_fuzzy_command_valid (&s->cmd.enc_shingle.cmd.basic,
+				sizeof (s->cmd.enc_shingle.cmd));
+	}
+
+	if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
+		return FALSE;
+	}
+
+	/* Encrypted is epoch 10 at least */
+	s->epoch = epoch;
 
 	return TRUE;
 }
@@ -1053,15 +1267,11 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 		if (!rspamd_fuzzy_decrypt_command (s)) {
 			return FALSE;
 		}
-		epoch = rspamd_fuzzy_command_valid (&s->cmd.enc_normal.cmd,
-				sizeof (s->cmd.enc_normal.cmd));
 
-		if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
+		if (!rspamd_fuzzy_encrypted_cmd_valid (s)) {
 			msg_debug ("invalid fuzzy command of size %d received", buflen);
 			return FALSE;
 		}
-		/* Encrypted is epoch 10 at least */
-		s->epoch = epoch;
 		break;
 	case sizeof (struct rspamd_fuzzy_encrypted_shingle_cmd):
 		s->cmd_type = CMD_ENCRYPTED_SHINGLE;
@@ -1070,15 +1280,11 @@ rspamd_fuzzy_cmd_from_wire (guchar *buf, guint buflen, struct fuzzy_session *s)
 		if (!rspamd_fuzzy_decrypt_command (s)) {
 			return FALSE;
 		}
-		epoch = rspamd_fuzzy_command_valid (&s->cmd.enc_shingle.cmd.basic,
-				sizeof (s->cmd.enc_shingle.cmd));
 
-		if (epoch == RSPAMD_FUZZY_EPOCH_MAX) {
+		if (!rspamd_fuzzy_encrypted_cmd_valid (s)) {
 			msg_debug ("invalid fuzzy command of size %d received", buflen);
 			return FALSE;
 		}
-
-		s->epoch = epoch;
 		break;
 	default:
 		msg_debug ("invalid fuzzy command of size %d received", buflen);
@@ -1257,7 +1463,30 @@ fuzzy_session_destroy (gpointer d)
 	rspamd_inet_address_destroy (session->addr);
 	rspamd_explicit_memzero (session->nm, sizeof (session->nm));
 	session->worker->nconns--;
-	g_slice_free1 (sizeof (*session), session);
+
+	if (session->preallocated) {
+		session->ctx->free_sessions[session->ctx->nfree_sessions ++] = session;
+	}
+	else {
+		g_slice_free1 (sizeof (*session), session);
+	}
+}
+
+static struct fuzzy_session *
+fuzzy_session_new (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_session *session;
+
+	if (ctx->nfree_sessions > 0) {
+		session = ctx->free_sessions[-- ctx->nfree_sessions];
+		memset (session, 0, sizeof (*session));
+		session->preallocated = TRUE;
+	}
+	else {
+		session = g_slice_alloc0 (sizeof (*session));
+	}
+
+	return session;
 }
 
 static void
@@ -1762,6 +1991,586 @@ accept_fuzzy_mirror_socket (gint fd, short what, void *arg)
 			ctx->ev_base);
 }
 
+static struct fuzzy_session *
+rspamd_fuzzy_datagram_session (struct rspamd_worker *worker, gint fd,
+		rspamd_inet_addr_t *addr)
+{
+	struct fuzzy_session *session;
+
+	worker->nconns++;
+	session = fuzzy_session_new (worker->ctx);
+	REF_INIT_RETAIN (session, fuzzy_session_destroy);
+	session->worker = worker;
+	session->fd = fd;
+	session->ctx = worker->ctx;
+	session->time = (guint64) time (NULL);
+	session->addr = addr;
+
+	return session;
+}
+
+static void
+rspamd_fuzzy_invalid_datagram (struct fuzzy_session *session, gsize len)
+{
+	guint64 *nerrors;
+
+	/* Discard input */
+	session->ctx->stat.invalid_requests ++;
+	msg_debug ("invalid fuzzy command of size %z received", len);
+
+	nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
+			session->addr, -1);
+
+	if (nerrors == NULL) {
+		nerrors = g_malloc (sizeof (*nerrors));
+		*nerrors = 1;
+		rspamd_lru_hash_insert (session->ctx->errors_ips,
+				rspamd_inet_address_copy (session->addr),
+				nerrors, -1, -1);
+	}
+	else {
+		*nerrors = *nerrors + 1;
+	}
+}
+
+static void
+rspamd_fuzzy_process_datagram (struct rspamd_worker *worker, gint fd,
+		guchar *buf, gsize len, rspamd_inet_addr_t *addr)
+{
+	struct fuzzy_session *session;
+
+	session = rspamd_fuzzy_datagram_session (worker, fd, addr);
+
+	if (rspamd_fuzzy_cmd_from_wire (buf, len, session)) {
+		/* Check shingles count sanity */
+		rspamd_fuzzy_process_command (session);
+	}
+	else {
+		rspamd_fuzzy_invalid_datagram (session, len);
+	}
+
+	REF_RELEASE (session);
+}
+
+#ifdef FUZZY_BATCHED_IO
+static void
+rspamd_fuzzy_send_replies (gint fd, struct fuzzy_session **sessions, guint n,
+		struct mmsghdr *msgs, struct iovec *iov)
+{
+	struct fuzzy_session *session;
+	struct msghdr *msg;
+	gsize len;
+	socklen_t slen;
+	guint i, sent = 0;
+	gint r;
+
+	for (i = 0; i < n; i ++) {
+		session = sessions[i];
+		iov[i].iov_base = (gpointer)rspamd_fuzzy_reply_data (session, &len);
+		iov[i].iov_len = len;
+		msg = &msgs[i].msg_hdr;
+		memset (msg, 0, sizeof (*msg));
+		msg->msg_name = (gpointer)rspamd_inet_address_get_sa (session->addr,
+				&slen);
+		msg->msg_namelen = slen;
+		msg->msg_iov = &iov[i];
+		msg->msg_iovlen = 1;
+	}
+
+	while (sent < n) {
+		r = sendmmsg (fd, &msgs[sent], n - sent, 0);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		sent += r;
+	}
+
+	for (i = 0; i < n; i ++) {
+		session = sessions[i];
+
+		if (i >= sent) {
+			/* Either wait for the socket or report error for this reply */
+			rspamd_fuzzy_write_reply (session);
+		}
+
+		REF_RELEASE (session);
+	}
+}
+
+static void rspamd_fuzzy_crypto_run (struct fuzzy_crypto_pool *pool,
+		struct fuzzy_crypto_job *job);
+
+static void
+rspamd_fuzzy_flush_replies (struct fuzzy_batch *batch)
+{
+	struct fuzzy_session *session;
+	struct fuzzy_crypto_job *job;
+	guint i;
+
+	batch->active = FALSE;
+
+	for (i = 0; i < batch->nout; i ++) {
+		session = batch->out_sessions[i];
+
+		if (session->encrypt_pending) {
+			/* Replies are sent when a crypto thread has encrypted them */
+			job = g_slice_alloc (sizeof (*job));
+			job->op = FUZZY_CRYPTO_ENCRYPT;
+			job->fd = batch->fd;
+			job->n = batch->nout;
+			memcpy (job->sessions, batch->out_sessions,
+					sizeof (*job->sessions) * batch->nout);
+			batch->nout = 0;
+			rspamd_fuzzy_crypto_run (session->ctx->crypto, job);
+
+			return;
+		}
+	}
+
+	rspamd_fuzzy_send_replies (batch->fd, batch->out_sessions, batch->nout,
+			batch->out_msgs, batch->out_iov);
+	batch->nout = 0;
+}
+
+static gboolean
+rspamd_fuzzy_crypto_ring_push (struct fuzzy_crypto_ring *ring,
+		struct fuzzy_crypto_job *job)
+{
+	gint head, next;
+
+	head = ring->head;
+	next = (head + 1) % FUZZY_CRYPTO_RING_SIZE;
+
+	if (next == g_atomic_int_get (&ring->tail)) {
+		/* Ring is full */
+		return FALSE;
+	}
+
+	ring->jobs[head] = job;
+	g_atomic_int_set (&ring->head, next);
+
+	return TRUE;
+}
+
+static struct fuzzy_crypto_job *
+rspamd_fuzzy_crypto_ring_pop (struct fuzzy_crypto_ring *ring)
+{
+	struct fuzzy_crypto_job *job;
+	gint tail;
+
+	tail = ring->tail;
+
+	if (tail == g_atomic_int_get (&ring->head)) {
+		/* Ring is empty */
+		return NULL;
+	}
+
+	job = ring->jobs[tail];
+	g_atomic_int_set (&ring->tail, (tail + 1) % FUZZY_CRYPTO_RING_SIZE);
+
+	return job;
+}
+
+static void
+rspamd_fuzzy_crypto_wakeup (gint fd)
+{
+	guchar c = 0;
+
+	while (write (fd, &c, sizeof (c)) == -1) {
+		if (errno != EINTR) {
+			/* Pipe is full, so the other side is going to wake up anyway */
+			break;
+		}
+	}
+}
+
+/*
+ * Called either from a crypto thread or from the event loop, when all crypto
+ * threads are busy, with the keypairs cache of the caller
+ */
+static void
+rspamd_fuzzy_crypto_process (struct fuzzy_crypto_job *job,
+		struct rspamd_keypair_cache *cache)
+{
+	struct fuzzy_session *session;
+	guint i;
+
+	for (i = 0; i < job->n; i ++) {
+		session = job->sessions[i];
+
+		if (job->op == FUZZY_CRYPTO_DECRYPT) {
+			job->errors[i] = rspamd_fuzzy_decrypt_payload (session,
+					job->keys[i], cache);
+		}
+		else if (session->encrypt_pending) {
+			rspamd_cryptobox_encrypt_nm_inplace (
+					(guchar *)&session->reply.rep,
+					sizeof (session->reply.rep),
+					session->reply.hdr.nonce,
+					session->nm,
+					session->reply.hdr.mac,
+					RSPAMD_CRYPTOBOX_MODE_25519);
+			session->encrypt_pending = FALSE;
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_crypto_finish (struct fuzzy_crypto_pool *pool,
+		struct fuzzy_crypto_job *job)
+{
+	struct fuzzy_batch *batch = pool->ctx->batch;
+	struct fuzzy_session *session;
+	guint i;
+
+	if (job->op == FUZZY_CRYPTO_DECRYPT) {
+		/* Replies to the decrypted commands are sent as a single batch */
+		batch->fd = job->fd;
+		batch->active = TRUE;
+
+		for (i = 0; i < job->n; i ++) {
+			session = job->sessions[i];
+
+			if (job->errors[i] == NULL &&
+					rspamd_fuzzy_encrypted_cmd_valid (session)) {
+				rspamd_fuzzy_process_command (session);
+			}
+			else {
+				if (job->errors[i] != NULL) {
+					msg_err ("%s", job->errors[i]);
+				}
+
+				rspamd_fuzzy_invalid_datagram (session,
+						session->cmd_type == CMD_ENCRYPTED_NORMAL ?
+						sizeof (session->cmd.enc_normal) :
+						sizeof (session->cmd.enc_shingle));
+			}
+
+			REF_RELEASE (session);
+		}
+
+		g_slice_free1 (sizeof (*job), job);
+		rspamd_fuzzy_flush_replies (batch);
+	}
+	else {
+		rspamd_fuzzy_send_replies (job->fd, job->sessions, job->n,
+				job->msgs, job->iov);
+		g_slice_free1 (sizeof (*job), job);
+	}
+}
+
+static void
+rspamd_fuzzy_crypto_run (struct fuzzy_crypto_pool *pool,
+		struct fuzzy_crypto_job *job)
+{
+	struct fuzzy_crypto_thread *thr;
+	guint i, idx;
+
+	for (i = 0; i < pool->nthreads; i ++) {
+		idx = (pool->cur + i) % pool->nthreads;
+		thr = &pool->threads[idx];
+
+		/* Limit of inflight jobs guarantees that output ring never overflows */
+		if (thr->inflight < FUZZY_CRYPTO_RING_SIZE - 1 &&
+				rspamd_fuzzy_crypto_ring_push (&thr->in, job)) {
+			thr->inflight ++;
+			pool->cur = (idx + 1) % pool->nthreads;
+			rspamd_fuzzy_crypto_wakeup (thr->wakeup[1]);
+
+			return;
+		}
+	}
+
+	/* All threads are busy, so do it in the event loop */
+	rspamd_fuzzy_crypto_process (job, pool->ctx->keypair_cache);
+	rspamd_fuzzy_crypto_finish (pool, job);
+}
+
+static gpointer
+rspamd_fuzzy_crypto_thread (gpointer ud)
+{
+	struct fuzzy_crypto_thread *thr = ud;
+	struct fuzzy_crypto_job *job;
+	guchar buf[64];
+	gssize r;
+
+	for (;;) {
+		r = read (thr->wakeup[0], buf, sizeof (buf));
+
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		else if (r <= 0) {
+			/* Write end is closed when the pool is destroyed */
+			break;
+		}
+
+		while ((job = rspamd_fuzzy_crypto_ring_pop (&thr->in)) != NULL) {
+			rspamd_fuzzy_crypto_process (job, thr->keypair_cache);
+
+			if (!rspamd_fuzzy_crypto_ring_push (&thr->out, job)) {
+				g_assert_not_reached ();
+			}
+
+			rspamd_fuzzy_crypto_wakeup (thr->pool->notify[1]);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_crypto_notify (gint fd, short what, void *arg)
+{
+	struct fuzzy_crypto_pool *pool = arg;
+	struct fuzzy_crypto_thread *thr;
+	struct fuzzy_crypto_job *job;
+	guchar buf[64];
+	guint i;
+
+	while (read (fd, buf, sizeof (buf)) > 0) {
+		/* Drain notifications, as all finished jobs are processed below */
+	}
+
+	for (i = 0; i < pool->nthreads; i ++) {
+		thr = &pool->threads[i];
+
+		while ((job = rspamd_fuzzy_crypto_ring_pop (&thr->out)) != NULL) {
+			thr->inflight --;
+			rspamd_fuzzy_crypto_finish (pool, job);
+		}
+	}
+}
+
+static void
+rspamd_fuzzy_crypto_pool_destroy (struct fuzzy_crypto_pool *pool)
+{
+	struct fuzzy_crypto_thread *thr;
+	struct fuzzy_crypto_job *job;
+	guint i, j;
+
+	for (i = 0; i < pool->nthreads; i ++) {
+		thr = &pool->threads[i];
+		close (thr->wakeup[1]);
+		g_thread_join (thr->thr);
+		close (thr->wakeup[0]);
+
+		/* Commands and replies that are not processed yet are dropped */
+		while ((job = rspamd_fuzzy_crypto_ring_pop (&thr->in)) != NULL ||
+				(job = rspamd_fuzzy_crypto_ring_pop (&thr->out)) != NULL) {
+			for (j = 0; j < job->n; j ++) {
+				REF_RELEASE (job->sessions[j]);
+			}
+
+			g_slice_free1 (sizeof (*job), job);
+		}
+
+		if (thr->keypair_cache) {
+			rspamd_keypair_cache_destroy (thr->keypair_cache);
+		}
+	}
+
+	if (pool->notify[0] != -1) {
+		event_del (&pool->notify_ev);
+		close (pool->notify[0]);
+		close (pool->notify[1]);
+	}
+
+	g_free (pool->threads);
+	g_free (pool);
+}
+
+static struct fuzzy_crypto_pool *
+rspamd_fuzzy_crypto_pool_new (struct rspamd_fuzzy_storage_ctx *ctx,
+		guint nthreads, GError **err)
+{
+	struct fuzzy_crypto_pool *pool;
+	struct fuzzy_crypto_thread *thr;
+	guint i;
+
+	pool = g_malloc0 (sizeof (*pool));
+	pool->ctx = ctx;
+	pool->threads = g_malloc0 (sizeof (*pool->threads) * nthreads);
+
+	if (pipe (pool->notify) == -1) {
+		g_set_error (err, g_quark_from_static_string ("fuzzy"), errno,
+				"cannot create pipe: %s", strerror (errno));
+		pool->notify[0] = -1;
+		rspamd_fuzzy_crypto_pool_destroy (pool);
+
+		return NULL;
+	}
+
+	rspamd_socket_nonblocking (pool->notify[0]);
+	rspamd_socket_nonblocking (pool->notify[1]);
+	event_set (&pool->notify_ev, pool->notify[0], EV_READ | EV_PERSIST,
+			rspamd_fuzzy_crypto_notify, pool);
+	event_base_set (ctx->ev_base, &pool->notify_ev);
+	event_add (&pool->notify_ev, NULL);
+
+	for (i = 0; i < nthreads; i ++) {
+		thr = &pool->threads[i];
+		thr->pool = pool;
+
+		if (pipe (thr->wakeup) == -1) {
+			g_set_error (err, g_quark_from_static_string ("fuzzy"), errno,
+					"cannot create pipe: %s", strerror (errno));
+			rspamd_fuzzy_crypto_pool_destroy (pool);
+
+			return NULL;
+		}
+
+		/* Thread blocks on reading, whilst the event loop must not block */
+		rspamd_socket_nonblocking (thr->wakeup[1]);
+
+		/*
+		 * Each thread has its own cache, so shared keys are calculated
+		 * without any locking
+		 */
+		if (ctx->keypair_cache_size > 0) {
+			thr->keypair_cache = rspamd_keypair_cache_new (
+					ctx->keypair_cache_size);
+		}
+		thr->thr = rspamd_create_thread ("fuzzy_crypto",
+				rspamd_fuzzy_crypto_thread, thr, err);
+
+		if (thr->thr == NULL) {
+			close (thr->wakeup[0]);
+			close (thr->wakeup[1]);
+
+			if (thr->keypair_cache) {
+				rspamd_keypair_cache_destroy (thr->keypair_cache);
+			}
+
+			rspamd_fuzzy_crypto_pool_destroy (pool);
+
+			return NULL;
+		}
+
+		pool->nthreads ++;
+	}
+
+	return pool;
+}
+
+static void
+rspamd_fuzzy_read_batch (struct rspamd_worker *worker, gint fd,
+		struct fuzzy_batch *batch)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
+	struct fuzzy_crypto_job *jobs[FUZZY_BATCH_SIZE / FUZZY_CRYPTO_MIN_JOB], *job;
+	struct fuzzy_session *session;
+	struct fuzzy_key *key;
+	struct msghdr *msg;
+	rspamd_inet_addr_t *addr;
+	guint njobs, job_size = 0, j;
+	gsize len;
+	gint r, i;
+
+	for (;;) {
+		for (i = 0; i < FUZZY_BATCH_SIZE; i ++) {
+			msg = &batch->in_msgs[i].msg_hdr;
+			memset (msg, 0, sizeof (*msg));
+			batch->in_iov[i].iov_base = batch->in_bufs[i];
+			batch->in_iov[i].iov_len = sizeof (batch->in_bufs[i]);
+			msg->msg_name = &batch->in_addrs[i];
+			msg->msg_namelen = sizeof (batch->in_addrs[i]);
+			msg->msg_iov = &batch->in_iov[i];
+			msg->msg_iovlen = 1;
+		}
+
+		r = recvmmsg (fd, batch->in_msgs, FUZZY_BATCH_SIZE, 0, NULL);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+
+				return;
+			}
+
+			msg_err ("got error while reading from socket: %d, %s",
+					errno,
+					strerror (errno));
+			return;
+		}
+
+		batch->fd = fd;
+		batch->active = TRUE;
+		njobs = 0;
+		job = NULL;
+
+		if (ctx->crypto != NULL) {
+			/* Spread encrypted commands between all crypto threads */
+			job_size = MAX ((r + ctx->crypto->nthreads - 1) /
+					ctx->crypto->nthreads, FUZZY_CRYPTO_MIN_JOB);
+		}
+
+		for (i = 0; i < r; i ++) {
+			msg = &batch->in_msgs[i].msg_hdr;
+			addr = rspamd_inet_address_from_peer (msg->msg_name,
+					msg->msg_namelen);
+			len = batch->in_msgs[i].msg_len;
+
+			if (ctx->crypto == NULL ||
+					(len != sizeof (struct rspamd_fuzzy_encrypted_cmd) &&
+					len != sizeof (struct rspamd_fuzzy_encrypted_shingle_cmd))) {
+				rspamd_fuzzy_process_datagram (worker, fd, batch->in_bufs[i],
+						len, addr);
+				continue;
+			}
+
+			/* Encrypted command is decrypted by a crypto thread */
+			session = rspamd_fuzzy_datagram_session (worker, fd, addr);
+			session->cmd_type = len == sizeof (session->cmd.enc_normal) ?
+					CMD_ENCRYPTED_NORMAL : CMD_ENCRYPTED_SHINGLE;
+			memcpy (&session->cmd, batch->in_bufs[i], len);
+			key = rspamd_fuzzy_encrypted_key (session);
+
+			if (key == NULL) {
+				rspamd_fuzzy_invalid_datagram (session, len);
+				REF_RELEASE (session);
+				continue;
+			}
+
+			if (job == NULL) {
+				job = g_slice_alloc (sizeof (*job));
+				job->op = FUZZY_CRYPTO_DECRYPT;
+				job->fd = fd;
+				job->n = 0;
+				jobs[njobs ++] = job;
+			}
+
+			job->sessions[job->n] = session;
+			job->keys[job->n] = key;
+			job->n ++;
+
+			if (job->n >= job_size) {
+				job = NULL;
+			}
+		}
+
+		rspamd_fuzzy_flush_replies (batch);
+
+		for (j = 0; j < njobs; j ++) {
+			rspamd_fuzzy_crypto_run (ctx->crypto, jobs[j]);
+		}
+
+		if (r < FUZZY_BATCH_SIZE) {
+			/* Socket is drained */
+			return;
+		}
+	}
+}
+#endif
+
 /*
  * Accept new connection and construct task
  */
@@ -1769,18 +2578,23 @@ static void
 accept_fuzzy_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *)arg;
-	struct fuzzy_session *session;
 	rspamd_inet_addr_t *addr;
 	gssize r;
-	guint8 buf[512];
-	guint64 *nerrors;
+	guint8 buf[FUZZY_DGRAM_MAX];
 
 	/* Got some data */
 	if (what == EV_READ) {
+#ifdef FUZZY_BATCHED_IO
+		struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
 
-		for (;;) {
-			worker->nconns++;
+		if (ctx->batch != NULL) {
+			rspamd_fuzzy_read_batch (worker, fd, ctx->batch);
 
+			return;
+		}
+#endif
+
+		for (;;) {
 			r = rspamd_inet_address_recvfrom (fd,
 					buf,
 					sizeof (buf),
@@ -1802,39 +2616,7 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 				return;
 			}
 
-			session = g_slice_alloc0 (sizeof (*session));
-			REF_INIT_RETAIN (session, fuzzy_session_destroy);
-			session->worker = worker;
-			session->fd = fd;
-			session->ctx = worker->ctx;
-			session->time = (guint64) time (NULL);
-			session->addr = addr;
-
-			if (rspamd_fuzzy_cmd_from_wire (buf, r, session)) {
-				/* Check shingles count sanity */
-				rspamd_fuzzy_process_command (session);
-			}
-			else {
-				/* Discard input */
-				session->ctx->stat.invalid_requests ++;
-				msg_debug ("invalid fuzzy command of size %z received", r);
-
-				nerrors = rspamd_lru_hash_lookup (session->ctx->errors_ips,
-						addr, -1);
-
-				if (nerrors == NULL) {
-					nerrors = g_malloc (sizeof (*nerrors));
-					*nerrors = 1;
-					rspamd_lru_hash_insert (session->ctx->errors_ips,
-							rspamd_inet_address_copy (addr),
-							nerrors, -1, -1);
-				}
-				else {
-					*nerrors = *nerrors + 1;
-				}
-			}
-
-			REF_RELEASE (session);
+			rspamd_fuzzy_process_datagram (worker, fd, buf, r, addr);
 		}
 	}
 }
@@ -2013,6 +2795,10 @@ rspamd_fuzzy_stat_to_ucl (struct rspamd_fuzzy_storage_ctx *ctx, gboolean ip_stat
 			0,
 			false);
 
+	if (ctx->backend) {
+		rspamd_fuzzy_backend_stat (ctx->backend, obj);
+	}
+
 	if (ctx->errors_ips && ip_stat) {
 		ip_hash = rspamd_lru_hash_get_htable (ctx->errors_ips);
 
@@ -2469,6 +3255,15 @@ init_fuzzy (struct rspamd_config *cfg)
 			"Size of keypairs cache, default: "
 					G_STRINGIFY (DEFAULT_KEYPAIR_CACHE_SIZE));
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"crypto_threads",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, crypto_threads),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of threads to decrypt requests and encrypt replies, default: 0 (disabled)");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"encrypted_only",
@@ -2615,7 +3410,7 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 		gpointer ud)
 {
 	struct rspamd_fuzzy_storage_ctx *ctx = ud;
-	GList *cur;
+	GList *cur, *all;
 	struct rspamd_worker_listen_socket *ls;
 	struct event *accept_events;
 
@@ -2629,8 +3424,11 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 		rspamd_socket_nonblocking (rep_fd);
 	}
 
-	/* Start listening */
-	cur = worker->cf->listen_socks;
+	/* Start listening, including sockets bound with SO_REUSEPORT for us */
+	cur = g_list_concat (g_list_copy (worker->cf->listen_socks),
+			g_list_copy (rspamd_worker_own_sockets (worker)));
+	all = cur;
+
 	while (cur) {
 		ls = cur->data;
 
@@ -2666,6 +3464,8 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 		cur = g_list_next (cur);
 	}
 
+	g_list_free (all);
+
 	if (worker->index == 0 && ctx->peer_fd != -1) {
 		/* Listen for peer requests */
 		event_set (&ctx->peer_ev, ctx->peer_fd, EV_READ | EV_PERSIST,
@@ -2685,6 +3485,7 @@ start_fuzzy (struct rspamd_worker *worker)
 	GError *err = NULL;
 	struct rspamd_srv_command srv_cmd;
 	struct rspamd_config *cfg = worker->srv->cfg;
+	guint i;
 
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"fuzzy",
@@ -2695,6 +3496,21 @@ start_fuzzy (struct rspamd_worker *worker)
 	ctx->cfg = worker->srv->cfg;
 	double_to_tv (ctx->master_timeout, &ctx->master_io_tv);
 
+	/* Sessions are taken from this array unless all of them are in use */
+	ctx->sessions = g_malloc (sizeof (*ctx->sessions) *
+			FUZZY_SESSIONS_PREALLOC);
+	ctx->free_sessions = g_malloc (sizeof (*ctx->free_sessions) *
+			FUZZY_SESSIONS_PREALLOC);
+
+	for (i = 0; i < FUZZY_SESSIONS_PREALLOC; i ++) {
+		ctx->free_sessions[i] = &ctx->sessions[i];
+	}
+
+	ctx->nfree_sessions = FUZZY_SESSIONS_PREALLOC;
+#ifdef FUZZY_BATCHED_IO
+	ctx->batch = g_malloc0 (sizeof (*ctx->batch));
+#endif
+
 	ctx->resolver = dns_resolver_init (worker->srv->logger,
 			ctx->ev_base,
 			worker->srv->cfg);
@@ -2705,6 +3521,23 @@ start_fuzzy (struct rspamd_worker *worker)
 		ctx->keypair_cache = rspamd_keypair_cache_new (ctx->keypair_cache_size);
 	}
 
+	if (ctx->crypto_threads > 0 && !ctx->collection_mode) {
+#ifdef FUZZY_BATCHED_IO
+		ctx->crypto = rspamd_fuzzy_crypto_pool_new (ctx, ctx->crypto_threads,
+				&err);
+
+		if (ctx->crypto == NULL) {
+			msg_err ("cannot start crypto threads, encryption is done by "
+					"the worker itself: %e", err);
+			g_error_free (err);
+			err = NULL;
+		}
+#else
+		msg_warn ("crypto threads require recvmmsg and sendmmsg support, "
+				"ignore crypto_threads option");
+#endif
+	}
+
 	if (!ctx->collection_mode) {
 		/*
 		 * Open DB and perform VACUUM
@@ -2855,6 +3688,13 @@ start_fuzzy (struct rspamd_worker *worker)
 		}
 	}
 
+#ifdef FUZZY_BATCHED_IO
+	if (ctx->crypto) {
+		rspamd_fuzzy_crypto_pool_destroy (ctx->crypto);
+		ctx->crypto = NULL;
+	}
+#endif
+
 	if (!ctx->collection_mode) {
 		rspamd_fuzzy_backend_close (ctx->backend);
 	}
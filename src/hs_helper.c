@@ -21,6 +21,10 @@
 #include "libserver/rspamd_control.h"
 #include "unix-std.h"
 
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
 #ifdef HAVE_GLOB_H
 #include <glob.h>
 #endif
@@ -39,6 +43,7 @@ worker_t hs_helper_worker = {
 
 static const gdouble default_max_time = 1.0;
 static const gdouble default_recompile_time = 60.0;
+static const guint default_max_processes = 4;
 static const guint64 rspamd_hs_helper_magic = 0x22d310157a2288a0ULL;
 
 /*
@@ -50,6 +55,14 @@ struct hs_helper_ctx {
 	gboolean loaded;
 	gdouble max_time;
 	gdouble recompile_time;
+	guint max_processes;
+	guint pending;
+	gboolean notified;
+	gboolean forced;
+	gboolean failed;
+	gboolean in_place;
+	gboolean compiled;
+	gboolean queued;
 	struct rspamd_config *cfg;
 	struct event recompile_timer;
 	struct event_base *ev_base;
@@ -69,6 +82,11 @@ init_hs_helper (struct rspamd_config *cfg)
 	ctx->hs_dir = NULL;
 	ctx->max_time = default_max_time;
 	ctx->recompile_time = default_recompile_time;
+	ctx->max_processes = default_max_processes;
+#ifdef HAVE_SC_NPROCESSORS_ONLN
+	ctx->max_processes = MIN (default_max_processes,
+			MAX (1, sysconf (_SC_NPROCESSORS_ONLN)));
+#endif
 
 	rspamd_rcl_register_worker_option (cfg,
 			type,
@@ -102,6 +120,14 @@ init_hs_helper (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct hs_helper_ctx, max_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT,
 			"Maximum time to wait for compilation of a single expression");
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"max_processes",
+			rspamd_rcl_parse_struct_integer,
+			ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, max_processes),
+			RSPAMD_CL_FLAG_UINT,
+			"Maximum number of processes used to compile expressions in parallel");
 
 	return ctx;
 }
@@ -173,18 +199,51 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx, gboolean forced)
 	return ret;
 }
 
-static gboolean
-rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
+static void
+rspamd_rs_notify (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 		gboolean forced)
 {
-	GError *err = NULL;
 	static struct rspamd_srv_command srv_cmd;
-	gint ncompiled;
 
-	if (!rspamd_hs_helper_cleanup_dir (ctx, forced)) {
-		msg_warn ("cannot cleanup cache dir '%s'", ctx->hs_dir);
+	/*
+	 * Do not send notification unless all other workers are started
+	 * XXX: now we just sleep for 5 seconds to ensure that
+	 */
+	if (!ctx->loaded) {
+		sleep (5);
+		ctx->loaded = TRUE;
 	}
 
+	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_LOADED;
+	rspamd_strlcpy (srv_cmd.cmd.hs_loaded.cache_dir, ctx->hs_dir,
+			sizeof (srv_cmd.cmd.hs_loaded.cache_dir));
+	srv_cmd.cmd.hs_loaded.forced = forced;
+
+	rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, -1, NULL, NULL);
+}
+
+struct rspamd_hs_compile_child {
+	pid_t pid;
+	gint fd;
+	guint part;
+	struct event ev;
+	struct hs_helper_ctx *ctx;
+	struct rspamd_worker *worker;
+};
+
+static gboolean rspamd_rs_compile (struct hs_helper_ctx *ctx,
+		struct rspamd_worker *worker, gboolean forced);
+
+/*
+ * Compiles the whole re cache in the helper process
+ */
+static gboolean
+rspamd_rs_compile_in_place (struct hs_helper_ctx *ctx,
+		struct rspamd_worker *worker, gboolean forced)
+{
+	GError *err = NULL;
+	gint ncompiled;
+
 	if ((ncompiled = rspamd_re_cache_compile_hyperscan (ctx->cfg->re_cache,
 			ctx->hs_dir, ctx->max_time, !forced,
 			&err)) == -1) {
@@ -200,21 +259,216 @@ rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
 		forced = TRUE;
 	}
 
-	/*
-	 * Do not send notification unless all other workers are started
-	 * XXX: now we just sleep for 5 seconds to ensure that
-	 */
-	if (!ctx->loaded) {
-		sleep (5);
-		ctx->loaded = TRUE;
+	rspamd_rs_notify (ctx, worker, forced);
+
+	return TRUE;
+}
+
+/*
+ * Called when all compile processes are finished
+ */
+static void
+rspamd_rs_compile_finished (struct hs_helper_ctx *ctx,
+		struct rspamd_worker *worker)
+{
+	if (ctx->in_place) {
+		/* Some parts have not been started, compile everything here */
+		ctx->in_place = FALSE;
+
+		if (rspamd_rs_compile_in_place (ctx, worker, ctx->forced)) {
+			ctx->failed = FALSE;
+			ctx->notified = TRUE;
+		}
+		else {
+			ctx->failed = TRUE;
+		}
 	}
 
-	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_LOADED;
-	rspamd_strlcpy (srv_cmd.cmd.hs_loaded.cache_dir, ctx->hs_dir,
-			sizeof (srv_cmd.cmd.hs_loaded.cache_dir));
-	srv_cmd.cmd.hs_loaded.forced = forced;
+	if (ctx->failed) {
+		msg_err ("failed to compile re cache in parallel processes");
 
-	rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, -1, NULL, NULL);
+		if (!ctx->compiled) {
+			/* Tell main not to respawn more workers */
+			event_base_loopexit (ctx->ev_base, NULL);
+
+			return;
+		}
+	}
+	else {
+		if (!ctx->notified) {
+			rspamd_rs_notify (ctx, worker, ctx->forced);
+		}
+
+		ctx->compiled = TRUE;
+	}
+
+	if (ctx->queued) {
+		/* Forced recompilation has been requested while compiling */
+		ctx->queued = FALSE;
+		rspamd_rs_compile (ctx, worker, TRUE);
+	}
+}
+
+static void
+rspamd_rs_compile_child_done (gint fd, short what, gpointer ud)
+{
+	struct rspamd_hs_compile_child *child = ud;
+	struct hs_helper_ctx *ctx = child->ctx;
+	struct rspamd_worker *worker = child->worker;
+	gint ncompiled = -1;
+
+	if (read (fd, &ncompiled, sizeof (ncompiled)) != sizeof (ncompiled)) {
+		ncompiled = -1;
+	}
+
+	event_del (&child->ev);
+	close (child->fd);
+	waitpid (child->pid, NULL, 0);
+	ctx->pending --;
+
+	if (ncompiled == -1) {
+		msg_err ("failed to compile part %ud of re cache", child->part);
+		ctx->failed = TRUE;
+	}
+	else if (ncompiled > 0) {
+		msg_info ("compiled %d regular expressions to the hyperscan tree "
+				"in part %ud", ncompiled, child->part);
+		/* Let workers load databases that are ready now */
+		rspamd_rs_notify (ctx, worker, TRUE);
+		ctx->notified = TRUE;
+	}
+
+	g_slice_free1 (sizeof (*child), child);
+
+	if (ctx->pending == 0) {
+		rspamd_rs_compile_finished (ctx, worker);
+	}
+}
+
+/*
+ * Forks a process that compiles a part of re cache classes and writes the
+ * number of compiled expressions to the pipe when done
+ */
+static gboolean
+rspamd_rs_compile_part (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
+		guint part, guint nparts, gboolean forced)
+{
+	struct rspamd_hs_compile_child *child;
+	GError *err = NULL;
+	gint fds[2], ncompiled;
+	pid_t pid;
+
+	if (pipe (fds) == -1) {
+		msg_err ("cannot create pipe: %s", strerror (errno));
+		return FALSE;
+	}
+
+	pid = fork ();
+
+	if (pid == -1) {
+		msg_err ("cannot fork compile process: %s", strerror (errno));
+		close (fds[0]);
+		close (fds[1]);
+
+		return FALSE;
+	}
+	else if (pid == 0) {
+		/* Child */
+		close (fds[0]);
+		ncompiled = rspamd_re_cache_compile_hyperscan_part (ctx->cfg->re_cache,
+				ctx->hs_dir, ctx->max_time, !forced, part, nparts, &err);
+
+		if (ncompiled == -1) {
+			msg_err ("failed to compile re cache: %e", err);
+			g_error_free (err);
+		}
+
+		if (write (fds[1], &ncompiled, sizeof (ncompiled)) == -1) {
+			msg_err ("cannot write compile result: %s", strerror (errno));
+		}
+
+		close (fds[1]);
+		_exit (ncompiled == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	close (fds[1]);
+	child = g_slice_alloc0 (sizeof (*child));
+	child->pid = pid;
+	child->fd = fds[0];
+	child->part = part;
+	child->ctx = ctx;
+	child->worker = worker;
+	event_set (&child->ev, child->fd, EV_READ, rspamd_rs_compile_child_done,
+			child);
+	event_base_set (ctx->ev_base, &child->ev);
+	event_add (&child->ev, NULL);
+	ctx->pending ++;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker,
+		gboolean forced)
+{
+	guint i;
+
+	if (ctx->pending > 0) {
+		if (forced) {
+			msg_info ("hyperscan compilation is still in progress, %ud parts "
+					"pending, queue forced recompilation", ctx->pending);
+			ctx->queued = TRUE;
+		}
+		else {
+			msg_info ("hyperscan compilation is still in progress, %ud parts "
+					"pending", ctx->pending);
+		}
+
+		return TRUE;
+	}
+
+	if (!rspamd_hs_helper_cleanup_dir (ctx, forced)) {
+		msg_warn ("cannot cleanup cache dir '%s'", ctx->hs_dir);
+	}
+
+	if (ctx->max_processes > 1) {
+		/*
+		 * Classes are stored in separate files keyed by the hash of their
+		 * regexps, so only changed classes are compiled and each part is
+		 * announced to workers as soon as it is ready. The result is
+		 * handled by rspamd_rs_compile_finished when all parts are done
+		 */
+		ctx->notified = FALSE;
+		ctx->failed = FALSE;
+		ctx->in_place = FALSE;
+		ctx->forced = forced;
+
+		for (i = 0; i < ctx->max_processes; i ++) {
+			if (!rspamd_rs_compile_part (ctx, worker, i, ctx->max_processes,
+					forced)) {
+				break;
+			}
+		}
+
+		if (i == ctx->max_processes) {
+			return TRUE;
+		}
+
+		msg_warn ("cannot start parallel compilation, compile in place");
+
+		if (ctx->pending > 0) {
+			/* Compile everything when already started children are done */
+			ctx->in_place = TRUE;
+
+			return TRUE;
+		}
+	}
+
+	if (!rspamd_rs_compile_in_place (ctx, worker, forced)) {
+		return FALSE;
+	}
+
+	ctx->compiled = TRUE;
 
 	return TRUE;
 }
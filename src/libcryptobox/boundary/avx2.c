@@ -0,0 +1,98 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+
+size_t boundary_scan_ref (const char *in, size_t len, size_t start,
+		rspamd_cryptobox_boundary_cb cb, void *ud);
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#ifndef __AVX__
+#define __AVX__
+#endif
+#ifndef __AVX2__
+#define __AVX2__
+#endif
+#include <immintrin.h>
+
+static inline guint32
+boundary_block_avx2 (const char *p) __attribute__((__target__("avx2")));
+
+/*
+ * Returns bitmask of positions in a 32 bytes block that start "\r--" or "\n--"
+ */
+static inline guint32
+boundary_block_avx2 (const char *p)
+{
+	const __m256i cr = _mm256_set1_epi8 ('\r'), lf = _mm256_set1_epi8 ('\n'),
+			dash = _mm256_set1_epi8 ('-');
+	__m256i c0, c1, c2, eol;
+
+	c0 = _mm256_loadu_si256 ((const __m256i *)p);
+	c1 = _mm256_loadu_si256 ((const __m256i *)(p + 1));
+	c2 = _mm256_loadu_si256 ((const __m256i *)(p + 2));
+	eol = _mm256_or_si256 (_mm256_cmpeq_epi8 (c0, cr),
+			_mm256_cmpeq_epi8 (c0, lf));
+	eol = _mm256_and_si256 (eol, _mm256_cmpeq_epi8 (c1, dash));
+	eol = _mm256_and_si256 (eol, _mm256_cmpeq_epi8 (c2, dash));
+
+	return (guint32)_mm256_movemask_epi8 (eol);
+}
+
+size_t
+boundary_scan_avx2 (const char *in, size_t len, size_t start,
+		rspamd_cryptobox_boundary_cb cb, void *ud)
+		__attribute__((__target__("avx2")));
+
+size_t
+boundary_scan_avx2 (const char *in, size_t len, size_t start,
+		rspamd_cryptobox_boundary_cb cb, void *ud)
+{
+	size_t i = start, nfound = 0;
+	guint64 mask;
+
+	/* We read two bytes after each block, so leave them in the buffer */
+	while (i + 64 + 2 <= len) {
+		mask = (guint64)boundary_block_avx2 (in + i) |
+				((guint64)boundary_block_avx2 (in + i + 32) << 32);
+
+		while (mask) {
+			nfound ++;
+
+			if (cb (in, len, i + __builtin_ctzll (mask) + 3, ud) != 0) {
+				return nfound;
+			}
+
+			mask &= mask - 1;
+		}
+
+		i += 64;
+	}
+
+	return nfound + boundary_scan_ref (in, len, i, cb, ud);
+}
+
+#pragma GCC pop_options
+#endif
@@ -0,0 +1,152 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+#include "boundary.h"
+#include "platform_config.h"
+#include "contrib/libottery/ottery.h"
+
+extern unsigned long cpu_config;
+
+typedef struct boundary_impl {
+	unsigned long cpu_flags;
+	const char *desc;
+
+	size_t (*scan) (const char *in, size_t len, size_t start,
+			rspamd_cryptobox_boundary_cb cb, void *ud);
+} boundary_impl_t;
+
+#define BOUNDARY_DECLARE(ext) \
+    size_t boundary_scan_##ext(const char *in, size_t len, size_t start, \
+    		rspamd_cryptobox_boundary_cb cb, void *ud);
+#define BOUNDARY_IMPL(cpuflags, desc, ext) \
+    {(cpuflags), desc, boundary_scan_##ext}
+
+BOUNDARY_DECLARE(ref);
+#define BOUNDARY_REF BOUNDARY_IMPL(0, "ref", ref)
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+# if defined(HAVE_AVX2)
+BOUNDARY_DECLARE(avx2);
+#  define BOUNDARY_AVX2 BOUNDARY_IMPL(CPUID_AVX2, "avx2", avx2)
+# endif
+# if defined(HAVE_SSE2)
+BOUNDARY_DECLARE(sse2);
+#  define BOUNDARY_SSE2 BOUNDARY_IMPL(CPUID_SSE2, "sse2", sse2)
+# endif
+#endif
+
+static const boundary_impl_t boundary_list[] = {
+		BOUNDARY_REF,
+#ifdef BOUNDARY_AVX2
+		BOUNDARY_AVX2,
+#endif
+#ifdef BOUNDARY_SSE2
+		BOUNDARY_SSE2,
+#endif
+};
+
+static const boundary_impl_t *boundary_opt = &boundary_list[0];
+
+const char *
+boundary_load (void)
+{
+	guint i;
+
+	if (cpu_config != 0) {
+		for (i = 0; i < G_N_ELEMENTS (boundary_list); i++) {
+			if (boundary_list[i].cpu_flags & cpu_config) {
+				boundary_opt = &boundary_list[i];
+				break;
+			}
+		}
+	}
+
+	return boundary_opt->desc;
+}
+
+gsize
+rspamd_cryptobox_find_boundaries (const gchar *in, gsize len,
+		rspamd_cryptobox_boundary_cb cb, gpointer ud)
+{
+	return boundary_opt->scan (in, len, 0, cb, ud);
+}
+
+static gint
+boundary_test_cb (const gchar *in, gsize len, gsize pos, gpointer ud)
+{
+	gsize *sum = ud;
+
+	*sum += pos;
+
+	return 0;
+}
+
+size_t
+boundary_test (bool generic, size_t niters, size_t len)
+{
+	size_t cycles, nref, nfound, pos = 0, line;
+	gsize sum_ref = 0, sum = 0;
+	const boundary_impl_t *impl;
+	static const char alpha[] = "abcdefghijklmnopqrstuvwxyz0123456789 -=";
+	gchar *in;
+
+	g_assert (len > 0);
+	in = g_malloc (len);
+
+	/*
+	 * Emulate multipart message: lines of text with dashes, CRLF and LF
+	 * line endings and some boundary lines
+	 */
+	while (pos < len) {
+		line = ottery_rand_range (76) + 1;
+
+		if (ottery_rand_range (16) == 0 && pos + 2 < len) {
+			in[pos++] = '-';
+			in[pos++] = '-';
+		}
+
+		while (line > 0 && pos < len) {
+			in[pos++] = alpha[ottery_rand_range (sizeof (alpha) - 2)];
+			line --;
+		}
+
+		if (pos < len && ottery_rand_range (2) == 0) {
+			in[pos++] = '\r';
+		}
+
+		if (pos < len) {
+			in[pos++] = '\n';
+		}
+	}
+
+	impl = generic ? &boundary_list[0] : boundary_opt;
+
+	nref = boundary_list[0].scan (in, len, 0, boundary_test_cb, &sum_ref);
+	nfound = impl->scan (in, len, 0, boundary_test_cb, &sum);
+
+	g_assert (nref == nfound);
+	g_assert (sum_ref == sum);
+
+	for (cycles = 0; cycles < niters; cycles ++) {
+		impl->scan (in, len, 0, boundary_test_cb, &sum);
+	}
+
+	g_free (in);
+
+	return cycles;
+}
@@ -0,0 +1,50 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+
+/*
+ * Reference scanner: checks every position for "\r--" or "\n--"
+ */
+size_t
+boundary_scan_ref (const char *in, size_t len, size_t start,
+		rspamd_cryptobox_boundary_cb cb, void *ud)
+{
+	const unsigned char *p = (const unsigned char *)in;
+	size_t i, nfound = 0;
+
+	if (len < 3) {
+		return 0;
+	}
+
+	for (i = start; i < len - 2; i ++) {
+		if (p[i + 1] != '-') {
+			/* Skip quickly as dash is the rarest char here */
+			continue;
+		}
+
+		if ((p[i] == '\n' || p[i] == '\r') && p[i + 2] == '-') {
+			nfound ++;
+
+			if (cb (in, len, i + 3, ud) != 0) {
+				break;
+			}
+		}
+	}
+
+	return nfound;
+}
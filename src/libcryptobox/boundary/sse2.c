@@ -0,0 +1,91 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "cryptobox.h"
+
+size_t boundary_scan_ref (const char *in, size_t len, size_t start,
+		rspamd_cryptobox_boundary_cb cb, void *ud);
+
+#ifdef RSPAMD_HAS_TARGET_ATTR
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#ifndef __SSE2__
+#define __SSE2__
+#endif
+#ifndef __SSE__
+#define __SSE__
+#endif
+#include <emmintrin.h>
+
+static inline unsigned int
+boundary_block_sse2 (const char *p) __attribute__((__target__("sse2")));
+
+/*
+ * Returns bitmask of positions in a 16 bytes block that start "\r--" or "\n--"
+ */
+static inline unsigned int
+boundary_block_sse2 (const char *p)
+{
+	const __m128i cr = _mm_set1_epi8 ('\r'), lf = _mm_set1_epi8 ('\n'),
+			dash = _mm_set1_epi8 ('-');
+	__m128i c0, c1, c2, eol;
+
+	c0 = _mm_loadu_si128 ((const __m128i *)p);
+	c1 = _mm_loadu_si128 ((const __m128i *)(p + 1));
+	c2 = _mm_loadu_si128 ((const __m128i *)(p + 2));
+	eol = _mm_or_si128 (_mm_cmpeq_epi8 (c0, cr), _mm_cmpeq_epi8 (c0, lf));
+	eol = _mm_and_si128 (eol, _mm_cmpeq_epi8 (c1, dash));
+	eol = _mm_and_si128 (eol, _mm_cmpeq_epi8 (c2, dash));
+
+	return _mm_movemask_epi8 (eol);
+}
+
+size_t
+boundary_scan_sse2 (const char *in, size_t len, size_t start,
+		rspamd_cryptobox_boundary_cb cb, void *ud)
+		__attribute__((__target__("sse2")));
+
+size_t
+boundary_scan_sse2 (const char *in, size_t len, size_t start,
+		rspamd_cryptobox_boundary_cb cb, void *ud)
+{
+	size_t i = start, nfound = 0;
+	unsigned int mask;
+
+	/* We read two bytes after each block, so leave them in the buffer */
+	while (i + 32 + 2 <= len) {
+		mask = boundary_block_sse2 (in + i) |
+				(boundary_block_sse2 (in + i + 16) << 16);
+
+		while (mask) {
+			nfound ++;
+
+			if (cb (in, len, i + __builtin_ctz (mask) + 3, ud) != 0) {
+				return nfound;
+			}
+
+			mask &= mask - 1;
+		}
+
+		i += 32;
+	}
+
+	return nfound + boundary_scan_ref (in, len, i, cb, ud);
+}
+
+#pragma GCC pop_options
+#endif
@@ -30,6 +30,7 @@
 #include "siphash/siphash.h"
 #include "catena/catena.h"
 #include "base64/base64.h"
+#include "boundary/boundary.h"
 #include "ottery.h"
 #include "printf.h"
 #include "xxhash.h"
@@ -332,6 +333,7 @@ rspamd_cryptobox_init (void)
 	ctx->blake2_impl = blake2b_load ();
 	ctx->ed25519_impl = ed25519_load ();
 	ctx->base64_impl = base64_load ();
+	ctx->boundary_impl = boundary_load ();
 #ifdef HAVE_USABLE_OPENSSL
 	ERR_load_EC_strings ();
 	ERR_load_RAND_strings ();
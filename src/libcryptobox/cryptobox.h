@@ -73,6 +73,7 @@ struct rspamd_cryptobox_library_ctx {
 	const gchar *siphash_impl;
 	const gchar *blake2_impl;
 	const gchar *base64_impl;
+	const gchar *boundary_impl;
 	unsigned long cpu_config;
 };
 
@@ -387,4 +388,27 @@ guint64 rspamd_cryptobox_fast_hash_specific (
  */
 gboolean rspamd_cryptobox_base64_decode (const gchar *in, gsize inlen,
 		guchar *out, gsize *outlen);
+
+/**
+ * Callback for boundaries scanner
+ * @param in input buffer
+ * @param len length of the input
+ * @param pos offset just after "--" of a candidate
+ * @param ud opaque data
+ * @return non-zero value to stop scanning
+ */
+typedef gint (*rspamd_cryptobox_boundary_cb) (const gchar *in, gsize len,
+		gsize pos, gpointer ud);
+
+/**
+ * Find MIME boundaries candidates ("\r--" and "\n--") using platform
+ * optimized code
+ * @param in
+ * @param len
+ * @param cb
+ * @param ud
+ * @return number of candidates found
+ */
+gsize rspamd_cryptobox_find_boundaries (const gchar *in, gsize len,
+		rspamd_cryptobox_boundary_cb cb, gpointer ud);
 #endif /* CRYPTOBOX_H_ */
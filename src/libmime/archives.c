@@ -18,6 +18,7 @@
 #include "message.h"
 #include "task.h"
 #include "archives.h"
+#include "mime_parser.h"
 #include "fstring.h"
 
 static void
@@ -559,6 +560,23 @@ part->flags |= RSPAMD_MIME_PART_ARCHIVE;
 	arch->size = part->parsed_data.len;
 }
 
+struct rspamd_archive_magic_cbdata {
+	guchar buf[8];
+	gsize len;
+};
+
+static gboolean
+rspamd_archive_magic_cb (const guchar *data, gsize len, gpointer ud)
+{
+	struct rspamd_archive_magic_cbdata *cbd = ud;
+
+	len = MIN (len, sizeof (cbd->buf) - cbd->len);
+	memcpy (cbd->buf + cbd->len, data, len);
+	cbd->len += len;
+
+	return cbd->len < sizeof (cbd->buf);
+}
+
 static gboolean
 rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
 		const guchar *magic_start, gsize magic_len)
@@ -591,8 +609,15 @@ rspamd_archive_cheat_detect (struct rspamd_mime_part *part, const gchar *str,
 			}
 		}
 
-		if (magic_start != NULL) {
-			if (part->parsed_data.len > magic_len && memcmp (part->parsed_data.begin,
+		if (magic_start != NULL && part->parsed_data.len > magic_len) {
+			/* Decode merely the beginning of a part to check magic */
+			struct rspamd_archive_magic_cbdata cbd;
+
+			g_assert (magic_len <= sizeof (cbd.buf));
+			cbd.len = 0;
+			rspamd_mime_part_decode_stream (part, rspamd_archive_magic_cb, &cbd);
+
+			if (cbd.len >= magic_len && memcmp (cbd.buf,
 					magic_start, magic_len) == 0) {
 				return TRUE;
 			}
@@ -616,10 +641,12 @@ rspamd_archives_process (struct rspamd_task *task)
 		if (part->parsed_data.len > 0) {
 			if (rspamd_archive_cheat_detect (part, "zip",
 					zip_magic, sizeof (zip_magic))) {
+				rspamd_mime_part_get_data (part);
 				rspamd_archive_process_zip (task, part);
 			}
 			else if (rspamd_archive_cheat_detect (part, "rar",
 					rar_magic, sizeof (rar_magic))) {
+				rspamd_mime_part_get_data (part);
 				rspamd_archive_process_rar (task, part);
 			}
 		}
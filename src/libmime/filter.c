@@ -271,7 +271,8 @@ insert_result_common (struct rspamd_task *task,
 
 	/* Process cache item */
 	if (task->cfg->cache) {
-		rspamd_symbols_cache_inc_frequency (task->cfg->cache, symbol);
+		rspamd_symbols_cache_inc_frequency (task->cfg->cache, symbol,
+				s != NULL ? s->score : 0.0);
 	}
 
 	return s;
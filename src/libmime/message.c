@@ -463,6 +463,12 @@ rspamd_message_process_text_part (struct rspamd_task *task,
 		return;
 	}
 
+	if ((found_txt || found_html) &&
+			(mime_part->flags & RSPAMD_MIME_PART_UNDECODED)) {
+		/* Parts with non-text content type are decoded lazily */
+		rspamd_mime_part_get_data (mime_part);
+	}
+
 	if (found_html) {
 		text_part = rspamd_mempool_alloc0 (task->task_pool,
 				sizeof (struct rspamd_mime_text_part));
@@ -24,7 +24,9 @@ enum rspamd_mime_part_flags {
 	RSPAMD_MIME_PART_ATTACHEMENT = (1 << 1),
 	RSPAMD_MIME_PART_IMAGE = (1 << 2),
 	RSPAMD_MIME_PART_ARCHIVE = (1 << 3),
-	RSPAMD_MIME_PART_BAD_CTE = (1 << 4)
+	RSPAMD_MIME_PART_BAD_CTE = (1 << 4),
+	RSPAMD_MIME_PART_UNDECODED = (1 << 5), /* parsed_data holds only length */
+	RSPAMD_MIME_PART_DECODED = (1 << 6) /* parsed_data is decoded on demand */
 };
 
 enum rspamd_cte {
@@ -20,12 +20,10 @@
 #include "mime_headers.h"
 #include "message.h"
 #include "content_type.h"
-#include "multipattern.h"
 #include "cryptobox.h"
 #include "contrib/libottery/ottery.h"
 
 struct rspamd_mime_parser_lib_ctx {
-	struct rspamd_multipattern *mp_boundary;
 	guchar hkey[rspamd_cryptobox_SIPKEYBYTES]; /* Key for hashing */
 	guint key_usages;
 } *lib_ctx = NULL;
@@ -33,6 +31,8 @@ struct rspamd_mime_parser_lib_ctx {
 static const guint max_nested = 32;
 static const guint max_key_usages = 10000;
 
+#define RSPAMD_MIME_DECODE_PORTION 4096
+
 #define msg_debug_mime(...)  rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
         "mime", task->task_pool->tag.uid, \
         G_STRFUNC, \
@@ -110,11 +110,6 @@ static void
 rspamd_mime_parser_init_lib (void)
 {
 	lib_ctx = g_malloc0 (sizeof (*lib_ctx));
-	lib_ctx->mp_boundary = rspamd_multipattern_create (RSPAMD_MULTIPATTERN_DEFAULT);
-	g_assert (lib_ctx->mp_boundary != NULL);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\r--", 0);
-	rspamd_multipattern_add_pattern (lib_ctx->mp_boundary, "\n--", 0);
-	g_assert (rspamd_multipattern_compile (lib_ctx->mp_boundary, NULL));
 	ottery_rand_bytes (lib_ctx->hkey, sizeof (lib_ctx->hkey));
 }
 
@@ -295,26 +290,170 @@ rspamd_mime_part_get_cd (struct rspamd_task *task, struct rspamd_mime_part *part
 	part->cd = cd;
 }
 
+/* Blake2b applied to string 'rspamd' */
+static const guchar rspamd_mime_digest_key[] = {
+		0xef,0x43,0xae,0x80,0xcc,0x8d,0xc3,0x4c,
+		0x6f,0x1b,0xd6,0x18,0x1b,0xae,0x87,0x74,
+		0x0c,0xca,0xf7,0x8e,0x5f,0x2e,0x54,0x32,
+		0xf6,0x79,0xb9,0x27,0x26,0x96,0x20,0x92,
+		0x70,0x07,0x85,0xeb,0x83,0xf7,0x89,0xe0,
+		0xd7,0x32,0x2a,0xd2,0x1a,0x64,0x41,0xef,
+		0x49,0xff,0xc3,0x8c,0x54,0xf9,0x67,0x74,
+		0x30,0x1e,0x70,0x2e,0xb7,0x12,0x09,0xfe,
+};
+
 static void
 rspamd_mime_parser_calc_digest (struct rspamd_mime_part *part)
 {
-	/* Blake2b applied to string 'rspamd' */
-	static const guchar hash_key[] = {
-			0xef,0x43,0xae,0x80,0xcc,0x8d,0xc3,0x4c,
-			0x6f,0x1b,0xd6,0x18,0x1b,0xae,0x87,0x74,
-			0x0c,0xca,0xf7,0x8e,0x5f,0x2e,0x54,0x32,
-			0xf6,0x79,0xb9,0x27,0x26,0x96,0x20,0x92,
-			0x70,0x07,0x85,0xeb,0x83,0xf7,0x89,0xe0,
-			0xd7,0x32,0x2a,0xd2,0x1a,0x64,0x41,0xef,
-			0x49,0xff,0xc3,0x8c,0x54,0xf9,0x67,0x74,
-			0x30,0x1e,0x70,0x2e,0xb7,0x12,0x09,0xfe,
-	};
-
 	if (part->parsed_data.len > 0) {
 		rspamd_cryptobox_hash (part->digest,
 				part->parsed_data.begin, part->parsed_data.len,
-				hash_key, sizeof (hash_key));
+				rspamd_mime_digest_key, sizeof (rspamd_mime_digest_key));
+	}
+}
+
+static gboolean
+rspamd_mime_parser_digest_cb (const guchar *data, gsize len, gpointer ud)
+{
+	rspamd_cryptobox_hash_state_t *st = ud;
+
+	rspamd_cryptobox_hash_update (st, data, len);
+
+	return TRUE;
+}
+
+gsize
+rspamd_mime_part_decode_stream (struct rspamd_mime_part *part,
+		rspamd_mime_part_data_cb cb, gpointer ud)
+{
+	const gchar *p, *end, *seg, *eol;
+	guchar *out = NULL;
+	gsize outlen, outsize = 0, need, total = 0, nchars = 0;
+	gssize r;
+
+	if (!(part->flags & RSPAMD_MIME_PART_UNDECODED)) {
+		if (part->parsed_data.len > 0) {
+			cb ((const guchar *)part->parsed_data.begin, part->parsed_data.len,
+					ud);
+		}
+
+		return part->parsed_data.len;
+	}
+
+	p = part->raw_data.begin;
+	end = p + part->raw_data.len;
+	seg = p;
+
+	while (p < end) {
+		eol = memchr (p, '\n', end - p);
+		eol = eol ? eol + 1 : end;
+
+		if (part->cte == RSPAMD_CTE_B64) {
+			/* Split input only where no base64 quantum is left unfinished */
+			for (; p < eol; p ++) {
+				if (g_ascii_isalnum (*p) || *p == '+' || *p == '/') {
+					nchars ++;
+				}
+			}
+		}
+
+		p = eol;
+
+		if (p == end || (p - seg >= RSPAMD_MIME_DECODE_PORTION &&
+				(nchars & 3) == 0)) {
+			need = p - seg + 12;
+
+			if (need > outsize) {
+				outsize = MAX (need, RSPAMD_MIME_DECODE_PORTION + 12);
+				out = g_realloc (out, outsize);
+			}
+
+			if (part->cte == RSPAMD_CTE_B64) {
+				outlen = outsize;
+				rspamd_cryptobox_base64_decode (seg, p - seg, out, &outlen);
+			}
+			else {
+				r = rspamd_decode_qp_buf (seg, p - seg, (gchar *)out, outsize);
+				g_assert (r != -1);
+				outlen = r;
+			}
+
+			seg = p;
+			total += outlen;
+
+			if (outlen > 0 && !cb (out, outlen, ud)) {
+				break;
+			}
+		}
 	}
+
+	g_free (out);
+
+	return total;
+}
+
+struct rspamd_mime_part_store_cbdata {
+	guchar *out;
+	gsize pos;
+	gsize len;
+};
+
+static gboolean
+rspamd_mime_part_store_cb (const guchar *data, gsize len, gpointer ud)
+{
+	struct rspamd_mime_part_store_cbdata *cbd = ud;
+
+	len = MIN (len, cbd->len - cbd->pos);
+	memcpy (cbd->out + cbd->pos, data, len);
+	cbd->pos += len;
+
+	return cbd->pos < cbd->len;
+}
+
+const rspamd_ftok_t *
+rspamd_mime_part_get_data (struct rspamd_mime_part *part)
+{
+	struct rspamd_mime_part_store_cbdata cbd;
+
+	if (part->flags & RSPAMD_MIME_PART_UNDECODED) {
+		/* Length is known from the first pass */
+		cbd.out = g_malloc (MAX (part->parsed_data.len, 1));
+		cbd.pos = 0;
+		cbd.len = part->parsed_data.len;
+
+		if (cbd.len > 0) {
+			rspamd_mime_part_decode_stream (part, rspamd_mime_part_store_cb,
+					&cbd);
+		}
+
+		part->parsed_data.begin = (const gchar *)cbd.out;
+		part->parsed_data.len = cbd.pos;
+		part->flags &= ~RSPAMD_MIME_PART_UNDECODED;
+		/* Freed with the task */
+		part->flags |= RSPAMD_MIME_PART_DECODED;
+	}
+
+	return &part->parsed_data;
+}
+
+/*
+ * Text parts and images are always used once message is parsed, other parts
+ * are decoded only when somebody needs their content
+ */
+static gboolean
+rspamd_mime_part_is_lazy (struct rspamd_mime_part *part)
+{
+	if (IS_CT_TEXT (part->ct)) {
+		return FALSE;
+	}
+
+	if (part->ct->type.len == sizeof ("image") - 1 &&
+			rspamd_lc_cmp (part->ct->type.begin, "image",
+					sizeof ("image") - 1) == 0) {
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 static gboolean
@@ -351,20 +490,45 @@ rspamd_mime_parse_normal_part (struct rspamd_task *task,
 		}
 		break;
 	case RSPAMD_CTE_QP:
-		parsed = rspamd_fstring_sized_new (part->raw_data.len);
-		r = rspamd_decode_qp_buf (part->raw_data.begin, part->raw_data.len,
-				parsed->str, parsed->allocated);
-		g_assert (r != -1);
-		parsed->len = r;
-		part->parsed_data.begin = parsed->str;
-		part->parsed_data.len = parsed->len;
-		rspamd_mempool_add_destructor (task->task_pool,
-				(rspamd_mempool_destruct_t)rspamd_fstring_free, parsed);
-		break;
 	case RSPAMD_CTE_B64:
-		parsed = rspamd_fstring_sized_new (part->raw_data.len / 4 * 3 + 12);
-		rspamd_cryptobox_base64_decode (part->raw_data.begin, part->raw_data.len,
-				parsed->str, &parsed->len);
+		if (rspamd_mime_part_is_lazy (part)) {
+			/*
+			 * Do not store decoded content, we need merely its length
+			 * and digest so far
+			 */
+			rspamd_cryptobox_hash_state_t hst;
+
+			part->flags |= RSPAMD_MIME_PART_UNDECODED;
+			rspamd_cryptobox_hash_init (&hst, rspamd_mime_digest_key,
+					sizeof (rspamd_mime_digest_key));
+			part->parsed_data.begin = NULL;
+			part->parsed_data.len = rspamd_mime_part_decode_stream (part,
+					rspamd_mime_parser_digest_cb, &hst);
+
+			if (part->parsed_data.len > 0) {
+				rspamd_cryptobox_hash_final (&hst, part->digest);
+			}
+
+			g_ptr_array_add (task->parts, part);
+			msg_debug_mime ("lazy data part %T/%T of length %z (%z orig), %s cte",
+					&part->ct->type, &part->ct->subtype, part->parsed_data.len,
+					part->raw_data.len, rspamd_cte_to_string (part->cte));
+
+			return TRUE;
+		}
+		else if (part->cte == RSPAMD_CTE_QP) {
+			parsed = rspamd_fstring_sized_new (part->raw_data.len);
+			r = rspamd_decode_qp_buf (part->raw_data.begin, part->raw_data.len,
+					parsed->str, parsed->allocated);
+			g_assert (r != -1);
+			parsed->len = r;
+		}
+		else {
+			parsed = rspamd_fstring_sized_new (part->raw_data.len / 4 * 3 + 12);
+			rspamd_cryptobox_base64_decode (part->raw_data.begin,
+					part->raw_data.len, parsed->str, &parsed->len);
+		}
+
 		part->parsed_data.begin = parsed->str;
 		part->parsed_data.len = parsed->len;
 		rspamd_mempool_add_destructor (task->task_pool,
@@ -688,13 +852,10 @@ rspamd_mime_parse_multipart_part (struct rspamd_task *task,
 
 /* Process boundary like structures in a message */
 static gint
-rspamd_mime_preprocess_cb (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
+rspamd_mime_preprocess_cb (const gchar *text,
 		gsize len,
-		void *context)
+		gsize match_pos,
+		gpointer context)
 {
 	const gchar *end = text + len, *p = text + match_pos, *bend;
 	gchar *lc_copy;
@@ -841,23 +1002,101 @@ end:
 	return (-1);
 }
 
+/*
+ * Drops headers parsed by rspamd_mime_parse_task_headers and everything
+ * derived from them
+ */
+static void
+rspamd_mime_reset_task_headers (struct rspamd_task *task)
+{
+	g_hash_table_remove_all (task->raw_headers);
+	g_ptr_array_set_size (task->received, 0);
+	/* Addresses lists are owned by the task pool */
+	task->rcpt_mime = NULL;
+	task->from_mime = NULL;
+	task->message_id = NULL;
+	memset (&task->raw_headers_content, 0, sizeof (task->raw_headers_content));
+	task->flags &= ~(RSPAMD_TASK_FLAG_HEADERS_PARSED|
+			RSPAMD_TASK_FLAG_BROKEN_HEADERS);
+
+	/* Results of prefetched headers regexps are invalid as well */
+	if (task->re_rt) {
+		rspamd_re_cache_runtime_destroy (task->re_rt);
+		task->re_rt = rspamd_re_cache_runtime_new (task->cfg->re_cache);
+	}
+}
+
+gboolean
+rspamd_mime_parse_task_headers (struct rspamd_task *task,
+		const gchar *in, gsize len, gsize *scanned)
+{
+	GString str;
+	goffset hdr_pos, body_pos;
+	gsize start;
+
+	if (task->flags & RSPAMD_TASK_FLAG_HEADERS_PARSED) {
+		return TRUE;
+	}
+
+	if (*scanned == 0 && len > 0) {
+		/*
+		 * Leading spaces and mailbox format are skipped when the whole message
+		 * is parsed, so leave such messages for the full parser
+		 */
+		if (g_ascii_isspace (*in) || (len >= sizeof ("From ") - 1 &&
+				memcmp (in, "From ", sizeof ("From ") - 1) == 0)) {
+			*scanned = G_MAXSIZE;
+		}
+	}
+
+	/* Rescan a few bytes to catch the empty line split between chunks */
+	start = *scanned > 4 ? *scanned - 4 : 0;
+
+	if (start >= len) {
+		return FALSE;
+	}
+
+	str.str = (gchar *)in + start;
+	str.len = len - start;
+	*scanned = len;
+	hdr_pos = rspamd_string_find_eoh (&str, &body_pos);
+
+	/*
+	 * We need at least one byte of the body to distinguish `\r\r` from
+	 * `\r\r\n`, so wait for the next chunk otherwise
+	 */
+	if (hdr_pos < 0 || hdr_pos + start == 0 || (gsize)body_pos >= str.len) {
+		return FALSE;
+	}
+
+	task->raw_headers_content.begin = (gchar *)in;
+	task->raw_headers_content.len = hdr_pos + start;
+	task->raw_headers_content.body_start = in + start + body_pos;
+	rspamd_mime_headers_process (task, task->raw_headers,
+			task->raw_headers_content.begin,
+			task->raw_headers_content.len,
+			TRUE);
+	task->flags |= RSPAMD_TASK_FLAG_HEADERS_PARSED;
+
+	return TRUE;
+}
+
 static void
 rspamd_mime_preprocess_message (struct rspamd_task *task,
 		struct rspamd_mime_part *top,
 		struct rspamd_mime_parser_ctx *st)
 {
 
+	/* Candidates are found by a vectorised scanner if the CPU supports it */
 	if (top->raw_data.begin >= st->pos) {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
-				top->raw_data.begin - 1,
+		rspamd_cryptobox_find_boundaries (top->raw_data.begin - 1,
 				top->raw_data.len + 1,
-				rspamd_mime_preprocess_cb, st, NULL);
+				rspamd_mime_preprocess_cb, st);
 	}
 	else {
-		rspamd_multipattern_lookup (lib_ctx->mp_boundary,
-				st->pos,
+		rspamd_cryptobox_find_boundaries (st->pos,
 				st->end - st->pos,
-				rspamd_mime_preprocess_cb, st, NULL);
+				rspamd_mime_preprocess_cb, st);
 	}
 }
 
@@ -929,9 +1168,26 @@ rspamd_mime_parse_message (struct rspamd_task *task,
 		str.str = (gchar *)p;
 		str.len = len;
 
-		hdr_pos = rspamd_string_find_eoh (&str, &body_pos);
+		if ((task->flags & RSPAMD_TASK_FLAG_HEADERS_PARSED) &&
+				task->raw_headers_content.begin != str.str) {
+			/*
+			 * Message has been moved since its headers were parsed while it
+			 * was being received, so they might be wrong: parse them again
+			 */
+			msg_info_task ("message has been moved after parsing its headers, "
+					"parse them once more");
+			rspamd_mime_reset_task_headers (task);
+		}
 
-		if (hdr_pos > 0 && hdr_pos < str.len) {
+		if (task->flags & RSPAMD_TASK_FLAG_HEADERS_PARSED) {
+			/* Headers have been parsed while the message was being received */
+			body_pos = task->raw_headers_content.body_start - str.str;
+			hdrs = rspamd_message_get_header_from_hash (task->raw_headers,
+					task->task_pool,
+					"Content-Type", FALSE);
+		}
+		else if ((hdr_pos = rspamd_string_find_eoh (&str, &body_pos)) > 0 &&
+				hdr_pos < str.len) {
 
 			task->raw_headers_content.begin = (gchar *) (str.str);
 			task->raw_headers_content.len = hdr_pos;
@@ -17,9 +17,43 @@
 #define SRC_LIBMIME_MIME_PARSER_H_
 
 #include "config.h"
+#include "fstring.h"
 
 struct rspamd_task;
+struct rspamd_mime_part;
+
+typedef gboolean (*rspamd_mime_part_data_cb) (const guchar *data, gsize len,
+		gpointer ud);
 
 gboolean rspamd_mime_parse_task (struct rspamd_task *task, GError **err);
 
+/**
+ * Parse message headers from the beginning of a message that is still being
+ * received, so `rspamd_mime_parse_task` will not parse them once more
+ * @param task
+ * @param in received part of the message
+ * @param len length of the received part
+ * @param scanned number of bytes already checked for the end of headers
+ * @return TRUE if message headers have been parsed
+ */
+gboolean rspamd_mime_parse_task_headers (struct rspamd_task *task,
+		const gchar *in, gsize len, gsize *scanned);
+
+/**
+ * Decode content of a part by portions without storing the decoded data
+ * @param part
+ * @param cb callback for each portion, returns FALSE to stop decoding
+ * @param ud
+ * @return number of decoded bytes
+ */
+gsize rspamd_mime_part_decode_stream (struct rspamd_mime_part *part,
+		rspamd_mime_part_data_cb cb, gpointer ud);
+
+/**
+ * Returns decoded content of a part decoding it if it has not been done yet
+ * @param part
+ * @return
+ */
+const rspamd_ftok_t * rspamd_mime_part_get_data (struct rspamd_mime_part *part);
+
 #endif /* SRC_LIBMIME_MIME_PARSER_H_ */
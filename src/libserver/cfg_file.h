@@ -196,6 +196,9 @@ struct rspamd_worker_conf {
 	gpointer *ctx;                                  /**< worker's context									*/
 	ucl_object_t *options;                          /**< other worker's options								*/
 	struct rspamd_worker_lua_script *scripts;       /**< registered lua scripts								*/
+	gboolean reuseport;                             /**< bind separate UDP sockets for each worker			*/
+	gboolean cpu_affinity;                          /**< pin each worker to a CPU core						*/
+	GPtrArray *reuseport_socks;                     /**< UDP sockets of each worker by its index			*/
 	ref_entry_t ref;
 };
 
@@ -298,6 +301,7 @@ struct rspamd_config {
 	gboolean convert_config;                        /**< convert config to XML format						*/
 	gboolean strict_protocol_headers;               /**< strictly check protocol headers					*/
 	gboolean check_all_filters;                     /**< check all filters									*/
+	gboolean ham_shortcut;                          /**< stop checks if no action could be reached			*/
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
 	gboolean disable_hyperscan;                     /**< disable hyperscan usage							*/
 	gboolean vectorized_hyperscan;                  /**< use vectorized hyperscan matching					*/
@@ -405,6 +409,9 @@ struct rspamd_config {
 	guint min_word_len;								/**< minimum length of the word to be considered		*/
 	guint max_word_len;								/**< maximum length of the word to be considered		*/
 	guint words_decay;								/**< limit for words for starting adaptive ignoring		*/
+	guint url_cache_size;							/**< number of parsed urls shared between workers		*/
+	guint tokens_cache_size;						/**< number of statistics tokens cached					*/
+	gdouble tokens_cache_ttl;						/**< lifetime of cached statistics tokens				*/
 	guint history_rows;								/**< number of history rows stored						*/
 
 	GList *classify_headers;						/**< list of headers using for statistics				*/
@@ -2022,6 +2022,12 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, check_all_filters),
 			0,
 			"Always check all filters");
+	rspamd_rcl_add_default_handler (sub,
+			"ham_shortcut",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, ham_shortcut),
+			0,
+			"Stop checking filters when a message cannot reach any action score");
 	rspamd_rcl_add_default_handler (sub,
 			"min_word_len",
 			rspamd_rcl_parse_struct_integer,
@@ -2052,6 +2058,24 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_config, tld_file),
 			RSPAMD_CL_FLAG_STRING_PATH,
 			"Path to the TLD file for urls detector");
+	rspamd_rcl_add_default_handler (sub,
+			"url_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, url_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of parsed urls cached and shared between workers (0 to disable)");
+	rspamd_rcl_add_default_handler (sub,
+			"tokens_cache_size",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, tokens_cache_size),
+			RSPAMD_CL_FLAG_UINT,
+			"Number of statistics tokens values cached in front of backends (0 to disable)");
+	rspamd_rcl_add_default_handler (sub,
+			"tokens_cache_ttl",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, tokens_cache_ttl),
+			RSPAMD_CL_FLAG_TIME_FLOAT,
+			"Lifetime of cached statistics tokens values");
 	rspamd_rcl_add_default_handler (sub,
 			"hs_cache_dir",
 			rspamd_rcl_parse_struct_string,
@@ -2379,6 +2403,18 @@ rspamd_rcl_config_init (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_worker_conf, rlimit_maxcore),
 			RSPAMD_CL_FLAG_INT_32,
 			"Max size of core file in bytes");
+	rspamd_rcl_add_default_handler (sub,
+			"reuseport",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_worker_conf, reuseport),
+			0,
+			"Bind a separate UDP socket with SO_REUSEPORT for each worker");
+	rspamd_rcl_add_default_handler (sub,
+			"cpu_affinity",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_worker_conf, cpu_affinity),
+			0,
+			"Pin each worker to a CPU core according to its index");
 
 	/**
 	 * Modules handler
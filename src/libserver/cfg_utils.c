@@ -39,6 +39,9 @@
 #define DEFAULT_MIN_WORD 4
 #define DEFAULT_MAX_WORD 40
 #define DEFAULT_WORDS_DECAY 200
+#define DEFAULT_URL_CACHE_SIZE 4096
+#define DEFAULT_TOKENS_CACHE_SIZE 0
+#define DEFAULT_TOKENS_CACHE_TTL 60.0
 #define DEFAULT_MAX_MESSAGE (50 * 1024 * 1024)
 #define DEFAULT_MAX_PIC (1 * 1024 * 1024)
 
@@ -159,6 +162,9 @@ rspamd_config_new (void)
 	cfg->words_decay = DEFAULT_WORDS_DECAY;
 	cfg->min_word_len = DEFAULT_MIN_WORD;
 	cfg->max_word_len = DEFAULT_MAX_WORD;
+	cfg->url_cache_size = DEFAULT_URL_CACHE_SIZE;
+	cfg->tokens_cache_size = DEFAULT_TOKENS_CACHE_SIZE;
+	cfg->tokens_cache_ttl = DEFAULT_TOKENS_CACHE_TTL;
 
 	cfg->lua_state = rspamd_lua_init ();
 	cfg->cache = rspamd_symbols_cache_new (cfg);
@@ -719,11 +725,18 @@ rspamd_config_post_load (struct rspamd_config *cfg,
 		}
 
 		if (opts & RSPAMD_CONFIG_INIT_NO_TLD) {
-			rspamd_url_init (NULL);
+			rspamd_url_init (NULL, NULL);
 		}
 		else {
-			rspamd_url_init (cfg->tld_file);
+			rspamd_url_init (cfg->tld_file, cfg->hs_cache_dir);
 		}
+
+		rspamd_url_cache_init (cfg->url_cache_size);
+	}
+
+	if (opts & RSPAMD_CONFIG_INIT_LIBS) {
+		rspamd_stat_tokens_cache_init (cfg->tokens_cache_size,
+				cfg->tokens_cache_ttl);
 	}
 
 	init_dynamic_config (cfg);
@@ -942,7 +955,27 @@ rspamd_config_new_group (struct rspamd_config *cfg, struct rspamd_metric *metric
 static void
 rspamd_worker_conf_dtor (struct rspamd_worker_conf *wcf)
 {
+	struct rspamd_worker_listen_socket *ls;
+	GList *socks, *cur;
+	guint i;
+
 	if (wcf) {
+		if (wcf->reuseport_socks) {
+			for (i = 0; i < wcf->reuseport_socks->len; i ++) {
+				socks = g_ptr_array_index (wcf->reuseport_socks, i);
+
+				for (cur = socks; cur != NULL; cur = g_list_next (cur)) {
+					ls = cur->data;
+					close (ls->fd);
+					g_slice_free1 (sizeof (*ls), ls);
+				}
+
+				g_list_free (socks);
+			}
+
+			g_ptr_array_free (wcf->reuseport_socks, TRUE);
+		}
+
 		ucl_object_unref (wcf->options);
 		g_queue_free (wcf->active_workers);
 		g_hash_table_unref (wcf->params);
@@ -18,6 +18,7 @@
 #include "fuzzy_backend.h"
 #include "fuzzy_backend_sqlite.h"
 #include "fuzzy_backend_redis.h"
+#include "fuzzy_backend_mmap.h"
 #include "cfg_file.h"
 
 #define DEFAULT_EXPIRE 172800L
@@ -25,6 +26,7 @@
 enum rspamd_fuzzy_backend_type {
 	RSPAMD_FUZZY_BACKEND_SQLITE = 0,
 	RSPAMD_FUZZY_BACKEND_REDIS = 1,
+	RSPAMD_FUZZY_BACKEND_MMAP = 2,
 };
 
 static void* rspamd_fuzzy_backend_init_sqlite (struct rspamd_fuzzy_backend *bk,
@@ -71,6 +73,8 @@ struct rspamd_fuzzy_backend_subr {
 			rspamd_fuzzy_version_cb cb, void *ud,
 			void *subr_ud);
 	const gchar* (*id) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
+	void (*stat) (struct rspamd_fuzzy_backend *bk, ucl_object_t *obj,
+			void *subr_ud);
 	void (*periodic) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 	void (*close) (struct rspamd_fuzzy_backend *bk, void *subr_ud);
 };
@@ -94,10 +98,21 @@ static const struct rspamd_fuzzy_backend_subr fuzzy_subrs[] = {
 		.count = rspamd_fuzzy_backend_count_redis,
 		.version = rspamd_fuzzy_backend_version_redis,
 		.id = rspamd_fuzzy_backend_id_redis,
+		.stat = rspamd_fuzzy_backend_stat_redis,
 		.periodic = rspamd_fuzzy_backend_expire_redis,
 		.close = rspamd_fuzzy_backend_close_redis,
-	}
+	},
 #endif
+	[RSPAMD_FUZZY_BACKEND_MMAP] = {
+		.init = rspamd_fuzzy_backend_init_mmap,
+		.check = rspamd_fuzzy_backend_check_mmap,
+		.update = rspamd_fuzzy_backend_update_mmap,
+		.count = rspamd_fuzzy_backend_count_mmap,
+		.version = rspamd_fuzzy_backend_version_mmap,
+		.id = rspamd_fuzzy_backend_id_mmap,
+		.periodic = rspamd_fuzzy_backend_expire_mmap,
+		.close = rspamd_fuzzy_backend_close_mmap,
+	},
 };
 
 struct rspamd_fuzzy_backend {
@@ -283,6 +298,9 @@ rspamd_fuzzy_backend_create (struct event_base *ev_base,
 			else if (strcmp (ucl_object_tostring (elt), "redis") == 0) {
 				type = RSPAMD_FUZZY_BACKEND_REDIS;
 			}
+			else if (strcmp (ucl_object_tostring (elt), "mmap") == 0) {
+				type = RSPAMD_FUZZY_BACKEND_MMAP;
+			}
 			else {
 				g_set_error (err, rspamd_fuzzy_backend_quark (),
 						EINVAL, "invalid backend type: %s",
@@ -373,6 +391,17 @@ rspamd_fuzzy_backend_id (struct rspamd_fuzzy_backend *bk)
 	return NULL;
 }
 
+void
+rspamd_fuzzy_backend_stat (struct rspamd_fuzzy_backend *bk,
+		ucl_object_t *obj)
+{
+	g_assert (bk != NULL);
+
+	if (bk->subr->stat) {
+		bk->subr->stat (bk, obj, bk->subr_ud);
+	}
+}
+
 static inline void
 rspamd_fuzzy_backend_periodic_sync (struct rspamd_fuzzy_backend *bk)
 {
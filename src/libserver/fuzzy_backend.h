@@ -92,6 +92,14 @@ void rspamd_fuzzy_backend_version (struct rspamd_fuzzy_backend *bk,
  */
 const gchar * rspamd_fuzzy_backend_id (struct rspamd_fuzzy_backend *backend);
 
+/**
+ * Adds backend specific statistics to the fuzzy storage stat object
+ * @param backend
+ * @param obj
+ */
+void rspamd_fuzzy_backend_stat (struct rspamd_fuzzy_backend *backend,
+		ucl_object_t *obj);
+
 /**
  * Starts expire process for the backend
  * @param backend
@@ -0,0 +1,1445 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * In-memory fuzzy storage.
+ *
+ * Hashes are stored in two open addressing tables: digests and shingles, where
+ * each shingle refers to a digest by the first 8 bytes of that digest. Tables
+ * are loaded from a snapshot file which is mapped privately by all processes,
+ * so its pages are shared between workers until they are modified.
+ *
+ * Modifications are appended to the log file (`<path>.log`) by the process
+ * that performs updates. All processes read new records from the log
+ * periodically and apply them to their own tables. Compaction writes a new
+ * snapshot without expired hashes and starts an empty log of the next
+ * generation, which tells other processes to reload the snapshot.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "fuzzy_backend.h"
+#include "fuzzy_backend_mmap.h"
+#include "cryptobox.h"
+#include "unix-std.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#define FUZZY_MMAP_MIN_SIZE 1024
+#define FUZZY_MMAP_MAX_SIZE (G_GUINT64_CONSTANT (1) << 36)
+#define FUZZY_MMAP_MAX_SOURCES 1024
+#define FUZZY_MMAP_SOURCE_LEN 56
+#define FUZZY_MMAP_LOG_CHUNK 32
+#define FUZZY_MMAP_DEFAULT_LOG_INTERVAL 1.0
+#define FUZZY_MMAP_DEFAULT_COMPACT_INTERVAL 3600.0
+
+/* Values of digest time for free slots */
+#define FUZZY_MMAP_SLOT_EMPTY 0
+#define FUZZY_MMAP_SLOT_DELETED -1
+
+static const guchar fuzzy_mmap_magic[8] = {'r', 's', 'f', 'z', 'm', 'a', 'p', '1'};
+static const guchar fuzzy_mmap_log_magic[8] = {'r', 's', 'f', 'z', 'l', 'o', 'g', '1'};
+
+/*
+ * Snapshot is a header followed by sources, digests and shingles tables
+ */
+struct rspamd_fuzzy_mmap_header {
+	guchar magic[8];
+	guint64 generation;
+	guint64 nsources;
+	guint64 digests_size;
+	guint64 digests_count;
+	guint64 shingles_size;
+	guint64 shingles_count;
+};
+
+struct rspamd_fuzzy_mmap_source {
+	gchar name[FUZZY_MMAP_SOURCE_LEN];
+	guint64 version;
+};
+
+struct rspamd_fuzzy_mmap_digest {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	gint64 time;
+	gint32 value;
+	guint32 flag;
+};
+
+struct rspamd_fuzzy_mmap_shingle {
+	guint64 value;
+	guint64 number;
+	guint64 digest_id; /* 0 for empty slots */
+};
+
+enum rspamd_fuzzy_mmap_log_op {
+	RSPAMD_FUZZY_MMAP_LOG_ADD = 1,
+	RSPAMD_FUZZY_MMAP_LOG_DEL,
+	RSPAMD_FUZZY_MMAP_LOG_VERSION,
+};
+
+struct rspamd_fuzzy_mmap_log_header {
+	guchar magic[8];
+	guint64 generation;
+};
+
+struct rspamd_fuzzy_mmap_log_record {
+	guint32 op;
+	guint32 flag;
+	gint32 value;
+	guint32 nshingles;
+	gint64 time; /* New version for version records */
+	guchar digest[rspamd_cryptobox_HASHBYTES]; /* Source name for version records */
+	guint64 shingles[RSPAMD_SHINGLE_SIZE];
+};
+
+struct rspamd_fuzzy_backend_mmap {
+	gchar *path;
+	gchar *log_path;
+	gchar id[MEMPOOL_UID_LEN];
+	rspamd_mempool_t *pool;
+	guint64 generation;
+	/* Snapshot mapping, tables point there unless they have been resized */
+	gpointer map;
+	gsize map_len;
+	struct rspamd_fuzzy_mmap_digest *digests;
+	guint64 digests_size;
+	guint64 digests_count;
+	guint64 digests_deleted;
+	gboolean digests_mapped;
+	struct rspamd_fuzzy_mmap_shingle *shingles;
+	guint64 shingles_size;
+	guint64 shingles_count;
+	gboolean shingles_mapped;
+	GArray *sources;
+	/* Log reading */
+	gint log_fd;
+	ino_t log_ino;
+	goffset log_offset;
+	guint64 log_records;
+	/* Log writing */
+	gint wlog_fd;
+	goffset wlog_size;
+	/* Log has a failed batch that might have been partially read */
+	gboolean wlog_failed;
+	gdouble log_interval;
+	gdouble compact_interval;
+	gdouble last_compact;
+	struct event_base *ev_base;
+	struct event log_ev;
+	struct timeval log_tv;
+};
+
+#define msg_err_fuzzy_backend(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_warn_fuzzy_backend(...)   rspamd_default_log_function (G_LOG_LEVEL_WARNING, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_info_fuzzy_backend(...)   rspamd_default_log_function (G_LOG_LEVEL_INFO, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+#define msg_debug_fuzzy_backend(...)  rspamd_default_log_function (G_LOG_LEVEL_DEBUG, \
+        backend->pool->tag.tagname, backend->pool->tag.uid, \
+        G_STRFUNC, \
+        __VA_ARGS__)
+
+static GQuark
+rspamd_fuzzy_backend_mmap_quark (void)
+{
+	return g_quark_from_static_string ("fuzzy-backend-mmap");
+}
+
+static inline guint64
+rspamd_fuzzy_mmap_digest_id (const guchar *digest)
+{
+	guint64 id;
+
+	memcpy (&id, digest, sizeof (id));
+
+	/* Zero is used for empty shingles */
+	return id == 0 ? 1 : id;
+}
+
+static inline gboolean
+rspamd_fuzzy_mmap_digest_used (const struct rspamd_fuzzy_mmap_digest *dg)
+{
+	return dg->time != FUZZY_MMAP_SLOT_EMPTY &&
+			dg->time != FUZZY_MMAP_SLOT_DELETED;
+}
+
+static inline guint64
+rspamd_fuzzy_mmap_shingle_hash (guint64 value, guint64 number)
+{
+	guint64 h;
+
+	/* Murmur3 finalizer */
+	h = value ^ ((number + 1) * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15));
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+
+	return h;
+}
+
+/*
+ * Finds digest by its id and (optionally) by the full digest
+ */
+static struct rspamd_fuzzy_mmap_digest *
+rspamd_fuzzy_mmap_digest_lookup (struct rspamd_fuzzy_mmap_digest *tbl,
+		guint64 size, guint64 id, const guchar *digest)
+{
+	struct rspamd_fuzzy_mmap_digest *dg;
+	guint64 i, mask = size - 1;
+
+	for (i = id & mask;; i = (i + 1) & mask) {
+		dg = &tbl[i];
+
+		if (dg->time == FUZZY_MMAP_SLOT_EMPTY) {
+			return NULL;
+		}
+
+		if (dg->time != FUZZY_MMAP_SLOT_DELETED &&
+				rspamd_fuzzy_mmap_digest_id (dg->digest) == id &&
+				(digest == NULL ||
+				memcmp (dg->digest, digest, sizeof (dg->digest)) == 0)) {
+			return dg;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the first free slot for a digest that is not in the table
+ */
+static struct rspamd_fuzzy_mmap_digest *
+rspamd_fuzzy_mmap_digest_slot (struct rspamd_fuzzy_mmap_digest *tbl,
+		guint64 size, guint64 id)
+{
+	guint64 i, mask = size - 1;
+
+	for (i = id & mask;; i = (i + 1) & mask) {
+		if (!rspamd_fuzzy_mmap_digest_used (&tbl[i])) {
+			return &tbl[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns slot with the specified shingle or an empty slot for it
+ */
+static struct rspamd_fuzzy_mmap_shingle *
+rspamd_fuzzy_mmap_shingle_slot (struct rspamd_fuzzy_mmap_shingle *tbl,
+		guint64 size, guint64 value, guint64 number)
+{
+	struct rspamd_fuzzy_mmap_shingle *sh;
+	guint64 i, mask = size - 1;
+
+	for (i = rspamd_fuzzy_mmap_shingle_hash (value, number) & mask;;
+			i = (i + 1) & mask) {
+		sh = &tbl[i];
+
+		if (sh->digest_id == 0 ||
+				(sh->value == value && sh->number == number)) {
+			return sh;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_fuzzy_mmap_resize_digests (struct rspamd_fuzzy_backend_mmap *backend,
+		guint64 nsize)
+{
+	struct rspamd_fuzzy_mmap_digest *ntbl, *dg;
+	guint64 i;
+
+	ntbl = g_malloc0 (nsize * sizeof (*ntbl));
+
+	for (i = 0; i < backend->digests_size; i ++) {
+		dg = &backend->digests[i];
+
+		if (rspamd_fuzzy_mmap_digest_used (dg)) {
+			memcpy (rspamd_fuzzy_mmap_digest_slot (ntbl, nsize,
+					rspamd_fuzzy_mmap_digest_id (dg->digest)),
+					dg, sizeof (*dg));
+		}
+	}
+
+	if (!backend->digests_mapped) {
+		g_free (backend->digests);
+	}
+
+	backend->digests = ntbl;
+	backend->digests_size = nsize;
+	backend->digests_deleted = 0;
+	backend->digests_mapped = FALSE;
+}
+
+static void
+rspamd_fuzzy_mmap_resize_shingles (struct rspamd_fuzzy_backend_mmap *backend,
+		guint64 nsize)
+{
+	struct rspamd_fuzzy_mmap_shingle *ntbl, *sh;
+	guint64 i;
+
+	ntbl = g_malloc0 (nsize * sizeof (*ntbl));
+
+	for (i = 0; i < backend->shingles_size; i ++) {
+		sh = &backend->shingles[i];
+
+		if (sh->digest_id != 0) {
+			memcpy (rspamd_fuzzy_mmap_shingle_slot (ntbl, nsize,
+					sh->value, sh->number), sh, sizeof (*sh));
+		}
+	}
+
+	if (!backend->shingles_mapped) {
+		g_free (backend->shingles);
+	}
+
+	backend->shingles = ntbl;
+	backend->shingles_size = nsize;
+	backend->shingles_mapped = FALSE;
+}
+
+static struct rspamd_fuzzy_mmap_digest *
+rspamd_fuzzy_mmap_digest_insert (struct rspamd_fuzzy_backend_mmap *backend,
+		const guchar *digest)
+{
+	struct rspamd_fuzzy_mmap_digest *dg;
+
+	/* Keep load below 3/4 including deleted elements */
+	if ((backend->digests_count + backend->digests_deleted + 1) * 4 >
+			backend->digests_size * 3) {
+		if ((backend->digests_count + 1) * 2 > backend->digests_size) {
+			rspamd_fuzzy_mmap_resize_digests (backend,
+					backend->digests_size * 2);
+		}
+		else {
+			/* Just drop deleted elements */
+			rspamd_fuzzy_mmap_resize_digests (backend, backend->digests_size);
+		}
+	}
+
+	dg = rspamd_fuzzy_mmap_digest_slot (backend->digests, backend->digests_size,
+			rspamd_fuzzy_mmap_digest_id (digest));
+
+	if (dg->time == FUZZY_MMAP_SLOT_DELETED) {
+		backend->digests_deleted --;
+	}
+
+	memcpy (dg->digest, digest, sizeof (dg->digest));
+	backend->digests_count ++;
+
+	return dg;
+}
+
+static void
+rspamd_fuzzy_mmap_shingle_insert (struct rspamd_fuzzy_backend_mmap *backend,
+		guint64 value, guint64 number, guint64 digest_id)
+{
+	struct rspamd_fuzzy_mmap_shingle *sh;
+
+	if ((backend->shingles_count + 1) * 4 > backend->shingles_size * 3) {
+		rspamd_fuzzy_mmap_resize_shingles (backend, backend->shingles_size * 2);
+	}
+
+	sh = rspamd_fuzzy_mmap_shingle_slot (backend->shingles,
+			backend->shingles_size, value, number);
+
+	if (sh->digest_id == 0) {
+		sh->value = value;
+		sh->number = number;
+		backend->shingles_count ++;
+	}
+
+	/* The last digest wins as in sqlite backend */
+	sh->digest_id = digest_id;
+}
+
+static struct rspamd_fuzzy_mmap_source *
+rspamd_fuzzy_mmap_source (struct rspamd_fuzzy_backend_mmap *backend,
+		const gchar *name, gboolean create)
+{
+	struct rspamd_fuzzy_mmap_source *src, nsrc;
+	guint i;
+
+	for (i = 0; i < backend->sources->len; i ++) {
+		src = &g_array_index (backend->sources,
+				struct rspamd_fuzzy_mmap_source, i);
+
+		if (strncmp (src->name, name, sizeof (src->name) - 1) == 0) {
+			return src;
+		}
+	}
+
+	if (!create) {
+		return NULL;
+	}
+
+	memset (&nsrc, 0, sizeof (nsrc));
+	rspamd_strlcpy (nsrc.name, name, sizeof (nsrc.name));
+	g_array_append_val (backend->sources, nsrc);
+
+	return &g_array_index (backend->sources, struct rspamd_fuzzy_mmap_source,
+			backend->sources->len - 1);
+}
+
+static void
+rspamd_fuzzy_mmap_free_tables (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	if (!backend->digests_mapped) {
+		g_free (backend->digests);
+	}
+
+	if (!backend->shingles_mapped) {
+		g_free (backend->shingles);
+	}
+
+	if (backend->map) {
+		munmap (backend->map, backend->map_len);
+	}
+
+	backend->map = NULL;
+	backend->map_len = 0;
+	backend->digests = NULL;
+	backend->shingles = NULL;
+}
+
+/*
+ * Loads snapshot replacing the current tables. Missing snapshot is treated as
+ * an empty storage of generation 0
+ */
+static gboolean
+rspamd_fuzzy_mmap_load (struct rspamd_fuzzy_backend_mmap *backend,
+		GError **err)
+{
+	struct rspamd_fuzzy_mmap_header *hdr;
+	struct stat st;
+	gpointer map;
+	guchar *p;
+	gint fd;
+	gsize expected;
+
+	fd = rspamd_file_xopen (backend->path, O_RDONLY, 0);
+
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			g_set_error (err, rspamd_fuzzy_backend_mmap_quark (),
+					errno, "cannot open %s: %s", backend->path,
+					strerror (errno));
+
+			return FALSE;
+		}
+
+		rspamd_fuzzy_mmap_free_tables (backend);
+		backend->generation = 0;
+		backend->digests_size = FUZZY_MMAP_MIN_SIZE;
+		backend->digests = g_malloc0 (backend->digests_size *
+				sizeof (*backend->digests));
+		backend->digests_count = 0;
+		backend->digests_deleted = 0;
+		backend->digests_mapped = FALSE;
+		backend->shingles_size = FUZZY_MMAP_MIN_SIZE;
+		backend->shingles = g_malloc0 (backend->shingles_size *
+				sizeof (*backend->shingles));
+		backend->shingles_count = 0;
+		backend->shingles_mapped = FALSE;
+		g_array_set_size (backend->sources, 0);
+
+		return TRUE;
+	}
+
+	if (fstat (fd, &st) == -1) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (),
+				errno, "cannot stat %s: %s", backend->path,
+				strerror (errno));
+		close (fd);
+
+		return FALSE;
+	}
+
+	if (st.st_size < (goffset)sizeof (*hdr)) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (),
+				EINVAL, "truncated storage file %s", backend->path);
+		close (fd);
+
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (),
+				errno, "cannot mmap %s: %s", backend->path,
+				strerror (errno));
+
+		return FALSE;
+	}
+
+	hdr = map;
+
+	if (memcmp (hdr->magic, fuzzy_mmap_magic, sizeof (hdr->magic)) != 0 ||
+			hdr->nsources > FUZZY_MMAP_MAX_SOURCES ||
+			hdr->digests_size > FUZZY_MMAP_MAX_SIZE ||
+			hdr->shingles_size > FUZZY_MMAP_MAX_SIZE ||
+			hdr->digests_size < FUZZY_MMAP_MIN_SIZE ||
+			hdr->shingles_size < FUZZY_MMAP_MIN_SIZE ||
+			(hdr->digests_size & (hdr->digests_size - 1)) != 0 ||
+			(hdr->shingles_size & (hdr->shingles_size - 1)) != 0) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (),
+				EINVAL, "invalid storage file %s", backend->path);
+		munmap (map, st.st_size);
+
+		return FALSE;
+	}
+
+	expected = sizeof (*hdr) +
+			hdr->nsources * sizeof (struct rspamd_fuzzy_mmap_source) +
+			hdr->digests_size * sizeof (struct rspamd_fuzzy_mmap_digest) +
+			hdr->shingles_size * sizeof (struct rspamd_fuzzy_mmap_shingle);
+
+	if (expected != (gsize)st.st_size) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (),
+				EINVAL, "invalid size of storage file %s: %uz, %uz expected",
+				backend->path, (gsize)st.st_size, expected);
+		munmap (map, st.st_size);
+
+		return FALSE;
+	}
+
+	rspamd_fuzzy_mmap_free_tables (backend);
+	backend->map = map;
+	backend->map_len = st.st_size;
+	backend->generation = hdr->generation;
+	p = (guchar *)map + sizeof (*hdr);
+	g_array_set_size (backend->sources, 0);
+	g_array_append_vals (backend->sources, p, hdr->nsources);
+	p += hdr->nsources * sizeof (struct rspamd_fuzzy_mmap_source);
+	backend->digests = (struct rspamd_fuzzy_mmap_digest *)p;
+	backend->digests_size = hdr->digests_size;
+	backend->digests_count = hdr->digests_count;
+	backend->digests_deleted = 0;
+	backend->digests_mapped = TRUE;
+	p += hdr->digests_size * sizeof (struct rspamd_fuzzy_mmap_digest);
+	backend->shingles = (struct rspamd_fuzzy_mmap_shingle *)p;
+	backend->shingles_size = hdr->shingles_size;
+	backend->shingles_count = hdr->shingles_count;
+	backend->shingles_mapped = TRUE;
+
+	msg_info_fuzzy_backend ("loaded %uL digests and %uL shingles from %s, "
+			"generation %uL", backend->digests_count, backend->shingles_count,
+			backend->path, backend->generation);
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_mmap_apply (struct rspamd_fuzzy_backend_mmap *backend,
+		const struct rspamd_fuzzy_mmap_log_record *rec)
+{
+	struct rspamd_fuzzy_mmap_digest *dg;
+	struct rspamd_fuzzy_mmap_source *src;
+	gchar name[FUZZY_MMAP_SOURCE_LEN];
+	guint64 id;
+	guint i;
+
+	switch (rec->op) {
+	case RSPAMD_FUZZY_MMAP_LOG_ADD:
+		id = rspamd_fuzzy_mmap_digest_id (rec->digest);
+		dg = rspamd_fuzzy_mmap_digest_lookup (backend->digests,
+				backend->digests_size, id, rec->digest);
+
+		if (dg) {
+			if (dg->flag == rec->flag) {
+				dg->value += rec->value;
+			}
+			else {
+				dg->value = rec->value;
+				dg->flag = rec->flag;
+			}
+		}
+		else {
+			dg = rspamd_fuzzy_mmap_digest_insert (backend, rec->digest);
+			dg->value = rec->value;
+			dg->flag = rec->flag;
+
+			if (rec->nshingles == RSPAMD_SHINGLE_SIZE) {
+				for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+					rspamd_fuzzy_mmap_shingle_insert (backend,
+							rec->shingles[i], i, id);
+				}
+			}
+		}
+
+		dg->time = rec->time;
+		break;
+	case RSPAMD_FUZZY_MMAP_LOG_DEL:
+		dg = rspamd_fuzzy_mmap_digest_lookup (backend->digests,
+				backend->digests_size,
+				rspamd_fuzzy_mmap_digest_id (rec->digest), rec->digest);
+
+		/* Shingles of the deleted digest are ignored and dropped on compaction */
+		if (dg) {
+			dg->time = FUZZY_MMAP_SLOT_DELETED;
+			backend->digests_count --;
+			backend->digests_deleted ++;
+		}
+		break;
+	case RSPAMD_FUZZY_MMAP_LOG_VERSION:
+		rspamd_strlcpy (name, (const gchar *)rec->digest, sizeof (name));
+		src = rspamd_fuzzy_mmap_source (backend, name, TRUE);
+		src->version = rec->time;
+		break;
+	default:
+		msg_warn_fuzzy_backend ("unknown log record type: %d", (gint)rec->op);
+		break;
+	}
+
+	backend->log_records ++;
+}
+
+/*
+ * Opens log for reading, records are read if the log belongs to the current
+ * snapshot
+ */
+static void
+rspamd_fuzzy_mmap_open_log (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_log_header hdr;
+	struct stat st;
+	gint fd;
+
+	if (backend->log_fd != -1) {
+		close (backend->log_fd);
+		backend->log_fd = -1;
+	}
+
+	backend->log_ino = 0;
+	backend->log_records = 0;
+	fd = rspamd_file_xopen (backend->log_path, O_RDONLY, 0);
+
+	if (fd == -1) {
+		return;
+	}
+
+	if (fstat (fd, &st) == -1) {
+		close (fd);
+
+		return;
+	}
+
+	backend->log_ino = st.st_ino;
+
+	if (read (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+			memcmp (hdr.magic, fuzzy_mmap_log_magic, sizeof (hdr.magic)) != 0) {
+		msg_warn_fuzzy_backend ("invalid log file %s, ignore it",
+				backend->log_path);
+		close (fd);
+
+		return;
+	}
+
+	if (hdr.generation != backend->generation) {
+		if (hdr.generation > backend->generation) {
+			/* Snapshot has not been renamed yet, retry later */
+			backend->log_ino = 0;
+		}
+		else {
+			msg_info_fuzzy_backend ("ignore stale log file %s of generation %uL",
+					backend->log_path, hdr.generation);
+		}
+
+		close (fd);
+
+		return;
+	}
+
+	backend->log_fd = fd;
+	backend->log_offset = sizeof (hdr);
+}
+
+static void
+rspamd_fuzzy_mmap_read_log (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_log_record recs[FUZZY_MMAP_LOG_CHUNK];
+	gssize r;
+	guint i, nrecs;
+
+	for (;;) {
+		r = pread (backend->log_fd, recs, sizeof (recs), backend->log_offset);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			msg_err_fuzzy_backend ("cannot read log file %s: %s",
+					backend->log_path, strerror (errno));
+			break;
+		}
+
+		/* Incomplete record is read when it is finished */
+		nrecs = r / sizeof (recs[0]);
+
+		for (i = 0; i < nrecs; i ++) {
+			rspamd_fuzzy_mmap_apply (backend, &recs[i]);
+		}
+
+		backend->log_offset += nrecs * sizeof (recs[0]);
+
+		if (nrecs < G_N_ELEMENTS (recs)) {
+			break;
+		}
+	}
+}
+
+/*
+ * Reads new records from the log, reloading snapshot if it has been compacted
+ */
+static void
+rspamd_fuzzy_mmap_sync (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_header hdr;
+	struct stat st;
+	GError *err = NULL;
+	gint fd;
+
+	if (stat (backend->log_path, &st) != -1 && st.st_ino != backend->log_ino) {
+		/* Log has been created or replaced */
+		fd = rspamd_file_xopen (backend->path, O_RDONLY, 0);
+
+		if (fd != -1) {
+			if (read (fd, &hdr, sizeof (hdr)) == sizeof (hdr) &&
+					hdr.generation != backend->generation) {
+				if (!rspamd_fuzzy_mmap_load (backend, &err)) {
+					msg_err_fuzzy_backend ("cannot reload storage: %e", err);
+					g_error_free (err);
+				}
+			}
+
+			close (fd);
+		}
+
+		rspamd_fuzzy_mmap_open_log (backend);
+	}
+
+	/* Records of a failed batch are dropped by the next compaction */
+	if (backend->log_fd != -1 && !backend->wlog_failed) {
+		rspamd_fuzzy_mmap_read_log (backend);
+	}
+}
+
+static void
+rspamd_fuzzy_mmap_log_cb (gint fd, short what, void *ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = ud;
+
+	rspamd_fuzzy_mmap_sync (backend);
+	event_add (&backend->log_ev, &backend->log_tv);
+}
+
+static gboolean
+rspamd_fuzzy_mmap_write_all (gint fd, gconstpointer buf, gsize len)
+{
+	const guchar *p = buf;
+	gssize r;
+
+	while (len > 0) {
+		r = write (fd, p, len);
+
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		p += r;
+		len -= r;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Atomically creates an empty log of the specified generation
+ */
+static gint
+rspamd_fuzzy_mmap_create_log (struct rspamd_fuzzy_backend_mmap *backend,
+		guint64 generation)
+{
+	struct rspamd_fuzzy_mmap_log_header hdr;
+	gchar tmp[PATH_MAX];
+	gint fd;
+
+	rspamd_snprintf (tmp, sizeof (tmp), "%s.tmp", backend->log_path);
+	fd = rspamd_file_xopen (tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 00644);
+
+	if (fd == -1) {
+		msg_err_fuzzy_backend ("cannot create log file %s: %s", tmp,
+				strerror (errno));
+
+		return -1;
+	}
+
+	memcpy (hdr.magic, fuzzy_mmap_log_magic, sizeof (hdr.magic));
+	hdr.generation = generation;
+
+	if (!rspamd_fuzzy_mmap_write_all (fd, &hdr, sizeof (hdr)) ||
+			fsync (fd) == -1 ||
+			rename (tmp, backend->log_path) == -1) {
+		msg_err_fuzzy_backend ("cannot create log file %s: %s",
+				backend->log_path, strerror (errno));
+		close (fd);
+		unlink (tmp);
+
+		return -1;
+	}
+
+	return fd;
+}
+
+static gboolean
+rspamd_fuzzy_mmap_open_wlog (struct rspamd_fuzzy_backend_mmap *backend)
+{
+	struct rspamd_fuzzy_mmap_log_header hdr;
+	struct stat st;
+	goffset tail;
+	gint fd;
+
+	fd = rspamd_file_xopen (backend->log_path, O_RDWR | O_APPEND, 0);
+
+	if (fd != -1) {
+		if (fstat (fd, &st) == -1 ||
+				pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr) ||
+				memcmp (hdr.magic, fuzzy_mmap_log_magic,
+						sizeof (hdr.magic)) != 0 ||
+				hdr.generation != backend->generation) {
+			/* Log is invalid or stale, start a new one */
+			close (fd);
+			fd = -1;
+		}
+		else {
+			/* Drop incomplete record left after an interrupted write */
+			tail = (st.st_size - sizeof (hdr)) %
+					sizeof (struct rspamd_fuzzy_mmap_log_record);
+
+			if (tail != 0 && ftruncate (fd, st.st_size - tail) == -1) {
+				msg_err_fuzzy_backend ("cannot truncate log file %s: %s",
+						backend->log_path, strerror (errno));
+				close (fd);
+
+				return FALSE;
+			}
+
+			backend->wlog_size = st.st_size - tail;
+		}
+	}
+
+	if (fd == -1) {
+		fd = rspamd_fuzzy_mmap_create_log (backend, backend->generation);
+
+		if (fd == -1) {
+			return FALSE;
+		}
+
+		backend->wlog_size = sizeof (hdr);
+	}
+
+	backend->wlog_fd = fd;
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_fuzzy_mmap_append (struct rspamd_fuzzy_backend_mmap *backend,
+		const struct rspamd_fuzzy_mmap_log_record *recs, guint nrecs)
+{
+	gsize len = nrecs * sizeof (*recs);
+
+	if (backend->wlog_fd == -1 && !rspamd_fuzzy_mmap_open_wlog (backend)) {
+		return FALSE;
+	}
+
+	if (!rspamd_fuzzy_mmap_write_all (backend->wlog_fd, recs, len) ||
+			fsync (backend->wlog_fd) == -1) {
+		msg_err_fuzzy_backend ("cannot write log file %s: %s",
+				backend->log_path, strerror (errno));
+
+		/*
+		 * Other processes might have already applied complete records of
+		 * this batch, so the log cannot be truncated: it is replaced by
+		 * compaction instead
+		 */
+		close (backend->wlog_fd);
+		backend->wlog_fd = -1;
+		backend->wlog_failed = TRUE;
+
+		return FALSE;
+	}
+
+	backend->wlog_size += len;
+
+	return TRUE;
+}
+
+/*
+ * Writes a new snapshot without expired digests and dangling shingles and
+ * starts an empty log for it
+ */
+static gboolean
+rspamd_fuzzy_mmap_compact (struct rspamd_fuzzy_backend_mmap *backend,
+		gdouble expire)
+{
+	struct rspamd_fuzzy_mmap_header hdr;
+	struct rspamd_fuzzy_mmap_digest *ndigests = NULL, *dg;
+	struct rspamd_fuzzy_mmap_shingle *nshingles = NULL, *sh;
+	gchar tmp[PATH_MAX];
+	guint64 i, nexpired = 0;
+	gint64 now;
+	gint fd, log_fd;
+	GError *err = NULL;
+
+	now = time (NULL);
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, fuzzy_mmap_magic, sizeof (hdr.magic));
+	hdr.generation = backend->generation + 1;
+	hdr.nsources = backend->sources->len;
+	hdr.digests_size = FUZZY_MMAP_MIN_SIZE;
+
+	while (hdr.digests_size < backend->digests_count * 2) {
+		hdr.digests_size *= 2;
+	}
+
+	hdr.shingles_size = FUZZY_MMAP_MIN_SIZE;
+
+	while (hdr.shingles_size < backend->shingles_count * 2) {
+		hdr.shingles_size *= 2;
+	}
+
+	ndigests = g_malloc0 (hdr.digests_size * sizeof (*ndigests));
+	nshingles = g_malloc0 (hdr.shingles_size * sizeof (*nshingles));
+
+	for (i = 0; i < backend->digests_size; i ++) {
+		dg = &backend->digests[i];
+
+		if (rspamd_fuzzy_mmap_digest_used (dg)) {
+			if (now - dg->time > expire) {
+				nexpired ++;
+				continue;
+			}
+
+			memcpy (rspamd_fuzzy_mmap_digest_slot (ndigests, hdr.digests_size,
+					rspamd_fuzzy_mmap_digest_id (dg->digest)),
+					dg, sizeof (*dg));
+			hdr.digests_count ++;
+		}
+	}
+
+	for (i = 0; i < backend->shingles_size; i ++) {
+		sh = &backend->shingles[i];
+
+		if (sh->digest_id != 0 &&
+				rspamd_fuzzy_mmap_digest_lookup (ndigests, hdr.digests_size,
+						sh->digest_id, NULL) != NULL) {
+			memcpy (rspamd_fuzzy_mmap_shingle_slot (nshingles,
+					hdr.shingles_size, sh->value, sh->number),
+					sh, sizeof (*sh));
+			hdr.shingles_count ++;
+		}
+	}
+
+	rspamd_snprintf (tmp, sizeof (tmp), "%s.tmp", backend->path);
+	fd = rspamd_file_xopen (tmp, O_WRONLY | O_CREAT | O_TRUNC, 00644);
+
+	if (fd == -1) {
+		msg_err_fuzzy_backend ("cannot create %s: %s", tmp, strerror (errno));
+		goto err;
+	}
+
+	if (!rspamd_fuzzy_mmap_write_all (fd, &hdr, sizeof (hdr)) ||
+			!rspamd_fuzzy_mmap_write_all (fd, backend->sources->data,
+					hdr.nsources * sizeof (struct rspamd_fuzzy_mmap_source)) ||
+			!rspamd_fuzzy_mmap_write_all (fd, ndigests,
+					hdr.digests_size * sizeof (*ndigests)) ||
+			!rspamd_fuzzy_mmap_write_all (fd, nshingles,
+					hdr.shingles_size * sizeof (*nshingles)) ||
+			fsync (fd) == -1) {
+		msg_err_fuzzy_backend ("cannot write %s: %s", tmp, strerror (errno));
+		close (fd);
+		unlink (tmp);
+		goto err;
+	}
+
+	close (fd);
+
+	if (rename (tmp, backend->path) == -1) {
+		msg_err_fuzzy_backend ("cannot rename %s to %s: %s", tmp,
+				backend->path, strerror (errno));
+		unlink (tmp);
+		goto err;
+	}
+
+	/*
+	 * The old log is now stale: it is ignored on the next start even if the
+	 * new log is not created here
+	 */
+	log_fd = rspamd_fuzzy_mmap_create_log (backend, hdr.generation);
+
+	if (backend->wlog_fd != -1) {
+		close (backend->wlog_fd);
+	}
+
+	backend->wlog_fd = log_fd;
+	backend->wlog_size = sizeof (struct rspamd_fuzzy_mmap_log_header);
+
+	if (rspamd_fuzzy_mmap_load (backend, &err)) {
+		g_free (ndigests);
+		g_free (nshingles);
+	}
+	else {
+		msg_warn_fuzzy_backend ("cannot map compacted storage, keep it in "
+				"memory: %e", err);
+		g_error_free (err);
+		rspamd_fuzzy_mmap_free_tables (backend);
+		backend->generation = hdr.generation;
+		backend->digests = ndigests;
+		backend->digests_size = hdr.digests_size;
+		backend->digests_count = hdr.digests_count;
+		backend->digests_deleted = 0;
+		backend->digests_mapped = FALSE;
+		backend->shingles = nshingles;
+		backend->shingles_size = hdr.shingles_size;
+		backend->shingles_count = hdr.shingles_count;
+		backend->shingles_mapped = FALSE;
+	}
+
+	rspamd_fuzzy_mmap_open_log (backend);
+	msg_info_fuzzy_backend ("compacted storage to generation %uL: %uL digests, "
+			"%uL shingles, %uL expired", hdr.generation, hdr.digests_count,
+			hdr.shingles_count, nexpired);
+
+	return TRUE;
+
+err:
+	g_free (ndigests);
+	g_free (nshingles);
+
+	return FALSE;
+}
+
+/*
+ * Starts a new generation after a failed write, so all processes reload the
+ * snapshot that has no records of the failed batch
+ */
+static gboolean
+rspamd_fuzzy_mmap_recover (struct rspamd_fuzzy_backend_mmap *backend,
+		gdouble expire)
+{
+	if (!rspamd_fuzzy_mmap_compact (backend, expire) ||
+			backend->wlog_fd == -1) {
+		/* Other processes cannot see a new generation without a new log */
+		return FALSE;
+	}
+
+	backend->wlog_failed = FALSE;
+	backend->last_compact = rspamd_get_calendar_ticks ();
+
+	return TRUE;
+}
+
+static gint
+rspamd_fuzzy_mmap_id_cmp (const void *a, const void *b)
+{
+	guint64 ia = *(const guint64 *)a, ib = *(const guint64 *)b;
+
+	if (ia == ib) {
+		return 0;
+	}
+
+	return ia < ib ? -1 : 1;
+}
+
+void*
+rspamd_fuzzy_backend_init_mmap (struct rspamd_fuzzy_backend *bk,
+		const ucl_object_t *obj, struct rspamd_config *cfg, GError **err)
+{
+	struct rspamd_fuzzy_backend_mmap *backend;
+	const ucl_object_t *elt;
+	rspamd_cryptobox_hash_state_t st;
+	guchar hash_out[rspamd_cryptobox_HASHBYTES];
+	const gchar *path;
+
+	elt = ucl_object_lookup_any (obj, "hashfile", "hash_file", "file",
+			"database", NULL);
+
+	if (elt == NULL || ucl_object_type (elt) != UCL_STRING) {
+		g_set_error (err, rspamd_fuzzy_backend_mmap_quark (),
+				EINVAL, "missing storage path");
+		return NULL;
+	}
+
+	path = ucl_object_tostring (elt);
+	backend = g_malloc0 (sizeof (*backend));
+	backend->path = g_strdup (path);
+	backend->log_path = g_strconcat (path, ".log", NULL);
+	backend->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (),
+			"fuzzy_mmap");
+	backend->log_fd = -1;
+	backend->wlog_fd = -1;
+	backend->log_interval = FUZZY_MMAP_DEFAULT_LOG_INTERVAL;
+	backend->compact_interval = FUZZY_MMAP_DEFAULT_COMPACT_INTERVAL;
+	backend->sources = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_fuzzy_mmap_source));
+
+	elt = ucl_object_lookup (obj, "log_interval");
+
+	if (elt != NULL && ucl_object_todouble (elt) > 0) {
+		backend->log_interval = ucl_object_todouble (elt);
+	}
+
+	elt = ucl_object_lookup (obj, "compact_interval");
+
+	if (elt != NULL && ucl_object_todouble (elt) > 0) {
+		backend->compact_interval = ucl_object_todouble (elt);
+	}
+
+	/* Set id for the backend */
+	rspamd_cryptobox_hash_init (&st, NULL, 0);
+	rspamd_cryptobox_hash_update (&st, path, strlen (path));
+	rspamd_cryptobox_hash_final (&st, hash_out);
+	rspamd_snprintf (backend->id, sizeof (backend->id), "%xs", hash_out);
+	memcpy (backend->pool->tag.uid, backend->id,
+			sizeof (backend->pool->tag.uid));
+
+	if (!rspamd_fuzzy_mmap_load (backend, err)) {
+		rspamd_fuzzy_backend_close_mmap (bk, backend);
+
+		return NULL;
+	}
+
+	rspamd_fuzzy_mmap_sync (backend);
+	backend->last_compact = rspamd_get_calendar_ticks ();
+	backend->ev_base = rspamd_fuzzy_backend_event_base (bk);
+
+	if (backend->ev_base) {
+		double_to_tv (backend->log_interval, &backend->log_tv);
+		event_set (&backend->log_ev, -1, EV_TIMEOUT,
+				rspamd_fuzzy_mmap_log_cb, backend);
+		event_base_set (backend->ev_base, &backend->log_ev);
+		event_add (&backend->log_ev, &backend->log_tv);
+	}
+
+	return backend;
+}
+
+void
+rspamd_fuzzy_backend_check_mmap (struct rspamd_fuzzy_backend *bk,
+		const struct rspamd_fuzzy_cmd *cmd,
+		rspamd_fuzzy_check_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct rspamd_fuzzy_reply rep = {0, 0, 0, 0.0};
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	struct rspamd_fuzzy_mmap_shingle *sh;
+	struct rspamd_fuzzy_mmap_digest *dg;
+	guint64 ids[RSPAMD_SHINGLE_SIZE], sel_id = 0;
+	gdouble expire;
+	gint64 now;
+	guint i, cur_cnt = 0, max_cnt = 0;
+
+	expire = rspamd_fuzzy_backend_get_expire (bk);
+	now = time (NULL);
+	dg = rspamd_fuzzy_mmap_digest_lookup (backend->digests,
+			backend->digests_size,
+			rspamd_fuzzy_mmap_digest_id ((const guchar *)cmd->digest),
+			(const guchar *)cmd->digest);
+
+	if (dg) {
+		if (now - dg->time > expire) {
+			msg_debug_fuzzy_backend ("requested hash has been expired");
+		}
+		else {
+			rep.value = dg->value;
+			rep.prob = 1.0;
+			rep.flag = dg->flag;
+		}
+	}
+	else if (cmd->shingles_count > 0) {
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			sh = rspamd_fuzzy_mmap_shingle_slot (backend->shingles,
+					backend->shingles_size, shcmd->sgl.hashes[i], i);
+			ids[i] = sh->digest_id;
+
+			/* Shingles of deleted digests are not counted */
+			if (ids[i] != 0 && rspamd_fuzzy_mmap_digest_lookup (
+					backend->digests, backend->digests_size,
+					ids[i], NULL) == NULL) {
+				ids[i] = 0;
+			}
+		}
+
+		/* Find the most frequent digest */
+		qsort (ids, RSPAMD_SHINGLE_SIZE, sizeof (guint64),
+				rspamd_fuzzy_mmap_id_cmp);
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (ids[i] == 0) {
+				continue;
+			}
+
+			if (i > 0 && ids[i] == ids[i - 1]) {
+				cur_cnt ++;
+			}
+			else {
+				cur_cnt = 1;
+			}
+
+			if (cur_cnt > max_cnt) {
+				max_cnt = cur_cnt;
+				sel_id = ids[i];
+			}
+		}
+
+		if (sel_id != 0) {
+			rep.prob = (float)max_cnt / (float)RSPAMD_SHINGLE_SIZE;
+
+			if (rep.prob > 0.5) {
+				msg_debug_fuzzy_backend (
+						"found fuzzy hash with probability %.2f",
+						rep.prob);
+				dg = rspamd_fuzzy_mmap_digest_lookup (backend->digests,
+						backend->digests_size, sel_id, NULL);
+				g_assert (dg != NULL);
+
+				if (now - dg->time > expire) {
+					msg_debug_fuzzy_backend (
+							"requested hash has been expired");
+					rep.prob = 0.0;
+				}
+				else {
+					rep.value = dg->value;
+					rep.flag = dg->flag;
+				}
+			}
+		}
+	}
+
+	if (cb) {
+		cb (&rep, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_update_mmap (struct rspamd_fuzzy_backend *bk,
+		GQueue *updates, const gchar *src,
+		rspamd_fuzzy_update_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct rspamd_fuzzy_mmap_log_record *rec;
+	struct rspamd_fuzzy_mmap_source *source;
+	struct fuzzy_peer_cmd *io_cmd;
+	struct rspamd_fuzzy_cmd *cmd;
+	GArray *recs;
+	GList *cur;
+	gint64 now;
+	gdouble expire;
+	gboolean success = TRUE;
+
+	now = time (NULL);
+	expire = rspamd_fuzzy_backend_get_expire (bk);
+	recs = g_array_sized_new (FALSE, TRUE,
+			sizeof (struct rspamd_fuzzy_mmap_log_record),
+			updates->length + 1);
+	cur = updates->head;
+
+	while (cur) {
+		io_cmd = cur->data;
+
+		if (io_cmd->is_shingle) {
+			cmd = &io_cmd->cmd.shingle.basic;
+		}
+		else {
+			cmd = &io_cmd->cmd.normal;
+		}
+
+		g_array_set_size (recs, recs->len + 1);
+		rec = &g_array_index (recs, struct rspamd_fuzzy_mmap_log_record,
+				recs->len - 1);
+		memset (rec, 0, sizeof (*rec));
+		memcpy (rec->digest, cmd->digest, sizeof (rec->digest));
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			rec->op = RSPAMD_FUZZY_MMAP_LOG_ADD;
+			rec->flag = cmd->flag;
+			rec->value = cmd->value;
+			rec->time = now;
+
+			if (io_cmd->is_shingle) {
+				rec->nshingles = RSPAMD_SHINGLE_SIZE;
+				memcpy (rec->shingles, io_cmd->cmd.shingle.sgl.hashes,
+						sizeof (rec->shingles));
+			}
+		}
+		else {
+			rec->op = RSPAMD_FUZZY_MMAP_LOG_DEL;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	if (recs->len > 0) {
+		g_array_set_size (recs, recs->len + 1);
+		rec = &g_array_index (recs, struct rspamd_fuzzy_mmap_log_record,
+				recs->len - 1);
+		memset (rec, 0, sizeof (*rec));
+		rec->op = RSPAMD_FUZZY_MMAP_LOG_VERSION;
+		source = rspamd_fuzzy_mmap_source (backend, src, FALSE);
+		rec->time = source ? source->version + 1 : 1;
+		rspamd_strlcpy ((gchar *)rec->digest, src, FUZZY_MMAP_SOURCE_LEN);
+
+		/* Records are applied when they are read back from the log */
+		if (backend->wlog_failed && !rspamd_fuzzy_mmap_recover (backend,
+				expire)) {
+			success = FALSE;
+		}
+		else if (!rspamd_fuzzy_mmap_append (backend,
+				(struct rspamd_fuzzy_mmap_log_record *)recs->data, recs->len)) {
+			success = FALSE;
+			rspamd_fuzzy_mmap_recover (backend, expire);
+		}
+
+		rspamd_fuzzy_mmap_sync (backend);
+	}
+
+	g_array_free (recs, TRUE);
+
+	if (cb) {
+		cb (success, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_count_mmap (struct rspamd_fuzzy_backend *bk,
+		rspamd_fuzzy_count_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	if (cb) {
+		cb (backend->digests_count, ud);
+	}
+}
+
+void
+rspamd_fuzzy_backend_version_mmap (struct rspamd_fuzzy_backend *bk,
+		const gchar *src,
+		rspamd_fuzzy_version_cb cb, void *ud,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	struct rspamd_fuzzy_mmap_source *source;
+
+	source = rspamd_fuzzy_mmap_source (backend, src, FALSE);
+
+	if (cb) {
+		cb (source ? source->version : 0, ud);
+	}
+}
+
+const gchar*
+rspamd_fuzzy_backend_id_mmap (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	return backend->id;
+}
+
+void
+rspamd_fuzzy_backend_expire_mmap (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+	gdouble now;
+
+	rspamd_fuzzy_mmap_sync (backend);
+	now = rspamd_get_calendar_ticks ();
+
+	if (backend->wlog_failed) {
+		rspamd_fuzzy_mmap_recover (backend,
+				rspamd_fuzzy_backend_get_expire (bk));
+
+		return;
+	}
+
+	if (backend->log_records == 0) {
+		return;
+	}
+
+	/* Compact when the log is larger than snapshot or it is too old */
+	if (backend->log_records * sizeof (struct rspamd_fuzzy_mmap_log_record) >
+			backend->map_len ||
+			now - backend->last_compact > backend->compact_interval) {
+		if (rspamd_fuzzy_mmap_compact (backend,
+				rspamd_fuzzy_backend_get_expire (bk))) {
+			backend->last_compact = now;
+		}
+	}
+}
+
+void
+rspamd_fuzzy_backend_close_mmap (struct rspamd_fuzzy_backend *bk,
+		void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_mmap *backend = subr_ud;
+
+	if (backend->ev_base) {
+		event_del (&backend->log_ev);
+	}
+
+	if (backend->log_fd != -1) {
+		close (backend->log_fd);
+	}
+
+	if (backend->wlog_fd != -1) {
+		close (backend->wlog_fd);
+	}
+
+	rspamd_fuzzy_mmap_free_tables (backend);
+	g_array_free (backend->sources, TRUE);
+	rspamd_mempool_delete (backend->pool);
+	g_free (backend->path);
+	g_free (backend->log_path);
+	g_free (backend);
+}
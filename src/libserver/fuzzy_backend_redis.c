@@ -28,6 +28,9 @@
 #define REDIS_DEFAULT_PORT 6379
 #define REDIS_DEFAULT_OBJECT "fuzzy"
 #define REDIS_DEFAULT_TIMEOUT 2.0
+#define REDIS_DEFAULT_BATCH_TIMEOUT 0.001
+#define REDIS_MAX_BATCH 128
+#define REDIS_BATCH_BUCKETS 8
 
 #define msg_err_redis_session(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "fuzzy_redis", session->backend->id, \
@@ -55,9 +58,32 @@ struct rspamd_fuzzy_backend_redis {
 	gchar *id;
 	struct rspamd_redis_pool *pool;
 	gdouble timeout;
+	gdouble batch_timeout;
+	struct rspamd_fuzzy_redis_batch *batch;
+	guint64 batches;
+	guint64 batch_sizes[REDIS_BATCH_BUCKETS];
 	ref_entry_t ref;
 };
 
+/*
+ * Checks of all sessions arriving within batch_timeout are sent over a single
+ * connection: digests are requested in one pipeline, then shingles of all
+ * sessions that have not matched are requested by a single MGET and the
+ * selected digests are fetched by another pipeline
+ */
+struct rspamd_fuzzy_redis_batch {
+	struct rspamd_fuzzy_backend_redis *backend;
+	struct event_base *ev_base;
+	redisAsyncContext *ctx;
+	struct upstream *up;
+	struct event flush_event;
+	struct event timeout;
+	GPtrArray *sessions;
+	guint inflight;
+	gboolean shingles_checked;
+	gboolean failed;
+};
+
 struct rspamd_fuzzy_redis_session {
 	struct rspamd_fuzzy_backend_redis *backend;
 	redisAsyncContext *ctx;
@@ -66,6 +92,8 @@ struct rspamd_fuzzy_redis_session {
 	struct event_base *ev_base;
 	float prob;
 	gboolean shingles_checked;
+	struct rspamd_fuzzy_redis_batch *batch;
+	guint batch_idx;
 
 	enum {
 		RSPAMD_FUZZY_REDIS_COMMAND_COUNT,
@@ -185,6 +213,14 @@ rspamd_fuzzy_backend_redis_try_ucl (struct rspamd_fuzzy_backend_redis *backend,
 		backend->timeout = REDIS_DEFAULT_TIMEOUT;
 	}
 
+	elt = ucl_object_lookup (obj, "batch_timeout");
+	if (elt) {
+		backend->batch_timeout = ucl_object_todouble (elt);
+	}
+	else {
+		backend->batch_timeout = REDIS_DEFAULT_BATCH_TIMEOUT;
+	}
+
 	elt = ucl_object_lookup (obj, "password");
 	if (elt) {
 		backend->password = ucl_object_tostring (elt);
@@ -234,6 +270,7 @@ rspamd_fuzzy_backend_init_redis (struct rspamd_fuzzy_backend *bk,
 	backend = g_slice_alloc0 (sizeof (*backend));
 
 	backend->timeout = REDIS_DEFAULT_TIMEOUT;
+	backend->batch_timeout = REDIS_DEFAULT_BATCH_TIMEOUT;
 	backend->redis_object = REDIS_DEFAULT_OBJECT;
 
 	ret = rspamd_fuzzy_backend_redis_try_ucl (backend, obj, cfg);
@@ -324,17 +361,84 @@ rspamd_fuzzy_backend_redis_shingles_cmp (const void *a, const void *b)
 	return memcmp (sha->digest, shb->digest, sizeof (sha->digest));
 }
 
+/*
+ * Selects the most frequent digest among replies for RSPAMD_SHINGLE_SIZE
+ * shingles
+ */
+static gboolean
+rspamd_fuzzy_redis_shingles_select (redisReply **elts, guchar *digest,
+		float *prob)
+{
+	redisReply *cur;
+	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
+	guint i, found = 0, max_found = 0, cur_found = 0;
+
+	shingles = g_alloca (sizeof (struct _rspamd_fuzzy_shingles_helper) *
+			RSPAMD_SHINGLE_SIZE);
+
+	for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+		cur = elts[i];
+
+		if (cur->type == REDIS_REPLY_STRING) {
+			shingles[i].found = 1;
+			memcpy (shingles[i].digest, cur->str, MIN (64, cur->len));
+			found ++;
+		}
+		else {
+			memset (shingles[i].digest, 0, sizeof (shingles[i].digest));
+			shingles[i].found = 0;
+		}
+	}
+
+	if (found > RSPAMD_SHINGLE_SIZE / 2) {
+		/* Now sort to find the most frequent element */
+		qsort (shingles, RSPAMD_SHINGLE_SIZE,
+				sizeof (struct _rspamd_fuzzy_shingles_helper),
+				rspamd_fuzzy_backend_redis_shingles_cmp);
+
+		prev = &shingles[0];
+
+		for (i = 1; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			if (!shingles[i].found) {
+				continue;
+			}
+
+			if (memcmp (shingles[i].digest, prev->digest, 64) == 0) {
+				cur_found ++;
+
+				if (cur_found > max_found) {
+					max_found = cur_found;
+					sel = &shingles[i];
+				}
+			}
+			else {
+				cur_found = 1;
+				prev = &shingles[i];
+			}
+		}
+
+		if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
+			g_assert (sel != NULL);
+			memcpy (digest, sel->digest, sizeof (sel->digest));
+			*prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 static void
 rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv)
 {
 	struct rspamd_fuzzy_redis_session *session = priv;
-	redisReply *reply = r, *cur;
+	redisReply *reply = r;
 	struct rspamd_fuzzy_reply rep;
 	struct timeval tv;
 	GString *key;
-	struct _rspamd_fuzzy_shingles_helper *shingles, *prev = NULL, *sel = NULL;
-	guint i, found = 0, max_found = 0, cur_found = 0;
+	guchar digest[64];
 
 	event_del (&session->timeout);
 	memset (&rep, 0, sizeof (rep));
@@ -343,102 +447,54 @@ rspamd_fuzzy_redis_shingles_callback (redisAsyncContext *c, gpointer r,
 		rspamd_upstream_ok (session->up);
 
 		if (reply->type == REDIS_REPLY_ARRAY &&
-				reply->elements == RSPAMD_SHINGLE_SIZE) {
-			shingles = g_alloca (sizeof (struct _rspamd_fuzzy_shingles_helper) *
-					RSPAMD_SHINGLE_SIZE);
-
-			for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
-				cur = reply->element[i];
-
-				if (cur->type == REDIS_REPLY_STRING) {
-					shingles[i].found = 1;
-					memcpy (shingles[i].digest, cur->str, MIN (64, cur->len));
-					found ++;
-				}
-				else {
-					memset (shingles[i].digest, 0, sizeof (shingles[i].digest));
-					shingles[i].found = 0;
-				}
-			}
+				reply->elements == RSPAMD_SHINGLE_SIZE &&
+				rspamd_fuzzy_redis_shingles_select (reply->element, digest,
+						&session->prob)) {
+			rep.prob = session->prob;
+
+			/* Prepare new check command */
+			rspamd_fuzzy_redis_session_free_args (session);
+			session->nargs = 4;
+			session->argv = g_malloc (sizeof (gchar *) * session->nargs);
+			session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
+
+			key = g_string_new (session->backend->redis_object);
+			g_string_append_len (key, digest, sizeof (digest));
+			session->argv[0] = g_strdup ("HMGET");
+			session->argv_lens[0] = 5;
+			session->argv[1] = key->str;
+			session->argv_lens[1] = key->len;
+			session->argv[2] = g_strdup ("V");
+			session->argv_lens[2] = 1;
+			session->argv[3] = g_strdup ("F");
+			session->argv_lens[3] = 1;
+			g_string_free (key, FALSE); /* Do not free underlying array */
+
+			g_assert (session->ctx != NULL);
+			if (redisAsyncCommandArgv (session->ctx,
+					rspamd_fuzzy_redis_check_callback,
+					session, session->nargs,
+					(const gchar **)session->argv,
+					session->argv_lens) != REDIS_OK) {
 
-			if (found > RSPAMD_SHINGLE_SIZE / 2) {
-				/* Now sort to find the most frequent element */
-				qsort (shingles, RSPAMD_SHINGLE_SIZE,
-						sizeof (struct _rspamd_fuzzy_shingles_helper),
-						rspamd_fuzzy_backend_redis_shingles_cmp);
-
-				prev = &shingles[0];
-
-				for (i = 1; i < RSPAMD_SHINGLE_SIZE; i ++) {
-					if (!shingles[i].found) {
-						continue;
-					}
-
-					if (memcmp (shingles[i].digest, prev->digest, 64) == 0) {
-						cur_found ++;
-
-						if (cur_found > max_found) {
-							max_found = cur_found;
-							sel = &shingles[i];
-						}
-					}
-					else {
-						cur_found = 1;
-						prev = &shingles[i];
-					}
+				if (session->callback.cb_check) {
+					memset (&rep, 0, sizeof (rep));
+					session->callback.cb_check (&rep, session->cbdata);
 				}
 
-				if (max_found > RSPAMD_SHINGLE_SIZE / 2) {
-					session->prob = ((float)max_found) / RSPAMD_SHINGLE_SIZE;
-					rep.prob = session->prob;
-
-					g_assert (sel != NULL);
-
-					/* Prepare new check command */
-					rspamd_fuzzy_redis_session_free_args (session);
-					session->nargs = 4;
-					session->argv = g_malloc (sizeof (gchar *) * session->nargs);
-					session->argv_lens = g_malloc (sizeof (gsize) * session->nargs);
-
-					key = g_string_new (session->backend->redis_object);
-					g_string_append_len (key, sel->digest, sizeof (sel->digest));
-					session->argv[0] = g_strdup ("HMGET");
-					session->argv_lens[0] = 5;
-					session->argv[1] = key->str;
-					session->argv_lens[1] = key->len;
-					session->argv[2] = g_strdup ("V");
-					session->argv_lens[2] = 1;
-					session->argv[3] = g_strdup ("F");
-					session->argv_lens[3] = 1;
-					g_string_free (key, FALSE); /* Do not free underlying array */
-
-					g_assert (session->ctx != NULL);
-					if (redisAsyncCommandArgv (session->ctx,
-							rspamd_fuzzy_redis_check_callback,
-							session, session->nargs,
-							(const gchar **)session->argv,
-							session->argv_lens) != REDIS_OK) {
-
-						if (session->callback.cb_check) {
-							memset (&rep, 0, sizeof (rep));
-							session->callback.cb_check (&rep, session->cbdata);
-						}
-
-						rspamd_fuzzy_redis_session_dtor (session, TRUE);
-					}
-					else {
-						/* Add timeout */
-						event_set (&session->timeout, -1, EV_TIMEOUT,
-								rspamd_fuzzy_redis_timeout,
-								session);
-						event_base_set (session->ev_base, &session->timeout);
-						double_to_tv (session->backend->timeout, &tv);
-						event_add (&session->timeout, &tv);
-					}
-
-					return;
-				}
+				rspamd_fuzzy_redis_session_dtor (session, TRUE);
 			}
+			else {
+				/* Add timeout */
+				event_set (&session->timeout, -1, EV_TIMEOUT,
+						rspamd_fuzzy_redis_timeout,
+						session);
+				event_base_set (session->ev_base, &session->timeout);
+				double_to_tv (session->backend->timeout, &tv);
+				event_add (&session->timeout, &tv);
+			}
+
+			return;
 		}
 
 		if (session->callback.cb_check) {
@@ -513,15 +569,45 @@ rspamd_fuzzy_backend_check_shingles (struct rspamd_fuzzy_redis_session *session)
 	}
 }
 
+/*
+ * Parses reply for HMGET V F of a digest
+ */
+static gboolean
+rspamd_fuzzy_redis_parse_digest (redisReply *reply,
+		struct rspamd_fuzzy_reply *rep)
+{
+	redisReply *cur;
+	gulong value;
+	guint found_elts = 0;
+
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
+		cur = reply->element[0];
+
+		if (cur->type == REDIS_REPLY_STRING) {
+			value = strtoul (cur->str, NULL, 10);
+			rep->value = value;
+			found_elts ++;
+		}
+
+		cur = reply->element[1];
+
+		if (cur->type == REDIS_REPLY_STRING) {
+			value = strtoul (cur->str, NULL, 10);
+			rep->flag = value;
+			found_elts ++;
+		}
+	}
+
+	return found_elts == 2;
+}
+
 static void
 rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 		gpointer priv)
 {
 	struct rspamd_fuzzy_redis_session *session = priv;
-	redisReply *reply = r, *cur;
+	redisReply *reply = r;
 	struct rspamd_fuzzy_reply rep;
-	gulong value;
-	guint found_elts = 0;
 
 	event_del (&session->timeout);
 	memset (&rep, 0, sizeof (rep));
@@ -529,60 +615,431 @@ rspamd_fuzzy_redis_check_callback (redisAsyncContext *c, gpointer r,
 	if (c->err == 0) {
 		rspamd_upstream_ok (session->up);
 
-		if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 2) {
-			cur = reply->element[0];
+		if (rspamd_fuzzy_redis_parse_digest (reply, &rep)) {
+			rep.prob = session->prob;
+		}
+		else if (session->cmd->shingles_count > 0 &&
+				!session->shingles_checked) {
+			/* We also need to check all shingles here */
+			rspamd_fuzzy_backend_check_shingles (session);
+			/* Do not free session */
+			return;
+		}
 
-			if (cur->type == REDIS_REPLY_STRING) {
-				value = strtoul (cur->str, NULL, 10);
-				rep.value = value;
-				found_elts ++;
-			}
+		if (session->callback.cb_check) {
+			session->callback.cb_check (&rep, session->cbdata);
+		}
+	}
+	else {
+		if (session->callback.cb_check) {
+			session->callback.cb_check (&rep, session->cbdata);
+		}
 
-			cur = reply->element[1];
+		if (c->errstr) {
+			msg_err_redis_session ("error getting hashes: %s", c->errstr);
+		}
 
-			if (cur->type == REDIS_REPLY_STRING) {
-				value = strtoul (cur->str, NULL, 10);
-				rep.flag = value;
-				found_elts ++;
-			}
+		rspamd_upstream_fail (session->up);
+	}
 
-			if (found_elts == 2) {
-				rep.prob = session->prob;
+	rspamd_fuzzy_redis_session_dtor (session, FALSE);
+}
+
+static void
+rspamd_fuzzy_redis_batch_free (struct rspamd_fuzzy_redis_batch *batch)
+{
+	struct rspamd_fuzzy_redis_session *session;
+	struct rspamd_fuzzy_reply rep;
+	redisAsyncContext *ac;
+	guint i;
+
+	if (event_get_base (&batch->timeout)) {
+		event_del (&batch->timeout);
+	}
+
+	/* Sessions that have not got their results */
+	for (i = 0; i < batch->sessions->len; i ++) {
+		session = g_ptr_array_index (batch->sessions, i);
+
+		if (session != NULL) {
+			memset (&rep, 0, sizeof (rep));
+
+			if (session->callback.cb_check) {
+				session->callback.cb_check (&rep, session->cbdata);
 			}
+
+			rspamd_fuzzy_redis_session_dtor (session, FALSE);
 		}
+	}
 
-		if (found_elts != 2) {
-			if (session->cmd->shingles_count > 0 && !session->shingles_checked) {
-				/* We also need to check all shingles here */
-				rspamd_fuzzy_backend_check_shingles (session);
-				/* Do not free session */
-				return;
-			}
-			else {
-				if (session->callback.cb_check) {
-					session->callback.cb_check (&rep, session->cbdata);
-				}
+	if (batch->failed) {
+		rspamd_upstream_fail (batch->up);
+	}
+	else {
+		rspamd_upstream_ok (batch->up);
+	}
+
+	if (batch->ctx) {
+		ac = batch->ctx;
+		batch->ctx = NULL;
+		rspamd_redis_pool_release_connection (batch->backend->pool,
+				ac, batch->failed);
+	}
+
+	g_ptr_array_free (batch->sessions, TRUE);
+	REF_RELEASE (batch->backend);
+	g_slice_free1 (sizeof (*batch), batch);
+}
+
+static void
+rspamd_fuzzy_redis_batch_reply (struct rspamd_fuzzy_redis_session *session,
+		struct rspamd_fuzzy_reply *rep)
+{
+	g_ptr_array_index (session->batch->sessions, session->batch_idx) = NULL;
+
+	if (session->callback.cb_check) {
+		session->callback.cb_check (rep, session->cbdata);
+	}
+
+	rspamd_fuzzy_redis_session_dtor (session, FALSE);
+}
+
+static void
+rspamd_fuzzy_redis_batch_timeout (gint fd, short what, gpointer priv)
+{
+	struct rspamd_fuzzy_redis_batch *batch = priv;
+	redisAsyncContext *ac;
+	static char errstr[128];
+
+	if (batch->ctx) {
+		ac = batch->ctx;
+		batch->ctx = NULL;
+		batch->failed = TRUE;
+		ac->err = REDIS_ERR_IO;
+		/* Should be safe as in hiredis it is char[128] */
+		rspamd_snprintf (errstr, sizeof (errstr), "%s", strerror (ETIMEDOUT));
+		ac->errstr = errstr;
+
+		/* This calls for all callbacks pending and frees batch */
+		rspamd_redis_pool_release_connection (batch->backend->pool,
+				ac, TRUE);
+	}
+}
+
+static void rspamd_fuzzy_redis_batch_next (struct rspamd_fuzzy_redis_batch *batch);
+
+static void
+rspamd_fuzzy_redis_batch_digest_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_session *session = priv;
+	struct rspamd_fuzzy_redis_batch *batch = session->batch;
+	redisReply *reply = r;
+	struct rspamd_fuzzy_reply rep;
+
+	batch->inflight --;
+	memset (&rep, 0, sizeof (rep));
+
+	if (c->err == 0 && reply != NULL) {
+		if (rspamd_fuzzy_redis_parse_digest (reply, &rep)) {
+			rep.prob = session->prob;
+			rspamd_fuzzy_redis_batch_reply (session, &rep);
+		}
+		else if (session->cmd->shingles_count == 0 ||
+				session->shingles_checked) {
+			rspamd_fuzzy_redis_batch_reply (session, &rep);
+		}
+		/* Otherwise shingles are checked for the whole batch */
+	}
+	else {
+		if (!batch->failed && c->errstr) {
+			msg_err_redis_session ("error getting hashes: %s", c->errstr);
+		}
+
+		batch->failed = TRUE;
+		rspamd_fuzzy_redis_batch_reply (session, &rep);
+	}
+
+	rspamd_fuzzy_redis_batch_next (batch);
+}
+
+static gboolean
+rspamd_fuzzy_redis_batch_send_digest (struct rspamd_fuzzy_redis_batch *batch,
+		struct rspamd_fuzzy_redis_session *session, const gchar *digest)
+{
+	const gchar *argv[4];
+	gsize argv_lens[4];
+	GString *key;
+	gint ret;
+
+	key = g_string_new (batch->backend->redis_object);
+	g_string_append_len (key, digest, 64);
+	argv[0] = "HMGET";
+	argv_lens[0] = 5;
+	argv[1] = key->str;
+	argv_lens[1] = key->len;
+	argv[2] = "V";
+	argv_lens[2] = 1;
+	argv[3] = "F";
+	argv_lens[3] = 1;
+
+	ret = redisAsyncCommandArgv (batch->ctx,
+			rspamd_fuzzy_redis_batch_digest_callback,
+			session, G_N_ELEMENTS (argv), argv, argv_lens);
+	g_string_free (key, TRUE);
+
+	if (ret != REDIS_OK) {
+		batch->failed = TRUE;
+
+		return FALSE;
+	}
+
+	batch->inflight ++;
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_redis_batch_shingles_callback (redisAsyncContext *c, gpointer r,
+		gpointer priv)
+{
+	struct rspamd_fuzzy_redis_batch *batch = priv;
+	struct rspamd_fuzzy_redis_session *session;
+	redisReply *reply = r;
+	struct rspamd_fuzzy_reply rep;
+	guchar digest[64];
+	guint i, nsessions = 0;
+
+	batch->inflight --;
+
+	if (c->err == 0 && reply != NULL) {
+		for (i = 0; i < batch->sessions->len; i ++) {
+			if (g_ptr_array_index (batch->sessions, i) != NULL) {
+				nsessions ++;
 			}
 		}
-		else {
-			if (session->callback.cb_check) {
-				session->callback.cb_check (&rep, session->cbdata);
+
+		if (reply->type == REDIS_REPLY_ARRAY &&
+				reply->elements == nsessions * RSPAMD_SHINGLE_SIZE) {
+			nsessions = 0;
+
+			for (i = 0; i < batch->sessions->len; i ++) {
+				session = g_ptr_array_index (batch->sessions, i);
+
+				if (session == NULL) {
+					continue;
+				}
+
+				if (!rspamd_fuzzy_redis_shingles_select (
+						&reply->element[nsessions * RSPAMD_SHINGLE_SIZE],
+						digest, &session->prob) ||
+						!rspamd_fuzzy_redis_batch_send_digest (batch, session,
+								(const gchar *)digest)) {
+					memset (&rep, 0, sizeof (rep));
+					rspamd_fuzzy_redis_batch_reply (session, &rep);
+				}
+
+				nsessions ++;
 			}
 		}
 	}
 	else {
-		if (session->callback.cb_check) {
-			session->callback.cb_check (&rep, session->cbdata);
+		if (!batch->failed && c->errstr) {
+			msg_err ("error getting shingles from %s: %s",
+					rspamd_upstream_name (batch->up), c->errstr);
 		}
 
-		if (c->errstr) {
-			msg_err_redis_session ("error getting hashes: %s", c->errstr);
+		batch->failed = TRUE;
+	}
+
+	rspamd_fuzzy_redis_batch_next (batch);
+}
+
+/*
+ * Requests shingles of all sessions that have not matched by digest
+ */
+static gboolean
+rspamd_fuzzy_redis_batch_send_shingles (struct rspamd_fuzzy_redis_batch *batch)
+{
+	struct rspamd_fuzzy_redis_session *session;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+	gchar **argv;
+	gsize *argv_lens;
+	GString *key;
+	guint i, j, nargs = 1;
+	gint ret;
+
+	for (i = 0; i < batch->sessions->len; i ++) {
+		if (g_ptr_array_index (batch->sessions, i) != NULL) {
+			nargs += RSPAMD_SHINGLE_SIZE;
 		}
+	}
 
-		rspamd_upstream_fail (session->up);
+	if (nargs == 1) {
+		return FALSE;
 	}
 
-	rspamd_fuzzy_redis_session_dtor (session, FALSE);
+	argv = g_malloc (sizeof (gchar *) * nargs);
+	argv_lens = g_malloc (sizeof (gsize) * nargs);
+	argv[0] = g_strdup ("MGET");
+	argv_lens[0] = 4;
+	nargs = 1;
+
+	for (i = 0; i < batch->sessions->len; i ++) {
+		session = g_ptr_array_index (batch->sessions, i);
+
+		if (session == NULL) {
+			continue;
+		}
+
+		shcmd = (const struct rspamd_fuzzy_shingle_cmd *)session->cmd;
+		session->shingles_checked = TRUE;
+
+		for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+			key = g_string_new (batch->backend->redis_object);
+			rspamd_printf_gstring (key, "_%d_%uL", j, shcmd->sgl.hashes[j]);
+			argv[nargs] = key->str;
+			argv_lens[nargs] = key->len;
+			g_string_free (key, FALSE); /* Do not free underlying array */
+			nargs ++;
+		}
+	}
+
+	ret = redisAsyncCommandArgv (batch->ctx,
+			rspamd_fuzzy_redis_batch_shingles_callback,
+			batch, nargs, (const gchar **)argv, argv_lens);
+
+	for (i = 0; i < nargs; i ++) {
+		g_free (argv[i]);
+	}
+
+	g_free (argv);
+	g_free (argv_lens);
+
+	if (ret != REDIS_OK) {
+		batch->failed = TRUE;
+
+		return FALSE;
+	}
+
+	batch->inflight ++;
+
+	return TRUE;
+}
+
+/* Called when all replies of the current stage are received */
+static void
+rspamd_fuzzy_redis_batch_next (struct rspamd_fuzzy_redis_batch *batch)
+{
+	if (batch->inflight > 0) {
+		return;
+	}
+
+	if (!batch->failed && batch->ctx != NULL && !batch->shingles_checked) {
+		batch->shingles_checked = TRUE;
+
+		if (rspamd_fuzzy_redis_batch_send_shingles (batch)) {
+			return;
+		}
+	}
+
+	rspamd_fuzzy_redis_batch_free (batch);
+}
+
+static void
+rspamd_fuzzy_redis_batch_flush (gint fd, short what, gpointer priv)
+{
+	struct rspamd_fuzzy_redis_batch *batch = priv;
+	struct rspamd_fuzzy_backend_redis *backend = batch->backend;
+	struct rspamd_fuzzy_redis_session *session;
+	rspamd_inet_addr_t *addr;
+	struct timeval tv;
+	guint i, bucket;
+
+	if (backend->batch == batch) {
+		backend->batch = NULL;
+	}
+
+	if (event_get_base (&batch->flush_event)) {
+		event_del (&batch->flush_event);
+	}
+
+	/* Batches of 1, 2-3, 4-7 ... sessions */
+	bucket = MIN (REDIS_BATCH_BUCKETS - 1,
+			g_bit_nth_msf (batch->sessions->len, -1));
+	backend->batches ++;
+	backend->batch_sizes[bucket] ++;
+
+	batch->up = rspamd_upstream_get (backend->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+	addr = rspamd_upstream_addr (batch->up);
+	g_assert (addr != NULL);
+	batch->ctx = rspamd_redis_pool_connect (backend->pool,
+			backend->dbname, backend->password,
+			rspamd_inet_address_to_string (addr),
+			rspamd_inet_address_get_port (addr));
+
+	if (batch->ctx == NULL) {
+		batch->failed = TRUE;
+		rspamd_fuzzy_redis_batch_free (batch);
+
+		return;
+	}
+
+	for (i = 0; i < batch->sessions->len; i ++) {
+		session = g_ptr_array_index (batch->sessions, i);
+
+		if (!rspamd_fuzzy_redis_batch_send_digest (batch, session,
+				session->cmd->digest)) {
+			break;
+		}
+	}
+
+	if (batch->inflight == 0) {
+		/* Nothing has been sent */
+		rspamd_fuzzy_redis_batch_free (batch);
+
+		return;
+	}
+
+	event_set (&batch->timeout, -1, EV_TIMEOUT,
+			rspamd_fuzzy_redis_batch_timeout, batch);
+	event_base_set (batch->ev_base, &batch->timeout);
+	double_to_tv (backend->timeout, &tv);
+	event_add (&batch->timeout, &tv);
+}
+
+static void
+rspamd_fuzzy_redis_batch_add (struct rspamd_fuzzy_backend_redis *backend,
+		struct rspamd_fuzzy_redis_session *session)
+{
+	struct rspamd_fuzzy_redis_batch *batch = backend->batch;
+	struct timeval tv;
+
+	if (batch == NULL) {
+		batch = g_slice_alloc0 (sizeof (*batch));
+		batch->backend = backend;
+		REF_RETAIN (backend);
+		batch->ev_base = session->ev_base;
+		batch->sessions = g_ptr_array_sized_new (REDIS_MAX_BATCH);
+		backend->batch = batch;
+
+		event_set (&batch->flush_event, -1, EV_TIMEOUT,
+				rspamd_fuzzy_redis_batch_flush, batch);
+		event_base_set (batch->ev_base, &batch->flush_event);
+		double_to_tv (backend->batch_timeout, &tv);
+		event_add (&batch->flush_event, &tv);
+	}
+
+	session->batch = batch;
+	session->batch_idx = batch->sessions->len;
+	g_ptr_array_add (batch->sessions, session);
+
+	if (batch->sessions->len >= REDIS_MAX_BATCH) {
+		rspamd_fuzzy_redis_batch_flush (-1, EV_TIMEOUT, batch);
+	}
 }
 
 void
@@ -612,6 +1069,13 @@ rspamd_fuzzy_backend_check_redis (struct rspamd_fuzzy_backend *bk,
 	session->prob = 1.0;
 	session->ev_base = rspamd_fuzzy_backend_event_base (bk);
 
+	if (backend->batch_timeout > 0) {
+		/* Digest is requested when the batch is flushed */
+		rspamd_fuzzy_redis_batch_add (backend, session);
+
+		return;
+	}
+
 	/* First of all check digest */
 	session->nargs = 4;
 	session->argv = g_malloc (sizeof (gchar *) * session->nargs);
@@ -925,6 +1389,32 @@ rspamd_fuzzy_backend_id_redis (struct rspamd_fuzzy_backend *bk,
 	return backend->id;
 }
 
+void
+rspamd_fuzzy_backend_stat_redis (struct rspamd_fuzzy_backend *bk,
+		ucl_object_t *obj, void *subr_ud)
+{
+	struct rspamd_fuzzy_backend_redis *backend = subr_ud;
+	ucl_object_t *elt;
+	guint i;
+
+	g_assert (backend != NULL);
+
+	ucl_object_insert_key (obj,
+			ucl_object_fromint (backend->batches),
+			"fuzzy_redis_batches",
+			0,
+			false);
+
+	/* Number of batches of 1, 2-3, 4-7 ... checks */
+	elt = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < REDIS_BATCH_BUCKETS; i ++) {
+		ucl_array_append (elt, ucl_object_fromint (backend->batch_sizes[i]));
+	}
+
+	ucl_object_insert_key (obj, elt, "fuzzy_redis_batch_sizes", 0, false);
+}
+
 void
 rspamd_fuzzy_backend_expire_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud)
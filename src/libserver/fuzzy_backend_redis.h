@@ -41,6 +41,8 @@ void rspamd_fuzzy_backend_version_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 const gchar* rspamd_fuzzy_backend_id_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
+void rspamd_fuzzy_backend_stat_redis (struct rspamd_fuzzy_backend *bk,
+		ucl_object_t *obj, void *subr_ud);
 void rspamd_fuzzy_backend_expire_redis (struct rspamd_fuzzy_backend *bk,
 		void *subr_ud);
 void rspamd_fuzzy_backend_close_redis (struct rspamd_fuzzy_backend *bk,
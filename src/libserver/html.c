@@ -21,6 +21,7 @@
 #include "html_tags.h"
 #include "html_colors.h"
 #include "url.h"
+#include "cryptobox.h"
 #include <unicode/uversion.h>
 #if U_ICU_VERSION_MAJOR_NUM >= 46
 #include <unicode/uidna.h>
@@ -447,7 +448,34 @@ static entity entities_defs[] = {
 	{"euro", 8364, "E"},
 };
 
-static GHashTable *html_colors_hash = NULL;
+/*
+ * Minimal perfect hash over a static names table (hash and displace). Keys
+ * are split into buckets by the first hash; each bucket gets a displacement
+ * that places all of its keys into distinct free slots, so a lookup costs
+ * one hash and one comparison.
+ */
+#define PHASH_MAX_LEN 64
+#define PHASH_MAX_DISP G_MAXUINT16
+
+struct html_phash_slot {
+	const gchar *name;
+	guint len;
+	gint idx;
+};
+
+struct html_phash {
+	guint64 seed;
+	guint nbuckets;
+	guint mask;
+	guint max_len;
+	gboolean icase;
+	guint16 *disp;
+	struct html_phash_slot *slots;
+};
+
+static struct html_phash tags_phash;
+static struct html_phash entities_phash;
+static struct html_phash colors_phash;
 
 static entity entities_defs_num[ (G_N_ELEMENTS (entities_defs)) ];
 static struct html_tag_def tag_defs_num[ (G_N_ELEMENTS (tag_defs)) ];
@@ -521,15 +549,215 @@ entity_cmp_num (const void *m1, const void *m2)
 	return p1->code - p2->code;
 }
 
+static inline guint64
+rspamd_html_phash_hash (const struct html_phash *ph, const gchar *name,
+		guint len)
+{
+	gchar lc[PHASH_MAX_LEN];
+	guint i;
+
+	if (ph->icase) {
+		for (i = 0; i < len; i ++) {
+			lc[i] = g_ascii_tolower (name[i]);
+		}
+
+		name = lc;
+	}
+
+	return rspamd_cryptobox_fast_hash (name, len, ph->seed);
+}
+
+static inline guint
+rspamd_html_phash_slot (const struct html_phash *ph, guint64 h, guint disp)
+{
+	return ((guint32)(h >> 32) + disp * ((guint32)h | 1)) & ph->mask;
+}
+
+static gint
+rspamd_html_phash_lookup (const struct html_phash *ph, const gchar *name,
+		guint len)
+{
+	const struct html_phash_slot *slot;
+	guint64 h;
+
+	if (len == 0 || len > ph->max_len) {
+		return -1;
+	}
+
+	h = rspamd_html_phash_hash (ph, name, len);
+	slot = &ph->slots[rspamd_html_phash_slot (ph, h,
+			ph->disp[(guint32)h % ph->nbuckets])];
+
+	if (slot->len == len) {
+		if (ph->icase) {
+			if (g_ascii_strncasecmp (slot->name, name, len) == 0) {
+				return slot->idx;
+			}
+		}
+		else if (memcmp (slot->name, name, len) == 0) {
+			return slot->idx;
+		}
+	}
+
+	return -1;
+}
+
+struct html_phash_bucket {
+	guint id;
+	guint nkeys;
+};
+
+static gint
+rspamd_html_phash_bucket_cmp (const void *a, const void *b)
+{
+	const struct html_phash_bucket *b1 = a, *b2 = b;
+
+	return (gint)b2->nkeys - (gint)b1->nkeys;
+}
+
+static gboolean
+rspamd_html_phash_try (struct html_phash *ph, const gchar **names,
+		guint n, guint64 *hashes, struct html_phash_bucket *buckets,
+		guint *keys, guint *pos)
+{
+	guint i, j, k, nkeys, disp;
+	gboolean found;
+
+	memset (ph->slots, 0, sizeof (*ph->slots) * (ph->mask + 1));
+	memset (ph->disp, 0, sizeof (*ph->disp) * ph->nbuckets);
+
+	for (i = 0; i < ph->nbuckets; i ++) {
+		buckets[i].id = i;
+		buckets[i].nkeys = 0;
+	}
+
+	for (i = 0; i < n; i ++) {
+		hashes[i] = rspamd_html_phash_hash (ph, names[i], strlen (names[i]));
+		buckets[(guint32)hashes[i] % ph->nbuckets].nkeys ++;
+	}
+
+	/* Place the largest buckets first while there are many free slots */
+	qsort (buckets, ph->nbuckets, sizeof (*buckets),
+			rspamd_html_phash_bucket_cmp);
+
+	for (i = 0; i < ph->nbuckets && buckets[i].nkeys > 0; i ++) {
+		nkeys = 0;
+
+		for (j = 0; j < n; j ++) {
+			if ((guint32)hashes[j] % ph->nbuckets == buckets[i].id) {
+				keys[nkeys ++] = j;
+			}
+		}
+
+		found = FALSE;
+
+		for (disp = 0; disp <= PHASH_MAX_DISP && !found; disp ++) {
+			found = TRUE;
+
+			for (j = 0; j < nkeys && found; j ++) {
+				pos[j] = rspamd_html_phash_slot (ph, hashes[keys[j]], disp);
+
+				if (ph->slots[pos[j]].name != NULL) {
+					found = FALSE;
+				}
+
+				for (k = 0; k < j && found; k ++) {
+					if (pos[k] == pos[j]) {
+						found = FALSE;
+					}
+				}
+			}
+
+			if (found) {
+				ph->disp[buckets[i].id] = disp;
+
+				for (j = 0; j < nkeys; j ++) {
+					ph->slots[pos[j]].name = names[keys[j]];
+					ph->slots[pos[j]].len = strlen (names[keys[j]]);
+					ph->slots[pos[j]].idx = keys[j];
+				}
+			}
+		}
+
+		if (!found) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Names must be unique (case insensitively if icase is set) and the
+ * resulting slot index is the position in the names array
+ */
+static void
+rspamd_html_phash_build (struct html_phash *ph, const gchar **names,
+		guint n, gboolean icase)
+{
+	guint64 *hashes;
+	struct html_phash_bucket *buckets;
+	guint *keys, *pos, i, nslots = 1, attempt;
+
+	while (nslots < n * 2) {
+		nslots <<= 1;
+	}
+
+	ph->icase = icase;
+	ph->mask = nslots - 1;
+	ph->nbuckets = MAX (n / 2, 1);
+	ph->max_len = 0;
+	ph->slots = g_malloc (sizeof (*ph->slots) * nslots);
+	ph->disp = g_malloc (sizeof (*ph->disp) * ph->nbuckets);
+
+	for (i = 0; i < n; i ++) {
+		g_assert (strlen (names[i]) <= PHASH_MAX_LEN);
+		ph->max_len = MAX (ph->max_len, strlen (names[i]));
+	}
+
+	hashes = g_malloc (sizeof (*hashes) * n);
+	buckets = g_malloc (sizeof (*buckets) * ph->nbuckets);
+	keys = g_malloc (sizeof (*keys) * n);
+	pos = g_malloc (sizeof (*pos) * n);
+
+	for (attempt = 0; ; attempt ++) {
+		g_assert (attempt < 1000);
+		ph->seed = rspamd_cryptobox_fast_hash (&attempt, sizeof (attempt),
+				0xdeadbabe);
+
+		if (rspamd_html_phash_try (ph, names, n, hashes, buckets, keys, pos)) {
+			break;
+		}
+	}
+
+	g_free (hashes);
+	g_free (buckets);
+	g_free (keys);
+	g_free (pos);
+}
+
 static void
 rspamd_html_library_init (void)
 {
+	const gchar **names;
+	guint i;
+
 	if (!tags_sorted) {
 		qsort (tag_defs, G_N_ELEMENTS (
 				tag_defs), sizeof (struct html_tag_def), tag_cmp);
 		memcpy (tag_defs_num, tag_defs, sizeof (tag_defs));
 		qsort (tag_defs_num, G_N_ELEMENTS (tag_defs_num),
 				sizeof (struct html_tag_def), tag_cmp_id);
+
+		names = g_malloc (sizeof (*names) * G_N_ELEMENTS (tag_defs));
+
+		for (i = 0; i < G_N_ELEMENTS (tag_defs); i ++) {
+			names[i] = tag_defs[i].name;
+		}
+
+		rspamd_html_phash_build (&tags_phash, names, G_N_ELEMENTS (tag_defs),
+				TRUE);
+		g_free (names);
 		tags_sorted = 1;
 	}
 
@@ -539,55 +767,68 @@ rspamd_html_library_init (void)
 		memcpy (entities_defs_num, entities_defs, sizeof (entities_defs));
 		qsort (entities_defs_num, G_N_ELEMENTS (
 				entities_defs), sizeof (entity), entity_cmp_num);
+
+		/* Entities are case sensitive (e.g. dagger and Dagger) */
+		names = g_malloc (sizeof (*names) * G_N_ELEMENTS (entities_defs));
+
+		for (i = 0; i < G_N_ELEMENTS (entities_defs); i ++) {
+			names[i] = entities_defs[i].name;
+		}
+
+		rspamd_html_phash_build (&entities_phash, names,
+				G_N_ELEMENTS (entities_defs), FALSE);
+		g_free (names);
 		entities_sorted = 1;
 	}
 
-	if (html_colors_hash == NULL) {
-		guint i;
-
-		html_colors_hash = g_hash_table_new_full (rspamd_ftok_icase_hash,
-				rspamd_ftok_icase_equal, g_free, g_free);
+	if (colors_phash.slots == NULL) {
+		names = g_malloc (sizeof (*names) * G_N_ELEMENTS (html_colornames));
 
 		for (i = 0; i < G_N_ELEMENTS (html_colornames); i ++) {
-			struct html_color *color;
-			rspamd_ftok_t *key;
+			names[i] = html_colornames[i].name;
+		}
+
+		rspamd_html_phash_build (&colors_phash, names,
+				G_N_ELEMENTS (html_colornames), TRUE);
+		g_free (names);
+	}
+}
+
+static entity *
+rspamd_html_entity_by_name (const gchar *name, guint len)
+{
+	gchar lc[PHASH_MAX_LEN];
+	gint idx;
+	guint i;
 
-			color = g_malloc0 (sizeof (*color));
-			color->d.comp.alpha = 255;
-			color->d.comp.r = html_colornames[i].rgb.r;
-			color->d.comp.g = html_colornames[i].rgb.g;
-			color->d.comp.b = html_colornames[i].rgb.b;
-			color->valid = TRUE;
-			key = g_malloc0 (sizeof (*key));
-			key->begin = html_colornames[i].name;
-			key->len = strlen (html_colornames[i].name);
+	idx = rspamd_html_phash_lookup (&entities_phash, name, len);
 
-			g_hash_table_insert (html_colors_hash, key, color);
+	if (idx == -1 && len <= entities_phash.max_len) {
+		/* Fall back to the lowercase form as in &NBSP; */
+		for (i = 0; i < len; i ++) {
+			lc[i] = g_ascii_tolower (name[i]);
 		}
+
+		idx = rspamd_html_phash_lookup (&entities_phash, lc, len);
 	}
+
+	return idx != -1 ? &entities_defs[idx] : NULL;
 }
 
 static gboolean
-rspamd_html_check_balance (GNode * node, GNode ** cur_level)
+rspamd_html_check_balance (struct html_tag *tag, struct html_tag **cur_level)
 {
-	struct html_tag *arg = node->data, *tmp;
-	GNode *cur;
+	struct html_tag *cur;
 
-	if (arg->flags & FL_CLOSING) {
+	if (tag->flags & FL_CLOSING) {
 		/* First of all check whether this tag is closing tag for parent node */
-		cur = node->parent;
-		while (cur && cur->data) {
-			tmp = cur->data;
-			if (tmp->id == arg->id &&
-				(tmp->flags & FL_CLOSED) == 0) {
-				tmp->flags |= FL_CLOSED;
-				/* Destroy current node as we find corresponding parent node */
-				g_node_destroy (node);
+		for (cur = *cur_level; cur != NULL; cur = cur->parent) {
+			if (cur->id == tag->id && (cur->flags & FL_CLOSED) == 0) {
+				cur->flags |= FL_CLOSED;
 				/* Change level */
 				*cur_level = cur->parent;
 				return TRUE;
 			}
-			cur = cur->parent;
 		}
 	}
 	else {
@@ -600,17 +841,13 @@ rspamd_html_check_balance (GNode * node, GNode ** cur_level)
 gint
 rspamd_html_tag_by_name (const gchar *name)
 {
-	struct html_tag tag;
-	struct html_tag_def *found;
-
-	tag.name.start = name;
-	tag.name.len = strlen (name);
+	gint idx;
 
-	found = bsearch (&tag, tag_defs, G_N_ELEMENTS (tag_defs),
-			sizeof (tag_defs[0]), tag_find);
+	rspamd_html_library_init ();
+	idx = rspamd_html_phash_lookup (&tags_phash, name, strlen (name));
 
-	if (found) {
-		return found->id;
+	if (idx != -1) {
+		return tag_defs[idx].id;
 	}
 
 	return -1;
@@ -667,6 +904,8 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 		l = len;
 	}
 
+	rspamd_html_library_init ();
+
 	while (h - s < (gint)l) {
 		switch (state) {
 		/* Out of entitle */
@@ -688,12 +927,10 @@ rspamd_html_decode_entitles_inplace (gchar *s, guint len)
 				/* Determine base */
 				/* First find in entities table */
 
-				key.name = e + 1;
 				*h = '\0';
 				if (*(e + 1) != '#' &&
-					(found =
-					bsearch (&key, entities_defs, G_N_ELEMENTS (entities_defs),
-							sizeof (entity), entity_cmp)) != NULL) {
+					(found = rspamd_html_entity_by_name (e + 1,
+							h - e - 1)) != NULL) {
 					if (found->replacement) {
 						rep_len = strlen (found->replacement);
 						memcpy (t, found->replacement, rep_len);
@@ -917,48 +1154,35 @@ rspamd_html_url_is_phished (rspamd_mempool_t *pool,
 
 static gboolean
 rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
-		struct html_tag *tag, GNode **cur_level, gboolean *balanced)
+		struct html_tag *tag, struct html_tag **cur_level, gboolean *balanced)
 {
-	GNode *nnode;
 	struct html_tag *parent;
 
-	if (hc->html_tags == NULL) {
-		nnode = g_node_new (NULL);
-		*cur_level = nnode;
-		hc->html_tags = nnode;
+	if (hc->tags == NULL) {
+		hc->tags = g_ptr_array_sized_new (128);
 		rspamd_mempool_add_destructor (pool,
-				(rspamd_mempool_destruct_t) g_node_destroy,
-				nnode);
+				rspamd_ptr_array_free_hard, hc->tags);
 	}
 
-	tag->parent = *cur_level;
+	parent = *cur_level;
+	tag->parent = parent;
 
 	if (!(tag->flags & CM_INLINE)) {
 		/* Block tag */
-		nnode = g_node_new (tag);
-
 		if (tag->flags & FL_CLOSING) {
-			if (!*cur_level) {
-				msg_debug_html ("bad parent node");
-				g_node_destroy (nnode);
-				return FALSE;
-			}
-
-			g_node_append (*cur_level, nnode);
-
-			if (!rspamd_html_check_balance (nnode, cur_level)) {
+			if (!rspamd_html_check_balance (tag, cur_level)) {
 				msg_debug_html (
 						"mark part as unbalanced as it has not pairable closing tags");
 				hc->flags |= RSPAMD_HTML_FLAG_UNBALANCED;
 				*balanced = FALSE;
+				/* Keep unpaired closing tags, paired ones are merged */
+				g_ptr_array_add (hc->tags, tag);
 			}
 			else {
 				*balanced = TRUE;
 			}
 		}
 		else {
-			parent = (*cur_level)->data;
-
 			if (parent) {
 				if ((parent->flags & FL_IGNORE)) {
 					tag->flags |= FL_IGNORE;
@@ -967,10 +1191,10 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 				parent->content_length += tag->content_length;
 			}
 
-			g_node_append (*cur_level, nnode);
+			g_ptr_array_add (hc->tags, tag);
 
 			if ((tag->flags & FL_CLOSED) == 0) {
-				*cur_level = nnode;
+				*cur_level = tag;
 			}
 
 			if (tag->flags & (CM_HEAD|CM_UNKNOWN|FL_IGNORE)) {
@@ -983,8 +1207,6 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	}
 	else {
 		/* Inline tag */
-		parent = (*cur_level)->data;
-
 		if (parent && (parent->flags & (CM_HEAD|CM_UNKNOWN|FL_IGNORE))) {
 			tag->flags |= FL_IGNORE;
 
@@ -995,12 +1217,35 @@ rspamd_html_process_tag (rspamd_mempool_t *pool, struct html_content *hc,
 	return TRUE;
 }
 
+static inline void
+rspamd_html_tag_add_component (rspamd_mempool_t *pool, struct html_tag *tag,
+		struct html_tag_component *comp)
+{
+	GList *l;
+
+	/* Avoid a slice allocation and a pool destructor per component */
+	l = rspamd_mempool_alloc (pool, sizeof (*l));
+	l->data = comp;
+	l->next = NULL;
+	l->prev = tag->params.tail;
+
+	if (tag->params.tail) {
+		tag->params.tail->next = l;
+	}
+	else {
+		tag->params.head = l;
+	}
+
+	tag->params.tail = l;
+	tag->params.length ++;
+}
+
 #define NEW_COMPONENT(comp_type) do {							\
 	comp = rspamd_mempool_alloc (pool, sizeof (*comp));			\
 	comp->type = (comp_type);									\
 	comp->start = NULL;											\
 	comp->len = 0;												\
-	g_queue_push_tail (tag->params, comp);						\
+	rspamd_html_tag_add_component (pool, tag, comp);			\
 	ret = TRUE;													\
 } while(0)
 
@@ -1083,7 +1328,7 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 		spaces_after_param,
 		ignore_bad_tag
 	} state;
-	struct html_tag_def *found;
+	gint idx;
 	gboolean store = FALSE;
 	struct html_tag_component *comp;
 
@@ -1122,15 +1367,15 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 						(gchar *)tag->name.start,
 						tag->name.len);
 
-				found = bsearch (tag, tag_defs, G_N_ELEMENTS (tag_defs),
-					sizeof (tag_defs[0]), tag_find);
-				if (found == NULL) {
+				idx = rspamd_html_phash_lookup (&tags_phash, tag->name.start,
+						tag->name.len);
+				if (idx == -1) {
 					hc->flags |= RSPAMD_HTML_FLAG_UNKNOWN_ELEMENTS;
 					tag->id = -1;
 				}
 				else {
-					tag->id = found->id;
-					tag->flags = found->flags;
+					tag->id = tag_defs[idx].id;
+					tag->flags = tag_defs[idx].flags;
 				}
 				state = spaces_after_name;
 			}
@@ -1262,8 +1507,7 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 		}
 		if (store) {
 			if (*savep != NULL) {
-				g_assert (tag->params != NULL);
-				comp = g_queue_peek_tail (tag->params);
+				comp = g_queue_peek_tail (&tag->params);
 				g_assert (comp != NULL);
 				comp->len = in - *savep;
 				comp->start = *savep;
@@ -1281,8 +1525,7 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 		}
 		if (store) {
 			if (*savep != NULL) {
-				g_assert (tag->params != NULL);
-				comp = g_queue_peek_tail (tag->params);
+				comp = g_queue_peek_tail (&tag->params);
 				g_assert (comp != NULL);
 				comp->len = in - *savep;
 				comp->start = *savep;
@@ -1305,8 +1548,7 @@ rspamd_html_parse_tag_content (rspamd_mempool_t *pool,
 
 		if (store) {
 			if (*savep != NULL) {
-				g_assert (tag->params != NULL);
-				comp = g_queue_peek_tail (tag->params);
+				comp = g_queue_peek_tail (&tag->params);
 				g_assert (comp != NULL);
 				comp->len = in - *savep;
 				comp->start = *savep;
@@ -1449,7 +1691,7 @@ rspamd_html_process_url_tag (rspamd_mempool_t *pool, struct html_tag *tag)
 	GList *cur;
 	struct rspamd_url *url;
 
-	cur = tag->params->head;
+	cur = tag->params.head;
 
 	while (cur) {
 		comp = cur->data;
@@ -1517,7 +1759,7 @@ rspamd_html_process_img_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 	gulong val;
 	gboolean seen_width = FALSE, seen_height = FALSE;
 
-	cur = tag->params->head;
+	cur = tag->params.head;
 	img = rspamd_mempool_alloc0 (pool, sizeof (*img));
 	img->tag = tag;
 
@@ -1611,8 +1853,7 @@ rspamd_html_process_color (const gchar *line, guint len, struct html_color *cl)
 {
 	const gchar *p = line, *end = line + len;
 	char hexbuf[7];
-	rspamd_ftok_t search;
-	struct html_color *el;
+	gint idx;
 
 	memset (cl, 0, sizeof (*cl));
 
@@ -1625,13 +1866,14 @@ rspamd_html_process_color (const gchar *line, guint len, struct html_color *cl)
 	}
 	else {
 		/* Compare color by name */
-		search.begin = line;
-		search.len = len;
-
-		el = g_hash_table_lookup (html_colors_hash, &search);
+		idx = rspamd_html_phash_lookup (&colors_phash, line, len);
 
-		if (el != NULL) {
-			memcpy (cl, el, sizeof (*cl));
+		if (idx != -1) {
+			cl->d.comp.alpha = 255;
+			cl->d.comp.r = html_colornames[idx].rgb.r;
+			cl->d.comp.g = html_colornames[idx].rgb.g;
+			cl->d.comp.b = html_colornames[idx].rgb.b;
+			cl->valid = TRUE;
 		}
 	}
 }
@@ -1738,10 +1980,9 @@ rspamd_html_process_block_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 	struct html_block *bl, *bl_parent;
 	rspamd_ftok_t fstr;
 	GList *cur;
-	GNode *parent;
 	struct html_tag *parent_tag;
 
-	cur = tag->params->head;
+	cur = tag->params.head;
 	bl = rspamd_mempool_alloc0 (pool, sizeof (*bl));
 	bl->tag = tag;
 	bl->visible = TRUE;
@@ -1784,10 +2025,9 @@ rspamd_html_process_block_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 
 	if (!bl->background_color.valid) {
 		/* Try to propagate background color from parent nodes */
-		for (parent = tag->parent; parent != NULL; parent = parent->parent) {
-			parent_tag = parent->data;
-
-			if (parent_tag && (parent_tag->flags & FL_BLOCK) && parent_tag->extra) {
+		for (parent_tag = tag->parent; parent_tag != NULL;
+				parent_tag = parent_tag->parent) {
+			if ((parent_tag->flags & FL_BLOCK) && parent_tag->extra) {
 				bl_parent = parent_tag->extra;
 
 				if (bl_parent->background_color.valid) {
@@ -1800,10 +2040,9 @@ rspamd_html_process_block_tag (rspamd_mempool_t *pool, struct html_tag *tag,
 	}
 	if (!bl->font_color.valid) {
 		/* Try to propagate background color from parent nodes */
-		for (parent = tag->parent; parent != NULL; parent = parent->parent) {
-			parent_tag = parent->data;
-
-			if (parent_tag && (parent_tag->flags & FL_BLOCK) && parent_tag->extra) {
+		for (parent_tag = tag->parent; parent_tag != NULL;
+				parent_tag = parent_tag->parent) {
+			if ((parent_tag->flags & FL_BLOCK) && parent_tag->extra) {
 				bl_parent = parent_tag->extra;
 
 				if (bl_parent->font_color.valid) {
@@ -1846,7 +2085,7 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 	GByteArray *dest;
 	GHashTable *target_tbl;
 	guint obrace = 0, ebrace = 0;
-	GNode *cur_level = NULL;
+	struct html_tag *cur_level = NULL;
 	gint substate = 0, len, href_offset = -1;
 	struct html_tag *cur_tag = NULL, *content_tag = NULL;
 	struct rspamd_url *url = NULL, *turl;
@@ -1933,9 +2172,6 @@ rspamd_html_process_part_full (rspamd_mempool_t *pool, struct html_content *hc,
 				substate = 0;
 				savep = NULL;
 				cur_tag = rspamd_mempool_alloc0 (pool, sizeof (*cur_tag));
-				cur_tag->params = g_queue_new ();
-				rspamd_mempool_add_destructor (pool,
-						(rspamd_mempool_destruct_t)g_queue_free, cur_tag->params);
 				break;
 			}
 
@@ -2328,3 +2564,71 @@ rspamd_html_process_part (rspamd_mempool_t *pool,
 {
 	return rspamd_html_process_part_full (pool, hc, in, NULL, NULL, NULL);
 }
+
+static gint
+color_find (const void *skey, const void *elt)
+{
+	const struct rspamd_html_colorname *c = elt;
+
+	return g_ascii_strcasecmp (skey, c->name);
+}
+
+/*
+ * Looks up all known tags, entities and colors niters times using either
+ * the reference bsearch over sorted tables or the perfect hash tables
+ */
+size_t
+html_lookup_test (bool generic, size_t niters)
+{
+	size_t cycles, hits = 0;
+	struct html_tag tag;
+	entity key;
+	guint i;
+
+	rspamd_html_library_init ();
+
+	for (cycles = 0; cycles < niters; cycles ++) {
+		for (i = 0; i < G_N_ELEMENTS (tag_defs); i ++) {
+			tag.name.start = tag_defs[i].name;
+			tag.name.len = strlen (tag_defs[i].name);
+
+			if (generic) {
+				hits += bsearch (&tag, tag_defs, G_N_ELEMENTS (tag_defs),
+						sizeof (tag_defs[0]), tag_find) != NULL;
+			}
+			else {
+				hits += rspamd_html_phash_lookup (&tags_phash, tag.name.start,
+						tag.name.len) != -1;
+			}
+		}
+
+		for (i = 0; i < G_N_ELEMENTS (entities_defs); i ++) {
+			key.name = entities_defs[i].name;
+
+			if (generic) {
+				hits += bsearch (&key, entities_defs,
+						G_N_ELEMENTS (entities_defs), sizeof (entity),
+						entity_cmp) != NULL;
+			}
+			else {
+				hits += rspamd_html_entity_by_name (key.name,
+						strlen (key.name)) != NULL;
+			}
+		}
+
+		for (i = 0; i < G_N_ELEMENTS (html_colornames); i ++) {
+			if (generic) {
+				hits += bsearch (html_colornames[i].name, html_colornames,
+						G_N_ELEMENTS (html_colornames), sizeof (html_colornames[0]),
+						color_find) != NULL;
+			}
+			else {
+				hits += rspamd_html_phash_lookup (&colors_phash,
+						html_colornames[i].name,
+						strlen (html_colornames[i].name)) != -1;
+			}
+		}
+	}
+
+	return hits;
+}
@@ -96,16 +96,16 @@ struct html_tag {
 	gsize content_length;
 	const gchar *content;
 	struct html_tag_component name;
-	GQueue *params;
+	GQueue params; /** Components, links are allocated from the pool */
 	gpointer extra; /** Additional data associated with tag (e.g. image) */
-	GNode *parent;
+	struct html_tag *parent; /** Enclosing block tag or NULL for the top level */
 };
 
 /* Forwarded declaration */
 struct rspamd_task;
 
 struct html_content {
-	GNode *html_tags;
+	GPtrArray *tags; /** Non-inline tags in document order */
 	gint flags;
 	struct html_color bgcolor;
 	guchar *tags_seen;
@@ -23,6 +23,7 @@
 #include "libutil/util.h"
 #include "libutil/regexp.h"
 #include "lua/lua_common.h"
+#include <math.h>
 #ifdef WITH_HYPERSCAN
 #include "hs.h"
 #include "unix-std.h"
@@ -61,6 +62,15 @@
         G_STRFUNC, \
         __VA_ARGS__)
 
+/*
+ * Scanning of the whole class by hyperscan costs about as much as this number
+ * of individual pcre runs over the same data
+ */
+#define RSPAMD_RE_CACHE_HS_COST 4.0
+/* Number of tasks to learn requests statistics for a class */
+#define RSPAMD_RE_CACHE_LAZY_WARMUP 100
+#define RSPAMD_RE_CACHE_LAZY_WINDOW 10000
+
 #ifdef WITH_HYPERSCAN
 #define RSPAMD_HS_MAGIC_LEN (sizeof (rspamd_hs_magic))
 static const guchar rspamd_hs_magic[] = {'r', 's', 'h', 's', 'r', 'e', '1', '1'},
@@ -81,6 +91,9 @@ struct rspamd_re_class {
 	gint *hs_ids;
 	guint nhs;
 #endif
+	/* Average number of regexps requested from this class per task */
+	gdouble avg_requests;
+	guint64 ntasks;
 };
 
 enum rspamd_re_cache_elt_match_type {
@@ -109,14 +122,28 @@ struct rspamd_re_cache {
 #endif
 };
 
+struct rspamd_re_class_input {
+	guint64 id;
+	const guchar **scvec;
+	guint *lenvec;
+	guint cnt;
+	gboolean raw;
+};
+
 struct rspamd_re_runtime {
 	guchar *checked;
 	guchar *results;
+	guchar *requested;
+	GHashTable *inputs;
+	GHashTable *requests;
+	GHashTable *lazy_runs;
 	struct rspamd_re_cache *cache;
 	struct rspamd_re_cache_stat stat;
 	gboolean has_hs;
 };
 
+static void rspamd_re_cache_class_input_dtor (gpointer p);
+
 static GQuark
 rspamd_re_cache_quark (void)
 {
@@ -460,8 +487,13 @@ rspamd_re_cache_runtime_new (struct rspamd_re_cache *cache)
 	rt->cache = cache;
 	REF_RETAIN (cache);
 	rt->checked = g_slice_alloc0 (NBYTES (cache->nre));
+	rt->requested = g_slice_alloc0 (NBYTES (cache->nre));
 	rt->results = g_slice_alloc0 (cache->nre);
 	rt->stat.regexp_total = cache->nre;
+	rt->inputs = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+			NULL, rspamd_re_cache_class_input_dtor);
+	rt->requests = g_hash_table_new (g_direct_hash, g_direct_equal);
+	rt->lazy_runs = g_hash_table_new (g_direct_hash, g_direct_equal);
 #ifdef WITH_HYPERSCAN
 	rt->has_hs = cache->hyperscan_loaded;
 #endif
@@ -620,7 +652,8 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 		rspamd_regexp_t *re, struct rspamd_task *task,
 		const guchar **in, guint *lens,
 		guint count,
-		gboolean is_raw)
+		gboolean is_raw,
+		gboolean force_pcre)
 {
 
 	guint64 re_id;
@@ -657,7 +690,7 @@ rspamd_re_cache_process_regexp_data (struct rspamd_re_runtime *rt,
 	re_class = rspamd_regexp_get_class (re);
 
 	if (rt->cache->disable_hyperscan || elt->match_type == RSPAMD_RE_CACHE_PCRE ||
-			!rt->has_hs) {
+			!rt->has_hs || force_pcre) {
 		for (i = 0; i < count; i++) {
 			ret = rspamd_re_cache_process_pcre (rt,
 					re,
@@ -745,222 +778,163 @@ rspamd_re_cache_finish_class (struct rspamd_re_runtime *rt,
 #endif
 }
 
+static void
+rspamd_re_cache_class_input_dtor (gpointer p)
+{
+	struct rspamd_re_class_input *inp = p;
+
+	g_free (inp->scvec);
+	g_free (inp->lenvec);
+	g_slice_free1 (sizeof (*inp), inp);
+}
+
 /*
- * Calculates the specified regexp for the specified class if it's not calculated
+ * Collects all buffers that should be scanned for the specified class
  */
-static guint
-rspamd_re_cache_exec_re (struct rspamd_task *task,
-		struct rspamd_re_runtime *rt,
-		rspamd_regexp_t *re,
+static struct rspamd_re_class_input *
+rspamd_re_cache_collect_input (struct rspamd_task *task,
 		struct rspamd_re_class *re_class,
 		gboolean is_strong)
 {
-	guint ret = 0, i, re_id;
+	struct rspamd_re_class_input *inp;
 	GPtrArray *headerlist;
 	GHashTableIter it;
 	struct rspamd_mime_header *rh;
 	const gchar *in, *end;
-	const guchar **scvec;
-	guint *lenvec;
-	gboolean raw = FALSE;
 	struct rspamd_mime_text_part *part;
 	struct rspamd_url *url;
 	gpointer k, v;
-	guint len, cnt;
+	guint i, cnt;
 
-	msg_debug_re_task ("check re type: %s: /%s/",
-			rspamd_re_cache_type_to_string (re_class->type),
-			rspamd_regexp_get_pattern (re));
-	re_id = rspamd_regexp_get_cache_id (re);
+	inp = g_slice_alloc0 (sizeof (*inp));
 
 	switch (re_class->type) {
 	case RSPAMD_RE_HEADER:
 	case RSPAMD_RE_RAWHEADER:
+	case RSPAMD_RE_MIMEHEADER:
 		/* Get list of specified headers */
-		headerlist = rspamd_message_get_header_array (task,
-				re_class->type_data,
-				is_strong);
+		if (re_class->type == RSPAMD_RE_MIMEHEADER) {
+			headerlist = rspamd_message_get_mime_header_array (task,
+					re_class->type_data,
+					is_strong);
+		}
+		else {
+			headerlist = rspamd_message_get_header_array (task,
+					re_class->type_data,
+					is_strong);
+		}
 
 		if (headerlist && headerlist->len > 0) {
-			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
-			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
+			cnt = headerlist->len;
+			inp->scvec = g_malloc (sizeof (*inp->scvec) * cnt);
+			inp->lenvec = g_malloc (sizeof (*inp->lenvec) * cnt);
 
-			for (i = 0; i < headerlist->len; i ++) {
+			for (i = 0; i < cnt; i ++) {
 				rh = g_ptr_array_index (headerlist, i);
 
 				if (re_class->type == RSPAMD_RE_RAWHEADER) {
 					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
+					inp->raw = TRUE;
+					inp->lenvec[i] = strlen (rh->value);
 				}
 				else {
 					in = rh->decoded;
 					/* Validate input */
 					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
+						inp->lenvec[i] = 0;
+						inp->scvec[i] = (guchar *)"";
 						continue;
 					}
-					lenvec[i] = end - in;
+					inp->lenvec[i] = end - in;
 				}
 
-				scvec[i] = (guchar *)in;
+				inp->scvec[i] = (guchar *)in;
 			}
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, headerlist->len, raw);
-			msg_debug_re_task ("checking header %s regexp: %s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			inp->cnt = cnt;
 		}
 		break;
 	case RSPAMD_RE_ALLHEADER:
-		raw = TRUE;
-		in = task->raw_headers_content.begin;
-		len = task->raw_headers_content.len;
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, (const guchar **)&in, &len, 1, raw);
-		msg_debug_re_task ("checking allheader regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
-		break;
-	case RSPAMD_RE_MIMEHEADER:
-		headerlist = rspamd_message_get_mime_header_array (task,
-				re_class->type_data,
-				is_strong);
-
-		if (headerlist && headerlist->len > 0) {
-			scvec = g_malloc (sizeof (*scvec) * headerlist->len);
-			lenvec = g_malloc (sizeof (*lenvec) * headerlist->len);
-
-			for (i = 0; i < headerlist->len; i ++) {
-				rh = g_ptr_array_index (headerlist, i);
-
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-					lenvec[i] = strlen (rh->value);
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, &end)) {
-						lenvec[i] = 0;
-						scvec[i] = (guchar *)"";
-						continue;
-					}
-					lenvec[i] = end - in;
-				}
-
-				scvec[i] = (guchar *)in;
-			}
+	case RSPAMD_RE_BODY:
+		inp->raw = TRUE;
+		inp->scvec = g_malloc (sizeof (*inp->scvec));
+		inp->lenvec = g_malloc (sizeof (*inp->lenvec));
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, headerlist->len, raw);
-			msg_debug_re_task ("checking mime header %s regexp: %s -> %d",
-					re_class->type_data,
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+		if (re_class->type == RSPAMD_RE_ALLHEADER) {
+			inp->scvec[0] = (guchar *)task->raw_headers_content.begin;
+			inp->lenvec[0] = task->raw_headers_content.len;
 		}
+		else {
+			inp->scvec[0] = (guchar *)task->msg.begin;
+			inp->lenvec[0] = task->msg.len;
+		}
+
+		inp->cnt = 1;
 		break;
 	case RSPAMD_RE_MIME:
 	case RSPAMD_RE_RAWMIME:
 		/* Iterate through text parts */
 		if (task->text_parts->len > 0) {
 			cnt = task->text_parts->len;
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
+			inp->scvec = g_malloc (sizeof (*inp->scvec) * cnt);
+			inp->lenvec = g_malloc (sizeof (*inp->lenvec) * cnt);
 
-			for (i = 0; i < task->text_parts->len; i++) {
+			for (i = 0; i < cnt; i++) {
 				part = g_ptr_array_index (task->text_parts, i);
 
 				/* Skip empty parts */
 				if (IS_PART_EMPTY (part)) {
-					lenvec[i] = 0;
-					scvec[i] = (guchar *) "";
+					inp->lenvec[i] = 0;
+					inp->scvec[i] = (guchar *) "";
 					continue;
 				}
 
 				/* Check raw flags */
 				if (!IS_PART_UTF (part)) {
-					raw = TRUE;
+					inp->raw = TRUE;
 				}
 				/* Select data for regexp */
 				if (re_class->type == RSPAMD_RE_RAWMIME) {
-					in = part->raw.begin;
-					len = part->raw.len;
-					raw = TRUE;
+					inp->scvec[i] = (guchar *)part->raw.begin;
+					inp->lenvec[i] = part->raw.len;
+					inp->raw = TRUE;
 				}
 				else {
-					in = part->content->data;
-					len = part->content->len;
+					inp->scvec[i] = (guchar *)part->content->data;
+					inp->lenvec[i] = part->content->len;
 				}
-
-				scvec[i] = (guchar *) in;
-				lenvec[i] = len;
 			}
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, raw);
-			msg_debug_re_task ("checking mime regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			inp->cnt = cnt;
 		}
 		break;
 	case RSPAMD_RE_URL:
 		cnt = g_hash_table_size (task->urls) + g_hash_table_size (task->emails);
 
 		if (cnt > 0) {
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
+			inp->scvec = g_malloc (sizeof (*inp->scvec) * cnt);
+			inp->lenvec = g_malloc (sizeof (*inp->lenvec) * cnt);
 			g_hash_table_iter_init (&it, task->urls);
 			i = 0;
 
 			while (g_hash_table_iter_next (&it, &k, &v)) {
 				url = v;
-				in = url->string;
-				len = url->urllen;
-				raw = FALSE;
-
-				scvec[i] = (guchar *)in;
-				lenvec[i++] = len;
+				inp->scvec[i] = (guchar *)url->string;
+				inp->lenvec[i++] = url->urllen;
 			}
 
 			g_hash_table_iter_init (&it, task->emails);
 
 			while (g_hash_table_iter_next (&it, &k, &v)) {
 				url = v;
-				in = url->string;
-				len = url->urllen;
-				raw = FALSE;
-
-				scvec[i] = (guchar *) in;
-				lenvec[i++] = len;
+				inp->scvec[i] = (guchar *)url->string;
+				inp->lenvec[i++] = url->urllen;
 			}
 
 			g_assert (i == cnt);
-
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, i, raw);
-			msg_debug_re_task ("checking url regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			inp->cnt = cnt;
 		}
 		break;
-	case RSPAMD_RE_BODY:
-		raw = TRUE;
-		in = task->msg.begin;
-		len = task->msg.len;
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re, task,
-				(const guchar **)&in, &len, 1, raw);
-		msg_debug_re_task ("checking rawbody regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
-		break;
 	case RSPAMD_RE_SABODY:
 		/* According to SA docs:
 		 * The 'body' in this case is the textual parts of the message body;
@@ -971,8 +945,9 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		 * be removed before matching.
 		 */
 		cnt = task->text_parts->len + 1;
-		scvec = g_malloc (sizeof (*scvec) * cnt);
-		lenvec = g_malloc (sizeof (*lenvec) * cnt);
+		inp->scvec = g_malloc (sizeof (*inp->scvec) * cnt);
+		inp->lenvec = g_malloc (sizeof (*inp->lenvec) * cnt);
+		inp->raw = TRUE;
 
 		/*
 		 * Body rules also include the Subject as the first line
@@ -984,32 +959,27 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		if (headerlist && headerlist->len > 0) {
 			rh = g_ptr_array_index (headerlist, 0);
 
-			scvec[0] = (guchar *)rh->decoded;
-			lenvec[0] = strlen (rh->decoded);
+			inp->scvec[0] = (guchar *)rh->decoded;
+			inp->lenvec[0] = strlen (rh->decoded);
 		}
 		else {
-			scvec[0] = (guchar *)"";
-			lenvec[0] = 0;
+			inp->scvec[0] = (guchar *)"";
+			inp->lenvec[0] = 0;
 		}
 		for (i = 0; i < task->text_parts->len; i++) {
 			part = g_ptr_array_index (task->text_parts, i);
 
 			if (part->stripped_content) {
-				scvec[i + 1] = (guchar *)part->stripped_content->data;
-				lenvec[i + 1] = part->stripped_content->len;
+				inp->scvec[i + 1] = (guchar *)part->stripped_content->data;
+				inp->lenvec[i + 1] = part->stripped_content->len;
 			}
 			else {
-				scvec[i + 1] = (guchar *)"";
-				lenvec[i + 1] = 0;
+				inp->scvec[i + 1] = (guchar *)"";
+				inp->lenvec[i + 1] = 0;
 			}
 		}
 
-		ret = rspamd_re_cache_process_regexp_data (rt, re,
-				task, scvec, lenvec, cnt, TRUE);
-		msg_debug_re_task ("checking sa body regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
-		g_free (scvec);
-		g_free (lenvec);
+		inp->cnt = cnt;
 		break;
 	case RSPAMD_RE_SARAWBODY:
 		/* According to SA docs:
@@ -1021,38 +991,118 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 		 */
 		if (task->text_parts->len > 0) {
 			cnt = task->text_parts->len;
-			scvec = g_malloc (sizeof (*scvec) * cnt);
-			lenvec = g_malloc (sizeof (*lenvec) * cnt);
+			inp->scvec = g_malloc (sizeof (*inp->scvec) * cnt);
+			inp->lenvec = g_malloc (sizeof (*inp->lenvec) * cnt);
+			inp->raw = TRUE;
 
-			for (i = 0; i < task->text_parts->len; i++) {
+			for (i = 0; i < cnt; i++) {
 				part = g_ptr_array_index (task->text_parts, i);
 
 				if (part->parsed.len > 0) {
-					scvec[i] = (guchar *)part->parsed.begin;
-					lenvec[i] = part->parsed.len;
+					inp->scvec[i] = (guchar *)part->parsed.begin;
+					inp->lenvec[i] = part->parsed.len;
 				}
 				else {
-					scvec[i] = (guchar *)"";
-					lenvec[i] = 0;
+					inp->scvec[i] = (guchar *)"";
+					inp->lenvec[i] = 0;
 				}
 			}
 
-			ret = rspamd_re_cache_process_regexp_data (rt, re,
-					task, scvec, lenvec, cnt, TRUE);
-			msg_debug_re_task ("checking sa rawbody regexp: %s -> %d",
-					rspamd_regexp_get_pattern (re), ret);
-			g_free (scvec);
-			g_free (lenvec);
+			inp->cnt = cnt;
 		}
 		break;
 	case RSPAMD_RE_MAX:
+		break;
+	}
+
+	return inp;
+}
+
+/*
+ * If we expect that only a few regexps of this class are going to be
+ * requested in this task (e.g. expressions are short-circuited early), then
+ * it is cheaper to run the requested regexp alone than to scan the whole
+ * class with hyperscan. Once a task requests more regexps than usual or
+ * single runs have cost as much as a scan, the whole class is scanned
+ */
+static gboolean
+rspamd_re_cache_class_is_lazy (struct rspamd_re_class *re_class,
+		guint requests, guint lazy_runs)
+{
+	if (re_class->ntasks <= RSPAMD_RE_CACHE_LAZY_WARMUP) {
+		return FALSE;
+	}
+
+	if (lazy_runs >= RSPAMD_RE_CACHE_HS_COST ||
+			requests > ceil (re_class->avg_requests)) {
+		return FALSE;
+	}
+
+	return re_class->avg_requests - requests + 1 < RSPAMD_RE_CACHE_HS_COST;
+}
+
+/*
+ * Calculates the specified regexp for the specified class if it's not calculated
+ */
+static guint
+rspamd_re_cache_exec_re (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re,
+		struct rspamd_re_class *re_class,
+		gboolean is_strong)
+{
+	guint ret = 0, re_id, requests, lazy_runs;
+	struct rspamd_re_class_input *inp;
+	guint64 input_id;
+	gboolean lazy = FALSE;
+
+	msg_debug_re_task ("check re type: %s: /%s/",
+			rspamd_re_cache_type_to_string (re_class->type),
+			rspamd_regexp_get_pattern (re));
+	re_id = rspamd_regexp_get_cache_id (re);
+
+	if (re_class->type == RSPAMD_RE_MAX) {
 		msg_err_task ("regexp of class invalid has been called: %s",
 				rspamd_regexp_get_pattern (re));
-		break;
+		setbit (rt->checked, re_id);
+
+		return 0;
+	}
+
+	/*
+	 * All regexps of a class are matched against the same buffers, so we
+	 * collect them once per task and reuse them for every regexp (and for
+	 * every database scan) of this class
+	 */
+	input_id = re_class->id ^ (is_strong ? 1 : 0);
+	inp = g_hash_table_lookup (rt->inputs, &input_id);
+
+	if (inp == NULL) {
+		inp = rspamd_re_cache_collect_input (task, re_class, is_strong);
+		inp->id = input_id;
+		g_hash_table_insert (rt->inputs, &inp->id, inp);
+	}
+
+	requests = GPOINTER_TO_UINT (g_hash_table_lookup (rt->requests, re_class));
+	lazy_runs = GPOINTER_TO_UINT (g_hash_table_lookup (rt->lazy_runs,
+			re_class));
+
+	if (rspamd_re_cache_class_is_lazy (re_class, requests, lazy_runs)) {
+		lazy = TRUE;
+		g_hash_table_insert (rt->lazy_runs, re_class,
+				GUINT_TO_POINTER (lazy_runs + 1));
+	}
+
+	if (inp->cnt > 0) {
+		ret = rspamd_re_cache_process_regexp_data (rt, re,
+				task, inp->scvec, inp->lenvec, inp->cnt, inp->raw, lazy);
+		msg_debug_re_task ("checking %s regexp: %s -> %d",
+				rspamd_re_cache_type_to_string (re_class->type),
+				rspamd_regexp_get_pattern (re), ret);
 	}
 
 #if WITH_HYPERSCAN
-	if (!rt->cache->disable_hyperscan && rt->has_hs) {
+	if (!rt->cache->disable_hyperscan && rt->has_hs && !lazy) {
 		rspamd_re_cache_finish_class (rt, re_class);
 	}
 #endif
@@ -1089,6 +1139,18 @@ rspamd_re_cache_process (struct rspamd_task *task,
 		return 0;
 	}
 
+	if (!isset (rt->requested, re_id)) {
+		/* Count distinct regexps requested from each class */
+		re_class = rspamd_regexp_get_class (re);
+
+		if (re_class != NULL) {
+			setbit (rt->requested, re_id);
+			g_hash_table_insert (rt->requests, re_class, GUINT_TO_POINTER (
+					GPOINTER_TO_UINT (g_hash_table_lookup (rt->requests,
+							re_class)) + 1));
+		}
+	}
+
 	if (isset (rt->checked, re_id)) {
 		/* Fast path */
 		rt->stat.regexp_fast_cached ++;
@@ -1130,13 +1192,90 @@ rspamd_re_cache_process_ffi (void *ptask,
 			type, type_data, typelen, is_strong);
 }
 
+guint
+rspamd_re_cache_process_headers (struct rspamd_task *task)
+{
+	guint nclasses = 0;
+#ifdef WITH_HYPERSCAN
+	struct rspamd_re_runtime *rt;
+	struct rspamd_re_class *re_class;
+	struct rspamd_re_cache_elt *elt;
+	GHashTableIter it;
+	gpointer k, v;
+
+	g_assert (task != NULL);
+	rt = task->re_rt;
+
+	if (rt == NULL || rt->cache->disable_hyperscan || !rt->has_hs) {
+		return 0;
+	}
+
+	g_hash_table_iter_init (&it, rt->cache->re_classes);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
+
+		if (re_class->type != RSPAMD_RE_HEADER &&
+				re_class->type != RSPAMD_RE_RAWHEADER &&
+				re_class->type != RSPAMD_RE_ALLHEADER) {
+			continue;
+		}
+
+		if (re_class->hs_db == NULL || re_class->nhs == 0 ||
+				isset (rt->checked, re_class->hs_ids[0])) {
+			continue;
+		}
+
+		/* Classes that are usually checked lazily are not worth a full scan */
+		if (re_class->ntasks > RSPAMD_RE_CACHE_LAZY_WARMUP &&
+				re_class->avg_requests + 1 < RSPAMD_RE_CACHE_HS_COST) {
+			continue;
+		}
+
+		/* Scanning with any regexp of a class fills results for the whole class */
+		elt = g_ptr_array_index (rt->cache->re, re_class->hs_ids[0]);
+		rspamd_re_cache_exec_re (task, rt, elt->re, re_class, FALSE);
+		nclasses ++;
+	}
+
+	msg_debug_re_task ("prefetched %ud headers classes", nclasses);
+#endif
+
+	return nclasses;
+}
+
 void
 rspamd_re_cache_runtime_destroy (struct rspamd_re_runtime *rt)
 {
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	guint requests;
+
 	g_assert (rt != NULL);
 
+	/* Update requests statistics for classes used in this task */
+	g_hash_table_iter_init (&it, rt->requests);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = k;
+		requests = GPOINTER_TO_UINT (v);
+
+		if (re_class->ntasks < RSPAMD_RE_CACHE_LAZY_WINDOW) {
+			re_class->ntasks ++;
+		}
+
+		re_class->avg_requests += (requests - re_class->avg_requests) /
+				(gdouble)re_class->ntasks;
+	}
+
+	g_hash_table_unref (rt->requests);
+	g_hash_table_unref (rt->lazy_runs);
+	g_slice_free1 (NBYTES (rt->cache->nre), rt->requested);
+
 	g_slice_free1 (NBYTES (rt->cache->nre), rt->checked);
 	g_slice_free1 (rt->cache->nre, rt->results);
+	g_hash_table_unref (rt->inputs);
 	REF_RELEASE (rt->cache);
 	g_slice_free1 (sizeof (*rt), rt);
 }
@@ -1351,6 +1490,16 @@ gint
 rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir, gdouble max_time, gboolean silent,
 		GError **err)
+{
+	return rspamd_re_cache_compile_hyperscan_part (cache, cache_dir, max_time,
+			silent, 0, 1, err);
+}
+
+gint
+rspamd_re_cache_compile_hyperscan_part (struct rspamd_re_cache *cache,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		guint part, guint nparts,
+		GError **err)
 {
 	g_assert (cache != NULL);
 	g_assert (cache_dir != NULL);
@@ -1379,6 +1528,11 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
 		re_class = v;
+
+		if (nparts > 1 && re_class->id % nparts != part) {
+			continue;
+		}
+
 		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
 				G_DIR_SEPARATOR, re_class->hash);
 
@@ -1837,6 +1991,7 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 #else
 	gchar path[PATH_MAX];
 	gint fd, i, n, *hs_ids = NULL, *hs_flags = NULL, total = 0, ret;
+	guint nmissing = 0;
 	GHashTableIter it;
 	gpointer k, v;
 	guint8 *map, *p, *end;
@@ -1848,10 +2003,17 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
 		re_class = v;
+
+		if (re_class->hs_db != NULL) {
+			/* Already loaded on the previous notification */
+			total += re_class->nhs;
+			continue;
+		}
+
 		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
 				G_DIR_SEPARATOR, re_class->hash);
 
-		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, FALSE, FALSE)) {
+		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path, TRUE, FALSE)) {
 			msg_debug_re_cache ("load hyperscan database from '%s'",
 					re_class->hash);
 
@@ -1949,15 +2111,50 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 			re_class->nhs = n;
 		}
 		else {
-			msg_err_re_cache ("invalid hyperscan hash file '%s'",
+			/* Not compiled yet, this class is still matched by pcre */
+			msg_debug_re_cache ("no valid hyperscan database for class in '%s'",
 					path);
-			return FALSE;
+			nmissing ++;
 		}
 	}
 
-	msg_info_re_cache ("hyperscan database of %d regexps has been loaded", total);
+	if (total == 0) {
+		msg_info_re_cache ("no hyperscan databases have been loaded from %s",
+				cache_dir);
+
+		return FALSE;
+	}
+
+	msg_info_re_cache ("hyperscan database of %d regexps has been loaded, "
+			"%ud classes are still pending compilation", total, nmissing);
 	cache->hyperscan_loaded = TRUE;
 
 	return TRUE;
 #endif
 }
+
+/*
+ * Returns the number of regexps that are run alone when a task requests
+ * `nrequests` regexps of a class with the specified average of requests
+ */
+guint
+re_cache_lazy_test (gdouble avg_requests, guint nrequests)
+{
+	struct rspamd_re_class re_class;
+	guint i, lazy_runs = 0;
+
+	memset (&re_class, 0, sizeof (re_class));
+	re_class.avg_requests = avg_requests;
+	re_class.ntasks = RSPAMD_RE_CACHE_LAZY_WINDOW;
+
+	for (i = 1; i <= nrequests; i ++) {
+		if (!rspamd_re_cache_class_is_lazy (&re_class, i, lazy_runs)) {
+			/* The whole class is scanned, so other regexps are cached */
+			break;
+		}
+
+		lazy_runs ++;
+	}
+
+	return lazy_runs;
+}
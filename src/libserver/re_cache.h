@@ -121,6 +121,14 @@ int rspamd_re_cache_process_ffi (void *ptask,
 		void *type_data,
 		int is_strong);
 
+/**
+ * Scan message headers with all hyperscan classes of headers regexps, so
+ * the results are ready when regexps are requested
+ * @param task task object with parsed headers
+ * @return number of classes scanned
+ */
+guint rspamd_re_cache_process_headers (struct rspamd_task *task);
+
 /**
  * Destroy runtime data
  */
@@ -157,6 +165,16 @@ gint rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir, gdouble max_time, gboolean silent,
 		GError **err);
 
+/**
+ * Compile a part of classes to the hyperscan tree: only classes whose id
+ * modulo `nparts` is equal to `part` are processed, so disjoint parts could
+ * be compiled by several processes in parallel
+ */
+gint rspamd_re_cache_compile_hyperscan_part (struct rspamd_re_cache *cache,
+		const char *cache_dir, gdouble max_time, gboolean silent,
+		guint part, guint nparts,
+		GError **err);
+
 
 /**
  * Returns TRUE if the specified file is valid hyperscan cache
@@ -165,7 +183,9 @@ gboolean rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 		const char *path, gboolean silent, gboolean try_load);
 
 /**
- * Loads all hyperscan regexps precompiled
+ * Loads all hyperscan regexps precompiled. Classes that have no valid
+ * database yet are skipped and left to pcre, so this function could be
+ * called multiple times as databases become ready
  */
 gboolean rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir);
@@ -42,7 +42,12 @@
         G_STRFUNC, \
         __VA_ARGS__)
 
-static const guchar rspamd_symbols_cache_magic[8] = {'r', 's', 'c', 2, 0, 0, 0, 0 };
+static const guchar rspamd_symbols_cache_magic[8] = {'r', 's', 'c', 3, 0, 0, 0, 0 };
+static const guchar rspamd_symbols_cache_legacy_magic[8] = {'r', 's', 'c', 2, 0, 0, 0, 0 };
+static const guint64 rspamd_symbols_cache_profile_seed = 0xdeadbabe;
+
+/* Log2 buckets of execution time in microseconds */
+#define RSPAMD_SYMBOLS_CACHE_HIST_BUCKETS 16
 
 static gint rspamd_symbols_cache_find_symbol_parent (struct symbols_cache *cache,
 		const gchar *name);
@@ -54,8 +59,28 @@ struct rspamd_symbols_cache_header {
 	guchar unused[128];
 };
 
+struct counter_data {
+	gdouble mean;
+	gdouble stddev;
+	guint64 number;
+};
+
+/* Saved profile of a cache item */
+struct rspamd_symbols_cache_profile {
+	guint64 id;
+	struct counter_data time_counter;
+	struct counter_data frequency_counter;
+	guint64 total_hits;
+	guint64 total_checks;
+	guint32 time_hist[RSPAMD_SYMBOLS_CACHE_HIST_BUCKETS];
+	gint32 frequency_peaks;
+	gfloat max_score;
+};
+
 struct symbols_cache_order {
 	GPtrArray *d;
+	/* Maximum positive score that could be added by items starting from i */
+	gdouble *potential;
 	ref_entry_t ref;
 };
 
@@ -78,12 +103,8 @@ struct symbols_cache {
 	rspamd_mempool_mutex_t *mtx;
 	gdouble reload_time;
 	gint peak_cb;
-};
-
-struct counter_data {
-	gdouble mean;
-	gdouble stddev;
-	guint64 number;
+	/* Maximum scores of inserted symbols that have no cache items */
+	GHashTable *uncached_scores;
 };
 
 struct item_stat {
@@ -92,9 +113,14 @@ struct item_stat {
 	gdouble weight;
 	guint hits;
 	guint64 total_hits;
+	guint checks;
+	guint64 total_checks;
 	struct counter_data frequency_counter;
 	gdouble avg_frequency;
 	gdouble stddev_frequency;
+	guint time_hist[RSPAMD_SYMBOLS_CACHE_HIST_BUCKETS];
+	/* Maximum score of the symbol in a task, including dynamic multipliers */
+	gdouble max_score;
 };
 
 struct cache_item {
@@ -122,6 +148,12 @@ struct cache_item {
 	gint priority;
 	gint id;
 	gint frequency_peaks;
+	/* Probability of inserting a symbol when checked */
+	gdouble hit_prob;
+	/* Maximum positive score this item (and its virtual symbols) can add */
+	gdouble potential;
+	/* Depth in the dependencies graph: 0 for items without dependencies */
+	guint dep_level;
 
 	/* Dependencies */
 	GPtrArray *deps;
@@ -160,6 +192,8 @@ struct cache_savepoint {
 	guint version;
 	struct rspamd_metric_result *rs;
 	gdouble lim;
+	gdouble ham_lim;
+	gboolean ham_lim_checked;
 	GPtrArray *waitq;
 	struct symbols_cache_order *order;
 };
@@ -209,6 +243,7 @@ rspamd_symbols_cache_order_dtor (gpointer p)
 	struct symbols_cache_order *ord = p;
 
 	g_ptr_array_free (ord->d, TRUE);
+	g_free (ord->potential);
 	g_slice_free1 (sizeof (*ord), ord);
 }
 
@@ -227,6 +262,7 @@ rspamd_symbols_cache_order_new (gsize nelts)
 
 	ord = g_slice_alloc (sizeof (*ord));
 	ord->d = g_ptr_array_sized_new (nelts);
+	ord->potential = NULL;
 	REF_INIT_RETAIN (ord, rspamd_symbols_cache_order_dtor);
 
 	return ord;
@@ -280,25 +316,24 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 	struct symbols_cache *cache = ud;
 	double w1, w2;
 	double weight1, weight2;
-	double f1 = 0, f2 = 0, t1, t2, avg_freq, avg_weight;
-
-	if (i1->deps->len != 0 || i2->deps->len != 0) {
-		/* TODO: handle complex dependencies */
-		w1 = 1.0;
-		w2 = 1.0;
+	double f1 = 0, f2 = 0, t1, t2, avg_weight;
 
-		if (i1->deps->len != 0) {
-			w1 = 1.0 / (i1->deps->len);
-		}
-		if (i2->deps->len != 0) {
-			w2 = 1.0 / (i2->deps->len);
-		}
+	if (i1->dep_level != i2->dep_level) {
+		/*
+		 * Items are sorted topologically: dependencies must always be
+		 * scheduled before their dependents
+		 */
+		w1 = -((gdouble)i1->dep_level);
+		w2 = -((gdouble)i2->dep_level);
 	}
 	else if (i1->priority == i2->priority) {
-		avg_freq = ((gdouble)cache->total_hits / cache->used_items);
+		/*
+		 * Expected score gained per microsecond of CPU: items that are
+		 * likely to fire with high weight and that are cheap go first
+		 */
 		avg_weight = (cache->total_weight / cache->used_items);
-		f1 = (double)i1->st->total_hits / avg_freq;
-		f2 = (double)i2->st->total_hits / avg_freq;
+		f1 = i1->hit_prob;
+		f2 = i2->hit_prob;
 		weight1 = fabs (i1->st->weight) / avg_weight;
 		weight2 = fabs (i2->st->weight) / avg_weight;
 		t1 = i1->st->avg_time;
@@ -322,6 +357,46 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 	return 0;
 }
 
+static inline guint
+rspamd_symbols_cache_hist_bucket (gdouble usec)
+{
+	guint64 v = usec;
+	guint b = 0;
+
+	while (v > 1 && b < RSPAMD_SYMBOLS_CACHE_HIST_BUCKETS - 1) {
+		v >>= 1;
+		b ++;
+	}
+
+	return b;
+}
+
+/* Returns upper bound (in microseconds) of the time quantile q */
+static gdouble
+rspamd_symbols_cache_hist_quantile (struct item_stat *st, gdouble q)
+{
+	guint64 total = 0, cur = 0;
+	guint i;
+
+	for (i = 0; i < RSPAMD_SYMBOLS_CACHE_HIST_BUCKETS; i ++) {
+		total += st->time_hist[i];
+	}
+
+	if (total == 0) {
+		return 0;
+	}
+
+	for (i = 0; i < RSPAMD_SYMBOLS_CACHE_HIST_BUCKETS; i ++) {
+		cur += st->time_hist[i];
+
+		if (cur >= total * q) {
+			break;
+		}
+	}
+
+	return (gdouble)(1ULL << (MIN (i, RSPAMD_SYMBOLS_CACHE_HIST_BUCKETS - 1) + 1));
+}
+
 /**
  * Set counter for a symbol
  */
@@ -343,12 +418,118 @@ rspamd_set_counter (struct counter_data *cd, gdouble value)
 	return cd->mean;
 }
 
+/*
+ * Estimates hit probability and maximum score for each item, virtual symbols
+ * are accounted in their parents as they are inserted by parent's callback
+ */
+static void
+rspamd_symbols_cache_update_estimations (struct symbols_cache *cache)
+{
+	struct cache_item *it, *parent;
+	guint i;
+	guint64 *hits;
+	gdouble avg_freq, score;
+
+	hits = g_malloc0 (cache->items_by_id->len * sizeof (*hits));
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		it = g_ptr_array_index (cache->items_by_id, i);
+		it->potential = 0;
+	}
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		it = g_ptr_array_index (cache->items_by_id, i);
+		parent = it;
+
+		if (it->parent != -1) {
+			parent = g_ptr_array_index (cache->items_by_id, it->parent);
+		}
+
+		hits[parent->id] += it->st->total_hits;
+		/* Symbols can be inserted with multipliers greater than one */
+		score = MAX (it->st->weight, it->st->max_score);
+
+		if (score > 0) {
+			parent->potential += score;
+		}
+	}
+
+	avg_freq = ((gdouble)cache->total_hits / cache->used_items);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		it = g_ptr_array_index (cache->items_by_id, i);
+
+		if (it->st->total_checks > 0) {
+			it->hit_prob = (gdouble)hits[i] / it->st->total_checks;
+
+			if (it->hit_prob > 1.0) {
+				it->hit_prob = 1.0;
+			}
+		}
+		else {
+			/* No checks information, fallback to the relative frequency */
+			it->hit_prob = (gdouble)hits[i] / avg_freq;
+		}
+	}
+
+	g_free (hits);
+}
+
+/*
+ * Symbols without cache items could be inserted by any rule, so their score
+ * is always possible
+ */
+static gdouble
+rspamd_symbols_cache_uncached_potential (struct symbols_cache *cache)
+{
+	struct rspamd_metric *metric = cache->cfg->default_metric;
+	struct rspamd_symbol *sdef;
+	GHashTableIter it;
+	gpointer k, v;
+	gdouble res = 0, score, *pmax;
+
+	if (metric != NULL) {
+		g_hash_table_iter_init (&it, metric->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+
+			if (g_hash_table_lookup (cache->items_by_symbol, k) != NULL) {
+				continue;
+			}
+
+			score = *sdef->weight_ptr;
+			pmax = g_hash_table_lookup (cache->uncached_scores, k);
+
+			if (pmax != NULL && *pmax > score) {
+				score = *pmax;
+			}
+
+			if (score > 0) {
+				res += score;
+			}
+		}
+	}
+
+	/* Symbols that have got their weights from settings */
+	g_hash_table_iter_init (&it, cache->uncached_scores);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		if (metric == NULL || g_hash_table_lookup (metric->symbols, k) == NULL) {
+			res += *(gdouble *)v;
+		}
+	}
+
+	return res;
+}
+
 static void
 rspamd_symbols_cache_resort (struct symbols_cache *cache)
 {
 	struct symbols_cache_order *ord;
 	guint i;
 	guint64 total_hits = 0;
+	gdouble extra = 0;
 	struct cache_item *it;
 
 	ord = rspamd_symbols_cache_order_new (cache->used_items);
@@ -363,8 +544,46 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 	}
 
 	cache->total_hits = total_hits;
+	rspamd_symbols_cache_update_estimations (cache);
 	g_ptr_array_sort_with_data (ord->d, cache_logic_cmp, cache);
 
+	/*
+	 * Composites and postfilters are executed after filters, so they
+	 * can always add their score
+	 */
+	for (i = 0; i < cache->composites->len; i ++) {
+		it = g_ptr_array_index (cache->composites, i);
+		extra += it->potential;
+	}
+
+	for (i = 0; i < cache->postfilters->len; i ++) {
+		it = g_ptr_array_index (cache->postfilters, i);
+		extra += it->potential;
+	}
+
+	extra += rspamd_symbols_cache_uncached_potential (cache);
+
+	/* Classifiers are also checked later */
+	for (i = 0; i < ord->d->len; i ++) {
+		it = g_ptr_array_index (ord->d, i);
+
+		if (it->type & SYMBOL_TYPE_CLASSIFIER) {
+			extra += it->potential;
+		}
+	}
+
+	ord->potential = g_malloc ((ord->d->len + 1) * sizeof (gdouble));
+	ord->potential[ord->d->len] = extra;
+
+	for (i = ord->d->len; i > 0; i --) {
+		it = g_ptr_array_index (ord->d, i - 1);
+		ord->potential[i - 1] = ord->potential[i];
+
+		if (!(it->type & SYMBOL_TYPE_CLASSIFIER)) {
+			ord->potential[i - 1] += it->potential;
+		}
+	}
+
 	if (cache->items_by_order) {
 		REF_RELEASE (cache->items_by_order);
 	}
@@ -372,6 +591,71 @@ rspamd_symbols_cache_resort (struct symbols_cache *cache)
 	cache->items_by_order = ord;
 }
 
+/*
+ * Builds dependencies graph levels using Kahn's algorithm: items on the same
+ * level are independent from each other, so they could be executed in any
+ * order (or concurrently via async events) once all items from the previous
+ * levels are finished
+ */
+static void
+rspamd_symbols_cache_calculate_levels (struct symbols_cache *cache)
+{
+	struct cache_item *it;
+	struct cache_dependency *dep, *rdep;
+	guint i, j, *indegree, processed = 0;
+	GQueue queue = G_QUEUE_INIT;
+
+	indegree = g_malloc0 (cache->items_by_id->len * sizeof (*indegree));
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		it = g_ptr_array_index (cache->items_by_id, i);
+		it->dep_level = 0;
+
+		for (j = 0; j < it->deps->len; j ++) {
+			dep = g_ptr_array_index (it->deps, j);
+
+			if (dep->item != NULL) {
+				indegree[i] ++;
+			}
+		}
+
+		if (indegree[i] == 0) {
+			g_queue_push_tail (&queue, it);
+		}
+	}
+
+	while ((it = g_queue_pop_head (&queue)) != NULL) {
+		processed ++;
+
+		for (j = 0; j < it->rdeps->len; j ++) {
+			rdep = g_ptr_array_index (it->rdeps, j);
+
+			if (rdep->item->dep_level < it->dep_level + 1) {
+				rdep->item->dep_level = it->dep_level + 1;
+			}
+
+			g_assert (indegree[rdep->item->id] > 0);
+
+			if (-- indegree[rdep->item->id] == 0) {
+				g_queue_push_tail (&queue, rdep->item);
+			}
+		}
+	}
+
+	if (processed != cache->items_by_id->len) {
+		for (i = 0; i < cache->items_by_id->len; i ++) {
+			it = g_ptr_array_index (cache->items_by_id, i);
+
+			if (indegree[i] != 0) {
+				msg_err_cache ("symbol %s is a part of cyclic dependency, "
+						"its dependencies cannot be ordered", it->symbol);
+			}
+		}
+	}
+
+	g_free (indegree);
+}
+
 /* Sort items in logical order */
 static void
 rspamd_symbols_cache_post_init (struct symbols_cache *cache)
@@ -384,8 +668,6 @@ rspamd_symbols_cache_post_init (struct symbols_cache *cache)
 	guint i, j;
 	gint id;
 
-	rspamd_symbols_cache_resort (cache);
-
 	cur = cache->delayed_deps;
 	while (cur) {
 		ddep = cur->data;
@@ -463,91 +745,59 @@ rspamd_symbols_cache_post_init (struct symbols_cache *cache)
 		}
 	}
 
+	rspamd_symbols_cache_calculate_levels (cache);
+	rspamd_symbols_cache_resort (cache);
 	g_ptr_array_sort_with_data (cache->prefilters, prefilters_cmp, cache);
 	g_ptr_array_sort_with_data (cache->postfilters, postfilters_cmp, cache);
 }
 
-static gboolean
-rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
+static void
+rspamd_symbols_cache_item_loaded (struct symbols_cache *cache,
+		struct cache_item *item)
 {
-	struct rspamd_symbols_cache_header *hdr;
-	struct stat st;
-	struct ucl_parser *parser;
-	ucl_object_t *top;
-	const ucl_object_t *cur, *elt;
-	ucl_object_iter_t it;
-	struct cache_item *item, *parent;
-	const guchar *p;
-	gint fd;
-	gpointer map;
-
-	fd = open (name, O_RDONLY);
-
-	if (fd == -1) {
-		msg_info_cache ("cannot open file %s, error %d, %s", name,
-			errno, strerror (errno));
-		return FALSE;
-	}
-
-	rspamd_file_lock (fd, FALSE);
+	struct cache_item *parent;
 
-	if (fstat (fd, &st) == -1) {
-		rspamd_file_unlock (fd, FALSE);
-		close (fd);
-		msg_info_cache ("cannot stat file %s, error %d, %s", name,
-				errno, strerror (errno));
-		return FALSE;
-	}
-
-	if (st.st_size < (gint)sizeof (*hdr)) {
-		rspamd_file_unlock (fd, FALSE);
-		close (fd);
-		errno = EINVAL;
-		msg_info_cache ("cannot use file %s, error %d, %s", name,
-				errno, strerror (errno));
-		return FALSE;
-	}
+	if ((item->type & SYMBOL_TYPE_VIRTUAL) && item->parent != -1) {
+		g_assert (item->parent < (gint)cache->items_by_id->len);
+		parent = g_ptr_array_index (cache->items_by_id, item->parent);
 
-	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (parent->st->weight < item->st->weight) {
+			parent->st->weight = item->st->weight;
+		}
 
-	if (map == MAP_FAILED) {
-		rspamd_file_unlock (fd, FALSE);
-		close (fd);
-		msg_info_cache ("cannot mmap file %s, error %d, %s", name,
-				errno, strerror (errno));
-		return FALSE;
+		/*
+		 * We maintain avg_time for virtual symbols equal to the
+		 * parent item avg_time
+		 */
+		item->st->avg_time = parent->st->avg_time;
 	}
 
-	hdr = map;
-
-	if (memcmp (hdr->magic, rspamd_symbols_cache_magic,
-			sizeof (rspamd_symbols_cache_magic)) != 0) {
-		msg_info_cache ("cannot use file %s, bad magic", name);
-		munmap (map, st.st_size);
-		rspamd_file_unlock (fd, FALSE);
-		close (fd);
+	cache->total_weight += fabs (item->st->weight);
+	cache->total_hits += item->st->total_hits;
+}
 
-		return FALSE;
-	}
+/* Legacy JSON format, used by versions prior to the binary profile */
+static gboolean
+rspamd_symbols_cache_load_items_legacy (struct symbols_cache *cache,
+		const gchar *name, const guchar *p, gsize len)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *top;
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it;
+	struct cache_item *item;
 
 	parser = ucl_parser_new (0);
-	p = (const guchar *)(hdr + 1);
 
-	if (!ucl_parser_add_chunk (parser, p, st.st_size - sizeof (*hdr))) {
+	if (!ucl_parser_add_chunk (parser, p, len)) {
 		msg_info_cache ("cannot use file %s, cannot parse: %s", name,
 				ucl_parser_get_error (parser));
-		munmap (map, st.st_size);
 		ucl_parser_free (parser);
-		rspamd_file_unlock (fd, FALSE);
-		close (fd);
 
 		return FALSE;
 	}
 
 	top = ucl_parser_get_object (parser);
-	munmap (map, st.st_size);
-	rspamd_file_unlock (fd, FALSE);
-	close (fd);
 	ucl_parser_free (parser);
 
 	if (top == NULL || ucl_object_type (top) != UCL_OBJECT) {
@@ -567,16 +817,6 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 			 * XXX: don't save or load weight, it should be obtained from the
 			 * metric
 			 */
-#if 0
-			elt = ucl_object_lookup (cur, "weight");
-
-			if (elt) {
-				w = ucl_object_todouble (elt);
-				if (w != 0) {
-					item->weight = w;
-				}
-			}
-#endif
 			elt = ucl_object_lookup (cur, "time");
 			if (elt) {
 				item->st->avg_time = ucl_object_todouble (elt);
@@ -588,6 +828,11 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 				item->last_count = item->st->total_hits;
 			}
 
+			elt = ucl_object_lookup (cur, "checks");
+			if (elt) {
+				item->st->total_checks = ucl_object_toint (elt);
+			}
+
 			elt = ucl_object_lookup (cur, "frequency");
 			if (elt && ucl_object_type (elt) == UCL_OBJECT) {
 				const ucl_object_t *cur;
@@ -604,43 +849,195 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 				}
 			}
 
-			if ((item->type & SYMBOL_TYPE_VIRTUAL) && item->parent != -1) {
-				g_assert (item->parent < (gint)cache->items_by_id->len);
-				parent = g_ptr_array_index (cache->items_by_id, item->parent);
+			rspamd_symbols_cache_item_loaded (cache, item);
+		}
+	}
 
-				if (parent->st->weight < item->st->weight) {
-					parent->st->weight = item->st->weight;
-				}
+	ucl_object_iterate_free (it);
+	ucl_object_unref (top);
 
-				/*
-				 * We maintain avg_time for virtual symbols equal to the
-				 * parent item avg_time
-				 */
-				item->st->avg_time = parent->st->avg_time;
-			}
+	return TRUE;
+}
+
+static guint64
+rspamd_symbols_cache_profile_id (struct cache_item *item)
+{
+	return t1ha (item->symbol, strlen (item->symbol),
+			rspamd_symbols_cache_profile_seed);
+}
+
+static gboolean
+rspamd_symbols_cache_load_profile (struct symbols_cache *cache,
+		const gchar *name, const struct rspamd_symbols_cache_header *hdr,
+		gsize len)
+{
+	struct rspamd_symbols_cache_profile cur, *prof = &cur;
+	const guchar *p;
+	struct cache_item *item;
+	GHashTable *items_by_id;
+	GHashTableIter it;
+	gpointer k, v;
+	guint64 *pid;
+	guint i;
+
+	if (len < sizeof (*hdr) + sizeof (*prof) * (gsize)hdr->nitems) {
+		msg_info_cache ("cannot use file %s, truncated profile: %d items "
+				"expected", name, (gint)hdr->nitems);
+
+		return FALSE;
+	}
+
+	items_by_id = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+			g_free, NULL);
+	g_hash_table_iter_init (&it, cache->items_by_symbol);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		item = v;
+		pid = g_malloc (sizeof (*pid));
+		*pid = rspamd_symbols_cache_profile_id (item);
+		g_hash_table_insert (items_by_id, pid, item);
+	}
+
+	p = (const guchar *)(hdr + 1);
 
-			cache->total_weight += fabs (item->st->weight);
-			cache->total_hits += item->st->total_hits;
+	for (i = 0; i < hdr->nitems; i ++, p += sizeof (*prof)) {
+		/* Records are not guaranteed to be aligned in the mapped file */
+		memcpy (prof, p, sizeof (*prof));
+		item = g_hash_table_lookup (items_by_id, &prof->id);
+
+		if (item) {
+			/*
+			 * Restore counters completely, so the next resort continues
+			 * averaging from the saved values instead of restarting
+			 */
+			memcpy (&item->st->time_counter, &prof->time_counter,
+					sizeof (prof->time_counter));
+			memcpy (&item->st->frequency_counter, &prof->frequency_counter,
+					sizeof (prof->frequency_counter));
+			memcpy (item->st->time_hist, prof->time_hist,
+					sizeof (prof->time_hist));
+			item->st->avg_time = prof->time_counter.mean;
+			item->st->avg_frequency = prof->frequency_counter.mean;
+			item->st->stddev_frequency = prof->frequency_counter.stddev;
+			item->st->total_hits = prof->total_hits;
+			item->st->total_checks = prof->total_checks;
+			item->last_count = item->st->total_hits;
+			item->frequency_peaks = prof->frequency_peaks;
+			item->st->max_score = prof->max_score;
+
+			rspamd_symbols_cache_item_loaded (cache, item);
 		}
 	}
 
-	ucl_object_iterate_free (it);
-	ucl_object_unref (top);
+	g_hash_table_unref (items_by_id);
 
 	return TRUE;
 }
 
+static gboolean
+rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
+{
+	struct rspamd_symbols_cache_header *hdr;
+	struct stat st;
+	gint fd;
+	gpointer map;
+	gboolean ret;
+
+	fd = open (name, O_RDONLY);
+
+	if (fd == -1) {
+		msg_info_cache ("cannot open file %s, error %d, %s", name,
+			errno, strerror (errno));
+		return FALSE;
+	}
+
+	rspamd_file_lock (fd, FALSE);
+
+	if (fstat (fd, &st) == -1) {
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+		msg_info_cache ("cannot stat file %s, error %d, %s", name,
+				errno, strerror (errno));
+		return FALSE;
+	}
+
+	if (st.st_size < (gint)sizeof (*hdr)) {
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+		errno = EINVAL;
+		msg_info_cache ("cannot use file %s, error %d, %s", name,
+				errno, strerror (errno));
+		return FALSE;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		rspamd_file_unlock (fd, FALSE);
+		close (fd);
+		msg_info_cache ("cannot mmap file %s, error %d, %s", name,
+				errno, strerror (errno));
+		return FALSE;
+	}
+
+	hdr = map;
+
+	if (memcmp (hdr->magic, rspamd_symbols_cache_magic,
+			sizeof (rspamd_symbols_cache_magic)) == 0) {
+		ret = rspamd_symbols_cache_load_profile (cache, name, hdr, st.st_size);
+	}
+	else if (memcmp (hdr->magic, rspamd_symbols_cache_legacy_magic,
+			sizeof (rspamd_symbols_cache_legacy_magic)) == 0) {
+		ret = rspamd_symbols_cache_load_items_legacy (cache, name,
+				(const guchar *)(hdr + 1), st.st_size - sizeof (*hdr));
+	}
+	else {
+		msg_info_cache ("cannot use file %s, bad magic", name);
+		ret = FALSE;
+	}
+
+	munmap (map, st.st_size);
+	rspamd_file_unlock (fd, FALSE);
+	close (fd);
+
+	return ret;
+}
+
 static gboolean
 rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
 {
 	struct rspamd_symbols_cache_header hdr;
-	ucl_object_t *top, *elt, *freq;
-	GHashTableIter it;
+	struct rspamd_symbols_cache_profile *prof;
+	GArray *profiles;
 	struct cache_item *item;
-	struct ucl_emitter_functions *efunc;
-	gpointer k, v;
+	guint i;
 	gint fd;
-	bool ret;
+	gboolean ret = TRUE;
+
+	profiles = g_array_sized_new (FALSE, TRUE, sizeof (*prof),
+			cache->items_by_id->len);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if (item->symbol == NULL) {
+			continue;
+		}
+
+		g_array_set_size (profiles, profiles->len + 1);
+		prof = &g_array_index (profiles, struct rspamd_symbols_cache_profile,
+				profiles->len - 1);
+		prof->id = rspamd_symbols_cache_profile_id (item);
+		memcpy (&prof->time_counter, &item->st->time_counter,
+				sizeof (prof->time_counter));
+		memcpy (&prof->frequency_counter, &item->st->frequency_counter,
+				sizeof (prof->frequency_counter));
+		memcpy (prof->time_hist, item->st->time_hist, sizeof (prof->time_hist));
+		prof->total_hits = item->st->total_hits;
+		prof->total_checks = item->st->total_checks;
+		prof->frequency_peaks = item->frequency_peaks;
+		prof->max_score = item->st->max_score;
+	}
 
 	(void)unlink (name);
 	fd = open (name, O_CREAT | O_TRUNC | O_WRONLY | O_EXCL, 00644);
@@ -648,6 +1045,8 @@ rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
 	if (fd == -1) {
 		msg_info_cache ("cannot open file %s, error %d, %s", name,
 				errno, strerror (errno));
+		g_array_free (profiles, TRUE);
+
 		return FALSE;
 	}
 
@@ -656,45 +1055,18 @@ rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
 	memset (&hdr, 0, sizeof (hdr));
 	memcpy (hdr.magic, rspamd_symbols_cache_magic,
 			sizeof (rspamd_symbols_cache_magic));
+	hdr.nitems = profiles->len;
 
-	if (write (fd, &hdr, sizeof (hdr)) == -1) {
+	if (write (fd, &hdr, sizeof (hdr)) == -1 ||
+			write (fd, profiles->data, profiles->len * sizeof (*prof)) == -1) {
 		msg_info_cache ("cannot write to file %s, error %d, %s", name,
 				errno, strerror (errno));
-		rspamd_file_unlock (fd, FALSE);
-		close (fd);
-
-		return FALSE;
+		ret = FALSE;
 	}
 
-	top = ucl_object_typed_new (UCL_OBJECT);
-	g_hash_table_iter_init (&it, cache->items_by_symbol);
-
-	while (g_hash_table_iter_next (&it, &k, &v)) {
-		item = v;
-		elt = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->weight),
-				"weight", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->time_counter.mean),
-				"time", 0, false);
-		ucl_object_insert_key (elt, ucl_object_fromdouble (item->st->total_hits),
-				"count", 0, false);
-
-		freq = ucl_object_typed_new (UCL_OBJECT);
-		ucl_object_insert_key (freq, ucl_object_fromdouble (item->st->frequency_counter.mean),
-				"avg", 0, false);
-		ucl_object_insert_key (freq, ucl_object_fromdouble (item->st->frequency_counter.stddev),
-				"stddev", 0, false);
-		ucl_object_insert_key (elt, freq, "frequency", 0, false);
-
-		ucl_object_insert_key (top, elt, k, 0, false);
-	}
-
-	efunc = ucl_object_emit_fd_funcs (fd);
-	ret = ucl_object_emit_full (top, UCL_EMIT_JSON_COMPACT, efunc, NULL);
-	ucl_object_emit_funcs_free (efunc);
-	ucl_object_unref (top);
 	rspamd_file_unlock (fd, FALSE);
 	close (fd);
+	g_array_free (profiles, TRUE);
 
 	return ret;
 }
@@ -917,6 +1289,7 @@ rspamd_symbols_cache_destroy (struct symbols_cache *cache)
 		}
 
 		g_hash_table_destroy (cache->items_by_symbol);
+		g_hash_table_destroy (cache->uncached_scores);
 		rspamd_mempool_delete (cache->static_pool);
 		g_ptr_array_free (cache->items_by_id, TRUE);
 		g_ptr_array_free (cache->prefilters, TRUE);
@@ -942,6 +1315,8 @@ rspamd_symbols_cache_new (struct rspamd_config *cfg)
 			rspamd_mempool_new (rspamd_mempool_suggest_size (), "symcache");
 	cache->items_by_symbol = g_hash_table_new (rspamd_str_hash,
 			rspamd_str_equal);
+	cache->uncached_scores = g_hash_table_new_full (rspamd_str_hash,
+			rspamd_str_equal, g_free, g_free);
 	cache->items_by_id = g_ptr_array_new ();
 	cache->prefilters = g_ptr_array_new ();
 	cache->postfilters = g_ptr_array_new ();
@@ -1200,6 +1575,50 @@ rspamd_symbols_cache_metric_limit (struct rspamd_task *task,
 	return FALSE;
 }
 
+/*
+ * Return true if metric cannot reach any action threshold even if all
+ * remaining rules fire
+ */
+static gboolean
+rspamd_symbols_cache_ham_limit (struct rspamd_task *task,
+		struct cache_savepoint *cp,
+		gdouble potential)
+{
+	guint i;
+
+	if (!task->cfg->ham_shortcut || cp->rs == NULL ||
+			(task->flags & RSPAMD_TASK_FLAG_PASS_ALL)) {
+		return FALSE;
+	}
+
+	/*
+	 * Potential scores are calculated for the default metric weights, so we
+	 * cannot rely on them if weights are changed by settings or grow
+	 */
+	if (task->settings != NULL || cp->rs->metric != task->cfg->default_metric ||
+			cp->rs->metric->grow_factor > 1.0) {
+		return FALSE;
+	}
+
+	if (!cp->ham_lim_checked) {
+		cp->ham_lim_checked = TRUE;
+
+		for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_NOACTION; i ++) {
+			if (!isnan (cp->rs->actions_limits[i]) &&
+					(isnan (cp->ham_lim) ||
+							cp->rs->actions_limits[i] < cp->ham_lim)) {
+				cp->ham_lim = cp->rs->actions_limits[i];
+			}
+		}
+	}
+
+	if (!isnan (cp->ham_lim) && cp->rs->score + potential < cp->ham_lim) {
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
 static void
 rspamd_symbols_cache_watcher_cb (gpointer sessiond, gpointer ud)
 {
@@ -1305,6 +1724,9 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 
 			if (rspamd_worker_is_normal (task->worker)) {
 				rspamd_set_counter (item->cd, diff);
+				g_atomic_int_inc (&item->st->checks);
+				g_atomic_int_inc (&item->st->time_hist[
+						rspamd_symbols_cache_hist_bucket (diff)]);
 			}
 
 			pending_after = rspamd_session_events_pending (task->s);
@@ -1460,6 +1882,7 @@ rspamd_symbols_cache_make_checkpoint (struct rspamd_task *task,
 	rspamd_mempool_add_destructor (task->task_pool,
 			rspamd_ptr_array_free_hard, checkpoint->waitq);
 	checkpoint->pass = RSPAMD_CACHE_PASS_INIT;
+	checkpoint->ham_lim = NAN;
 	task->checkpoint = checkpoint;
 
 	rspamd_create_metric_result (task, DEFAULT_METRIC);
@@ -1659,15 +2082,24 @@ rspamd_symbols_cache_process_symbols (struct rspamd_task * task,
 				continue;
 			}
 
-			if (!(item->type & SYMBOL_TYPE_FINE) &&
-					rspamd_session_events_pending (task->s) == 0) {
-				if (rspamd_symbols_cache_metric_limit (task, checkpoint)) {
+			if (rspamd_session_events_pending (task->s) == 0) {
+				if (!(item->type & SYMBOL_TYPE_FINE) &&
+						rspamd_symbols_cache_metric_limit (task, checkpoint)) {
 					msg_info_task ("<%s> has already scored more than %.2f, so do "
 							"not "
 							"plan more checks", task->message_id,
 							checkpoint->rs->score);
 					continue;
 				}
+
+				if (checkpoint->waitq->len == 0 &&
+						rspamd_symbols_cache_ham_limit (task, checkpoint,
+								checkpoint->order->potential[i])) {
+					msg_info_task ("<%s> cannot reach score %.2f having %.2f, "
+							"so do not plan more checks", task->message_id,
+							checkpoint->ham_lim, checkpoint->rs->score);
+					break;
+				}
 			}
 
 			if (!isset (checkpoint->processed_bits, item->id * 2)) {
@@ -1842,6 +2274,9 @@ rspamd_symbols_cache_counters_cb (gpointer v, gpointer ud)
 					"hits", 0, false);
 			ucl_object_insert_key (obj, ucl_object_fromdouble (parent->st->avg_time),
 					"time", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromdouble (
+					rspamd_symbols_cache_hist_quantile (parent->st, 0.99)),
+					"time_p99", 0, false);
 		}
 		else {
 			ucl_object_insert_key (obj, ucl_object_fromdouble (item->st->weight),
@@ -1852,6 +2287,9 @@ rspamd_symbols_cache_counters_cb (gpointer v, gpointer ud)
 					"hits", 0, false);
 			ucl_object_insert_key (obj, ucl_object_fromdouble (item->st->avg_time),
 					"time", 0, false);
+			ucl_object_insert_key (obj, ucl_object_fromdouble (
+					rspamd_symbols_cache_hist_quantile (item->st, 0.99)),
+					"time_p99", 0, false);
 		}
 
 		ucl_array_append (top, obj);
@@ -1931,6 +2369,8 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 			item = g_ptr_array_index (cache->items_by_id, i);
 			item->st->total_hits += item->st->hits;
 			item->st->hits = 0;
+			item->st->total_checks += item->st->checks;
+			item->st->checks = 0;
 
 			if (item->last_count > 0 && cbdata->w->index == 0) {
 				/* Calculate frequency */
@@ -2030,9 +2470,10 @@ rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 
 void
 rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
-		const gchar *symbol)
+		const gchar *symbol, gdouble score)
 {
 	struct cache_item *item;
+	gdouble *pmax;
 
 	g_assert (cache != NULL);
 
@@ -2040,6 +2481,23 @@ rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
 
 	if (item != NULL) {
 		g_atomic_int_inc (&item->st->hits);
+
+		if (score > item->st->max_score) {
+			item->st->max_score = score;
+		}
+	}
+	else if (score > 0) {
+		pmax = g_hash_table_lookup (cache->uncached_scores, symbol);
+
+		if (pmax == NULL) {
+			pmax = g_malloc (sizeof (*pmax));
+			*pmax = score;
+			g_hash_table_insert (cache->uncached_scores, g_strdup (symbol),
+					pmax);
+		}
+		else if (score > *pmax) {
+			*pmax = score;
+		}
 	}
 }
 
@@ -196,12 +196,13 @@ void rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 		struct event_base *ev_base, struct rspamd_worker *w);
 
 /**
- * Increases counter for a specific symbol
+ * Increases counter for a specific symbol and updates its maximum score
  * @param cache
  * @param symbol
+ * @param score the current score of the symbol in a task
  */
 void rspamd_symbols_cache_inc_frequency (struct symbols_cache *cache,
-		const gchar *symbol);
+		const gchar *symbol, gdouble score);
 
 /**
  * Add dependency relation between two symbols identified by id (source) and
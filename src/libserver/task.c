@@ -213,6 +213,10 @@ rspamd_task_free (struct rspamd_task *task)
 					g_ptr_array_free (p->specific.mp.children, TRUE);
 				}
 			}
+
+			if (p->flags & RSPAMD_MIME_PART_DECODED) {
+				g_free ((gpointer)p->parsed_data.begin);
+			}
 		}
 
 		for (i = 0; i < task->text_parts->len; i ++) {
@@ -0,0 +1,624 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "config.h"
+#include "tld_trie.h"
+#include "libutil/util.h"
+#include "libutil/printf.h"
+#include "libutil/logger.h"
+#include "libcryptobox/cryptobox.h"
+#include "unix-std.h"
+
+#ifdef HAVE_GLOB_H
+#include <glob.h>
+#endif
+
+#define TLD_TRIE_MAGIC "rsltld01"
+
+/* Rule ends at this node */
+#define TLD_TRIE_TERMINAL (1u << 0)
+/* Any label below this node is a suffix (e.g. *.ck) */
+#define TLD_TRIE_WILDCARD (1u << 1)
+
+/*
+ * Image layout: header, nodes, edges and labels. Node 0 is the root, edges of
+ * each node are consecutive and sorted by label, so children are found by
+ * a binary search
+ */
+struct rspamd_tld_trie_header {
+	gchar magic[8];
+	guint32 nnodes;
+	guint32 nedges;
+	guint32 strings_len;
+	guint32 nrules;
+};
+
+struct rspamd_tld_trie_node {
+	guint32 edges;
+	guint32 nedges;
+	guint32 flags;
+};
+
+struct rspamd_tld_trie_edge {
+	guint32 label;
+	guint32 len;
+	guint32 node;
+};
+
+struct rspamd_tld_trie {
+	gpointer image;
+	gsize len;
+	gboolean mapped;
+	const struct rspamd_tld_trie_header *hdr;
+	const struct rspamd_tld_trie_node *nodes;
+	const struct rspamd_tld_trie_edge *edges;
+	const gchar *strings;
+};
+
+struct tld_build_node {
+	GHashTable *children;
+	guint flags;
+	guint id;
+};
+
+static GQuark
+rspamd_tld_trie_quark (void)
+{
+	return g_quark_from_static_string ("tld_trie");
+}
+
+static void
+rspamd_tld_build_node_free (gpointer p)
+{
+	struct tld_build_node *n = p;
+
+	g_hash_table_unref (n->children);
+	g_free (n);
+}
+
+static struct tld_build_node *
+rspamd_tld_build_node_new (void)
+{
+	struct tld_build_node *n;
+
+	n = g_malloc0 (sizeof (*n));
+	n->children = g_hash_table_new_full (g_str_hash, g_str_equal,
+			g_free, rspamd_tld_build_node_free);
+
+	return n;
+}
+
+static gboolean
+rspamd_tld_trie_add_rule (struct tld_build_node *root, const gchar *rule,
+		gsize len)
+{
+	const gchar *p, *lstart;
+	struct tld_build_node *cur = root, *child;
+	gchar *label;
+
+	p = rule + len;
+
+	for (;;) {
+		lstart = p;
+
+		while (lstart > rule && *(lstart - 1) != '.') {
+			lstart --;
+		}
+
+		if (lstart == p) {
+			/* Empty label */
+			return FALSE;
+		}
+
+		if (lstart == rule && p - lstart == 1 && *lstart == '*') {
+			if (cur == root) {
+				return FALSE;
+			}
+
+			cur->flags |= TLD_TRIE_WILDCARD;
+
+			return TRUE;
+		}
+
+		label = g_ascii_strdown (lstart, p - lstart);
+		child = g_hash_table_lookup (cur->children, label);
+
+		if (child == NULL) {
+			child = rspamd_tld_build_node_new ();
+			g_hash_table_insert (cur->children, label, child);
+		}
+		else {
+			g_free (label);
+		}
+
+		cur = child;
+
+		if (lstart == rule) {
+			break;
+		}
+
+		p = lstart - 1;
+	}
+
+	cur->flags |= TLD_TRIE_TERMINAL;
+
+	return TRUE;
+}
+
+static struct rspamd_tld_trie *
+rspamd_tld_trie_from_image (gpointer image, gsize len, gboolean mapped,
+		GError **err)
+{
+	const struct rspamd_tld_trie_header *hdr = image;
+	struct rspamd_tld_trie *trie;
+	guint64 expected;
+	guint i;
+
+	if (len < sizeof (*hdr) ||
+			memcmp (hdr->magic, TLD_TRIE_MAGIC, sizeof (hdr->magic)) != 0) {
+		g_set_error (err, rspamd_tld_trie_quark (), EINVAL,
+				"invalid tld trie image");
+		return NULL;
+	}
+
+	expected = sizeof (*hdr) +
+			(guint64)hdr->nnodes * sizeof (struct rspamd_tld_trie_node) +
+			(guint64)hdr->nedges * sizeof (struct rspamd_tld_trie_edge) +
+			hdr->strings_len;
+
+	if (expected != len || hdr->nnodes == 0) {
+		g_set_error (err, rspamd_tld_trie_quark (), EINVAL,
+				"truncated tld trie image: %z bytes, %L expected",
+				len, expected);
+		return NULL;
+	}
+
+	trie = g_malloc0 (sizeof (*trie));
+	trie->image = image;
+	trie->len = len;
+	trie->mapped = mapped;
+	trie->hdr = hdr;
+	trie->nodes = (const struct rspamd_tld_trie_node *)(hdr + 1);
+	trie->edges = (const struct rspamd_tld_trie_edge *)
+			(trie->nodes + hdr->nnodes);
+	trie->strings = (const gchar *)(trie->edges + hdr->nedges);
+
+	/* Check that all references are within the image */
+	for (i = 0; i < hdr->nnodes; i ++) {
+		if ((guint64)trie->nodes[i].edges + trie->nodes[i].nedges >
+				hdr->nedges) {
+			goto err;
+		}
+	}
+
+	for (i = 0; i < hdr->nedges; i ++) {
+		if (trie->edges[i].node >= hdr->nnodes ||
+				(guint64)trie->edges[i].label + trie->edges[i].len >
+				hdr->strings_len) {
+			goto err;
+		}
+	}
+
+	return trie;
+
+err:
+	g_set_error (err, rspamd_tld_trie_quark (), EINVAL,
+			"corrupted tld trie image");
+	g_free (trie);
+
+	return NULL;
+}
+
+struct rspamd_tld_trie *
+rspamd_tld_trie_compile (const gchar *data, gsize len, GError **err)
+{
+	struct tld_build_node *root, *cur, *child;
+	struct rspamd_tld_trie_header hdr;
+	struct rspamd_tld_trie_node node;
+	struct rspamd_tld_trie_edge edge;
+	struct rspamd_tld_trie *trie;
+	const gchar *p, *end, *line, *eol;
+	GArray *nodes, *edges;
+	GString *strings;
+	GQueue *queue;
+	GList *keys, *cur_key;
+	guint nrules = 0, nnodes;
+	guchar *image;
+	gsize image_len;
+
+	root = rspamd_tld_build_node_new ();
+	p = data;
+	end = data + len;
+
+	while (p < end) {
+		line = p;
+		eol = memchr (p, '\n', end - p);
+
+		if (eol == NULL) {
+			eol = end;
+		}
+
+		p = eol + 1;
+
+		while (eol > line && g_ascii_isspace (*(eol - 1))) {
+			eol --;
+		}
+
+		if (eol == line || *line == '/' || g_ascii_isspace (*line)) {
+			/* Skip comment or empty line */
+			continue;
+		}
+
+		/* TODO: add support for ! patterns */
+		if (*line == '!') {
+			continue;
+		}
+
+		if (rspamd_tld_trie_add_rule (root, line, eol - line)) {
+			nrules ++;
+		}
+	}
+
+	if (nrules == 0) {
+		g_set_error (err, rspamd_tld_trie_quark (), EINVAL,
+				"no suffix rules found");
+		rspamd_tld_build_node_free (root);
+
+		return NULL;
+	}
+
+	/* Serialize nodes in BFS order so that children have consecutive edges */
+	nodes = g_array_new (FALSE, FALSE, sizeof (node));
+	edges = g_array_new (FALSE, FALSE, sizeof (edge));
+	strings = g_string_new (NULL);
+	queue = g_queue_new ();
+	root->id = 0;
+	nnodes = 1;
+	g_queue_push_tail (queue, root);
+
+	while ((cur = g_queue_pop_head (queue)) != NULL) {
+		keys = g_list_sort (g_hash_table_get_keys (cur->children),
+				(GCompareFunc)strcmp);
+		node.edges = edges->len;
+		node.nedges = g_hash_table_size (cur->children);
+		node.flags = cur->flags;
+		g_array_append_val (nodes, node);
+
+		for (cur_key = keys; cur_key != NULL; cur_key = g_list_next (cur_key)) {
+			child = g_hash_table_lookup (cur->children, cur_key->data);
+			child->id = nnodes ++;
+			edge.label = strings->len;
+			edge.len = strlen (cur_key->data);
+			edge.node = child->id;
+			g_string_append_len (strings, cur_key->data, edge.len);
+			g_array_append_val (edges, edge);
+			g_queue_push_tail (queue, child);
+		}
+
+		g_list_free (keys);
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, TLD_TRIE_MAGIC, sizeof (hdr.magic));
+	hdr.nnodes = nodes->len;
+	hdr.nedges = edges->len;
+	hdr.strings_len = strings->len;
+	hdr.nrules = nrules;
+
+	image_len = sizeof (hdr) + nodes->len * sizeof (node) +
+			edges->len * sizeof (edge) + strings->len;
+	image = g_malloc (image_len);
+	memcpy (image, &hdr, sizeof (hdr));
+	memcpy (image + sizeof (hdr), nodes->data, nodes->len * sizeof (node));
+	memcpy (image + sizeof (hdr) + nodes->len * sizeof (node), edges->data,
+			edges->len * sizeof (edge));
+	memcpy (image + image_len - strings->len, strings->str, strings->len);
+
+	g_array_free (nodes, TRUE);
+	g_array_free (edges, TRUE);
+	g_string_free (strings, TRUE);
+	g_queue_free (queue);
+	rspamd_tld_build_node_free (root);
+
+	trie = rspamd_tld_trie_from_image (image, image_len, FALSE, err);
+
+	if (trie == NULL) {
+		g_free (image);
+	}
+
+	return trie;
+}
+
+static gboolean
+rspamd_tld_trie_save (struct rspamd_tld_trie *trie, const gchar *fname)
+{
+	gchar fp[PATH_MAX];
+	gint fd;
+
+	/* Temporary file left by a dead process must not block saving */
+	rspamd_snprintf (fp, sizeof (fp), "%s.%P.tmp", fname, getpid ());
+
+	if ((fd = rspamd_file_xopen (fp, O_WRONLY|O_CREAT|O_TRUNC, 00644)) == -1) {
+		msg_warn ("cannot create tld trie cache %s: %s", fp, strerror (errno));
+		return FALSE;
+	}
+
+	if (write (fd, trie->image, trie->len) != (gssize)trie->len) {
+		msg_warn ("cannot write tld trie cache to %s: %s",
+				fp, strerror (errno));
+		close (fd);
+		unlink (fp);
+
+		return FALSE;
+	}
+
+	fsync (fd);
+	close (fd);
+
+	if (rename (fp, fname) == -1) {
+		msg_warn ("cannot rename tld trie cache from %s to %s: %s",
+				fp, fname, strerror (errno));
+		unlink (fp);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Removes images of other TLD files from the cache directory
+ */
+static void
+rspamd_tld_trie_cleanup (const gchar *cache_dir, const gchar *fname)
+{
+#ifdef HAVE_GLOB_H
+	glob_t globbuf;
+	gchar pattern[PATH_MAX];
+	const gchar *keep, *p;
+	guint i;
+
+	memset (&globbuf, 0, sizeof (globbuf));
+	rspamd_snprintf (pattern, sizeof (pattern), "%s/*.tld", cache_dir);
+
+	keep = strrchr (fname, G_DIR_SEPARATOR);
+	keep = keep ? keep + 1 : fname;
+
+	if (glob (pattern, 0, NULL, &globbuf) == 0) {
+		for (i = 0; i < globbuf.gl_pathc; i ++) {
+			p = strrchr (globbuf.gl_pathv[i], G_DIR_SEPARATOR);
+			p = p ? p + 1 : globbuf.gl_pathv[i];
+
+			if (strcmp (p, keep) != 0) {
+				msg_debug ("remove stale tld trie cache %s",
+						globbuf.gl_pathv[i]);
+				(void)unlink (globbuf.gl_pathv[i]);
+			}
+		}
+	}
+
+	globfree (&globbuf);
+#endif
+}
+
+static struct rspamd_tld_trie *
+rspamd_tld_trie_map (const gchar *fname)
+{
+	struct rspamd_tld_trie *trie;
+	gpointer map;
+	gsize len;
+
+	if ((map = rspamd_file_xmap (fname, PROT_READ, &len)) == NULL) {
+		return NULL;
+	}
+
+	trie = rspamd_tld_trie_from_image (map, len, TRUE, NULL);
+
+	if (trie == NULL) {
+		munmap (map, len);
+		/* Remove stale file */
+		(void)unlink (fname);
+	}
+
+	return trie;
+}
+
+struct rspamd_tld_trie *
+rspamd_tld_trie_load (const gchar *fname, const gchar *cache_dir,
+		GError **err)
+{
+	struct rspamd_tld_trie *trie, *mapped;
+	guchar hash[rspamd_cryptobox_HASHBYTES];
+	gchar fp[PATH_MAX];
+	gpointer map;
+	gsize len;
+
+	if ((map = rspamd_file_xmap (fname, PROT_READ, &len)) == NULL) {
+		g_set_error (err, rspamd_tld_trie_quark (), errno,
+				"cannot open TLD file %s: %s", fname, strerror (errno));
+		return NULL;
+	}
+
+	if (cache_dir != NULL) {
+		rspamd_cryptobox_hash (hash, map, len, NULL, 0);
+		rspamd_snprintf (fp, sizeof (fp), "%s/%*xs.tld", cache_dir,
+				(gint)rspamd_cryptobox_HASHBYTES / 2, hash);
+
+		if ((trie = rspamd_tld_trie_map (fp)) != NULL) {
+			munmap (map, len);
+			msg_debug ("loaded tld trie from %s", fp);
+
+			return trie;
+		}
+	}
+
+	trie = rspamd_tld_trie_compile (map, len, err);
+	munmap (map, len);
+
+	if (trie != NULL && cache_dir != NULL && rspamd_tld_trie_save (trie, fp)) {
+		rspamd_tld_trie_cleanup (cache_dir, fp);
+
+		/* Use the mapped file so that its pages are shared between processes */
+		if ((mapped = rspamd_tld_trie_map (fp)) != NULL) {
+			rspamd_tld_trie_destroy (trie);
+			trie = mapped;
+		}
+	}
+
+	return trie;
+}
+
+static inline gint
+rspamd_tld_trie_label_cmp (const gchar *s, guint slen, const gchar *key,
+		gsize klen)
+{
+	guint i, l = MIN (slen, klen);
+	guchar c;
+
+	for (i = 0; i < l; i ++) {
+		c = g_ascii_tolower (key[i]);
+
+		if ((guchar)s[i] != c) {
+			return (gint)(guchar)s[i] - (gint)c;
+		}
+	}
+
+	return (gint)slen - (gint)klen;
+}
+
+static gint
+rspamd_tld_trie_child (const struct rspamd_tld_trie *trie, guint node,
+		const gchar *label, gsize len)
+{
+	const struct rspamd_tld_trie_edge *e;
+	guint lo, hi, mid;
+	gint cmp;
+
+	lo = trie->nodes[node].edges;
+	hi = lo + trie->nodes[node].nedges;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &trie->edges[mid];
+		cmp = rspamd_tld_trie_label_cmp (trie->strings + e->label, e->len,
+				label, len);
+
+		if (cmp == 0) {
+			return e->node;
+		}
+		else if (cmp < 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return -1;
+}
+
+gboolean
+rspamd_tld_trie_find (const struct rspamd_tld_trie *trie,
+		const gchar *host, gsize len, rspamd_ftok_t *tld)
+{
+	const gchar *p, *lstart, *end = host + len;
+	gint node = 0, child;
+	guint depth = 0, suffix = 0, ndots;
+
+	g_assert (trie != NULL);
+
+	p = end;
+
+	while (p > host) {
+		lstart = p;
+
+		while (lstart > host && *(lstart - 1) != '.') {
+			lstart --;
+		}
+
+		if (lstart == p) {
+			/* Empty label */
+			break;
+		}
+
+		if (trie->nodes[node].flags & TLD_TRIE_WILDCARD) {
+			suffix = depth + 1;
+		}
+
+		if (lstart == host) {
+			/* Suffix must be preceded by another label */
+			break;
+		}
+
+		child = rspamd_tld_trie_child (trie, node, lstart, p - lstart);
+
+		if (child == -1) {
+			break;
+		}
+
+		node = child;
+		depth ++;
+
+		if (trie->nodes[node].flags & TLD_TRIE_TERMINAL) {
+			suffix = depth;
+		}
+
+		p = lstart - 1;
+	}
+
+	if (suffix == 0) {
+		return FALSE;
+	}
+
+	/* Registered domain is the suffix with one more label */
+	p = end;
+	ndots = suffix + 1;
+
+	while (p > host) {
+		if (*(p - 1) == '.' && --ndots == 0) {
+			break;
+		}
+
+		p --;
+	}
+
+	if (tld) {
+		tld->begin = p;
+		tld->len = end - p;
+	}
+
+	return TRUE;
+}
+
+guint
+rspamd_tld_trie_nrules (const struct rspamd_tld_trie *trie)
+{
+	return trie->hdr->nrules;
+}
+
+void
+rspamd_tld_trie_destroy (struct rspamd_tld_trie *trie)
+{
+	if (trie) {
+		if (trie->mapped) {
+			munmap (trie->image, trie->len);
+		}
+		else {
+			g_free (trie->image);
+		}
+
+		g_free (trie);
+	}
+}
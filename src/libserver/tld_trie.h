@@ -0,0 +1,77 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef SRC_LIBSERVER_TLD_TRIE_H_
+#define SRC_LIBSERVER_TLD_TRIE_H_
+
+#include "config.h"
+#include "fstring.h"
+
+/*
+ * Suffix trie built from the public suffix list. Domain labels are stored
+ * in reverse order, so a lookup is a walk from the last label of a hostname.
+ * The whole trie is a single position independent image, so it can be saved
+ * to a file and mapped read-only by all processes.
+ */
+struct rspamd_tld_trie;
+
+/**
+ * Compiles public suffix list data to a trie
+ * @param data content of the suffix list
+ * @param len length of data
+ * @param err error
+ * @return new trie or NULL
+ */
+struct rspamd_tld_trie *rspamd_tld_trie_compile (const gchar *data, gsize len,
+		GError **err);
+
+/**
+ * Loads trie for the specified suffix list file. If cache_dir is not NULL
+ * then the compiled image is looked up there by the hash of the list and
+ * saved there if it is missing
+ * @param fname suffix list file
+ * @param cache_dir directory for compiled images (can be NULL)
+ * @param err error
+ * @return new trie or NULL
+ */
+struct rspamd_tld_trie *rspamd_tld_trie_load (const gchar *fname,
+		const gchar *cache_dir, GError **err);
+
+/**
+ * Finds the registered domain (public suffix plus one more label) of the
+ * hostname. Hostname must not have a trailing dot
+ * @param trie
+ * @param host hostname
+ * @param len length of hostname
+ * @param tld output
+ * @return TRUE if the hostname ends with a public suffix
+ */
+gboolean rspamd_tld_trie_find (const struct rspamd_tld_trie *trie,
+		const gchar *host, gsize len, rspamd_ftok_t *tld);
+
+/**
+ * Returns number of rules in the trie
+ * @param trie
+ * @return
+ */
+guint rspamd_tld_trie_nrules (const struct rspamd_tld_trie *trie);
+
+/**
+ * Destroys trie (unmapping image if needed)
+ * @param trie
+ */
+void rspamd_tld_trie_destroy (struct rspamd_tld_trie *trie);
+
+#endif /* SRC_LIBSERVER_TLD_TRIE_H_ */
@@ -47,6 +47,7 @@
 #include "message.h"
 #include "http.h"
 #include "multipattern.h"
+#include "tld_trie.h"
 #include "http_parser.h"
 #include "contrib/uthash/utlist.h"
 
@@ -63,7 +64,6 @@ typedef struct url_match_s {
 
 #define URL_FLAG_NOHTML (1 << 0)
 #define URL_FLAG_TLD_MATCH (1 << 1)
-#define URL_FLAG_STAR_MATCH (1 << 2)
 #define URL_FLAG_REGEXP (1 << 3)
 
 struct url_callback_data;
@@ -213,13 +213,76 @@ struct url_callback_data {
 	void *funcd;
 };
 
+/* Matches domains ending with a known suffix, found by the tld trie */
+static struct url_matcher tld_matcher = {
+		"",           "http://",   url_tld_start,   url_tld_end,
+		URL_FLAG_NOHTML | URL_FLAG_TLD_MATCH, 0
+};
+
 struct url_match_scanner {
 	GArray *matchers;
 	struct rspamd_multipattern *search_trie;
+	struct rspamd_tld_trie *tld_trie;
+	guint tld_matcher_idx;
 };
 
 struct url_match_scanner *url_scanner = NULL;
 
+/*
+ * Cache of parsed urls shared between all processes. It is allocated before
+ * workers are forked, so all of them see the same memory. The cache is
+ * set associative: each raw url hashes to a set of URL_CACHE_WAYS elements
+ * and the least recently used element of the set is replaced on insertion.
+ */
+#define URL_CACHE_WAYS 4
+#define URL_CACHE_LOCKS 64
+#define URL_CACHE_DATA_LEN 1024
+#define URL_CACHE_NOPTR G_MAXUINT16
+/* Raw url, its parsed copy and a numeric host must fit in the element */
+#define URL_CACHE_MAX_RAW ((URL_CACHE_DATA_LEN - INET6_ADDRSTRLEN) / 2)
+
+enum rspamd_url_cache_flags {
+	URL_CACHE_ELT_COPY = 1 << 0, /* String is not parsed in place */
+	URL_CACHE_ELT_HOST = 1 << 1, /* Host is stored after the string */
+};
+
+struct rspamd_url_cache_elt {
+	guint64 hash;
+	guint stamp;
+	guint16 rawlen;
+	guint16 cflags;
+	guint16 protocol;
+	guint16 port;
+	guint16 protocollen;
+	guint16 userlen;
+	guint16 hostlen;
+	guint16 datalen;
+	guint16 querylen;
+	guint16 fragmentlen;
+	guint16 tldlen;
+	guint16 urllen;
+	/* Offsets from the string start (or from the host start for tld) */
+	guint16 user;
+	guint16 host;
+	guint16 data;
+	guint16 query;
+	guint16 fragment;
+	guint16 tld;
+	enum rspamd_url_flags flags;
+	/* Raw url, then parsed string, then host if it is not in the string */
+	gchar buf[URL_CACHE_DATA_LEN];
+};
+
+struct rspamd_url_cache {
+	struct rspamd_url_cache_elt *elts;
+	rspamd_mempool_mutex_t *locks[URL_CACHE_LOCKS];
+	guint nsets;
+	gint stamp;
+	guint64 seed;
+};
+
+static struct rspamd_url_cache *url_cache = NULL;
+
 enum {
 	IS_LWSP = (1 << 0),
 	IS_DOMAIN = (1 << 1),
@@ -385,75 +448,6 @@ rspamd_url_strerror (enum uri_errno err)
 	return NULL;
 }
 
-static void
-rspamd_url_parse_tld_file (const gchar *fname,
-		struct url_match_scanner *scanner)
-{
-	FILE *f;
-	struct url_matcher m;
-	gchar *linebuf = NULL, *p;
-	gsize buflen = 0;
-	gssize r;
-	gint flags;
-
-	f = fopen (fname, "r");
-
-	if (f == NULL) {
-		msg_err ("cannot open TLD file %s: %s", fname, strerror (errno));
-		return;
-	}
-
-	m.end = url_tld_end;
-	m.start = url_tld_start;
-	m.prefix = "http://";
-
-	while ((r = getline (&linebuf, &buflen, f)) > 0) {
-		if (linebuf[0] == '/' || g_ascii_isspace (linebuf[0])) {
-			/* Skip comment or empty line */
-			continue;
-		}
-
-		g_strchomp (linebuf);
-
-		/* TODO: add support for ! patterns */
-		if (linebuf[0] == '!') {
-			msg_debug ("skip '!' patterns from parsing for now: %s", linebuf);
-			continue;
-		}
-
-		flags = URL_FLAG_NOHTML | URL_FLAG_TLD_MATCH;
-
-#ifndef WITH_HYPERSCAN
-		if (linebuf[0] == '*') {
-			flags |= URL_FLAG_STAR_MATCH;
-			p = strchr (linebuf, '.');
-
-			if (p == NULL) {
-				msg_err ("got bad star line, skip it: %s", linebuf);
-				continue;
-			}
-			p++;
-		}
-		else {
-			p = linebuf;
-		}
-#else
-		p = linebuf;
-#endif
-
-		m.flags = flags;
-		rspamd_multipattern_add_pattern (url_scanner->search_trie, p,
-				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
-		m.pattern = rspamd_multipattern_get_pattern (url_scanner->search_trie,
-				rspamd_multipattern_get_npatterns (url_scanner->search_trie) - 1);
-		m.patlen = strlen (m.pattern);
-		g_array_append_val (url_scanner->matchers, m);
-	}
-
-	free (linebuf);
-	fclose (f);
-}
-
 static void
 rspamd_url_add_static_matchers (struct url_match_scanner *sc)
 {
@@ -478,44 +472,74 @@ rspamd_url_add_static_matchers (struct url_match_scanner *sc)
 }
 
 void
-rspamd_url_init (const gchar *tld_file)
+rspamd_url_init (const gchar *tld_file, const gchar *cache_dir)
 {
 	GError *err = NULL;
 
 	if (url_scanner == NULL) {
-		url_scanner = g_malloc (sizeof (struct url_match_scanner));
-
-		if (tld_file) {
-			/* Reserve larger multipattern */
-			url_scanner->matchers = g_array_sized_new (FALSE, TRUE,
-					sizeof (struct url_matcher), 13000);
-			url_scanner->search_trie = rspamd_multipattern_create_sized (13000,
+		url_scanner = g_malloc0 (sizeof (struct url_match_scanner));
+		url_scanner->matchers = g_array_sized_new (FALSE, TRUE,
+				sizeof (struct url_matcher), 128);
+		url_scanner->search_trie = rspamd_multipattern_create_sized (128,
 				RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
-		}
-		else {
-			url_scanner->matchers = g_array_sized_new (FALSE, TRUE,
-					sizeof (struct url_matcher), 128);
-			url_scanner->search_trie = rspamd_multipattern_create_sized (128,
-					RSPAMD_MULTIPATTERN_TLD | RSPAMD_MULTIPATTERN_ICASE);
-		}
 
 		rspamd_url_add_static_matchers (url_scanner);
 
+		/* TLD matches are not in the multipattern, so it is after all others */
+		g_array_append_val (url_scanner->matchers, tld_matcher);
+		url_scanner->tld_matcher_idx = url_scanner->matchers->len - 1;
+
 		if (tld_file != NULL) {
-			rspamd_url_parse_tld_file (tld_file, url_scanner);
+			url_scanner->tld_trie = rspamd_tld_trie_load (tld_file, cache_dir,
+					&err);
+
+			if (url_scanner->tld_trie == NULL) {
+				msg_err ("cannot load tld file, url matching will be "
+						"broken completely: %e", err);
+				g_error_free (err);
+				err = NULL;
+			}
 		}
 
 		if (!rspamd_multipattern_compile (url_scanner->search_trie, &err)) {
-			msg_err ("cannot compile tld patterns, url matching will be "
+			msg_err ("cannot compile url patterns, url matching will be "
 					"broken completely: %e", err);
 			g_error_free (err);
 		}
 
-		msg_debug ("initialized trie of %ud elements",
-				url_scanner->matchers->len);
+		msg_debug ("initialized url scanner with %ud matchers and %ud tld rules",
+				url_scanner->matchers->len,
+				url_scanner->tld_trie ?
+				rspamd_tld_trie_nrules (url_scanner->tld_trie) : 0);
 	}
 }
 
+void
+rspamd_url_cache_init (guint nelts)
+{
+	rspamd_mempool_t *pool;
+	guint i;
+
+	if (url_cache != NULL || nelts == 0) {
+		return;
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "url_cache");
+	url_cache = rspamd_mempool_alloc0_shared (pool, sizeof (*url_cache));
+	url_cache->nsets = MAX (nelts / URL_CACHE_WAYS, 1);
+	url_cache->elts = rspamd_mempool_alloc0_shared (pool,
+			sizeof (struct rspamd_url_cache_elt) *
+			url_cache->nsets * URL_CACHE_WAYS);
+	url_cache->seed = rspamd_hash_seed ();
+
+	for (i = 0; i < G_N_ELEMENTS (url_cache->locks); i ++) {
+		url_cache->locks[i] = rspamd_mempool_get_mutex (pool);
+	}
+
+	msg_debug ("initialized url cache with %ud elements",
+			url_cache->nsets * URL_CACHE_WAYS);
+}
+
 #define SET_U(u, field) do {                                                \
     if ((u) != NULL) {                                                        \
         (u)->field_set |= 1 << (field);                                        \
@@ -1156,69 +1180,6 @@ rspamd_web_parse (struct http_parser_url *u, const gchar *str, gsize len,
 
 #undef SET_U
 
-static gint
-rspamd_tld_trie_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
-{
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct rspamd_url *url = context;
-	gint ndots = 1;
-
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
-
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
-
-	pos = text + match_start;
-	p = pos - 1;
-	start = url->host;
-
-	if (*pos != '.' || match_pos != (gint) url->hostlen) {
-		/* Something weird has been found */
-		if (match_pos == (gint) url->hostlen - 1) {
-			pos = url->host + match_pos;
-			if (*pos == '.') {
-				/* This is dot at the end of domain */
-				url->hostlen--;
-			}
-			else {
-				return 0;
-			}
-		}
-		else {
-			return 0;
-		}
-	}
-
-	/* Now we need to find top level domain */
-	pos = start;
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
-		}
-
-		p--;
-	}
-
-	if ((ndots == 0 || p == start - 1) &&
-			url->tldlen < url->host + url->hostlen - pos) {
-		url->tld = (gchar *) pos;
-		url->tldlen = url->host + url->hostlen - pos;
-	}
-
-	return 0;
-}
-
 static gboolean
 rspamd_url_is_ip (struct rspamd_url *uri, rspamd_mempool_t *pool)
 {
@@ -1481,8 +1442,8 @@ rspamd_url_shift (struct rspamd_url *uri, gsize nlen,
 	}
 }
 
-enum uri_errno
-rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
+static enum uri_errno
+rspamd_url_parse_uncached (struct rspamd_url *uri, gchar *uristring, gsize len,
 		rspamd_mempool_t *pool)
 {
 	struct http_parser_url u;
@@ -1611,9 +1572,22 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	}
 
 	/* Find TLD part */
-	rspamd_multipattern_lookup (url_scanner->search_trie,
-				uri->host, uri->hostlen,
-				rspamd_tld_trie_callback, uri, NULL);
+	if (url_scanner->tld_trie != NULL && uri->hostlen > 0) {
+		rspamd_ftok_t tld;
+		guint hostlen = uri->hostlen;
+
+		if (hostlen > 1 && uri->host[hostlen - 1] == '.') {
+			/* Dot at the end of domain */
+			hostlen --;
+		}
+
+		if (rspamd_tld_trie_find (url_scanner->tld_trie, uri->host, hostlen,
+				&tld)) {
+			uri->hostlen = hostlen;
+			uri->tld = (gchar *)tld.begin;
+			uri->tldlen = tld.len;
+		}
+	}
 
 	if (uri->tldlen == 0) {
 		/* Ignore URL's without TLD if it is not a numeric URL */
@@ -1629,86 +1603,240 @@ rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
 	return URI_ERRNO_OK;
 }
 
-struct tld_trie_cbdata {
-	const gchar *begin;
-	gsize len;
-	rspamd_ftok_t *out;
-};
+static inline guint16
+rspamd_url_cache_off (const gchar *base, const gchar *ptr)
+{
+	return ptr == NULL ? URL_CACHE_NOPTR : ptr - base;
+}
 
-static gint
-rspamd_tld_trie_find_callback (struct rspamd_multipattern *mp,
-		guint strnum,
-		gint match_start,
-		gint match_pos,
-		const gchar *text,
-		gsize len,
-		void *context)
+static inline gchar *
+rspamd_url_cache_ptr (gchar *base, guint16 off)
 {
-	struct url_matcher *matcher;
-	const gchar *start, *pos, *p;
-	struct tld_trie_cbdata *cbdata = context;
-	gint ndots = 1;
+	return off == URL_CACHE_NOPTR ? NULL : base + off;
+}
 
-	matcher = &g_array_index (url_scanner->matchers, struct url_matcher,
-			strnum);
+static inline gboolean
+rspamd_url_cache_in (const gchar *base, gsize len, const gchar *ptr)
+{
+	return ptr == NULL || (ptr >= base && ptr <= base + len);
+}
 
-	if (matcher->flags & URL_FLAG_STAR_MATCH) {
-		/* Skip one more tld component */
-		ndots = 2;
-	}
+static gboolean
+rspamd_url_cache_lookup (guint64 h, struct rspamd_url *uri,
+		gchar *uristring, gsize len, rspamd_mempool_t *pool)
+{
+	struct rspamd_url_cache_elt *elt;
+	rspamd_mempool_mutex_t *lock;
+	gchar *str, *host;
+	guint set, i;
+	gboolean ret = FALSE;
 
-	pos = text + match_start;
-	p = pos - 1;
-	start = text;
+	set = h % url_cache->nsets;
+	lock = url_cache->locks[set % URL_CACHE_LOCKS];
+	elt = &url_cache->elts[set * URL_CACHE_WAYS];
+
+	rspamd_mempool_lock_mutex (lock);
+
+	for (i = 0; i < URL_CACHE_WAYS; i ++, elt ++) {
+		if (elt->hash != h || elt->rawlen != len ||
+				memcmp (elt->buf, uristring, len) != 0) {
+			continue;
+		}
+
+		memset (uri, 0, sizeof (*uri));
+
+		/* Restore the string exactly as the parser would leave it */
+		if (elt->cflags & URL_CACHE_ELT_COPY) {
+			str = rspamd_mempool_alloc (pool, elt->urllen + 1);
+			memcpy (str, elt->buf + len, elt->urllen);
+			str[elt->urllen] = '\0';
+			host = elt->buf + len + elt->urllen;
+		}
+		else {
+			str = uristring;
+			memcpy (str, elt->buf + len, len);
+			host = elt->buf + len + len;
+		}
 
-	if (*pos != '.' || match_pos != (gint)cbdata->len) {
-		/* Something weird has been found */
-		if (match_pos != (gint)cbdata->len - 1) {
-			/* Search more */
-			return 0;
+		if (elt->cflags & URL_CACHE_ELT_HOST) {
+			uri->host = rspamd_mempool_alloc (pool, elt->hostlen + 1);
+			memcpy (uri->host, host, elt->hostlen);
+			uri->host[elt->hostlen] = '\0';
 		}
+		else {
+			uri->host = str + elt->host;
+		}
+
+		uri->string = str;
+		uri->user = rspamd_url_cache_ptr (str, elt->user);
+		uri->data = rspamd_url_cache_ptr (str, elt->data);
+		uri->query = rspamd_url_cache_ptr (str, elt->query);
+		uri->fragment = rspamd_url_cache_ptr (str, elt->fragment);
+		uri->tld = rspamd_url_cache_ptr (uri->host, elt->tld);
+		uri->protocol = elt->protocol;
+		uri->port = elt->port;
+		uri->protocollen = elt->protocollen;
+		uri->userlen = elt->userlen;
+		uri->hostlen = elt->hostlen;
+		uri->datalen = elt->datalen;
+		uri->querylen = elt->querylen;
+		uri->fragmentlen = elt->fragmentlen;
+		uri->tldlen = elt->tldlen;
+		uri->urllen = elt->urllen;
+		uri->flags = elt->flags;
+
+		elt->stamp = g_atomic_int_add (&url_cache->stamp, 1);
+		ret = TRUE;
+		break;
+	}
+
+	rspamd_mempool_unlock_mutex (lock);
+
+	return ret;
+}
+
+static void
+rspamd_url_cache_insert (guint64 h, const gchar *raw, gsize len,
+		const gchar *uristring, const struct rspamd_url *uri)
+{
+	struct rspamd_url_cache_elt *elt, *victim = NULL;
+	rspamd_mempool_mutex_t *lock;
+	gboolean in_place, host_in_string;
+	gsize slen, total;
+	guint set, i;
+
+	in_place = (uri->string == uristring);
+	slen = in_place ? len : uri->urllen;
+	host_in_string = rspamd_url_cache_in (uri->string, uri->urllen, uri->host);
+	total = len + slen + (host_in_string ? 0 : uri->hostlen);
+
+	if (total > URL_CACHE_DATA_LEN || uri->port > G_MAXUINT16 ||
+			!rspamd_url_cache_in (uri->string, uri->urllen, uri->user) ||
+			!rspamd_url_cache_in (uri->string, uri->urllen, uri->data) ||
+			!rspamd_url_cache_in (uri->string, uri->urllen, uri->query) ||
+			!rspamd_url_cache_in (uri->string, uri->urllen, uri->fragment) ||
+			!rspamd_url_cache_in (uri->host, uri->hostlen, uri->tld)) {
+		/* Cannot be represented by offsets */
+		return;
 	}
 
-	/* Now we need to find top level domain */
-	pos = start;
+	set = h % url_cache->nsets;
+	lock = url_cache->locks[set % URL_CACHE_LOCKS];
+	elt = &url_cache->elts[set * URL_CACHE_WAYS];
+
+	rspamd_mempool_lock_mutex (lock);
+
+	for (i = 0; i < URL_CACHE_WAYS; i ++, elt ++) {
+		if (elt->hash == h && elt->rawlen == len &&
+				memcmp (elt->buf, raw, len) == 0) {
+			/* Another process has already inserted this url */
+			rspamd_mempool_unlock_mutex (lock);
 
-	while (p >= start && ndots > 0) {
-		if (*p == '.') {
-			ndots--;
-			pos = p + 1;
+			return;
 		}
 
-		p--;
+		if (elt->rawlen == 0) {
+			if (victim == NULL || victim->rawlen != 0) {
+				victim = elt;
+			}
+		}
+		else if (victim == NULL ||
+				(victim->rawlen != 0 && elt->stamp < victim->stamp)) {
+			victim = elt;
+		}
 	}
 
-	if (ndots == 0 || p == start - 1) {
-		if (cbdata->begin + cbdata->len - pos > cbdata->out->len) {
-			cbdata->out->begin = pos;
-			cbdata->out->len = cbdata->begin + cbdata->len - pos;
+	elt = victim;
+	elt->hash = h;
+	elt->rawlen = len;
+	elt->cflags = in_place ? 0 : URL_CACHE_ELT_COPY;
+	memcpy (elt->buf, raw, len);
+	memcpy (elt->buf + len, uri->string, slen);
+
+	if (host_in_string) {
+		elt->host = rspamd_url_cache_off (uri->string, uri->host);
+	}
+	else {
+		elt->cflags |= URL_CACHE_ELT_HOST;
+		elt->host = 0;
+		memcpy (elt->buf + len + slen, uri->host, uri->hostlen);
+	}
+
+	elt->user = rspamd_url_cache_off (uri->string, uri->user);
+	elt->data = rspamd_url_cache_off (uri->string, uri->data);
+	elt->query = rspamd_url_cache_off (uri->string, uri->query);
+	elt->fragment = rspamd_url_cache_off (uri->string, uri->fragment);
+	elt->tld = rspamd_url_cache_off (uri->host, uri->tld);
+	elt->protocol = uri->protocol;
+	elt->port = uri->port;
+	elt->protocollen = uri->protocollen;
+	elt->userlen = uri->userlen;
+	elt->hostlen = uri->hostlen;
+	elt->datalen = uri->datalen;
+	elt->querylen = uri->querylen;
+	elt->fragmentlen = uri->fragmentlen;
+	elt->tldlen = uri->tldlen;
+	elt->urllen = uri->urllen;
+	elt->flags = uri->flags;
+	elt->stamp = g_atomic_int_add (&url_cache->stamp, 1);
+
+	rspamd_mempool_unlock_mutex (lock);
+}
+
+enum uri_errno
+rspamd_url_parse (struct rspamd_url *uri, gchar *uristring, gsize len,
+		rspamd_mempool_t *pool)
+{
+	gchar raw[URL_CACHE_MAX_RAW];
+	guint64 h = 0;
+	gboolean cacheable;
+	enum uri_errno ret;
+
+	/* Parsing is done in place, so the raw url is saved for the cache */
+	cacheable = (url_cache != NULL && len > 0 && len <= sizeof (raw));
+
+	if (cacheable) {
+		h = rspamd_cryptobox_fast_hash (uristring, len, url_cache->seed);
+
+		if (rspamd_url_cache_lookup (h, uri, uristring, len, pool)) {
+			return URI_ERRNO_OK;
 		}
+
+		memcpy (raw, uristring, len);
 	}
 
-	return 0;
+	ret = rspamd_url_parse_uncached (uri, uristring, len, pool);
+
+	if (cacheable && ret == URI_ERRNO_OK) {
+		rspamd_url_cache_insert (h, raw, len, uristring, uri);
+	}
+
+	return ret;
 }
 
 gboolean
 rspamd_url_find_tld (const gchar *in, gsize inlen, rspamd_ftok_t *out)
 {
-	struct tld_trie_cbdata cbdata;
+	gsize len = inlen;
 
 	g_assert (in != NULL);
 	g_assert (out != NULL);
 	g_assert (url_scanner != NULL);
 
-	cbdata.begin = in;
-	cbdata.len = inlen;
-	cbdata.out = out;
 	out->len = 0;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in, inlen,
-			rspamd_tld_trie_find_callback, &cbdata, NULL);
+	if (url_scanner->tld_trie == NULL) {
+		return FALSE;
+	}
+
+	if (len > 1 && in[len - 1] == '.') {
+		len --;
+	}
+
+	if (rspamd_tld_trie_find (url_scanner->tld_trie, in, len, out)) {
+		/* Trailing dot is a part of tld as it has been passed */
+		out->len += inlen - len;
 
-	if (out->len > 0) {
 		return TRUE;
 	}
 
@@ -2180,6 +2308,123 @@ rspamd_url_trie_callback (struct rspamd_multipattern *mp,
 	return 0;
 }
 
+struct url_lookup_cbdata {
+	rspamd_multipattern_cb_t cb;
+	gpointer ud;
+	const gchar *in;
+	gsize len;
+	gsize tld_pos;
+};
+
+#define is_label_char(x) (g_ascii_isalnum (x) || (x) == '-' || \
+		(guchar)(x) >= 0x80)
+
+/*
+ * Emits matches for domains with known suffixes that end before limit. Each
+ * domain is reported once as a match of its last label with the leading dot
+ */
+static gint
+rspamd_url_tld_scan (struct url_lookup_cbdata *cbd, gsize limit)
+{
+	const gchar *in = cbd->in, *dot;
+	gsize d, e, s;
+	gint ret;
+
+	while (cbd->tld_pos < cbd->len) {
+		dot = memchr (in + cbd->tld_pos, '.', cbd->len - cbd->tld_pos);
+
+		if (dot == NULL) {
+			cbd->tld_pos = cbd->len;
+			break;
+		}
+
+		d = dot - in;
+		e = d + 1;
+
+		while (e < cbd->len && is_label_char (in[e])) {
+			e ++;
+		}
+
+		if (e == d + 1 || (e + 1 < cbd->len && in[e] == '.' &&
+				is_label_char (in[e + 1]))) {
+			/* Not the last label of a domain */
+			cbd->tld_pos = d + 1;
+			continue;
+		}
+
+		if (e > limit) {
+			/* Wait for the pattern matches that end before this domain */
+			break;
+		}
+
+		cbd->tld_pos = e;
+		s = d;
+
+		while (s > 0 && (is_label_char (in[s - 1]) || in[s - 1] == '.')) {
+			s --;
+		}
+
+		if (s < d && rspamd_tld_trie_find (url_scanner->tld_trie, in + s,
+				e - s, NULL)) {
+			ret = cbd->cb (NULL, url_scanner->tld_matcher_idx, d, e,
+					in, cbd->len, cbd->ud);
+
+			if (ret != 0) {
+				return ret;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static gint
+rspamd_url_lookup_callback (struct rspamd_multipattern *mp,
+		guint strnum,
+		gint match_start,
+		gint match_pos,
+		const gchar *text,
+		gsize len,
+		void *context)
+{
+	struct url_lookup_cbdata *cbd = context;
+	gint ret;
+
+	/* Keep matches ordered by their end as callbacks track newlines */
+	if (url_scanner->tld_trie &&
+			(ret = rspamd_url_tld_scan (cbd, match_pos)) != 0) {
+		return ret;
+	}
+
+	return cbd->cb (mp, strnum, match_start, match_pos, text, len, cbd->ud);
+}
+
+/*
+ * Finds url patterns and domains with known suffixes in the text
+ */
+static gint
+rspamd_url_lookup (const gchar *in, gsize len, rspamd_multipattern_cb_t cb,
+		gpointer ud)
+{
+	struct url_lookup_cbdata cbd;
+	gint ret;
+
+	cbd.cb = cb;
+	cbd.ud = ud;
+	cbd.in = in;
+	cbd.len = len;
+	cbd.tld_pos = 0;
+
+	ret = rspamd_multipattern_lookup (url_scanner->search_trie, in, len,
+			rspamd_url_lookup_callback, &cbd, NULL);
+
+	if (ret == 0 && url_scanner->tld_trie) {
+		ret = rspamd_url_tld_scan (&cbd, len);
+	}
+
+	return ret;
+}
+
 gboolean
 rspamd_url_find (rspamd_mempool_t *pool,
 		const gchar *begin,
@@ -2196,8 +2441,7 @@ rspamd_url_find (rspamd_mempool_t *pool,
 	cb.is_html = is_html;
 	cb.pool = pool;
 
-	ret = rspamd_multipattern_lookup (url_scanner->search_trie, begin, len,
-			rspamd_url_trie_callback, &cb, NULL);
+	ret = rspamd_url_lookup (begin, len, rspamd_url_trie_callback, &cb);
 
 	if (ret) {
 		if (url_str) {
@@ -2258,11 +2502,12 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 		}
 	}
 
-	if (!rspamd_url_trie_is_match (matcher, pos, text + len, newline_pos)) {
+	if (!rspamd_url_trie_is_match (matcher, pos, cb->end, newline_pos)) {
 		return 0;
 	}
 
-	pos = cb->begin + match_start;
+	/* Text might be a window of cb->begin if scanned with a prefilter */
+	pos = text + match_start;
 	m.pattern = matcher->pattern;
 	m.prefix = matcher->prefix;
 	m.add_prefix = FALSE;
@@ -2295,7 +2540,8 @@ rspamd_url_trie_generic_callback_common (struct rspamd_multipattern *mp,
 
 		if (rc == URI_ERRNO_OK && url->hostlen > 0) {
 			if (cb->func) {
-				cb->func (url, cb->start - text, cb->fin - text, cb->funcd);
+				cb->func (url, cb->start - cb->begin, cb->fin - cb->begin,
+						cb->funcd);
 			}
 		}
 		else if (rc != URI_ERRNO_OK) {
@@ -2434,12 +2680,97 @@ rspamd_url_text_extract (rspamd_mempool_t *pool,
 			rspamd_url_text_part_callback, &mcbd);
 }
 
+#define URL_SWAR_ONES G_GUINT64_CONSTANT (0x0101010101010101)
+#define URL_SWAR_HIGHS G_GUINT64_CONSTANT (0x8080808080808080)
+#define URL_SWAR_HAS(w, c) ((((w) ^ (URL_SWAR_ONES * (c))) - URL_SWAR_ONES) & \
+		~((w) ^ (URL_SWAR_ONES * (c))) & URL_SWAR_HIGHS)
+#define URL_SWAR_CANDIDATE(w) \
+		(URL_SWAR_HAS (w, '.') | URL_SWAR_HAS (w, ':') | URL_SWAR_HAS (w, '@'))
+/* Candidate tokens closer than this are scanned as a single window */
+#define URL_WINDOW_GAP 128
+
+/*
+ * Returns the offset of the next '.', ':' or '@' starting from pos or len if
+ * there are no such characters. Every url matcher pattern contains at least
+ * one of them, so text without them cannot contain urls. The text is checked
+ * in 16 bytes blocks using word-at-a-time comparisons
+ */
+static gsize
+rspamd_url_next_special (const gchar *in, gsize len, gsize pos)
+{
+	guint64 w1, w2;
+
+	while (pos + 16 <= len) {
+		memcpy (&w1, in + pos, sizeof (w1));
+		memcpy (&w2, in + pos + 8, sizeof (w2));
+
+		if ((URL_SWAR_CANDIDATE (w1) | URL_SWAR_CANDIDATE (w2)) != 0) {
+			break;
+		}
+
+		pos += 16;
+	}
+
+	for (; pos < len; pos ++) {
+		if (in[pos] == '.' || in[pos] == ':' || in[pos] == '@') {
+			return pos;
+		}
+	}
+
+	return len;
+}
+
+static gboolean
+rspamd_url_has_suffix_icase (const gchar *in, gsize pos, const gchar *suffix,
+		gsize slen)
+{
+	return pos >= slen &&
+			g_ascii_strncasecmp (in + pos - slen, suffix, slen) == 0;
+}
+
+/*
+ * Checks whether a special character found by rspamd_url_next_special can be
+ * a part of url pattern match
+ */
+static gboolean
+rspamd_url_is_candidate (const gchar *in, gsize len, gsize pos)
+{
+	guchar next = pos + 1 < len ? in[pos + 1] : '\0';
+
+	switch (in[pos]) {
+	case '@':
+		return TRUE;
+	case ':':
+		/* Schemes, either with slashes or mailto:, sip: and h323: */
+		if (next == '/' || next == '\\') {
+			return TRUE;
+		}
+
+		return rspamd_url_has_suffix_icase (in, pos, "mailto", 6) ||
+				rspamd_url_has_suffix_icase (in, pos, "sip", 3) ||
+				rspamd_url_has_suffix_icase (in, pos, "h323", 4);
+	case '.':
+		/* TLD starts with a letter, numbers such as 1.5 are skipped */
+		if (g_ascii_isalpha (next) || next >= 0x80) {
+			return TRUE;
+		}
+
+		return rspamd_url_has_suffix_icase (in, pos, "www", 3) ||
+				rspamd_url_has_suffix_icase (in, pos, "ftp", 3);
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
 void
 rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 		gsize inlen, gboolean is_html, GPtrArray *nlines,
 		url_insert_function func, gpointer ud)
 {
 	struct url_callback_data cb;
+	gsize pos, tstart, wstart, wend;
 
 	g_assert (in != NULL);
 
@@ -2457,9 +2788,57 @@ rspamd_url_find_multiple (rspamd_mempool_t *pool, const gchar *in,
 	cb.func = func;
 	cb.newlines = nlines;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_multiple, &cb, NULL);
+	/*
+	 * Run the trie only over windows of whitespace separated tokens that
+	 * have candidate characters, as patterns cannot span whitespace
+	 */
+	pos = 0;
+	wstart = 0;
+	wend = 0;
+
+	for (;;) {
+		pos = rspamd_url_next_special (in, inlen, pos);
+
+		if (pos < inlen && !rspamd_url_is_candidate (in, inlen, pos)) {
+			pos ++;
+			continue;
+		}
+
+		if (pos < inlen) {
+			tstart = pos;
+
+			while (tstart > wend && !g_ascii_isspace (in[tstart - 1])) {
+				tstart --;
+			}
+
+			if (wend > wstart && tstart - wend <= URL_WINDOW_GAP) {
+				/* Extend the current window */
+				tstart = wstart;
+			}
+		}
+		else {
+			tstart = inlen;
+		}
+
+		if (wend > wstart && tstart != wstart) {
+			/* Flush the previous window */
+			rspamd_url_lookup (in + wstart, wend - wstart,
+					rspamd_url_trie_generic_callback_multiple, &cb);
+		}
+
+		if (pos >= inlen) {
+			break;
+		}
+
+		wstart = tstart;
+		wend = pos + 1;
+
+		while (wend < inlen && !g_ascii_isspace (in[wend])) {
+			wend ++;
+		}
+
+		pos = wend;
+	}
 }
 
 void
@@ -2484,9 +2863,7 @@ rspamd_url_find_single (rspamd_mempool_t *pool, const gchar *in,
 	cb.funcd = ud;
 	cb.func = func;
 
-	rspamd_multipattern_lookup (url_scanner->search_trie, in,
-			inlen,
-			rspamd_url_trie_generic_callback_single, &cb, NULL);
+	rspamd_url_lookup (in, inlen, rspamd_url_trie_generic_callback_single, &cb);
 }
 
 
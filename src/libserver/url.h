@@ -74,9 +74,17 @@ enum rspamd_url_protocol {
 
 /**
  * Initialize url library
- * @param cfg
+ * @param tld_file public suffix list file
+ * @param cache_dir directory to cache the compiled suffix trie (can be NULL)
  */
-void rspamd_url_init (const gchar *tld_file);
+void rspamd_url_init (const gchar *tld_file, const gchar *cache_dir);
+
+/**
+ * Initialize cache of parsed urls shared by all processes forked after this
+ * call. Does nothing if the cache has been already initialized
+ * @param nelts number of urls in the cache (0 to disable caching)
+ */
+void rspamd_url_cache_init (guint nelts);
 
 /*
  * Parse urls inside text
@@ -91,7 +99,8 @@ void rspamd_url_text_extract (rspamd_mempool_t *pool,
 	gboolean is_html);
 
 /*
- * Parse a single url into an uri structure
+ * Parse a single url into an uri structure. If the url cache is initialized,
+ * then urls parsed before are restored from it
  * @param pool memory pool
  * @param uristring text form of url
  * @param uri url object, must be pre allocated
@@ -43,6 +43,9 @@
 #ifdef HAVE_LIBUTIL_H
 #include <libutil.h>
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 
 static void rspamd_worker_ignore_signal (int signo);
 /**
@@ -254,7 +257,7 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 {
 	struct event_base *ev_base;
 	struct event *accept_events;
-	GList *cur;
+	GList *cur, *all;
 	struct rspamd_worker_listen_socket *ls;
 
 #ifdef WITH_PROFILER
@@ -279,7 +282,9 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 
 	/* Accept all sockets */
 	if (accept_handler) {
-		cur = worker->cf->listen_socks;
+		cur = g_list_concat (g_list_copy (worker->cf->listen_socks),
+				g_list_copy (rspamd_worker_own_sockets (worker)));
+		all = cur;
 
 		while (cur) {
 			ls = cur->data;
@@ -296,6 +301,8 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 
 			cur = g_list_next (cur);
 		}
+
+		g_list_free (all);
 	}
 
 	if (load_lua) {
@@ -515,6 +522,44 @@ rspamd_worker_set_limits (struct rspamd_main *rspamd_main,
 	}
 }
 
+GList *
+rspamd_worker_own_sockets (struct rspamd_worker *worker)
+{
+	GPtrArray *socks = worker->cf->reuseport_socks;
+
+	if (socks != NULL && worker->index < socks->len) {
+		return g_ptr_array_index (socks, worker->index);
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_worker_set_cpu_affinity (struct rspamd_main *rspamd_main,
+		struct rspamd_worker *wrk)
+{
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t set;
+	glong ncpus;
+
+	ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (ncpus <= 0) {
+		return;
+	}
+
+	CPU_ZERO (&set);
+	CPU_SET (wrk->index % ncpus, &set);
+
+	if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+		msg_warn_main ("cannot bind worker to cpu %d: %s",
+				(gint)(wrk->index % ncpus), strerror (errno));
+	}
+#else
+	msg_warn_main ("cpu affinity is not supported on this platform");
+#endif
+}
+
 struct rspamd_worker *
 rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		struct rspamd_worker_conf *cf,
@@ -573,6 +618,11 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		rspamd_worker_drop_priv (rspamd_main);
 		/* Set limits */
 		rspamd_worker_set_limits (rspamd_main, cf);
+
+		if (cf->cpu_affinity) {
+			rspamd_worker_set_cpu_affinity (rspamd_main, wrk);
+		}
+
 		/* Re-set stack limit */
 		getrlimit (RLIMIT_STACK, &rlim);
 		rlim.rlim_cur = 100 * 1024 * 1024;
@@ -57,6 +57,14 @@ void rspamd_worker_set_signal_handler (int signo,
  */
 void rspamd_worker_stop_accept (struct rspamd_worker *worker);
 
+/**
+ * Returns sockets that are bound for this worker only, when `reuseport` is
+ * set for the workers of this type
+ * @param worker
+ * @return list of struct rspamd_worker_listen_socket (must not be freed)
+ */
+GList * rspamd_worker_own_sockets (struct rspamd_worker *worker);
+
 typedef gint (*rspamd_controller_func_t) (
 	struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg,
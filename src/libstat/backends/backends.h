@@ -53,6 +53,8 @@ struct rspamd_stat_backend {
 	gulong (*dec_learns)(struct rspamd_task *task,
 			gpointer runtime, gpointer ctx);
 	ucl_object_t* (*get_stat)(gpointer runtime, gpointer ctx);
+	const gchar* (*storage_key)(struct rspamd_task *task,
+			gpointer runtime, gpointer ctx);
 	void (*close)(gpointer ctx);
 
 	gpointer (*load_tokenizer_config)(gpointer runtime, gsize *sz);
@@ -91,6 +93,9 @@ struct rspamd_stat_backend {
 				gpointer ctx); \
 		ucl_object_t * rspamd_##name##_get_stat (gpointer runtime, \
 				gpointer ctx); \
+		const gchar * rspamd_##name##_storage_key (struct rspamd_task *task, \
+				gpointer runtime, \
+				gpointer ctx); \
 		gpointer rspamd_##name##_load_tokenizer_config (gpointer runtime, \
 				gsize *len); \
 		void rspamd_##name##_close (gpointer ctx)
@@ -1087,6 +1087,14 @@ rspamd_mmaped_file_get_stat (gpointer runtime,
 	return res;
 }
 
+const gchar *
+rspamd_mmaped_file_storage_key (struct rspamd_task *task, gpointer runtime,
+		gpointer ctx)
+{
+	/* Statfile is the only storage of its tokens */
+	return "";
+}
+
 void
 rspamd_mmaped_file_finalize_learn (struct rspamd_task *task, gpointer runtime,
 		gpointer ctx)
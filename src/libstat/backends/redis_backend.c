@@ -32,8 +32,11 @@
 #define REDIS_DEFAULT_OBJECT "%s%l"
 #define REDIS_DEFAULT_USERS_OBJECT "%s%l%r"
 #define REDIS_DEFAULT_TIMEOUT 0.5
+#define REDIS_DEFAULT_BATCH_TIMEOUT 0.001
 #define REDIS_STAT_TIMEOUT 30
 
+struct redis_stat_batch;
+
 struct redis_stat_ctx {
 	struct rspamd_statfile_config *stcf;
 	struct upstream_list *read_servers;
@@ -43,8 +46,11 @@ struct redis_stat_ctx {
 	const gchar *password;
 	const gchar *dbname;
 	gdouble timeout;
+	gdouble batch_timeout;
+	struct redis_stat_batch *batch;
 	gboolean enable_users;
 	gint cbref_user;
+	ref_entry_t ref;
 };
 
 enum rspamd_redis_connection_state {
@@ -67,6 +73,48 @@ struct redis_stat_runtime {
 	guint64 learned;
 	gint id;
 	gboolean has_event;
+	/* Batched classification */
+	gboolean batched;
+	GPtrArray *tokens;
+	guint32 *tok_idx;
+	struct redis_stat_batch_group *group;
+	guint group_idx;
+};
+
+/*
+ * Tokens lookups of all tasks classified within batch_timeout are gathered
+ * and sent as a single pipeline. Tasks using the same redis object form
+ * a group, and common tokens of a group are requested only once.
+ */
+struct redis_stat_batch_group {
+	gchar *object;
+	GPtrArray *rts;
+	guint64 *tokens;
+	guint ntokens;
+	struct redis_stat_batch_request *req;
+};
+
+struct redis_stat_batch {
+	struct redis_stat_ctx *ctx;
+	struct event_base *ev_base;
+	struct event flush_event;
+	GHashTable *groups;
+	gboolean armed;
+};
+
+struct redis_stat_batch_request {
+	struct redis_stat_ctx *ctx;
+	redisAsyncContext *redis;
+	struct upstream *selected;
+	struct event timeout_event;
+	GPtrArray *groups;
+	guint inflight;
+};
+
+struct redis_stat_batch_ref {
+	guint64 num;
+	guint rt;
+	guint tok;
 };
 
 /* Used to get statistics from redis */
@@ -813,9 +861,9 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 		if (r != NULL) {
 			if (reply->type == REDIS_REPLY_ARRAY) {
 
-				if (reply->elements == task->tokens->len) {
+				if (reply->elements == rt->tokens->len) {
 					for (i = 0; i < reply->elements; i ++) {
-						tok = g_ptr_array_index (task->tokens, i);
+						tok = g_ptr_array_index (rt->tokens, i);
 						elt = reply->element[i];
 
 						if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
@@ -853,7 +901,7 @@ rspamd_redis_processed (redisAsyncContext *c, gpointer r, gpointer priv)
 					msg_err_task_check ("got invalid length of reply vector from redis: "
 							"%d, expected: %d",
 							(gint)reply->elements,
-							(gint)task->tokens->len);
+							(gint)rt->tokens->len);
 				}
 			}
 			else {
@@ -906,6 +954,500 @@ rspamd_redis_learned (redisAsyncContext *c, gpointer r, gpointer priv)
 	}
 }
 
+static rspamd_fstring_t *
+rspamd_redis_nums_to_query (const guint64 *nums, guint n,
+		const gchar *arg0, const gchar *arg1)
+{
+	rspamd_fstring_t *out;
+	gchar n0[64];
+	guint i, l0;
+
+	out = rspamd_fstring_sized_new (32 * (n + 2));
+	rspamd_printf_fstring (&out, ""
+			"*%d\r\n"
+			"$%d\r\n"
+			"%s\r\n"
+			"$%d\r\n"
+			"%s\r\n",
+			(n + 2),
+			(gint)strlen (arg0), arg0,
+			(gint)strlen (arg1), arg1);
+
+	for (i = 0; i < n; i ++) {
+		l0 = rspamd_snprintf (n0, sizeof (n0), "%uL", nums[i]);
+		rspamd_printf_fstring (&out, ""
+				"$%d\r\n"
+				"%s\r\n", l0, n0);
+	}
+
+	return out;
+}
+
+/* Called when task is finished or its batch has been processed */
+static void
+rspamd_redis_fin_batch (gpointer data)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
+
+	rt->has_event = FALSE;
+
+	if (rt->group) {
+		g_ptr_array_index (rt->group->rts, rt->group_idx) = NULL;
+		rt->group = NULL;
+	}
+}
+
+static void
+rspamd_redis_batch_group_free (struct redis_stat_batch_group *group)
+{
+	struct redis_stat_runtime *rt;
+	guint i;
+
+	/* Release tasks that have not got their results */
+	for (i = 0; i < group->rts->len; i ++) {
+		rt = g_ptr_array_index (group->rts, i);
+
+		if (rt != NULL && rt->has_event) {
+			rspamd_session_remove_event (rt->task->s, rspamd_redis_fin_batch,
+					rt);
+		}
+	}
+
+	g_ptr_array_free (group->rts, TRUE);
+	g_free (group->tokens);
+	g_free (group->object);
+	g_slice_free1 (sizeof (*group), group);
+}
+
+static void
+rspamd_redis_batch_request_fin (struct redis_stat_batch_request *req)
+{
+	redisAsyncContext *redis;
+	guint i;
+
+	if (event_get_base (&req->timeout_event)) {
+		event_del (&req->timeout_event);
+	}
+
+	for (i = 0; i < req->groups->len; i ++) {
+		rspamd_redis_batch_group_free (g_ptr_array_index (req->groups, i));
+	}
+
+	if (req->redis) {
+		redis = req->redis;
+		req->redis = NULL;
+		redisAsyncFree (redis);
+	}
+
+	g_ptr_array_free (req->groups, TRUE);
+	REF_RELEASE (req->ctx);
+	g_slice_free1 (sizeof (*req), req);
+}
+
+static void
+rspamd_redis_batch_request_dec (struct redis_stat_batch_request *req)
+{
+	g_assert (req->inflight > 0);
+
+	if (--req->inflight == 0) {
+		rspamd_redis_batch_request_fin (req);
+	}
+}
+
+static void
+rspamd_redis_batch_timeout (gint fd, short what, gpointer d)
+{
+	struct redis_stat_batch_request *req = d;
+	redisAsyncContext *redis;
+
+	msg_err ("connection to redis server %s timed out",
+			rspamd_upstream_name (req->selected));
+	rspamd_upstream_fail (req->selected);
+
+	if (req->redis) {
+		redis = req->redis;
+		req->redis = NULL;
+		/* This calls for all callbacks pending and frees request */
+		redisAsyncFree (redis);
+	}
+}
+
+static gint
+rspamd_redis_batch_ref_cmp (const void *a, const void *b)
+{
+	const struct redis_stat_batch_ref *r1 = a, *r2 = b;
+
+	if (r1->num < r2->num) {
+		return -1;
+	}
+	else if (r1->num > r2->num) {
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Builds unique tokens of a group and maps tokens of each task to them
+ */
+static guint
+rspamd_redis_batch_group_prepare (struct redis_stat_batch_group *group)
+{
+	struct redis_stat_runtime *rt;
+	struct redis_stat_batch_ref *refs;
+	rspamd_token_t *tok;
+	guint i, j, nrefs = 0, nuniq = 0;
+
+	for (i = 0; i < group->rts->len; i ++) {
+		rt = g_ptr_array_index (group->rts, i);
+
+		if (rt != NULL) {
+			nrefs += rt->tokens->len;
+		}
+	}
+
+	if (nrefs == 0) {
+		return 0;
+	}
+
+	refs = g_malloc (nrefs * sizeof (*refs));
+	nrefs = 0;
+
+	for (i = 0; i < group->rts->len; i ++) {
+		rt = g_ptr_array_index (group->rts, i);
+
+		if (rt != NULL) {
+			for (j = 0; j < rt->tokens->len; j ++) {
+				tok = g_ptr_array_index (rt->tokens, j);
+				memcpy (&refs[nrefs].num, tok->data, sizeof (refs[nrefs].num));
+				refs[nrefs].rt = i;
+				refs[nrefs].tok = j;
+				nrefs ++;
+			}
+		}
+	}
+
+	qsort (refs, nrefs, sizeof (*refs), rspamd_redis_batch_ref_cmp);
+	group->tokens = g_malloc (nrefs * sizeof (guint64));
+
+	for (i = 0; i < nrefs; i ++) {
+		if (nuniq == 0 || group->tokens[nuniq - 1] != refs[i].num) {
+			group->tokens[nuniq ++] = refs[i].num;
+		}
+
+		rt = g_ptr_array_index (group->rts, refs[i].rt);
+		rt->tok_idx[refs[i].tok] = nuniq - 1;
+	}
+
+	g_free (refs);
+	group->ntokens = nuniq;
+
+	return nuniq;
+}
+
+/* Called when we have got learns of a batch group */
+static void
+rspamd_redis_batch_learns (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_batch_group *group = priv;
+	struct redis_stat_runtime *rt;
+	redisReply *reply = r;
+	glong val = 0;
+	guint i;
+
+	if (c->err == 0 && r != NULL) {
+		if (G_UNLIKELY (reply->type == REDIS_REPLY_INTEGER)) {
+			val = reply->integer;
+		}
+		else if (reply->type == REDIS_REPLY_STRING) {
+			rspamd_strtol (reply->str, reply->len, &val);
+		}
+		else if (reply->type != REDIS_REPLY_NIL) {
+			msg_err ("bad learned type for %s: %s, nil expected",
+					group->object,
+					rspamd_redis_type_to_string (reply->type));
+		}
+
+		if (val < 0) {
+			msg_warn ("invalid number of learns for %s: %L",
+					group->object, val);
+			val = 0;
+		}
+
+		for (i = 0; i < group->rts->len; i ++) {
+			rt = g_ptr_array_index (group->rts, i);
+
+			if (rt != NULL) {
+				rt->learned = val;
+			}
+		}
+	}
+
+	rspamd_redis_batch_request_dec (group->req);
+}
+
+/* Called when we have received tokens values of a batch group */
+static void
+rspamd_redis_batch_processed (redisAsyncContext *c, gpointer r, gpointer priv)
+{
+	struct redis_stat_batch_group *group = priv;
+	struct redis_stat_batch_request *req = group->req;
+	struct redis_stat_runtime *rt;
+	struct rspamd_task *task;
+	redisReply *reply = r, *elt;
+	rspamd_token_t *tok;
+	gdouble *values;
+	gulong val;
+	guint i, j, found = 0;
+
+	if (c->err == 0 && r != NULL) {
+		if (reply->type == REDIS_REPLY_ARRAY &&
+				reply->elements == group->ntokens) {
+			values = g_malloc (group->ntokens * sizeof (gdouble));
+
+			for (i = 0; i < reply->elements; i ++) {
+				elt = reply->element[i];
+
+				if (G_UNLIKELY (elt->type == REDIS_REPLY_INTEGER)) {
+					values[i] = elt->integer;
+					found ++;
+				}
+				else if (elt->type == REDIS_REPLY_STRING) {
+					if (req->ctx->stcf->clcf->flags &
+							RSPAMD_FLAG_CLASSIFIER_INTEGER) {
+						rspamd_strtoul (elt->str, elt->len, &val);
+						values[i] = val;
+					}
+					else {
+						values[i] = strtod (elt->str, NULL);
+					}
+
+					found ++;
+				}
+				else {
+					values[i] = 0;
+				}
+			}
+
+			for (i = 0; i < group->rts->len; i ++) {
+				rt = g_ptr_array_index (group->rts, i);
+
+				if (rt == NULL) {
+					continue;
+				}
+
+				task = rt->task;
+
+				for (j = 0; j < rt->tokens->len; j ++) {
+					tok = g_ptr_array_index (rt->tokens, j);
+					tok->values[rt->id] = values[rt->tok_idx[j]];
+				}
+
+				if (rt->stcf->is_spam) {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+				}
+				else {
+					task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+				}
+
+				msg_debug_task ("received tokens for %s: %d processed, "
+						"%d unique tokens requested, %d found",
+						rt->redis_object_expanded, rt->tokens->len,
+						group->ntokens, found);
+			}
+
+			g_free (values);
+		}
+		else if (reply->type == REDIS_REPLY_ARRAY) {
+			msg_err ("got invalid length of reply vector from redis: "
+					"%d, expected: %d",
+					(gint)reply->elements,
+					(gint)group->ntokens);
+		}
+		else {
+			msg_err ("got invalid reply from redis: %s, array expected",
+					rspamd_redis_type_to_string (reply->type));
+		}
+
+		rspamd_upstream_ok (req->selected);
+	}
+	else if (c->err != 0) {
+		msg_err ("error getting reply from redis server %s: %s",
+				rspamd_upstream_name (req->selected), c->errstr);
+
+		if (req->redis) {
+			rspamd_upstream_fail (req->selected);
+		}
+	}
+
+	/* Results are ready, so release tasks */
+	for (i = 0; i < group->rts->len; i ++) {
+		rt = g_ptr_array_index (group->rts, i);
+
+		if (rt != NULL && rt->has_event) {
+			rspamd_session_remove_event (rt->task->s, rspamd_redis_fin_batch,
+					rt);
+		}
+	}
+
+	rspamd_redis_batch_request_dec (req);
+}
+
+/* Sends all gathered lookups */
+static void
+rspamd_redis_batch_flush (gint fd, short what, gpointer d)
+{
+	struct redis_stat_batch *batch = d;
+	struct redis_stat_ctx *ctx = batch->ctx;
+	struct redis_stat_batch_request *req;
+	struct redis_stat_batch_group *group;
+	rspamd_inet_addr_t *addr;
+	rspamd_fstring_t *query;
+	GHashTableIter it;
+	gpointer k, v;
+	struct timeval tv;
+	guint i;
+
+	batch->armed = FALSE;
+
+	req = g_slice_alloc0 (sizeof (*req));
+	req->ctx = ctx;
+	REF_RETAIN (ctx);
+	req->groups = g_ptr_array_sized_new (g_hash_table_size (batch->groups));
+	g_hash_table_iter_init (&it, batch->groups);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		group = v;
+		group->req = req;
+		g_ptr_array_add (req->groups, group);
+		g_hash_table_iter_steal (&it);
+	}
+
+	req->selected = rspamd_upstream_get (ctx->read_servers,
+			RSPAMD_UPSTREAM_ROUND_ROBIN,
+			NULL,
+			0);
+
+	if (req->selected == NULL) {
+		msg_err ("no upstreams reachable");
+		rspamd_redis_batch_request_fin (req);
+
+		return;
+	}
+
+	addr = rspamd_upstream_addr (req->selected);
+	g_assert (addr != NULL);
+
+	if (rspamd_inet_address_get_af (addr) == AF_UNIX) {
+		req->redis = redisAsyncConnectUnix (rspamd_inet_address_to_string (addr));
+	}
+	else {
+		req->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
+	}
+
+	if (req->redis == NULL) {
+		msg_err ("cannot connect redis");
+		rspamd_redis_batch_request_fin (req);
+
+		return;
+	}
+
+	redisLibeventAttach (req->redis, batch->ev_base);
+	rspamd_redis_maybe_auth (ctx, req->redis);
+
+	for (i = 0; i < req->groups->len; i ++) {
+		group = g_ptr_array_index (req->groups, i);
+
+		if (rspamd_redis_batch_group_prepare (group) == 0) {
+			continue;
+		}
+
+		if (redisAsyncCommand (req->redis, rspamd_redis_batch_learns, group,
+				"HGET %s %s", group->object, "learns") == REDIS_OK) {
+			req->inflight ++;
+		}
+
+		query = rspamd_redis_nums_to_query (group->tokens, group->ntokens,
+				"HMGET", group->object);
+
+		if (redisAsyncFormattedCommand (req->redis,
+				rspamd_redis_batch_processed, group,
+				query->str, query->len) == REDIS_OK) {
+			req->inflight ++;
+		}
+		else {
+			msg_err ("call to redis failed: %s", req->redis->errstr);
+		}
+
+		rspamd_fstring_free (query);
+	}
+
+	if (req->inflight == 0) {
+		rspamd_redis_batch_request_fin (req);
+
+		return;
+	}
+
+	msg_debug ("sent %ud tokens groups to redis server %s",
+			req->groups->len, rspamd_upstream_name (req->selected));
+
+	event_set (&req->timeout_event, -1, EV_TIMEOUT,
+			rspamd_redis_batch_timeout, req);
+	event_base_set (batch->ev_base, &req->timeout_event);
+	double_to_tv (ctx->timeout, &tv);
+	event_add (&req->timeout_event, &tv);
+}
+
+static gboolean
+rspamd_redis_batch_add (struct rspamd_task *task,
+		struct redis_stat_runtime *rt, GPtrArray *tokens)
+{
+	struct redis_stat_ctx *ctx = rt->ctx;
+	struct redis_stat_batch *batch = ctx->batch;
+	struct redis_stat_batch_group *group;
+	struct timeval tv;
+
+	if (batch == NULL) {
+		batch = g_slice_alloc0 (sizeof (*batch));
+		batch->ctx = ctx;
+		batch->ev_base = task->ev_base;
+		batch->groups = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
+		ctx->batch = batch;
+	}
+
+	group = g_hash_table_lookup (batch->groups, rt->redis_object_expanded);
+
+	if (group == NULL) {
+		group = g_slice_alloc0 (sizeof (*group));
+		group->object = g_strdup (rt->redis_object_expanded);
+		group->rts = g_ptr_array_new ();
+		g_hash_table_insert (batch->groups, group->object, group);
+	}
+
+	rt->tokens = tokens;
+	rt->tok_idx = rspamd_mempool_alloc (task->task_pool,
+			sizeof (guint32) * tokens->len);
+	rt->group = group;
+	rt->group_idx = group->rts->len;
+	g_ptr_array_add (group->rts, rt);
+
+	rspamd_session_add_event (task->s, rspamd_redis_fin_batch, rt,
+			rspamd_redis_stat_quark ());
+	rt->has_event = TRUE;
+
+	if (!batch->armed) {
+		event_set (&batch->flush_event, -1, EV_TIMEOUT,
+				rspamd_redis_batch_flush, batch);
+		event_base_set (batch->ev_base, &batch->flush_event);
+		double_to_tv (ctx->batch_timeout, &tv);
+		event_add (&batch->flush_event, &tv);
+		batch->armed = TRUE;
+	}
+
+	return TRUE;
+}
+
 static gboolean
 rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		const ucl_object_t *obj,
@@ -1013,6 +1555,14 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 		backend->timeout = REDIS_DEFAULT_TIMEOUT;
 	}
 
+	elt = ucl_object_lookup (obj, "batch_timeout");
+	if (elt) {
+		backend->batch_timeout = ucl_object_todouble (elt);
+	}
+	else {
+		backend->batch_timeout = REDIS_DEFAULT_BATCH_TIMEOUT;
+	}
+
 	elt = ucl_object_lookup (obj, "password");
 	if (elt) {
 		backend->password = ucl_object_tostring (elt);
@@ -1032,6 +1582,20 @@ rspamd_redis_try_ucl (struct redis_stat_ctx *backend,
 	return TRUE;
 }
 
+static void
+rspamd_redis_ctx_dtor (struct redis_stat_ctx *ctx)
+{
+	if (ctx->read_servers) {
+		rspamd_upstreams_destroy (ctx->read_servers);
+	}
+
+	if (ctx->write_servers) {
+		rspamd_upstreams_destroy (ctx->write_servers);
+	}
+
+	g_slice_free1 (sizeof (*ctx), ctx);
+}
+
 gpointer
 rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 		struct rspamd_config *cfg, struct rspamd_statfile *st)
@@ -1089,6 +1653,7 @@ rspamd_redis_init (struct rspamd_stat_ctx *ctx,
 
 	stf->clcf->flags |= RSPAMD_FLAG_CLASSIFIER_INCREMENTING_BACKEND;
 	backend->stcf = stf;
+	REF_INIT_RETAIN (backend, rspamd_redis_ctx_dtor);
 
 	st_elt = g_slice_alloc0 (sizeof (*st_elt));
 	st_elt->ev_base = ctx->ev_base;
@@ -1147,6 +1712,13 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	rt->ctx = ctx;
 	rt->stcf = stcf;
 
+	if (!learn && ctx->batch_timeout > 0) {
+		/* Connection is opened for the whole batch of tasks */
+		rt->batched = TRUE;
+
+		return rt;
+	}
+
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
 
@@ -1173,16 +1745,29 @@ void
 rspamd_redis_close (gpointer p)
 {
 	struct redis_stat_ctx *ctx = REDIS_CTX (p);
+	GHashTableIter it;
+	gpointer k, v;
 
-	if (ctx->read_servers) {
-		rspamd_upstreams_destroy (ctx->read_servers);
-	}
+	if (ctx->batch) {
+		if (ctx->batch->armed) {
+			event_del (&ctx->batch->flush_event);
+		}
 
-	if (ctx->write_servers) {
-		rspamd_upstreams_destroy (ctx->write_servers);
+		/* Lookups that have not been sent yet are never sent, release tasks */
+		g_hash_table_iter_init (&it, ctx->batch->groups);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			g_hash_table_iter_steal (&it);
+			rspamd_redis_batch_group_free (v);
+		}
+
+		g_hash_table_unref (ctx->batch->groups);
+		g_slice_free1 (sizeof (*ctx->batch), ctx->batch);
+		ctx->batch = NULL;
 	}
 
-	g_slice_free1 (sizeof (*ctx), ctx);
+	/* Sent batches keep context until they are finished */
+	REF_RELEASE (ctx);
 }
 
 gboolean
@@ -1195,12 +1780,22 @@ rspamd_redis_process_tokens (struct rspamd_task *task,
 	struct timeval tv;
 	gint ret;
 
-	if (tokens == NULL || tokens->len == 0 || rt->redis == NULL) {
+	if (tokens == NULL || tokens->len == 0) {
 		return FALSE;
 	}
 
 	rt->id = id;
 
+	if (rt->batched) {
+		return rspamd_redis_batch_add (task, rt, tokens);
+	}
+
+	if (rt->redis == NULL) {
+		return FALSE;
+	}
+
+	rt->tokens = tokens;
+
 	if (redisAsyncCommand (rt->redis, rspamd_redis_connected, rt, "HGET %s %s",
 			rt->redis_object_expanded, "learns") == REDIS_OK) {
 
@@ -1244,6 +1839,12 @@ rspamd_redis_finalize_process (struct rspamd_task *task, gpointer runtime,
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
 	redisAsyncContext *redis;
 
+	if (rt->group) {
+		/* Batch has not been processed yet, so just leave it */
+		g_ptr_array_index (rt->group->rts, rt->group_idx) = NULL;
+		rt->group = NULL;
+	}
+
 	if (event_get_base (&rt->timeout_event)) {
 		event_del (&rt->timeout_event);
 	}
@@ -1462,6 +2063,16 @@ rspamd_redis_get_stat (gpointer runtime,
 	return NULL;
 }
 
+const gchar *
+rspamd_redis_storage_key (struct rspamd_task *task, gpointer runtime,
+		gpointer ctx)
+{
+	struct redis_stat_runtime *rt = REDIS_RUNTIME (runtime);
+
+	/* Expanded object includes user when statistics are per user */
+	return rt->redis_object_expanded;
+}
+
 gpointer
 rspamd_redis_load_tokenizer_config (gpointer runtime,
 		gsize *len)
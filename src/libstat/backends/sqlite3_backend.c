@@ -992,6 +992,25 @@ rspamd_sqlite3_get_stat (gpointer runtime,
 	return res;
 }
 
+const gchar *
+rspamd_sqlite3_storage_key (struct rspamd_task *task, gpointer runtime,
+		gpointer ctx)
+{
+	struct rspamd_stat_sqlite3_rt *rt = runtime;
+
+	g_assert (rt != NULL);
+
+	/*
+	 * Values of users and languages tokens include the default ones, so they
+	 * change whenever the default tokens are learned
+	 */
+	if (rt->db->enable_users || rt->db->enable_languages) {
+		return NULL;
+	}
+
+	return "";
+}
+
 gpointer
 rspamd_sqlite3_load_tokenizer_config (gpointer runtime,
 		gsize *len)
@@ -80,14 +80,6 @@ inv_chi_square (struct rspamd_task *task, gdouble value, gint freedom_deg)
 	return MIN (1.0, sum);
 }
 
-struct bayes_task_closure {
-	double ham_prob;
-	double spam_prob;
-	guint64 processed_tokens;
-	guint64 total_hits;
-	struct rspamd_task *task;
-};
-
 /*
  * Mathematically we use pow(complexity, complexity), where complexity is the
  * window index
@@ -95,82 +87,165 @@ struct bayes_task_closure {
 static const double feature_weight[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
 
 #define PROB_COMBINE(prob, cnt, weight, assumed) (((weight) * (assumed) + (cnt) * (prob)) / ((weight) + (cnt)))
+
+/*
+ * Number of independent products used to sum logarithms and number of
+ * probabilities multiplied in each of them before taking a logarithm. Token
+ * probabilities are far from zero, so a product of 8 of them cannot underflow
+ */
+#define BAYES_LOG_LANES 4
+#define BAYES_LOG_BLOCK 8
+
 /*
- * In this callback we calculate local probabilities for tokens
+ * Calculates local probabilities of tokens. There are no calls and branches
+ * in the loop, so it is vectorized by a compiler
  */
 static void
-bayes_classify_token (struct rspamd_classifier *ctx,
-		rspamd_token_t *tok, struct bayes_task_closure *cl)
+bayes_tokens_probs (const gdouble * restrict spam_cnt,
+		const gdouble * restrict ham_cnt,
+		const gdouble * restrict weight,
+		gdouble * restrict spam_prob,
+		gdouble * restrict ham_prob,
+		guint len, gdouble spam_learns, gdouble ham_learns)
 {
 	guint i;
-	gint id;
-	guint64 spam_count = 0, ham_count = 0, total_count = 0;
-	struct rspamd_statfile *st;
-	struct rspamd_task *task;
-	double spam_prob, spam_freq, ham_freq, bayes_spam_prob, bayes_ham_prob,
-		ham_prob, fw, w, norm_sum, norm_sub, val;
+	gdouble spam_freq, ham_freq, total_count, fw, norm_sum, norm_sub, w;
 
-	task = cl->task;
+	for (i = 0; i < len; i ++) {
+		spam_freq = spam_cnt[i] / spam_learns;
+		ham_freq = ham_cnt[i] / ham_learns;
+		total_count = spam_cnt[i] + ham_cnt[i];
+		fw = weight[i];
+		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
+		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
+		w = (norm_sub) / (norm_sum) *
+				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
 
-	if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_LUA_META) {
-		/* Ignore lua metatokens for now */
-		return;
+		spam_prob[i] = PROB_COMBINE (spam_freq / (spam_freq + ham_freq),
+				total_count, w, 0.5);
+		ham_prob[i] = PROB_COMBINE (ham_freq / (spam_freq + ham_freq),
+				total_count, w, 0.5);
 	}
+}
 
-	for (i = 0; i < ctx->statfiles_ids->len; i++) {
-		id = g_array_index (ctx->statfiles_ids, gint, i);
-		st = g_ptr_array_index (ctx->ctx->statfiles, id);
-		g_assert (st != NULL);
-		val = tok->values[id];
+/*
+ * Returns sum of log2 of all probabilities. Instead of a logarithm per
+ * token, probabilities are multiplied in independent lanes and a logarithm
+ * is taken once per block; the exponent is extracted by frexp to avoid
+ * underflow of the products
+ */
+static gdouble
+bayes_log2_sum (const gdouble * restrict probs, guint len)
+{
+	gdouble lanes[BAYES_LOG_LANES], m, sum = 0;
+	guint i, j, k;
+	gint e;
+
+	for (i = 0; i + BAYES_LOG_LANES * BAYES_LOG_BLOCK <= len;
+			i += BAYES_LOG_LANES * BAYES_LOG_BLOCK) {
+		for (k = 0; k < BAYES_LOG_LANES; k ++) {
+			lanes[k] = 1.0;
+		}
 
-		if (val > 0) {
-			if (st->stcf->is_spam) {
-				spam_count += val;
-			}
-			else {
-				ham_count += val;
+		for (j = 0; j < BAYES_LOG_BLOCK; j ++) {
+			for (k = 0; k < BAYES_LOG_LANES; k ++) {
+				lanes[k] *= probs[i + j * BAYES_LOG_LANES + k];
 			}
+		}
 
-			total_count += val;
-			cl->total_hits += val;
+		for (k = 0; k < BAYES_LOG_LANES; k ++) {
+			m = frexp (lanes[k], &e);
+			sum += log2 (m) + e;
 		}
 	}
 
-	/* Probability for this token */
-	if (total_count > 0) {
-		spam_freq = ((double)spam_count / MAX (1., (double) ctx->spam_learns));
-		ham_freq = ((double)ham_count / MAX (1., (double)ctx->ham_learns));
-		spam_prob = spam_freq / (spam_freq + ham_freq);
-		ham_prob = ham_freq / (spam_freq + ham_freq);
-		fw = feature_weight[tok->window_idx % G_N_ELEMENTS (feature_weight)];
-		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
-		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
-
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_spam_prob = PROB_COMBINE (spam_prob, total_count, w, 0.5);
-		norm_sub = (ham_freq - spam_freq) * (ham_freq - spam_freq);
-		w = (norm_sub) / (norm_sum) *
-				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
-		bayes_ham_prob = PROB_COMBINE (ham_prob, total_count, w, 0.5);
-
-		cl->spam_prob += log2 (bayes_spam_prob);
-		cl->ham_prob += log2 (bayes_ham_prob);
-		cl->processed_tokens ++;
-
-		msg_debug_bayes ("token: weight: %f, total_count: %L, "
-				"spam_count: %L, ham_count: %L,"
-				"spam_prob: %.3f, ham_prob: %.3f, "
-				"bayes_spam_prob: %.3f, bayes_ham_prob: %.3f, "
-				"current spam prob: %.3f, current ham prob: %.3f",
-				fw, total_count, spam_count, ham_count,
-				spam_prob, ham_prob,
-				bayes_spam_prob, bayes_ham_prob,
-				cl->spam_prob, cl->ham_prob);
+	for (; i < len; i ++) {
+		sum += log2 (probs[i]);
 	}
+
+	return sum;
 }
 
+void
+bayes_combine_tokens (struct bayes_tokens_soa *soa,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob)
+{
+	bayes_tokens_probs (soa->spam_cnt, soa->ham_cnt, soa->weight,
+			soa->spam_prob, soa->ham_prob, soa->len,
+			MAX (1., spam_learns), MAX (1., ham_learns));
 
+	*spam_prob = bayes_log2_sum (soa->spam_prob, soa->len);
+	*ham_prob = bayes_log2_sum (soa->ham_prob, soa->len);
+}
+
+/*
+ * Gathers values of tokens from all statfiles of the classifier to the dense
+ * arrays
+ */
+static void
+bayes_tokens_gather (struct rspamd_classifier *ctx, GPtrArray *tokens,
+		struct bayes_tokens_soa *soa, struct rspamd_task *task)
+{
+	guint i, j, nst;
+	gint *ids;
+	gboolean *is_spam;
+	struct rspamd_statfile *st;
+	rspamd_token_t *tok;
+	gdouble val, spam_count, ham_count;
+
+	nst = ctx->statfiles_ids->len;
+	ids = rspamd_mempool_alloc (task->task_pool, sizeof (*ids) * nst);
+	is_spam = rspamd_mempool_alloc (task->task_pool, sizeof (*is_spam) * nst);
+
+	for (j = 0; j < nst; j ++) {
+		ids[j] = g_array_index (ctx->statfiles_ids, gint, j);
+		st = g_ptr_array_index (ctx->ctx->statfiles, ids[j]);
+		g_assert (st != NULL);
+		is_spam[j] = st->stcf->is_spam;
+	}
+
+	soa->spam_cnt = rspamd_mempool_alloc (task->task_pool,
+			sizeof (gdouble) * tokens->len * 5);
+	soa->ham_cnt = soa->spam_cnt + tokens->len;
+	soa->weight = soa->ham_cnt + tokens->len;
+	soa->spam_prob = soa->weight + tokens->len;
+	soa->ham_prob = soa->spam_prob + tokens->len;
+	soa->len = 0;
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+
+		if (tok->flags & RSPAMD_STAT_TOKEN_FLAG_LUA_META) {
+			/* Ignore lua metatokens for now */
+			continue;
+		}
+
+		spam_count = 0;
+		ham_count = 0;
+
+		for (j = 0; j < nst; j ++) {
+			val = tok->values[ids[j]];
+
+			if (val > 0) {
+				if (is_spam[j]) {
+					spam_count += val;
+				}
+				else {
+					ham_count += val;
+				}
+			}
+		}
+
+		if (spam_count + ham_count > 0) {
+			soa->spam_cnt[soa->len] = spam_count;
+			soa->ham_cnt[soa->len] = ham_count;
+			soa->weight[soa->len] = feature_weight[tok->window_idx %
+					G_N_ELEMENTS (feature_weight)];
+			soa->len ++;
+		}
+	}
+}
 
 gboolean
 bayes_init (rspamd_mempool_t *pool, struct rspamd_classifier *cl)
@@ -185,20 +260,16 @@ bayes_classify (struct rspamd_classifier * ctx,
 		GPtrArray *tokens,
 		struct rspamd_task *task)
 {
-	double final_prob, h, s, *pprob;
+	double final_prob, h, s, spam_prob, ham_prob, *pprob;
 	gchar sumbuf[32];
 	struct rspamd_statfile *st = NULL;
-	struct bayes_task_closure cl;
-	rspamd_token_t *tok;
+	struct bayes_tokens_soa soa;
 	guint i;
 	gint id;
 
 	g_assert (ctx != NULL);
 	g_assert (tokens != NULL);
 
-	memset (&cl, 0, sizeof (cl));
-	cl.task = task;
-
 	/* Check min learns */
 	if (ctx->cfg->min_learns > 0) {
 		if (ctx->ham_learns < ctx->cfg->min_learns) {
@@ -217,26 +288,24 @@ bayes_classify (struct rspamd_classifier * ctx,
 		}
 	}
 
-	for (i = 0; i < tokens->len; i ++) {
-		tok = g_ptr_array_index (tokens, i);
-
-		bayes_classify_token (ctx, tok, &cl);
-	}
+	bayes_tokens_gather (ctx, tokens, &soa, task);
+	bayes_combine_tokens (&soa, ctx->spam_learns, ctx->ham_learns,
+			&spam_prob, &ham_prob);
 
-	h = 1 - inv_chi_square (task, cl.spam_prob, cl.processed_tokens);
-	s = 1 - inv_chi_square (task, cl.ham_prob, cl.processed_tokens);
+	h = 1 - inv_chi_square (task, spam_prob, soa.len);
+	s = 1 - inv_chi_square (task, ham_prob, soa.len);
 
 	if (isfinite (s) && isfinite (h)) {
 		final_prob = (s + 1.0 - h) / 2.;
 		msg_debug_bayes (
 				"<%s> got ham prob %.2f -> %.2f and spam prob %.2f -> %.2f,"
-						" %L tokens processed of %ud total tokens",
+						" %ud tokens processed of %ud total tokens",
 				task->message_id,
-				cl.ham_prob,
+				ham_prob,
 				h,
-				cl.spam_prob,
+				spam_prob,
 				s,
-				cl.processed_tokens,
+				soa.len,
 				tokens->len);
 	}
 	else {
@@ -265,7 +334,7 @@ bayes_classify (struct rspamd_classifier * ctx,
 	*pprob = final_prob;
 	rspamd_mempool_set_variable (task->task_pool, "bayes_prob", pprob, NULL);
 
-	if (cl.processed_tokens > 0 && fabs (final_prob - 0.5) > 0.05) {
+	if (soa.len > 0 && fabs (final_prob - 0.5) > 0.05) {
 		/* Now we can have exactly one HAM and exactly one SPAM statfiles per classifier */
 		for (i = 0; i < ctx->statfiles_ids->len; i++) {
 			id = g_array_index (ctx->statfiles_ids, gint, i);
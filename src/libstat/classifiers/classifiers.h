@@ -42,6 +42,32 @@ gboolean bayes_learn_spam (struct rspamd_classifier *ctx,
 		gboolean unlearn,
 		GError **err);
 
+/*
+ * Tokens of a message in a dense form suitable for vectorized processing:
+ * element i of every array corresponds to the same token. Only tokens found
+ * in statistics are stored
+ */
+struct bayes_tokens_soa {
+	gdouble *spam_cnt;		/* number of spam hits */
+	gdouble *ham_cnt;		/* number of ham hits */
+	gdouble *weight;		/* feature weight of the window */
+	gdouble *spam_prob;		/* scratch space for spam probabilities */
+	gdouble *ham_prob;		/* scratch space for ham probabilities */
+	guint len;
+};
+
+/**
+ * Combines probabilities of all tokens
+ * @param soa tokens
+ * @param spam_learns number of spam learns
+ * @param ham_learns number of ham learns
+ * @param spam_prob output: sum of log2 of spam probabilities
+ * @param ham_prob output: sum of log2 of ham probabilities
+ */
+void bayes_combine_tokens (struct bayes_tokens_soa *soa,
+		gdouble spam_learns, gdouble ham_learns,
+		gdouble *spam_prob, gdouble *ham_prob);
+
 /* Generic lua classifier */
 gboolean lua_classifier_init (rspamd_mempool_t *pool,
 		struct rspamd_classifier *);
@@ -106,4 +106,18 @@ rspamd_stat_result_t rspamd_stat_statistics (struct rspamd_task *task,
 
 void rspamd_stat_unload (void);
 
+/**
+ * Initialize cache of tokens values shared by all processes forked after
+ * this call. Does nothing if the cache has been already initialized
+ * @param nelts number of tokens in the cache (0 to disable caching)
+ * @param ttl time in seconds while cached values are used
+ */
+void rspamd_stat_tokens_cache_init (guint nelts, gdouble ttl);
+
+/**
+ * Get size and hit rate of the tokens cache
+ * @return new ucl object or NULL if the cache is disabled
+ */
+ucl_object_t *rspamd_stat_tokens_cache_statistics (void);
+
 #endif /* STAT_API_H_ */
@@ -64,6 +64,7 @@ static struct rspamd_stat_tokenizer stat_tokenizers[] = {
 		.inc_learns = rspamd_##eltn##_inc_learns, \
 		.dec_learns = rspamd_##eltn##_dec_learns, \
 		.get_stat = rspamd_##eltn##_get_stat, \
+		.storage_key = rspamd_##eltn##_storage_key, \
 		.load_tokenizer_config = rspamd_##eltn##_load_tokenizer_config, \
 		.close = rspamd_##eltn##_close \
 	}
@@ -116,6 +116,16 @@ struct rspamd_stat_async_elt* rspamd_stat_ctx_register_async (
 		rspamd_stat_async_handler handler, rspamd_stat_async_cleanup cleanup,
 		gpointer d, gdouble timeout);
 
+/* Tokens values cache, see tokens_cache.c */
+gboolean rspamd_stat_tokens_cache_enabled (void);
+gboolean rspamd_stat_tokens_cache_seed (struct rspamd_task *task,
+		struct rspamd_statfile *st, gpointer runtime, guint64 *seed);
+GPtrArray *rspamd_stat_tokens_cache_lookup (struct rspamd_task *task,
+		GPtrArray *tokens, gint id, guint64 seed, guint64 *learns);
+void rspamd_stat_tokens_cache_insert (struct rspamd_task *task,
+		GPtrArray *tokens, gint id, guint64 seed, guint64 learns);
+void rspamd_stat_tokens_cache_invalidate (GPtrArray *tokens, guint64 seed);
+
 static GQuark rspamd_stat_quark (void)
 {
 	return g_quark_from_static_string ("rspamd-statistics");
@@ -31,6 +31,16 @@
 
 static const gdouble similarity_treshold = 80.0;
 
+#define RSPAMD_STAT_TOKENS_CACHE_VAR "stat_tokens_cache"
+
+/* Tokens cache state of a statfile for a task */
+struct rspamd_stat_tokens_cache_res {
+	GPtrArray *requested;
+	guint64 seed;
+	guint64 learns;
+	gboolean cached;
+};
+
 static void
 rspamd_stat_tokenize_header (struct rspamd_task *task,
 		const gchar *name, const gchar *prefix, GArray *ar)
@@ -344,10 +354,19 @@ rspamd_stat_backends_process (struct rspamd_stat_ctx *st_ctx,
 	guint i;
 	struct rspamd_statfile *st;
 	struct rspamd_classifier *cl;
+	struct rspamd_stat_tokens_cache_res *cache_res = NULL, *r;
+	GPtrArray *tokens, *missed;
 	gpointer bk_run;
 
 	g_assert (task->stat_runtimes != NULL);
 
+	if (rspamd_stat_tokens_cache_enabled ()) {
+		cache_res = rspamd_mempool_alloc0 (task->task_pool,
+				sizeof (*cache_res) * st_ctx->statfiles->len);
+		rspamd_mempool_set_variable (task->task_pool,
+				RSPAMD_STAT_TOKENS_CACHE_VAR, cache_res, NULL);
+	}
+
 	for (i = 0; i < st_ctx->statfiles->len; i++) {
 		st = g_ptr_array_index (st_ctx->statfiles, i);
 		cl = st->classifier;
@@ -359,7 +378,40 @@ rspamd_stat_backends_process (struct rspamd_stat_ctx *st_ctx,
 		bk_run = g_ptr_array_index (task->stat_runtimes, i);
 
 		if (bk_run != NULL) {
-			st->backend->process_tokens (task, task->tokens, i, bk_run);
+			tokens = task->tokens;
+
+			if (cache_res != NULL && tokens->len > 0 &&
+					rspamd_stat_tokens_cache_seed (task, st, bk_run,
+							&cache_res[i].seed)) {
+				r = &cache_res[i];
+				missed = rspamd_stat_tokens_cache_lookup (task, tokens, i,
+						r->seed, &r->learns);
+
+				if (missed->len == 0 && r->learns > 0) {
+					/* Backend is not needed at all */
+					r->cached = TRUE;
+
+					if (st->stcf->is_spam) {
+						task->flags |= RSPAMD_TASK_FLAG_HAS_SPAM_TOKENS;
+					}
+					else {
+						task->flags |= RSPAMD_TASK_FLAG_HAS_HAM_TOKENS;
+					}
+
+					msg_debug_task ("all %ud tokens of %s are found in cache",
+							tokens->len, st->stcf->symbol);
+					continue;
+				}
+
+				/* Learns are returned along with tokens, so request all */
+				if (missed->len > 0) {
+					tokens = missed;
+				}
+
+				r->requested = tokens;
+			}
+
+			st->backend->process_tokens (task, tokens, i, bk_run);
 		}
 	}
 }
@@ -371,10 +423,15 @@ rspamd_stat_backends_post_process (struct rspamd_stat_ctx *st_ctx,
 	guint i;
 	struct rspamd_statfile *st;
 	struct rspamd_classifier *cl;
+	struct rspamd_stat_tokens_cache_res *cache_res, *r;
 	gpointer bk_run;
+	guint64 learns;
 
 	g_assert (task->stat_runtimes != NULL);
 
+	cache_res = rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_STAT_TOKENS_CACHE_VAR);
+
 	for (i = 0; i < st_ctx->statfiles->len; i++) {
 		st = g_ptr_array_index (st_ctx->statfiles, i);
 		cl = st->classifier;
@@ -386,6 +443,20 @@ rspamd_stat_backends_post_process (struct rspamd_stat_ctx *st_ctx,
 		bk_run = g_ptr_array_index (task->stat_runtimes, i);
 
 		if (bk_run != NULL) {
+			if (cache_res != NULL && cache_res[i].requested != NULL) {
+				r = &cache_res[i];
+				learns = st->backend->total_learns (task, bk_run, st_ctx);
+
+				/*
+				 * Failed requests leave zero learns, so their values
+				 * are not cached
+				 */
+				if (learns > 0) {
+					rspamd_stat_tokens_cache_insert (task, r->requested, i,
+							r->seed, learns);
+				}
+			}
+
 			st->backend->finalize_process (task, bk_run, st_ctx);
 		}
 	}
@@ -398,13 +469,18 @@ rspamd_stat_classifiers_process (struct rspamd_stat_ctx *st_ctx,
 	guint i, j, id;
 	struct rspamd_classifier *cl;
 	struct rspamd_statfile *st;
+	struct rspamd_stat_tokens_cache_res *cache_res;
 	gpointer bk_run;
+	guint64 learns;
 	gboolean skip;
 
 	if (st_ctx->classifiers->len == 0) {
 		return;
 	}
 
+	cache_res = rspamd_mempool_get_variable (task->task_pool,
+			RSPAMD_STAT_TOKENS_CACHE_VAR);
+
 	/*
 	 * Do not classify a message if some class is missing
 	 */
@@ -431,15 +507,18 @@ rspamd_stat_classifiers_process (struct rspamd_stat_ctx *st_ctx,
 		g_assert (st != NULL);
 
 		if (bk_run != NULL) {
+			if (cache_res != NULL && cache_res[i].cached) {
+				learns = cache_res[i].learns;
+			}
+			else {
+				learns = st->backend->total_learns (task, bk_run, st_ctx);
+			}
+
 			if (st->stcf->is_spam) {
-				cl->spam_learns += st->backend->total_learns (task,
-						bk_run,
-						st_ctx);
+				cl->spam_learns += learns;
 			}
 			else {
-				cl->ham_learns += st->backend->total_learns (task,
-						bk_run,
-						st_ctx);
+				cl->ham_learns += learns;
 			}
 		}
 	}
@@ -758,6 +837,7 @@ rspamd_stat_backends_learn (struct rspamd_stat_ctx *st_ctx,
 	gpointer bk_run;
 	guint i, j;
 	gint id;
+	guint64 seed;
 	gboolean res = FALSE;
 
 	for (i = 0; i < st_ctx->classifiers->len; i ++) {
@@ -805,6 +885,12 @@ rspamd_stat_backends_learn (struct rspamd_stat_ctx *st_ctx,
 				goto end;
 			}
 			else {
+				if (rspamd_stat_tokens_cache_enabled () &&
+						rspamd_stat_tokens_cache_seed (task, st, bk_run, &seed)) {
+					/* Cached values of the learned tokens are no longer valid */
+					rspamd_stat_tokens_cache_invalidate (task->tokens, seed);
+				}
+
 				if (!!spam == !!st->stcf->is_spam) {
 					st->backend->inc_learns (task, bk_run, st_ctx);
 				}
@@ -255,6 +255,75 @@ rspamd_tokenizer_osb_is_compat (struct rspamd_tokenizer_runtime *rt)
 
 
 
+/*
+ * Hashes all words of the array into a flat array of hashes
+ */
+static void
+rspamd_tokenizer_osb_hash_words (struct rspamd_osb_tokenizer_config *osb_cf,
+		GArray *words, gboolean is_utf, guint64 seed, gboolean has_prefix,
+		guint64 *hashes)
+{
+	rspamd_stat_token_t *token;
+	rspamd_ftok_t ftok;
+	guint w;
+
+	/* The hash type is checked once per array and not once per word */
+	switch (osb_cf->ht) {
+	case RSPAMD_OSB_HASH_COMPAT:
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			ftok.begin = token->begin;
+			ftok.len = token->len;
+			hashes[w] = rspamd_fstrhash_lc (&ftok, is_utf);
+		}
+		break;
+	case RSPAMD_OSB_HASH_XXHASH:
+		/* We know that the words are normalized */
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			hashes[w] = rspamd_cryptobox_fast_hash_specific (
+					RSPAMD_CRYPTOBOX_XXHASH64,
+					token->begin, token->len, osb_cf->seed);
+		}
+		break;
+	default:
+		for (w = 0; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			rspamd_cryptobox_siphash ((guchar *)&hashes[w], token->begin,
+					token->len, osb_cf->sk);
+
+			if (has_prefix) {
+				hashes[w] ^= seed;
+			}
+		}
+		break;
+	}
+}
+
+static inline void
+rspamd_tokenizer_osb_set_token (struct rspamd_osb_tokenizer_config *osb_cf,
+		rspamd_token_t *new_tok, guint64 h0, guint64 hi, guint i, guint flags)
+{
+	guint32 h1, h2;
+	guint64 cur;
+
+	new_tok->datalen = sizeof (gint64);
+	new_tok->flags = flags;
+
+	if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
+		h1 = ((guint32)h0) * primes[0] + ((guint32)hi) * primes[i << 1];
+		h2 = ((guint32)h0) * primes[1] + ((guint32)hi) * primes[(i << 1) - 1];
+		memcpy (new_tok->data, &h1, sizeof (h1));
+		memcpy (new_tok->data + sizeof (h1), &h2, sizeof (h2));
+	}
+	else {
+		cur = h0 * primes[0] + hi * primes[i << 1];
+		memcpy (new_tok->data, &cur, sizeof (cur));
+	}
+
+	new_tok->window_idx = i + 1;
+}
+
 gint
 rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		rspamd_mempool_t *pool,
@@ -263,13 +332,12 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		const gchar *prefix,
 		GPtrArray *result)
 {
-	rspamd_token_t *new_tok = NULL;
 	rspamd_stat_token_t *token;
 	struct rspamd_osb_tokenizer_config *osb_cf;
-	guint64 *hashpipe, cur, seed;
-	guint32 h1, h2;
-	gsize token_size;
-	guint processed = 0, i, w, window_size, token_flags = 0;
+	guint64 *hashes, *hashpipe, seed, hashes_buf[128];
+	guchar *tokens;
+	gsize token_size, ntokens, offset;
+	guint processed, i, w, window_size, token_flags;
 
 	if (words == NULL) {
 		return FALSE;
@@ -278,6 +346,10 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 	osb_cf = ctx->tkcf;
 	window_size = osb_cf->window_size;
 
+	if (words->len == 0 || window_size < 2) {
+		return TRUE;
+	}
+
 	if (prefix) {
 		seed = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
 				prefix, strlen (prefix), osb_cf->seed);
@@ -286,85 +358,82 @@ rspamd_tokenizer_osb (struct rspamd_stat_ctx *ctx,
 		seed = osb_cf->seed;
 	}
 
-	hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
-	memset (hashpipe, 0xfe, window_size * sizeof (hashpipe[0]));
-	token_size = sizeof (rspamd_token_t) + sizeof (gdouble) * ctx->statfiles->len;
-	g_assert (token_size > 0);
+	if (words->len <= G_N_ELEMENTS (hashes_buf)) {
+		hashes = hashes_buf;
+	}
+	else {
+		hashes = g_malloc (words->len * sizeof (hashes[0]));
+	}
 
-	for (w = 0; w < words->len; w ++) {
-		token = &g_array_index (words, rspamd_stat_token_t, w);
-		token_flags = token->flags;
+	rspamd_tokenizer_osb_hash_words (osb_cf, words, is_utf, seed,
+			prefix != NULL, hashes);
 
-		if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) {
-			rspamd_ftok_t ftok;
+	/*
+	 * Each word after the first window is combined with window_size - 1
+	 * previous words, whilst short texts are combined within a single window
+	 */
+	if (words->len > window_size) {
+		ntokens = (words->len - window_size) * (window_size - 1);
+	}
+	else {
+		ntokens = words->len - 1;
+	}
 
-			ftok.begin = token->begin;
-			ftok.len = token->len;
-			cur = rspamd_fstrhash_lc (&ftok, is_utf);
-		}
-		else {
-			/* We know that the words are normalized */
-			if (osb_cf->ht == RSPAMD_OSB_HASH_XXHASH) {
-				cur = rspamd_cryptobox_fast_hash_specific (RSPAMD_CRYPTOBOX_XXHASH64,
-						token->begin, token->len, osb_cf->seed);
-			}
-			else {
-				rspamd_cryptobox_siphash ((guchar *)&cur, token->begin,
-						token->len, osb_cf->sk);
+	if (ntokens == 0) {
+		goto end;
+	}
 
-				if (prefix) {
-					cur ^= seed;
-				}
-			}
-		}
+	/* All tokens are allocated at once and placed to the result afterwards */
+	token_size = sizeof (rspamd_token_t) + sizeof (gdouble) * ctx->statfiles->len;
+	tokens = rspamd_mempool_alloc0 (pool, token_size * ntokens);
+	offset = result->len;
+	g_ptr_array_set_size (result, offset + ntokens);
 
-#define ADD_TOKEN do {\
-    new_tok = rspamd_mempool_alloc0 (pool, token_size); \
-    new_tok->datalen = sizeof (gint64); \
-    new_tok->flags = token_flags; \
-    if (osb_cf->ht == RSPAMD_OSB_HASH_COMPAT) { \
-        h1 = ((guint32)hashpipe[0]) * primes[0] + \
-            ((guint32)hashpipe[i]) * primes[i << 1]; \
-        h2 = ((guint32)hashpipe[0]) * primes[1] + \
-            ((guint32)hashpipe[i]) * primes[(i << 1) - 1]; \
-        memcpy(new_tok->data, &h1, sizeof (h1)); \
-        memcpy(new_tok->data + sizeof (h1), &h2, sizeof (h2)); \
-    } \
-    else { \
-        cur = hashpipe[0] * primes[0] + hashpipe[i] * primes[i << 1]; \
-        memcpy (new_tok->data, &cur, sizeof (cur)); \
-    } \
-    new_tok->window_idx = i + 1; \
-    g_ptr_array_add (result, new_tok); \
-  } while(0)
-
-		if (processed < window_size) {
-			/* Just fill a hashpipe */
-			hashpipe[window_size - ++processed] = cur;
-		}
-		else {
-			/* Shift hashpipe */
-			for (i = window_size - 1; i > 0; i--) {
-				hashpipe[i] = hashpipe[i - 1];
-			}
-			hashpipe[0] = cur;
-			processed++;
+	for (i = 0; i < ntokens; i ++) {
+		g_ptr_array_index (result, offset + i) = tokens + token_size * i;
+	}
+
+	if (words->len > window_size) {
+		for (w = window_size; w < words->len; w ++) {
+			token = &g_array_index (words, rspamd_stat_token_t, w);
+			token_flags = token->flags;
 
-			for (i = 1; i < window_size; i++) {
-				ADD_TOKEN;
+			for (i = 1; i < window_size; i ++) {
+				rspamd_tokenizer_osb_set_token (osb_cf,
+						(rspamd_token_t *)tokens, hashes[w], hashes[w - i], i,
+						token_flags);
+				tokens += token_size;
 			}
 		}
 	}
+	else {
+		/*
+		 * Emulate the pipe the words used to be placed to, including its
+		 * byte sized move, as tokens of short texts must stay the same
+		 */
+		hashpipe = g_alloca (window_size * sizeof (hashpipe[0]));
+		memset (hashpipe, 0xfe, window_size * sizeof (hashpipe[0]));
+
+		for (processed = 0; processed < words->len; processed ++) {
+			hashpipe[window_size - processed - 1] = hashes[processed];
+		}
 
-	if (processed <= window_size) {
+		token = &g_array_index (words, rspamd_stat_token_t, words->len - 1);
+		token_flags = token->flags;
 		memmove (hashpipe, hashpipe + (window_size - processed + 1), processed);
 
-		for (i = 1; i < processed; i++) {
-			ADD_TOKEN;
+		for (i = 1; i < processed; i ++) {
+			rspamd_tokenizer_osb_set_token (osb_cf,
+					(rspamd_token_t *)tokens, hashpipe[0], hashpipe[i], i,
+					token_flags);
+			tokens += token_size;
 		}
 	}
 
-#undef ADD_TOKEN
+end:
+	if (hashes != hashes_buf) {
+		g_free (hashes);
+	}
 
 	return TRUE;
 }
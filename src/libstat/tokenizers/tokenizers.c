@@ -22,7 +22,11 @@
 #include "stat_internal.h"
 #include "../../../contrib/mumhash/mum.h"
 #include "unicode/utf8.h"
+#include "unicode/utf16.h"
 #include "unicode/uchar.h"
+#include "unicode/uscript.h"
+#include "unicode/ustring.h"
+#include "unicode/ubrk.h"
 
 typedef gboolean (*token_get_function) (rspamd_stat_token_t * buf, gchar const **pos,
 		rspamd_stat_token_t * token,
@@ -57,6 +61,99 @@ const gchar t_delimiters[255] = {
 	0, 0, 0, 0, 0
 };
 
+/* Internal flag for words that should be split by a break iterator */
+#define RSPAMD_TOKENIZER_FLAG_BREAK (1u << 31)
+
+enum rspamd_tokenizer_class {
+	RSPAMD_TOKENIZER_DELIM = 0,
+	RSPAMD_TOKENIZER_PUNCT,
+	RSPAMD_TOKENIZER_WORD,
+};
+
+/* Classes of ascii characters, the same as ICU returns for them */
+static guchar ascii_classes[128];
+static gboolean ascii_classes_initialized = FALSE;
+
+static inline enum rspamd_tokenizer_class
+rspamd_tokenizer_uchar_class (UChar32 uc)
+{
+	if (!u_isgraph (uc)) {
+		return RSPAMD_TOKENIZER_DELIM;
+	}
+
+	return u_ispunct (uc) ? RSPAMD_TOKENIZER_PUNCT : RSPAMD_TOKENIZER_WORD;
+}
+
+static void
+rspamd_tokenizer_init_classes (void)
+{
+	UChar32 i;
+
+	if (!ascii_classes_initialized) {
+		for (i = 0; i < (UChar32)G_N_ELEMENTS (ascii_classes); i ++) {
+			ascii_classes[i] = rspamd_tokenizer_uchar_class (i);
+		}
+
+		ascii_classes_initialized = TRUE;
+	}
+}
+
+/*
+ * Checks whether 8 bytes are all ascii letters or digits, so they could be
+ * added to a word without classifying them one by one
+ */
+#define TOK_ONES G_GUINT64_CONSTANT (0x0101010101010101)
+#define TOK_HIGH G_GUINT64_CONSTANT (0x8080808080808080)
+#define TOK_GE(x, c) ((x) + TOK_ONES * (0x80 - (c)))
+#define TOK_GT(x, c) ((x) + TOK_ONES * (0x7f - (c)))
+
+static inline gboolean
+rspamd_tokenizer_is_alnum8 (const gchar *p)
+{
+	guint64 x, lc, alpha, digit;
+
+	memcpy (&x, p, sizeof (x));
+
+	if (x & TOK_HIGH) {
+		return FALSE;
+	}
+
+	lc = x | (TOK_ONES * 0x20);
+	alpha = TOK_GE (lc, 'a') & ~TOK_GT (lc, 'z');
+	digit = TOK_GE (x, '0') & ~TOK_GT (x, '9');
+
+	return ((alpha | digit) & TOK_HIGH) == TOK_HIGH;
+}
+
+/*
+ * Scripts that are written without spaces between words, so they need
+ * dictionary based segmentation
+ */
+static inline gboolean
+rspamd_tokenizer_need_break (UChar32 uc)
+{
+	UErrorCode uc_err = U_ZERO_ERROR;
+
+	if (uc < 0x0E00) {
+		return FALSE;
+	}
+
+	switch (uscript_getScript (uc, &uc_err)) {
+	case USCRIPT_HAN:
+	case USCRIPT_HIRAGANA:
+	case USCRIPT_KATAKANA:
+	case USCRIPT_THAI:
+	case USCRIPT_LAO:
+	case USCRIPT_KHMER:
+	case USCRIPT_MYANMAR:
+		return TRUE;
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
 gint
 token_node_compare_func (gconstpointer a, gconstpointer b)
 {
@@ -176,6 +273,8 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 	const gchar *p, *s, *sig = NULL;
 	UChar32 uc;
 	guint processed = 0;
+	gboolean need_break = FALSE;
+	enum rspamd_tokenizer_class cls;
 	struct rspamd_process_exception *ex = NULL;
 	enum {
 		skip_delimiters = 0,
@@ -200,6 +299,7 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 	}
 
 	token->len = 0;
+	token->flags &= ~RSPAMD_TOKENIZER_FLAG_BREAK;
 
 	pos = *cur - buf->begin;
 	if (pos >= buf->len) {
@@ -212,15 +312,25 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 
 	for (i = 0; i < remain; ) {
 		p = &s[i];
-		U8_NEXT (s, i, remain, uc);
 
-		if (uc < 0) {
-			if (i < remain) {
-				uc = 0xFFFD;
-			}
-			else {
-				return FALSE;
+		if (G_LIKELY ((guchar)*p < 0x80)) {
+			uc = (guchar)*p;
+			cls = ascii_classes[uc];
+			i ++;
+		}
+		else {
+			U8_NEXT (s, i, remain, uc);
+
+			if (uc < 0) {
+				if (i < remain) {
+					uc = 0xFFFD;
+				}
+				else {
+					return FALSE;
+				}
 			}
+
+			cls = rspamd_tokenizer_uchar_class (uc);
 		}
 
 		switch (state) {
@@ -235,13 +345,14 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 				state = skip_exception;
 				continue;
 			}
-			else if (u_isgraph (uc)) {
-				if (!u_ispunct (uc)) {
-					state = feed_token;
-					token->begin = p;
-					continue;
-				}
-				else if (check_signature && pos != 0 && (*p == '_' || *p == '-')) {
+			else if (cls == RSPAMD_TOKENIZER_WORD) {
+				state = feed_token;
+				token->begin = p;
+				need_break = rspamd_tokenizer_need_break (uc);
+				continue;
+			}
+			else if (cls == RSPAMD_TOKENIZER_PUNCT) {
+				if (check_signature && pos != 0 && (*p == '_' || *p == '-')) {
 					sig = p;
 					siglen = remain - i;
 					state = process_signature;
@@ -254,11 +365,29 @@ rspamd_tokenizer_get_word (rspamd_stat_token_t * buf,
 				token->flags = RSPAMD_STAT_TOKEN_FLAG_TEXT;
 				goto set_token;
 			}
-			else if (!u_isgraph (uc) || u_ispunct (uc)) {
+			else if (cls != RSPAMD_TOKENIZER_WORD) {
 				token->flags = RSPAMD_STAT_TOKEN_FLAG_TEXT;
 				goto set_token;
 			}
+
 			processed ++;
+
+			if (uc >= 0x80) {
+				if (!need_break) {
+					need_break = rspamd_tokenizer_need_break (uc);
+				}
+			}
+			else {
+				/* Skip runs of ascii letters and digits by 8 bytes */
+				while (remain - i >= (gint32)sizeof (guint64) &&
+						(ex == NULL ||
+						 (goffset)ex->pos >= s - buf->begin + i + 8) &&
+						rspamd_tokenizer_is_alnum8 (s + i)) {
+					i += sizeof (guint64);
+					processed += sizeof (guint64);
+					p = &s[i - 1];
+				}
+			}
 			break;
 		case skip_exception:
 			*cur = p + ex->len;
@@ -283,6 +412,10 @@ set_token:
 		*rl = processed;
 	}
 
+	if (need_break) {
+		token->flags |= RSPAMD_TOKENIZER_FLAG_BREAK;
+	}
+
 	if (token->len == 0 && processed > 0) {
 		token->len = p - token->begin;
 		g_assert (token->len > 0);
@@ -293,6 +426,157 @@ set_token:
 	return TRUE;
 }
 
+struct rspamd_tokenize_state {
+	GArray *res;
+	const gchar *text;
+	gsize len;
+	guint min_len;
+	guint max_len;
+	guint word_decay;
+	guint64 hv;
+	guint64 prob;
+	gboolean decay;
+};
+
+static void
+rspamd_tokenize_push (struct rspamd_tokenize_state *st,
+		const rspamd_stat_token_t *token, gsize l, const gchar *pos,
+		gboolean check_min)
+{
+	if (l == 0 || (check_min && st->min_len > 0 && l < st->min_len) ||
+			(st->max_len > 0 && l > st->max_len)) {
+		return;
+	}
+
+	if (!st->decay) {
+		if (token->len >= sizeof (guint64)) {
+#ifdef _MUM_UNALIGNED_ACCESS
+			st->hv = mum_hash_step (st->hv, *(guint64 *)token->begin);
+#else
+			guint64 tmp;
+			memcpy (&tmp, token->begin, sizeof (tmp));
+			st->hv = mum_hash_step (st->hv, tmp);
+#endif
+		}
+
+		/* Check for decay */
+		if (st->word_decay > 0 && st->res->len > st->word_decay &&
+				pos - st->text < (gssize)st->len) {
+			/* Start decay */
+			gdouble decay_prob;
+
+			st->decay = TRUE;
+			st->hv = mum_hash_finish (st->hv);
+
+			/* We assume that word is 6 symbols length in average */
+			decay_prob = (gdouble)st->word_decay /
+					((st->len - (pos - st->text)) / 6.0);
+
+			if (decay_prob >= 1.0) {
+				st->prob = G_MAXUINT64;
+			}
+			else {
+				st->prob = decay_prob * G_MAXUINT64;
+			}
+		}
+	}
+	else {
+		/* Decaying probability */
+		/* LCG64 x[n] = a x[n - 1] + b mod 2^64 */
+		st->hv = 2862933555777941757ULL * st->hv + 3037000493ULL;
+
+		if (st->hv > st->prob) {
+			return;
+		}
+	}
+
+	g_array_append_val (st->res, *token);
+}
+
+/*
+ * Splits a word written in a script without spaces (CJK, Thai and so on)
+ * using ICU word break iterator
+ */
+static gboolean
+rspamd_tokenize_break_word (struct rspamd_tokenize_state *st,
+		const rspamd_stat_token_t *token, const gchar *pos)
+{
+	static UBreakIterator *bi = NULL;
+	UErrorCode uc_err = U_ZERO_ERROR;
+	UChar *utf16, buf[256];
+	gint32 ulen, nsubs = 0, u16pos = 0, u8pos = 0, start8, bpos;
+	UChar32 uc;
+	rspamd_stat_token_t word;
+	gsize rl;
+
+	if (bi == NULL) {
+		bi = ubrk_open (UBRK_WORD, NULL, NULL, 0, &uc_err);
+
+		if (U_FAILURE (uc_err)) {
+			msg_err ("cannot open word break iterator: %s",
+					u_errorName (uc_err));
+			bi = NULL;
+
+			return FALSE;
+		}
+	}
+
+	/* UTF-16 text is never longer than UTF-8 one */
+	if (token->len < G_N_ELEMENTS (buf)) {
+		utf16 = buf;
+	}
+	else {
+		utf16 = g_malloc (sizeof (UChar) * (token->len + 1));
+	}
+
+	u_strFromUTF8WithSub (utf16, token->len + 1, &ulen, token->begin,
+			token->len, 0xFFFD, &nsubs, &uc_err);
+
+	if (U_FAILURE (uc_err) || nsubs > 0) {
+		/* Offsets cannot be mapped back for invalid utf8 */
+		if (utf16 != buf) {
+			g_free (utf16);
+		}
+
+		return FALSE;
+	}
+
+	ubrk_setText (bi, utf16, ulen, &uc_err);
+
+	if (U_FAILURE (uc_err)) {
+		if (utf16 != buf) {
+			g_free (utf16);
+		}
+
+		return FALSE;
+	}
+
+	for (bpos = ubrk_next (bi); bpos != UBRK_DONE; bpos = ubrk_next (bi)) {
+		start8 = u8pos;
+		rl = 0;
+
+		while (u16pos < bpos) {
+			U16_NEXT (utf16, u16pos, ulen, uc);
+			u8pos += U8_LENGTH (uc);
+			rl ++;
+		}
+
+		if (ubrk_getRuleStatus (bi) >= UBRK_WORD_NONE_LIMIT) {
+			word.begin = token->begin + start8;
+			word.len = u8pos - start8;
+			word.flags = RSPAMD_STAT_TOKEN_FLAG_TEXT;
+			/* Dictionary words are short, so minimum length is not checked */
+			rspamd_tokenize_push (st, &word, rl, pos, FALSE);
+		}
+	}
+
+	if (utf16 != buf) {
+		g_free (utf16);
+	}
+
+	return TRUE;
+}
+
 GArray *
 rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
 		struct rspamd_config *cfg, GList *exceptions, gboolean compat,
@@ -301,13 +585,10 @@ rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
 	rspamd_stat_token_t token, buf;
 	const gchar *pos = NULL;
 	gsize l;
-	GArray *res;
 	GList *cur = exceptions;
 	token_get_function func;
-	guint min_len = 0, max_len = 0, word_decay = 0, initial_size = 128;
-	guint64 hv = 0;
-	gboolean decay = FALSE;
-	guint64 prob;
+	guint initial_size = 128;
+	struct rspamd_tokenize_state st;
 
 	if (text == NULL) {
 		return NULL;
@@ -317,85 +598,53 @@ rspamd_tokenize_text (gchar *text, gsize len, gboolean is_utf,
 	buf.len = len;
 	token.begin = NULL;
 	token.len = 0;
+	token.flags = 0;
+
+	memset (&st, 0, sizeof (st));
+	st.text = text;
+	st.len = len;
 
 	if (compat || !is_utf) {
 		func = rspamd_tokenizer_get_word_compat;
 	}
 	else {
 		func = rspamd_tokenizer_get_word;
+		rspamd_tokenizer_init_classes ();
 	}
 
 	if (cfg != NULL) {
-		min_len = cfg->min_word_len;
-		max_len = cfg->max_word_len;
-		word_decay = cfg->words_decay;
-		initial_size = word_decay * 2;
+		st.min_len = cfg->min_word_len;
+		st.max_len = cfg->max_word_len;
+		st.word_decay = cfg->words_decay;
+		initial_size = st.word_decay * 2;
 	}
 
-	res = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_stat_token_t),
+	st.res = g_array_sized_new (FALSE, FALSE, sizeof (rspamd_stat_token_t),
 			initial_size);
 
 	while (func (&buf, &pos, &token, &cur, is_utf, &l, FALSE)) {
-		if (l == 0 || (min_len > 0 && l < min_len) ||
-					(max_len > 0 && l > max_len)) {
-			token.begin = pos;
-			continue;
-		}
-
-		if (!decay) {
-			if (token.len >= sizeof (guint64)) {
-#ifdef _MUM_UNALIGNED_ACCESS
-				hv = mum_hash_step (hv, *(guint64 *)token.begin);
-#else
-				guint64 tmp;
-				memcpy (&tmp, token.begin, sizeof (tmp));
-				hv = mum_hash_step (hv, tmp);
-#endif
-			}
-
-			/* Check for decay */
-			if (word_decay > 0 && res->len > word_decay && pos - text < (gssize)len) {
-				/* Start decay */
-				gdouble decay_prob;
-
-				decay = TRUE;
-				hv = mum_hash_finish (hv);
-
-				/* We assume that word is 6 symbols length in average */
-				decay_prob = (gdouble)word_decay / ((len - (pos - text)) / 6.0);
-
-				if (decay_prob >= 1.0) {
-					prob = G_MAXUINT64;
-				}
-				else {
-					prob = decay_prob * G_MAXUINT64;
-				}
-			}
-		}
-		else {
-			/* Decaying probability */
-			/* LCG64 x[n] = a x[n - 1] + b mod 2^64 */
-			hv = 2862933555777941757ULL * hv + 3037000493ULL;
+		if ((token.flags & RSPAMD_TOKENIZER_FLAG_BREAK) && token.len > 0) {
+			token.flags &= ~RSPAMD_TOKENIZER_FLAG_BREAK;
 
-			if (hv > prob) {
+			if (rspamd_tokenize_break_word (&st, &token, pos)) {
 				token.begin = pos;
 				continue;
 			}
 		}
 
-		g_array_append_val (res, token);
+		rspamd_tokenize_push (&st, &token, l, pos, TRUE);
 		token.begin = pos;
 	}
 
-	if (!decay) {
-		hv = mum_hash_finish (hv);
+	if (!st.decay) {
+		st.hv = mum_hash_finish (st.hv);
 	}
 
 	if (hash) {
-		*hash = hv;
+		*hash = st.hv;
 	}
 
-	return res;
+	return st.res;
 }
 
 /*
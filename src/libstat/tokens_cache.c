@@ -0,0 +1,335 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+/*
+ * Cache of tokens values placed in front of statistics backends
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "stat_internal.h"
+#include "cryptobox.h"
+
+/*
+ * The cache is allocated in shared memory before workers are forked. Each key
+ * is hashed to a set of RSPAMD_TOKENS_CACHE_WAYS elements and the least
+ * recently used element of the set is replaced on insertion.
+ */
+#define RSPAMD_TOKENS_CACHE_WAYS 4
+#define RSPAMD_TOKENS_CACHE_LOCKS 64
+
+/* Key of the number of learns, which is cached alongside tokens */
+static const guchar learns_token[] = {'l', 'e', 'a', 'r', 'n', 's', 0, 0};
+
+struct rspamd_stat_tokens_cache_elt {
+	guint64 key;
+	gdouble value;
+	guint32 ts;
+	guint32 stamp;
+};
+
+struct rspamd_stat_tokens_cache {
+	struct rspamd_stat_tokens_cache_elt *elts;
+	rspamd_mempool_mutex_t *locks[RSPAMD_TOKENS_CACHE_LOCKS];
+	guint nsets;
+	guint32 ttl;
+	gint stamp;
+	guint64 hits;
+	guint64 misses;
+	guint64 invalidations;
+};
+
+static struct rspamd_stat_tokens_cache *tokens_cache = NULL;
+
+static inline void
+rspamd_stat_tokens_cache_counter_add (guint64 *cnt, guint64 n)
+{
+#ifndef HAVE_ATOMIC_BUILTINS
+	*cnt += n;
+#else
+	__atomic_add_fetch (cnt, n, __ATOMIC_RELEASE);
+#endif
+}
+
+void
+rspamd_stat_tokens_cache_init (guint nelts, gdouble ttl)
+{
+	rspamd_mempool_t *pool;
+	guint i;
+
+	if (tokens_cache != NULL || nelts == 0 || ttl <= 0) {
+		return;
+	}
+
+	pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "tokens_cache");
+	tokens_cache = rspamd_mempool_alloc0_shared (pool, sizeof (*tokens_cache));
+	tokens_cache->nsets = MAX (nelts / RSPAMD_TOKENS_CACHE_WAYS, 1);
+	tokens_cache->ttl = MAX (ttl, 1);
+	tokens_cache->elts = rspamd_mempool_alloc0_shared (pool,
+			sizeof (struct rspamd_stat_tokens_cache_elt) *
+			tokens_cache->nsets * RSPAMD_TOKENS_CACHE_WAYS);
+
+	for (i = 0; i < G_N_ELEMENTS (tokens_cache->locks); i ++) {
+		tokens_cache->locks[i] = rspamd_mempool_get_mutex (pool);
+	}
+
+	msg_debug ("initialized tokens cache with %ud elements",
+			tokens_cache->nsets * RSPAMD_TOKENS_CACHE_WAYS);
+}
+
+gboolean
+rspamd_stat_tokens_cache_enabled (void)
+{
+	return tokens_cache != NULL;
+}
+
+gboolean
+rspamd_stat_tokens_cache_seed (struct rspamd_task *task,
+		struct rspamd_statfile *st, gpointer runtime, guint64 *seed)
+{
+	const gchar *key;
+
+	key = st->backend->storage_key (task, runtime, st->bkcf);
+
+	if (key == NULL) {
+		/* Backend cannot tell where tokens of this task are stored */
+		return FALSE;
+	}
+
+	/* Both classification and learning must get the same seed */
+	*seed = rspamd_cryptobox_fast_hash (st->stcf->symbol,
+			strlen (st->stcf->symbol), rspamd_hash_seed ());
+	*seed = rspamd_cryptobox_fast_hash (key, strlen (key), *seed);
+
+	return TRUE;
+}
+
+static inline guint64
+rspamd_stat_tokens_cache_key (const guchar *data, guint64 seed)
+{
+	guint64 key;
+
+	key = rspamd_cryptobox_fast_hash (data, RSPAMD_MAX_TOKEN_LEN, seed);
+
+	/* Zero is used for empty elements */
+	return key == 0 ? 1 : key;
+}
+
+static gboolean
+rspamd_stat_tokens_cache_get (guint64 key, guint32 now, gdouble *value)
+{
+	struct rspamd_stat_tokens_cache_elt *elt;
+	rspamd_mempool_mutex_t *lock;
+	guint set, i;
+	gboolean ret = FALSE;
+
+	set = key % tokens_cache->nsets;
+	lock = tokens_cache->locks[set % RSPAMD_TOKENS_CACHE_LOCKS];
+	elt = &tokens_cache->elts[set * RSPAMD_TOKENS_CACHE_WAYS];
+
+	rspamd_mempool_lock_mutex (lock);
+
+	for (i = 0; i < RSPAMD_TOKENS_CACHE_WAYS; i ++, elt ++) {
+		if (elt->key == key) {
+			if (now - elt->ts < tokens_cache->ttl) {
+				*value = elt->value;
+				elt->stamp = g_atomic_int_add (&tokens_cache->stamp, 1);
+				ret = TRUE;
+			}
+			else {
+				/* Expired */
+				elt->key = 0;
+			}
+
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (lock);
+
+	return ret;
+}
+
+static void
+rspamd_stat_tokens_cache_set (guint64 key, guint32 now, gdouble value)
+{
+	struct rspamd_stat_tokens_cache_elt *elt, *victim = NULL;
+	rspamd_mempool_mutex_t *lock;
+	guint set, i;
+
+	set = key % tokens_cache->nsets;
+	lock = tokens_cache->locks[set % RSPAMD_TOKENS_CACHE_LOCKS];
+	elt = &tokens_cache->elts[set * RSPAMD_TOKENS_CACHE_WAYS];
+
+	rspamd_mempool_lock_mutex (lock);
+
+	for (i = 0; i < RSPAMD_TOKENS_CACHE_WAYS; i ++, elt ++) {
+		if (elt->key == key) {
+			victim = elt;
+			break;
+		}
+
+		if (elt->key == 0) {
+			if (victim == NULL || victim->key != 0) {
+				victim = elt;
+			}
+		}
+		else if (victim == NULL ||
+				(victim->key != 0 && elt->stamp < victim->stamp)) {
+			victim = elt;
+		}
+	}
+
+	victim->key = key;
+	victim->value = value;
+	victim->ts = now;
+	victim->stamp = g_atomic_int_add (&tokens_cache->stamp, 1);
+
+	rspamd_mempool_unlock_mutex (lock);
+}
+
+static void
+rspamd_stat_tokens_cache_del (guint64 key)
+{
+	struct rspamd_stat_tokens_cache_elt *elt;
+	rspamd_mempool_mutex_t *lock;
+	guint set, i;
+
+	set = key % tokens_cache->nsets;
+	lock = tokens_cache->locks[set % RSPAMD_TOKENS_CACHE_LOCKS];
+	elt = &tokens_cache->elts[set * RSPAMD_TOKENS_CACHE_WAYS];
+
+	rspamd_mempool_lock_mutex (lock);
+
+	for (i = 0; i < RSPAMD_TOKENS_CACHE_WAYS; i ++, elt ++) {
+		if (elt->key == key) {
+			elt->key = 0;
+			break;
+		}
+	}
+
+	rspamd_mempool_unlock_mutex (lock);
+}
+
+GPtrArray *
+rspamd_stat_tokens_cache_lookup (struct rspamd_task *task,
+		GPtrArray *tokens, gint id, guint64 seed, guint64 *learns)
+{
+	GPtrArray *missed;
+	rspamd_token_t *tok;
+	guint32 now;
+	gdouble value;
+	guint i;
+
+	now = task->tv.tv_sec;
+	missed = g_ptr_array_sized_new (tokens->len);
+	rspamd_mempool_add_destructor (task->task_pool,
+			rspamd_ptr_array_free_hard, missed);
+
+	if (rspamd_stat_tokens_cache_get (
+			rspamd_stat_tokens_cache_key (learns_token, seed), now, &value)) {
+		*learns = value;
+	}
+	else {
+		*learns = 0;
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+
+		if (rspamd_stat_tokens_cache_get (
+				rspamd_stat_tokens_cache_key (tok->data, seed), now, &value)) {
+			tok->values[id] = value;
+		}
+		else {
+			g_ptr_array_add (missed, tok);
+		}
+	}
+
+	rspamd_stat_tokens_cache_counter_add (&tokens_cache->hits,
+			tokens->len - missed->len);
+	rspamd_stat_tokens_cache_counter_add (&tokens_cache->misses, missed->len);
+
+	return missed;
+}
+
+void
+rspamd_stat_tokens_cache_insert (struct rspamd_task *task,
+		GPtrArray *tokens, gint id, guint64 seed, guint64 learns)
+{
+	rspamd_token_t *tok;
+	guint32 now;
+	guint i;
+
+	now = task->tv.tv_sec;
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		rspamd_stat_tokens_cache_set (
+				rspamd_stat_tokens_cache_key (tok->data, seed), now,
+				tok->values[id]);
+	}
+
+	rspamd_stat_tokens_cache_set (
+			rspamd_stat_tokens_cache_key (learns_token, seed), now, learns);
+}
+
+void
+rspamd_stat_tokens_cache_invalidate (GPtrArray *tokens, guint64 seed)
+{
+	rspamd_token_t *tok;
+	guint i;
+
+	for (i = 0; i < tokens->len; i ++) {
+		tok = g_ptr_array_index (tokens, i);
+		rspamd_stat_tokens_cache_del (
+				rspamd_stat_tokens_cache_key (tok->data, seed));
+	}
+
+	rspamd_stat_tokens_cache_del (
+			rspamd_stat_tokens_cache_key (learns_token, seed));
+	rspamd_stat_tokens_cache_counter_add (&tokens_cache->invalidations, 1);
+}
+
+ucl_object_t *
+rspamd_stat_tokens_cache_statistics (void)
+{
+	ucl_object_t *res;
+	guint64 hits, misses;
+
+	if (tokens_cache == NULL) {
+		return NULL;
+	}
+
+	hits = tokens_cache->hits;
+	misses = tokens_cache->misses;
+	res = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (res,
+			ucl_object_fromint (tokens_cache->nsets * RSPAMD_TOKENS_CACHE_WAYS),
+			"size", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (tokens_cache->ttl),
+			"ttl", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (hits), "hits", 0, false);
+	ucl_object_insert_key (res, ucl_object_fromint (misses), "misses", 0, false);
+	ucl_object_insert_key (res,
+			ucl_object_fromint (tokens_cache->invalidations),
+			"invalidations", 0, false);
+	ucl_object_insert_key (res,
+			ucl_object_fromdouble (hits + misses > 0 ?
+					(gdouble)hits / (hits + misses) : 0.0),
+			"hit_rate", 0, false);
+
+	return res;
+}
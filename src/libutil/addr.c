@@ -957,9 +957,9 @@ rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
-int
-rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
-		gboolean async)
+static int
+rspamd_inet_address_listen_common (const rspamd_inet_addr_t *addr, gint type,
+		gboolean async, gboolean reuseport)
 {
 	gint fd, r;
 	gint on = 1;
@@ -989,6 +989,22 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 
 	(void)setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&on, sizeof (gint));
 
+	if (reuseport) {
+#ifdef HAVE_SO_REUSEPORT
+		if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&on,
+				sizeof (gint)) == -1) {
+			msg_warn ("cannot set SO_REUSEPORT: %d, '%s'", errno,
+					strerror (errno));
+			close (fd);
+			return -1;
+		}
+#else
+		close (fd);
+		errno = ENOTSUP;
+		return -1;
+#endif
+	}
+
 #ifdef HAVE_IPV6_V6ONLY
 	if (addr->af == AF_INET6) {
 		/* We need to set this flag to avoid errors */
@@ -1042,6 +1058,20 @@ rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 	return fd;
 }
 
+int
+rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
+		gboolean async)
+{
+	return rspamd_inet_address_listen_common (addr, type, async, FALSE);
+}
+
+int
+rspamd_inet_address_listen_reuseport (const rspamd_inet_addr_t *addr,
+		gint type, gboolean async)
+{
+	return rspamd_inet_address_listen_common (addr, type, async, TRUE);
+}
+
 gssize
 rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 		rspamd_inet_addr_t **target)
@@ -1060,21 +1090,44 @@ rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 	}
 
 	if (target) {
-		addr = rspamd_inet_addr_create (su.sa.sa_family);
-		addr->slen = slen;
+		*target = rspamd_inet_address_from_peer (&su.sa, slen);
+	}
 
-		if (addr->af == AF_UNIX) {
-			addr->u.un = g_slice_alloc (sizeof (*addr->u.un));
-			memcpy (&addr->u.un->addr, &su.su, sizeof (struct sockaddr_un));
-		}
-		else {
-			memcpy (&addr->u.in.addr, &su.sa, MIN (slen, sizeof (addr->u.in.addr)));
-		}
+	return (ret);
+}
 
-		*target = addr;
+rspamd_inet_addr_t *
+rspamd_inet_address_from_peer (const struct sockaddr *sa, socklen_t slen)
+{
+	rspamd_inet_addr_t *addr;
+
+	addr = rspamd_inet_addr_create (sa->sa_family);
+	addr->slen = slen;
+
+	if (addr->af == AF_UNIX) {
+		memcpy (&addr->u.un->addr, sa, MIN (slen, sizeof (struct sockaddr_un)));
+	}
+	else {
+		memcpy (&addr->u.in.addr, sa, MIN (slen, sizeof (addr->u.in.addr)));
 	}
 
-	return (ret);
+	return addr;
+}
+
+const struct sockaddr *
+rspamd_inet_address_get_sa (const rspamd_inet_addr_t *addr, socklen_t *sz)
+{
+	g_assert (addr != NULL);
+
+	if (sz) {
+		*sz = addr->slen;
+	}
+
+	if (addr->af == AF_UNIX) {
+		return (const struct sockaddr *)&addr->u.un->addr;
+	}
+
+	return &addr->u.in.addr.sa;
 }
 
 gssize
@@ -159,6 +159,25 @@ guchar * rspamd_inet_address_get_hash_key (const rspamd_inet_addr_t *addr, guint
 gssize rspamd_inet_address_recvfrom (gint fd, void *buf, gsize len, gint fl,
 		rspamd_inet_addr_t **target);
 
+/**
+ * Create inet address of a peer as it is returned by recvfrom(2) or
+ * recvmmsg(2)
+ * @param sa peer address
+ * @param slen length of the peer address
+ * @return new address
+ */
+rspamd_inet_addr_t * rspamd_inet_address_from_peer (const struct sockaddr *sa,
+		socklen_t slen);
+
+/**
+ * Returns sockaddr of the inet address suitable for sendto(2) and sendmmsg(2)
+ * @param addr
+ * @param sz output length of the sockaddr
+ * @return
+ */
+const struct sockaddr * rspamd_inet_address_get_sa (
+		const rspamd_inet_addr_t *addr, socklen_t *sz);
+
 /**
  * Send data via unconnected socket using the specified inet_addr structure
  * @param fd
@@ -193,6 +212,18 @@ int rspamd_inet_address_connect (const rspamd_inet_addr_t *addr, gint type,
  */
 int rspamd_inet_address_listen (const rspamd_inet_addr_t *addr, gint type,
 	gboolean async);
+
+/**
+ * Listen on a specified inet address allowing other sockets to be bound to
+ * the same address with SO_REUSEPORT, so the kernel balances incoming
+ * datagrams and connections between them
+ * @param addr
+ * @param type
+ * @param async
+ * @return socket or -1 (with errno set to ENOTSUP if SO_REUSEPORT is unsupported)
+ */
+int rspamd_inet_address_listen_reuseport (const rspamd_inet_addr_t *addr,
+		gint type, gboolean async);
 /**
  * Check whether specified ip is valid (not INADDR_ANY or INADDR_NONE) for ipv4 or ipv6
  * @param ptr pointer to struct in_addr or struct in6_addr
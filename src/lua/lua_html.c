@@ -402,13 +402,12 @@ struct lua_html_traverse_ud {
 };
 
 static gboolean
-lua_html_node_foreach_cb (GNode *n, gpointer d)
+lua_html_node_foreach_cb (struct html_tag *tag, struct lua_html_traverse_ud *ud)
 {
-	struct lua_html_traverse_ud *ud = d;
-	struct html_tag *tag = n->data, **ptag;
+	struct html_tag **ptag;
 
-	if (tag && (ud->any || g_hash_table_lookup (ud->tags,
-			GSIZE_TO_POINTER (mum_hash64 (tag->id, 0))))) {
+	if (ud->any || g_hash_table_lookup (ud->tags,
+			GSIZE_TO_POINTER (mum_hash64 (tag->id, 0)))) {
 
 		lua_rawgeti (ud->L, LUA_REGISTRYINDEX, ud->cbref);
 
@@ -441,6 +440,7 @@ lua_html_foreach_tag (lua_State *L)
 	struct lua_html_traverse_ud ud;
 	const gchar *tagname;
 	gint id;
+	guint i;
 
 	ud.tags = g_hash_table_new (g_direct_hash, g_direct_equal);
 	ud.any = FALSE;
@@ -485,14 +485,19 @@ lua_html_foreach_tag (lua_State *L)
 	}
 
 	if (hc && g_hash_table_size (ud.tags) > 0 && lua_isfunction (L, 3)) {
-		if (hc->html_tags) {
+		if (hc->tags) {
 
 			lua_pushvalue (L, 3);
 			ud.cbref = luaL_ref (L, LUA_REGISTRYINDEX);
 			ud.L = L;
 
-			g_node_traverse (hc->html_tags, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
-					lua_html_node_foreach_cb, &ud);
+			/* Tags are stored in document order, which is the tree pre-order */
+			for (i = 0; i < hc->tags->len; i ++) {
+				if (lua_html_node_foreach_cb (g_ptr_array_index (hc->tags, i),
+						&ud)) {
+					break;
+				}
+			}
 
 			luaL_unref (L, LUA_REGISTRYINDEX, ud.cbref);
 		}
@@ -534,16 +539,16 @@ static gint
 lua_html_tag_get_parent (lua_State *L)
 {
 	struct html_tag *tag = lua_check_html_tag (L, 1), **ptag;
-	GNode *node;
 
 	if (tag != NULL) {
-		node = tag->parent;
-
-		if (node && node->data) {
+		if (tag->parent) {
 			ptag = lua_newuserdata (L, sizeof (gpointer));
-			*ptag = node->data;
+			*ptag = tag->parent;
 			rspamd_lua_setclass (L, "rspamd{html_tag}", -1);
 		}
+		else {
+			lua_pushnil (L);
+		}
 	}
 	else {
 		return luaL_error (L, "invalid arguments");
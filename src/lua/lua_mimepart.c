@@ -15,6 +15,7 @@
  */
 #include "lua_common.h"
 #include "message.h"
+#include "mime_parser.h"
 
 /* Textpart methods */
 /***
@@ -601,16 +602,18 @@ lua_mimepart_get_content (lua_State * L)
 {
 	struct rspamd_mime_part *part = lua_check_mimepart (L);
 	struct rspamd_lua_text *t;
+	const rspamd_ftok_t *data;
 
 	if (part == NULL) {
 		lua_pushnil (L);
 		return 1;
 	}
 
+	data = rspamd_mime_part_get_data (part);
 	t = lua_newuserdata (L, sizeof (*t));
 	rspamd_lua_setclass (L, "rspamd{text}", -1);
-	t->start = part->parsed_data.begin;
-	t->len = part->parsed_data.len;
+	t->start = data->begin;
+	t->len = data->len;
 	t->flags = 0;
 
 	return 1;
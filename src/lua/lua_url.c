@@ -680,7 +680,7 @@ lua_url_init (lua_State *L)
 
 	tld_path = luaL_checkstring (L, 1);
 
-	rspamd_url_init (tld_path);
+	rspamd_url_init (tld_path, NULL);
 
 	return 0;
 }
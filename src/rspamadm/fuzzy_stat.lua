@@ -116,7 +116,17 @@ local function add_result(dst, src, k)
   return dst
 end
 
-local function print_result(r)
+local function print_result(r, k)
+  local function num_to_batch(num)
+    local min = 2 ^ (num - 1)
+
+    if num == 1 then
+      return '1'
+    elseif num == 8 then
+      return string.format('%d+', min)
+    end
+    return string.format('%d-%d', min, min * 2 - 1)
+  end
   local function num_to_epoch(num)
     if num == 1 then
       return 'v0.6'
@@ -131,8 +141,12 @@ local function print_result(r)
   end
   if type(r) == 'table' then
     local res = {}
+    local label = num_to_epoch
+    if k == 'fuzzy_redis_batch_sizes' then
+      label = num_to_batch
+    end
     for i,num in ipairs(r) do
-      res[i] = string.format('(%s: %s)', num_to_epoch(i), print_num(num))
+      res[i] = string.format('(%s: %s)', label(i), print_num(num))
     end
 
     return table.concat(res, ', ')
@@ -219,7 +233,7 @@ return function(args, res)
 
     for k,v in pairs(st) do
       if k ~= 'keys' and k ~= 'errors_ips' then
-        print(string.format('%s: %s', k, print_result(v)))
+        print(string.format('%s: %s', k, print_result(v, k)))
       end
     end
     print('')
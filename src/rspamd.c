@@ -348,7 +348,7 @@ rspamd_fork_delayed (struct rspamd_worker_conf *cf,
 
 static GList *
 create_listen_socket (GPtrArray *addrs, guint cnt,
-		enum rspamd_worker_socket_type listen_type)
+		enum rspamd_worker_socket_type listen_type, gboolean reuseport)
 {
 	GList *result = NULL;
 	gint fd;
@@ -370,8 +370,14 @@ create_listen_socket (GPtrArray *addrs, guint cnt,
 			}
 		}
 		if (listen_type & RSPAMD_WORKER_SOCKET_UDP) {
-			fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
-					SOCK_DGRAM, TRUE);
+			if (reuseport) {
+				fd = rspamd_inet_address_listen_reuseport (
+						g_ptr_array_index (addrs, i), SOCK_DGRAM, TRUE);
+			}
+			else {
+				fd = rspamd_inet_address_listen (g_ptr_array_index (addrs, i),
+						SOCK_DGRAM, TRUE);
+			}
 			if (fd != -1) {
 				ls = g_slice_alloc0 (sizeof (*ls));
 				ls->addr = g_ptr_array_index (addrs, i);
@@ -385,6 +391,66 @@ create_listen_socket (GPtrArray *addrs, guint cnt,
 	return result;
 }
 
+/*
+ * Creates UDP sockets for each worker of the specified type, all of them are
+ * bound to the same addresses with SO_REUSEPORT. Sockets are kept in the
+ * worker config, so a respawned worker gets the sockets of its predecessor
+ */
+static gboolean
+create_reuseport_sockets (struct rspamd_main *rspamd_main,
+		struct rspamd_worker_conf *cf)
+{
+	struct rspamd_worker_bind_conf *bcf;
+	GList *socks, *ls;
+	guint i, nworkers;
+
+	if (cf->reuseport_socks != NULL) {
+		return cf->reuseport_socks->len > 0;
+	}
+
+	if (cf->worker->flags & (RSPAMD_WORKER_UNIQUE|RSPAMD_WORKER_THREADED)) {
+		nworkers = 1;
+	}
+	else {
+		nworkers = cf->count;
+	}
+
+	cf->reuseport_socks = g_ptr_array_sized_new (nworkers);
+
+	for (i = 0; i < nworkers; i ++) {
+		socks = NULL;
+
+		LL_FOREACH (cf->bind_conf, bcf) {
+			if (bcf->is_systemd) {
+				msg_warn_main ("cannot bind separate sockets to systemd "
+						"socket %s, ignore it", bcf->name);
+				continue;
+			}
+
+			ls = create_listen_socket (bcf->addrs, bcf->cnt,
+					RSPAMD_WORKER_SOCKET_UDP, TRUE);
+
+			if (ls == NULL) {
+				msg_err_main ("cannot listen on %s for worker %d: %s",
+						bcf->name, i, strerror (errno));
+				g_list_free (socks);
+
+				return FALSE;
+			}
+
+			socks = g_list_concat (socks, ls);
+		}
+
+		if (socks == NULL) {
+			return FALSE;
+		}
+
+		g_ptr_array_add (cf->reuseport_socks, socks);
+	}
+
+	return TRUE;
+}
+
 static GList *
 systemd_get_socket (struct rspamd_main *rspamd_main, gint number)
 {
@@ -531,7 +597,8 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 	gpointer p;
 	guintptr key;
 	struct rspamd_worker_bind_conf *bcf;
-	gboolean listen_ok = FALSE;
+	enum rspamd_worker_socket_type listen_type;
+	gboolean listen_ok = FALSE, reuseport_ok;
 	GPtrArray *seen_mandatory_workers;
 	worker_t **cw, *wrk;
 	guint i;
@@ -543,6 +610,7 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 	while (cur) {
 		cf = cur->data;
 		listen_ok = FALSE;
+		reuseport_ok = TRUE;
 
 		if (cf->worker == NULL) {
 			msg_err_main ("type of worker is unspecified, skip spawning");
@@ -552,7 +620,25 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 				g_ptr_array_add (seen_mandatory_workers, cf->worker);
 			}
 			if (cf->worker->flags & RSPAMD_WORKER_HAS_SOCKET) {
+				listen_type = cf->worker->listen_type;
+
+				if (cf->reuseport &&
+						(listen_type & RSPAMD_WORKER_SOCKET_UDP)) {
+					/*
+					 * Each worker receives datagrams from its own socket, so
+					 * the shared socket must not be bound to avoid losing
+					 * datagrams that the kernel would route to it
+					 */
+					listen_type &= ~RSPAMD_WORKER_SOCKET_UDP;
+					reuseport_ok = create_reuseport_sockets (rspamd_main, cf);
+					listen_ok = reuseport_ok;
+				}
+
 				LL_FOREACH (cf->bind_conf, bcf) {
+					if (listen_type == 0) {
+						break;
+					}
+
 					key = make_listen_key (bcf);
 
 					if ((p =
@@ -562,7 +648,7 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									listen_type, FALSE);
 						}
 						else {
 							ls = systemd_get_socket (rspamd_main, bcf->cnt);
@@ -590,7 +676,7 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 					}
 				}
 
-				if (listen_ok) {
+				if (listen_ok && reuseport_ok) {
 					spawn_worker_type (rspamd_main, ev_base, cf);
 				}
 				else {
@@ -1273,13 +1359,15 @@ main (gint argc, gchar **argv, gchar **env)
 	msg_info_main ("cpu features: %s",
 			rspamd_main->cfg->libs_ctx->crypto_ctx->cpu_extensions);
 	msg_info_main ("cryptobox configuration: curve25519(%s), "
-			"chacha20(%s), poly1305(%s), siphash(%s), blake2(%s), base64(%s)",
+			"chacha20(%s), poly1305(%s), siphash(%s), blake2(%s), base64(%s), "
+			"boundary(%s)",
 			rspamd_main->cfg->libs_ctx->crypto_ctx->curve25519_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->chacha20_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->poly1305_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->siphash_impl,
 			rspamd_main->cfg->libs_ctx->crypto_ctx->blake2_impl,
-			rspamd_main->cfg->libs_ctx->crypto_ctx->base64_impl);
+			rspamd_main->cfg->libs_ctx->crypto_ctx->base64_impl,
+			rspamd_main->cfg->libs_ctx->crypto_ctx->boundary_impl);
 
 	/* Daemonize */
 	if (!no_fork && daemon (0, 0) == -1) {
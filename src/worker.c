@@ -27,6 +27,8 @@
 #include "libserver/url.h"
 #include "libserver/dns.h"
 #include "libmime/message.h"
+#include "libmime/mime_parser.h"
+#include "libserver/re_cache.h"
 #include "rspamd.h"
 #include "keypairs_cache.h"
 #include "libstat/stat_api.h"
@@ -219,23 +221,24 @@ rspamd_worker_guard_handler (gint fd, short what, void *data)
 	}
 }
 
-static gint
-rspamd_worker_body_handler (struct rspamd_http_connection *conn,
+struct rspamd_worker_stream {
+	gsize scanned;
+	gboolean enabled;
+	gboolean complete;
+};
+
+static void
+rspamd_worker_start_task (struct rspamd_task *task,
 	struct rspamd_http_message *msg,
 	const gchar *chunk, gsize len)
 {
-	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
 	struct rspamd_worker_ctx *ctx;
 	struct timeval task_tv;
 	struct event *guard_ev;
 
 	ctx = task->worker->ctx;
 
-	if (!rspamd_protocol_handle_request (task, msg)) {
-		msg_err_task ("cannot handle request: %e", task->err);
-		task->flags |= RSPAMD_TASK_FLAG_SKIP;
-	}
-	else {
+	if (!RSPAMD_TASK_IS_SKIPPED (task)) {
 		if (task->cmd == CMD_PING) {
 			task->flags |= RSPAMD_TASK_FLAG_SKIP;
 		}
@@ -270,6 +273,79 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	task->guard_ev = guard_ev;
 
 	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
+}
+
+static gint
+rspamd_worker_body_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *chunk, gsize len)
+{
+	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+
+	if (!rspamd_protocol_handle_request (task, msg)) {
+		msg_err_task ("cannot handle request: %e", task->err);
+		task->flags |= RSPAMD_TASK_FLAG_SKIP;
+	}
+
+	rspamd_worker_start_task (task, msg, chunk, len);
+
+	return 0;
+}
+
+/*
+ * Called for each portion of data received when `stream_message` is enabled:
+ * message headers are parsed and scanned by headers regexps as soon as they
+ * are available, whilst the rest of the message is processed on finish
+ */
+static gint
+rspamd_worker_stream_handler (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *chunk, gsize len)
+{
+	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_stream *stream;
+	const rspamd_ftok_t *clen;
+
+	stream = rspamd_mempool_get_variable (task->task_pool, "stream");
+
+	if (stream == NULL) {
+		/* HTTP headers are complete at the first portion of the body */
+		stream = rspamd_mempool_alloc0 (task->task_pool, sizeof (*stream));
+		rspamd_mempool_set_variable (task->task_pool, "stream", stream, NULL);
+
+		if (!rspamd_protocol_handle_request (task, msg)) {
+			msg_err_task ("cannot handle request: %e", task->err);
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+		else {
+			clen = rspamd_http_message_find_header (msg, "Content-Length");
+
+			/*
+			 * We can only parse message in place if the body buffer is
+			 * preallocated and if the body is a plain message: a control
+			 * block precedes the message if Message-Length is specified
+			 */
+			if (clen != NULL && task->cmd != CMD_PING &&
+					(task->flags & RSPAMD_TASK_FLAG_MIME) &&
+					!(task->flags & RSPAMD_TASK_FLAG_HAS_CONTROL) &&
+					!(msg->flags & RSPAMD_HTTP_FLAG_SHMEM) &&
+					rspamd_http_message_find_header (msg, "shm") == NULL &&
+					rspamd_http_message_find_header (msg, "file") == NULL &&
+					rspamd_http_message_find_header (msg, "path") == NULL &&
+					rspamd_http_message_find_header (msg, "compression") == NULL) {
+				stream->enabled = TRUE;
+			}
+		}
+	}
+
+	if (stream->enabled && !(task->flags & RSPAMD_TASK_FLAG_HEADERS_PARSED)) {
+		if (rspamd_mime_parse_task_headers (task, msg->body_buf.begin,
+				msg->body_buf.len, &stream->scanned)) {
+			msg_debug_task ("parsed message headers after %z bytes received",
+					msg->body_buf.len);
+			rspamd_re_cache_process_headers (task);
+		}
+	}
 
 	return 0;
 }
@@ -324,6 +400,24 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_stream *stream;
+
+	if (conn->opts & RSPAMD_HTTP_BODY_PARTIAL) {
+		stream = rspamd_mempool_get_variable (task->task_pool, "stream");
+
+		if (stream == NULL) {
+			/* Request has no body at all */
+			rspamd_worker_stream_handler (conn, msg, NULL, 0);
+			stream = rspamd_mempool_get_variable (task->task_pool, "stream");
+		}
+
+		if (!stream->complete) {
+			/* Streamed message has been received completely */
+			stream->complete = TRUE;
+			rspamd_worker_start_task (task, msg, msg->body_buf.begin,
+					msg->body_buf.len);
+		}
+	}
 
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 		/* We are done here */
@@ -392,13 +486,27 @@ accept_socket (gint fd, short what, void *arg)
 	/* TODO: allow to disable autolearn in protocol */
 	task->flags |= RSPAMD_TASK_FLAG_LEARN_AUTO;
 
-	task->http_conn = rspamd_http_connection_new (rspamd_worker_body_handler,
-			rspamd_worker_error_handler,
-			rspamd_worker_finish_handler,
-			0,
-			RSPAMD_HTTP_SERVER,
-			ctx->keys_cache,
-			NULL);
+	if (ctx->stream_message && ctx->key == NULL) {
+		/* Encrypted requests cannot be processed incrementally */
+		task->http_conn = rspamd_http_connection_new (
+				rspamd_worker_stream_handler,
+				rspamd_worker_error_handler,
+				rspamd_worker_finish_handler,
+				RSPAMD_HTTP_BODY_PARTIAL,
+				RSPAMD_HTTP_SERVER,
+				ctx->keys_cache,
+				NULL);
+	}
+	else {
+		task->http_conn = rspamd_http_connection_new (
+				rspamd_worker_body_handler,
+				rspamd_worker_error_handler,
+				rspamd_worker_finish_handler,
+				0,
+				RSPAMD_HTTP_SERVER,
+				ctx->keys_cache,
+				NULL);
+	}
 	rspamd_http_connection_set_max_size (task->http_conn, task->cfg->max_message);
 	task->ev_base = ctx->ev_base;
 	worker->nconns++;
@@ -540,6 +648,15 @@ init_worker (struct rspamd_config *cfg)
 			0,
 			"Deprecated: disabled and forgotten");
 
+	rspamd_rcl_register_worker_option (cfg,
+			type,
+			"stream_message",
+			rspamd_rcl_parse_struct_boolean,
+			ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, stream_message),
+			0,
+			"Parse message headers while the message body is being received");
+
 	rspamd_rcl_register_worker_option (cfg,
 			type,
 			"timeout",
@@ -145,6 +145,13 @@ vehemence of any carnal pleasure.]]
 
     print("Optimized base64 (512): " .. tostring(t2 - t1) .. " sec")
     assert_not_equal(res, 0)
+  end)
+  test("Base64 optimized decoder random lengths", function()
+    for i = 1,1000 do
+      local l = ffi.C.ottery_rand_unsigned() % 4096 + 1
+      local res = ffi.C.base64_test(false, 1, l)
+      assert_not_equal(res, 0)
+    end
   end)
     test("Base64 test reference vectors 10K", function()
     local t1 = ffi.C.rspamd_get_ticks()
@@ -0,0 +1,42 @@
+context("MIME boundaries scanner", function()
+  local ffi = require("ffi")
+  ffi.cdef[[
+    void rspamd_cryptobox_init (void);
+    size_t boundary_test (bool generic, size_t niters, size_t len);
+    double rspamd_get_ticks (void);
+  ]]
+
+  ffi.C.rspamd_cryptobox_init()
+
+  local cases = {
+    {1, 10},
+    {63, 1000},
+    {65, 1000},
+    {4096, 1000},
+  }
+
+  for _,c in ipairs(cases) do
+    test("Boundaries scanner consistency " .. tostring(c[1]), function()
+      -- Optimized scanner is checked against the reference one inside
+      local res = ffi.C.boundary_test(false, c[2], c[1])
+      assert_not_equal(res, 0)
+    end)
+  end
+
+  test("Boundaries scanner reference 64K", function()
+    local t1 = ffi.C.rspamd_get_ticks()
+    local res = ffi.C.boundary_test(true, 10000, 65536)
+    local t2 = ffi.C.rspamd_get_ticks()
+
+    print("Reference boundaries scanner (64K): " .. tostring(t2 - t1) .. " sec")
+    assert_not_equal(res, 0)
+  end)
+  test("Boundaries scanner optimized 64K", function()
+    local t1 = ffi.C.rspamd_get_ticks()
+    local res = ffi.C.boundary_test(false, 10000, 65536)
+    local t2 = ffi.C.rspamd_get_ticks()
+
+    print("Optimized boundaries scanner (64K): " .. tostring(t2 - t1) .. " sec")
+    assert_not_equal(res, 0)
+  end)
+end)
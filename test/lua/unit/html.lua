@@ -66,4 +66,25 @@ context("HTML processing", function()
       assert_equal(c[2], tostring(t))
     end
   end)
+
+  test("Perfect hash lookups of tags, entities and colors", function()
+    local ffi = require("ffi")
+    ffi.cdef[[
+      size_t html_lookup_test (bool generic, size_t niters);
+      double rspamd_get_ticks (void);
+    ]]
+
+    local t1 = ffi.C.rspamd_get_ticks()
+    local ref = ffi.C.html_lookup_test(true, 10000)
+    local t2 = ffi.C.rspamd_get_ticks()
+    print("Reference html lookups (bsearch): " .. tostring(t2 - t1) .. " sec")
+
+    t1 = ffi.C.rspamd_get_ticks()
+    local res = ffi.C.html_lookup_test(false, 10000)
+    t2 = ffi.C.rspamd_get_ticks()
+    print("Optimized html lookups (perfect hash): " .. tostring(t2 - t1) .. " sec")
+
+    assert_not_equal(res, 0)
+    assert_equal(tonumber(ref), tonumber(res))
+  end)
 end)
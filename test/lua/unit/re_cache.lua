@@ -0,0 +1,31 @@
+context("Regexp cache", function()
+  local ffi = require("ffi")
+  ffi.cdef[[
+    unsigned re_cache_lazy_test (double avg_requests, unsigned nrequests);
+  ]]
+
+  test("Few regexps of a class are run alone", function()
+    assert_equal(ffi.C.re_cache_lazy_test(2.0, 1), 1)
+    assert_equal(ffi.C.re_cache_lazy_test(2.0, 2), 2)
+    assert_equal(ffi.C.re_cache_lazy_test(0.5, 1), 1)
+  end)
+  test("Many regexps of a class switch to the whole class scan", function()
+    local cases = {
+      {2.0, 500},
+      {2.0, 3},
+      {0.5, 100},
+      {3.5, 1000},
+    }
+
+    for _,c in ipairs(cases) do
+      local res = ffi.C.re_cache_lazy_test(c[1], c[2])
+      assert_true(res < c[2], string.format("%s regexps of a class with %s " ..
+        "average requests are all run alone", c[2], c[1]))
+      assert_true(res <= 4, string.format("%s regexps run alone", res))
+    end
+  end)
+  test("Frequently used classes are always scanned", function()
+    assert_equal(ffi.C.re_cache_lazy_test(10.0, 1), 0)
+    assert_equal(ffi.C.re_cache_lazy_test(10.0, 100), 0)
+  end)
+end)
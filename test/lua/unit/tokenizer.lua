@@ -15,7 +15,13 @@ context("Text tokenization test", function()
       {",,,,,", {}},
       {"word,,,,,word    ", {"word", "word"}},
       {"word", {"word"}},
-      {",,,,word,,,", {"word"}}
+      {",,,,word,,,", {"word"}},
+      {"abcdefghijklmnopqrstuvwxyz0123456789 ABCDEFGHIJKLMNOP,x",
+        {"abcdefghijklmnopqrstuvwxyz0123456789", "ABCDEFGHIJKLMNOP"}
+      },
+      {"price$12345678 mixed12345678ascii-and-Ünicode12345678 ",
+        {"price$12345678", "mixed12345678ascii", "and", "Ünicode12345678"}
+      },
     }
     
     for _,c in ipairs(cases) do
@@ -30,6 +36,20 @@ context("Text tokenization test", function()
         end
       end
     end
+  end)
+  test("Tokenize scripts without spaces", function()
+    local cases = {
+      {"我喜欢吃苹果。", "我喜欢吃苹果"},
+      {"สวัสดีครับ ", "สวัสดีครับ"},
+      {"日本語のテキストです。", "日本語のテキストです"},
+    }
+
+    for _,c in ipairs(cases) do
+      local w = util.tokenize_text(c[1])
+      assert_not_nil(w, "must tokenize " .. c[1])
+      assert_true(#w > 1, "must split " .. c[1])
+      assert_equal(table.concat(w), c[2])
+    end
   end)
     test("Tokenize simple text (legacy)", function()
     local cases = {
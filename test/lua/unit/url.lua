@@ -6,14 +6,15 @@ context("URL check functions", function()
   local logger = require("rspamd_logger")
   local ffi = require("ffi")
   ffi.cdef[[
-  void rspamd_url_init (const char *tld_file);
+  void rspamd_url_init (const char *tld_file, const char *cache_dir);
+  void rspamd_url_cache_init (unsigned nelts);
   unsigned ottery_rand_range(unsigned top);
   void rspamd_http_normalize_path_inplace(char *path, size_t len, size_t *nlen);
   ]]
 
   local test_dir = string.gsub(debug.getinfo(1).source, "^@(.+/)[^/]+$", "%1")
 
-  ffi.C.rspamd_url_init(string.format('%s/%s', test_dir, "test_tld.dat"))
+  ffi.C.rspamd_url_init(string.format('%s/%s', test_dir, "test_tld.dat"), nil)
 
   test("Extract urls from text", function()
     local pool = mpool.create()
@@ -51,6 +52,54 @@ context("URL check functions", function()
     pool:destroy()
   end)
 
+  test("Extract all urls from text", function()
+    local pool = mpool.create()
+    local cases = {
+      {"no urls here at all", {}},
+      {"version 1.2.3 costs 3.50 at 12:30", {}},
+      {"see http://example.com/a and test.org", {"example.com/a", "test.org"}},
+      {"1.1 2.2 3.3 4.4 5.5 6.6 7.7 8.8 9.9 www.example.com 1.1 2.2",
+        {"www.example.com"}},
+      {"value;1.5;2.5\nmail;somebody@example.com;3.5", {"somebody@example.com"}},
+    }
+
+    for _,c in ipairs(cases) do
+      local res = url.all(pool, c[1])
+
+      assert_not_nil(res, "cannot extract urls from " .. c[1])
+
+      if #c[2] == 0 then
+        assert_equal(0, #res, "extracted urls from " .. c[1])
+      end
+
+      for _,u in ipairs(c[2]) do
+        local found = false
+        for _,r in ipairs(res) do
+          if string.find(r, u, 1, true) then found = true end
+        end
+        assert_true(found, "cannot find " .. u .. " in " .. c[1])
+      end
+    end
+    pool:destroy()
+  end)
+
+  test("Find tld", function()
+    local util = require("rspamd_util")
+    local cases = {
+      {"example.com", "example.com"},
+      {"a.b.example.com", "example.com"},
+      {"A.B.Example.COM", "Example.COM"},
+      {"example.com.", "example.com."},
+      {"www.тест.рф", "тест.рф"},
+      {"com", "com"},
+      {"example.unknown", "example.unknown"},
+    }
+
+    for _,c in ipairs(cases) do
+      assert_equal(c[2], util.get_tld(c[1]), "bad tld for " .. c[1])
+    end
+  end)
+
   -- Some cases from https://code.google.com/p/google-url/source/browse/trunk/src/url_canon_unittest.cc
   test("Parse urls", function()
     local pool = mpool.create()
@@ -120,6 +169,39 @@ context("URL check functions", function()
     end
   end
   )
+  test("Parse cached urls", function()
+    local pool = mpool.create()
+    local cases = {
+      "http://www.google.com/foo?bar=baz#",
+      "http:////////user:@google.com:99?foo",
+      "http://%30%78%63%30%2e%30%32%35%30.01",
+      "http://[::eeee:192.168.0.1]",
+      "http://twitter.com#test",
+      "http://%D1%82%D0%B5%D1%81%D1%82.%D1%80%D1%84/%7Epath/../x",
+    }
+
+    ffi.C.rspamd_url_cache_init(64)
+
+    for _,c in ipairs(cases) do
+      local first = url.create(pool, c)
+      assert_not_nil(first, "cannot parse " .. c)
+      local uf = first:to_table()
+
+      for _=1,2 do
+        local res = url.create(pool, c)
+        assert_not_nil(res, "cannot parse cached " .. c)
+        local t = res:to_table()
+
+        for k,v in pairs(uf) do
+          assert_equal(v, t[k], 'cached ' .. k .. ' differs in url ' .. c)
+        end
+        for k,v in pairs(t) do
+          assert_not_nil(uf[k], k .. ' should be absent in cached url ' .. c)
+        end
+      end
+    end
+  end)
+
   test("Normalize paths", function()
     local cases = {
       {"/././foo", "/foo"},
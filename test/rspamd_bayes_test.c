@@ -0,0 +1,110 @@
+/*-
+ * Copyright 2017 Vsevolod Stakhov
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libstat/classifiers/classifiers.h"
+#include "ottery.h"
+#include <math.h>
+
+static const guint ntokens = 100500;
+static const guint niter = 100;
+static const gdouble spam_learns = 1000, ham_learns = 1500;
+static const gdouble weights[] = { 0, 1, 4, 27, 256, 3125, 46656, 823543 };
+
+/* Straightforward per token combination used as a reference */
+static void
+bayes_combine_reference (struct bayes_tokens_soa *soa,
+		gdouble *spam_prob, gdouble *ham_prob)
+{
+	gdouble spam_freq, ham_freq, total_count, fw, norm_sum, norm_sub, w;
+	guint i;
+
+	*spam_prob = 0;
+	*ham_prob = 0;
+
+	for (i = 0; i < soa->len; i ++) {
+		spam_freq = soa->spam_cnt[i] / spam_learns;
+		ham_freq = soa->ham_cnt[i] / ham_learns;
+		total_count = soa->spam_cnt[i] + soa->ham_cnt[i];
+		fw = soa->weight[i];
+		norm_sum = (spam_freq + ham_freq) * (spam_freq + ham_freq);
+		norm_sub = (spam_freq - ham_freq) * (spam_freq - ham_freq);
+		w = norm_sub / norm_sum *
+				(fw * total_count) / (4.0 * (1.0 + fw * total_count));
+
+		*spam_prob += log2 ((w * 0.5 +
+				total_count * spam_freq / (spam_freq + ham_freq)) /
+				(w + total_count));
+		*ham_prob += log2 ((w * 0.5 +
+				total_count * ham_freq / (spam_freq + ham_freq)) /
+				(w + total_count));
+	}
+}
+
+void
+rspamd_bayes_test_func (void)
+{
+	struct bayes_tokens_soa soa;
+	gdouble spam_prob, ham_prob, ref_spam_prob, ref_ham_prob, t1, t2;
+	guint i;
+
+	soa.spam_cnt = g_malloc (sizeof (gdouble) * ntokens * 5);
+	soa.ham_cnt = soa.spam_cnt + ntokens;
+	soa.weight = soa.ham_cnt + ntokens;
+	soa.spam_prob = soa.weight + ntokens;
+	soa.ham_prob = soa.spam_prob + ntokens;
+	soa.len = ntokens;
+
+	/* Synthetic tokens that are found in both classes */
+	for (i = 0; i < ntokens; i ++) {
+		soa.spam_cnt[i] = ottery_rand_range (100) + 1;
+		soa.ham_cnt[i] = ottery_rand_range (100) + 1;
+		soa.weight[i] = weights[i % G_N_ELEMENTS (weights)];
+	}
+
+	t1 = rspamd_get_virtual_ticks ();
+	for (i = 0; i < niter; i ++) {
+		bayes_combine_reference (&soa, &ref_spam_prob, &ref_ham_prob);
+	}
+	t2 = rspamd_get_virtual_ticks ();
+
+	msg_info ("reference combination of %ud tokens: %.6f", ntokens,
+			(t2 - t1) / niter);
+
+	t1 = rspamd_get_virtual_ticks ();
+	for (i = 0; i < niter; i ++) {
+		bayes_combine_tokens (&soa, spam_learns, ham_learns,
+				&spam_prob, &ham_prob);
+	}
+	t2 = rspamd_get_virtual_ticks ();
+
+	msg_info ("vectorized combination of %ud tokens: %.6f", ntokens,
+			(t2 - t1) / niter);
+
+	g_assert (fabs (spam_prob - ref_spam_prob) < fabs (ref_spam_prob) * 1e-9);
+	g_assert (fabs (ham_prob - ref_ham_prob) < fabs (ref_ham_prob) * 1e-9);
+
+	/* Tokens that are missing from a class make the sum infinite */
+	soa.spam_cnt[ntokens / 2] = 0;
+	soa.weight[ntokens / 2] = 0;
+	bayes_combine_tokens (&soa, spam_learns, ham_learns,
+			&spam_prob, &ham_prob);
+	g_assert (isinf (spam_prob) && spam_prob < 0);
+	g_assert (isfinite (ham_prob));
+
+	g_free (soa.spam_cnt);
+}
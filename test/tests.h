@@ -41,4 +41,6 @@ void rspamd_cryptobox_test_func (void);
 
 void rspamd_heap_test_func (void);
 
+void rspamd_bayes_test_func (void);
+
 #endif